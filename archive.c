@@ -0,0 +1,374 @@
+// archive.c
+#include "archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "verify.h"
+
+#define ARCHIVE_MAGIC 0x53444A54 // "TJDS"
+#define ARCHIVE_VERSION 2
+/** Every structure in the image starts at a multiple of this */
+#define ARCHIVE_ALIGN 16
+
+/** The first bytes of an archive */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    /** The sizes of the archived structures in the build that wrote it */
+    uint32_t layout[6];
+    /** The size and modification time of the class file */
+    uint64_t class_size;
+    int64_t class_mtime_sec;
+    int64_t class_mtime_nsec;
+    /** The size of the whole file, which is all mapped */
+    uint64_t size;
+    /** Where the class_file_t is */
+    uint64_t class_offset;
+    /** The offsets of the pointers in the image, as uint64_t */
+    uint64_t relocs_offset;
+    uint64_t relocs_count;
+} archive_header_t;
+
+static void get_layout(uint32_t layout[6]) {
+    layout[0] = sizeof(class_file_t);
+    layout[1] = sizeof(cp_info_t);
+    layout[2] = sizeof(field_t);
+    layout[3] = sizeof(method_t);
+    layout[4] = sizeof(ref_map_t);
+    layout[5] = sizeof(void *);
+}
+
+/** Memory a class points into, and where it was copied in the image */
+typedef struct {
+    const void *start;
+    size_t length;
+    size_t offset;
+} region_t;
+
+typedef struct {
+    uint8_t *image;
+    size_t size;
+    size_t capacity;
+    uint64_t *relocs;
+    size_t relocs_count;
+    size_t relocs_capacity;
+    /** The class file bytes, constant pool, fields and methods */
+    region_t regions[4];
+    bool ok;
+} builder_t;
+
+/** Appends `size` zeroed bytes to the image and returns their offset */
+static size_t reserve(builder_t *b, size_t size) {
+    size_t offset = (b->size + ARCHIVE_ALIGN - 1) & ~(size_t)(ARCHIVE_ALIGN - 1);
+    if (offset + size > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (capacity < offset + size) {
+            capacity *= 2;
+        }
+        uint8_t *image = realloc(b->image, capacity);
+        if (!image) {
+            b->ok = false;
+            return 0;
+        }
+        memset(image + b->capacity, 0, capacity - b->capacity);
+        b->image = image;
+        b->capacity = capacity;
+    }
+    b->size = offset + size;
+    return offset;
+}
+
+static size_t copy(builder_t *b, const void *src, size_t size) {
+    size_t offset = reserve(b, size);
+    if (b->ok && size > 0) {
+        memcpy(b->image + offset, src, size);
+    }
+    return offset;
+}
+
+/** Makes the pointer at image offset `field` point at image offset `target` */
+static void set_pointer(builder_t *b, size_t field, size_t target) {
+    if (!b->ok) {
+        return;
+    }
+    if (b->relocs_count == b->relocs_capacity) {
+        b->relocs_capacity = b->relocs_capacity ? b->relocs_capacity * 2 : 256;
+        uint64_t *relocs = realloc(b->relocs, b->relocs_capacity * sizeof(uint64_t));
+        if (!relocs) {
+            b->ok = false;
+            return;
+        }
+        b->relocs = relocs;
+    }
+    b->relocs[b->relocs_count++] = field;
+    uintptr_t address = ARCHIVE_BASE + target;
+    memcpy(b->image + field, &address, sizeof(address));
+}
+
+/**
+ * Rewrites the pointer at image offset `field`, still holding its value in
+ * the loaded class, to point at the copy of what it pointed to
+ */
+static void translate(builder_t *b, size_t field) {
+    if (!b->ok) {
+        return;
+    }
+    uintptr_t address;
+    memcpy(&address, b->image + field, sizeof(address));
+    if (address == 0) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(b->regions) / sizeof(b->regions[0]); i++) {
+        uintptr_t start = (uintptr_t) b->regions[i].start;
+        // A pointer to an empty range may point just past the end
+        if (start != 0 && address >= start && address <= start + b->regions[i].length) {
+            set_pointer(b, field, b->regions[i].offset + (address - start));
+            return;
+        }
+    }
+    b->ok = false;
+}
+
+/** Copies a region the class's pointers point into */
+static size_t copy_region(builder_t *b, uint32_t index, const void *src, size_t size) {
+    size_t offset = copy(b, src, size);
+    b->regions[index] = (region_t){.start = src, .length = size, .offset = offset};
+    return offset;
+}
+
+/** Copies a bitmap or array a method owns and points the method's field at it */
+static void copy_owned(builder_t *b, size_t field, const void *src, size_t size) {
+    if (src) {
+        size_t offset = copy(b, src, size);
+        set_pointer(b, field, offset);
+    }
+}
+
+static void archive_method(builder_t *b, size_t offset, const method_t *method) {
+    // Start from a zeroed method so that no runtime state is archived
+    method_t archived = {
+        .name = method->name,
+        .descriptor = method->descriptor,
+        .access_flags = method->access_flags,
+        .code = method->code,
+        .verified = method->verified,
+    };
+    memcpy(b->image + offset, &archived, sizeof(method_t));
+    translate(b, offset + offsetof(method_t, name));
+    translate(b, offset + offsetof(method_t, descriptor));
+    translate(b, offset + offsetof(method_t, code.code));
+    translate(b, offset + offsetof(method_t, code.exception_table));
+
+    size_t bitmap_size = (method->code.code_length + 7) / 8;
+    copy_owned(b, offset + offsetof(method_t, in_bounds), method->in_bounds, bitmap_size);
+    copy_owned(b, offset + offsetof(method_t, frame_arrays), method->frame_arrays, bitmap_size);
+    const ref_map_t *maps = method->ref_maps;
+    if (maps) {
+        size_t maps_offset = copy(b, maps, sizeof(ref_map_t));
+        set_pointer(b, offset + offsetof(method_t, ref_maps), maps_offset);
+        copy_owned(b, maps_offset + offsetof(ref_map_t, pcs), maps->pcs,
+                   (maps->count ? maps->count : 1) * sizeof(uint16_t));
+        copy_owned(b, maps_offset + offsetof(ref_map_t, bits), maps->bits,
+                   ((size_t) maps->count * maps->slots + 7) / 8 + 1);
+    }
+}
+
+/** Lays out the class in the image, returning the offset of its class_file_t */
+static size_t build_image(builder_t *b, const class_file_t *cls) {
+    size_t class_offset = reserve(b, sizeof(class_file_t));
+    size_t map = copy_region(b, 0, cls->map, cls->map_size);
+    size_t constant_pool = copy_region(b, 1, cls->constant_pool,
+                                       cls->constant_pool_count * sizeof(cp_info_t));
+    size_t fields = copy_region(b, 2, cls->fields,
+                                (cls->fields_count ? cls->fields_count : 1) * sizeof(field_t));
+    size_t methods = reserve(b, (cls->methods_count ? cls->methods_count : 1) * sizeof(method_t));
+    b->regions[3] = (region_t){
+        .start = cls->methods,
+        .length = cls->methods_count * sizeof(method_t),
+        .offset = methods,
+    };
+    size_t symbols = copy(b, cls->table.symbols,
+                          (cls->table.symbols_mask + 1) * sizeof(utf8_t *));
+    size_t method_slots = copy(b, cls->table.method_slots,
+                               (cls->table.methods_mask + 1) * sizeof(uint16_t));
+    size_t field_slots = copy(b, cls->table.field_slots,
+                              (cls->table.fields_mask + 1) * sizeof(uint16_t));
+    if (!b->ok) {
+        return 0;
+    }
+
+    class_file_t archived = {
+        .map_size = cls->map_size,
+        .constant_pool_count = cls->constant_pool_count,
+        .this_class = cls->this_class,
+        .fields_count = cls->fields_count,
+        .methods_count = cls->methods_count,
+        .table = {
+            .symbols_mask = cls->table.symbols_mask,
+            .methods_mask = cls->table.methods_mask,
+            .fields_mask = cls->table.fields_mask,
+        },
+    };
+    memcpy(b->image + class_offset, &archived, sizeof(class_file_t));
+    set_pointer(b, class_offset + offsetof(class_file_t, map), map);
+    set_pointer(b, class_offset + offsetof(class_file_t, constant_pool), constant_pool);
+    set_pointer(b, class_offset + offsetof(class_file_t, fields), fields);
+    set_pointer(b, class_offset + offsetof(class_file_t, methods), methods);
+    set_pointer(b, class_offset + offsetof(class_file_t, table.symbols), symbols);
+    set_pointer(b, class_offset + offsetof(class_file_t, table.method_slots), method_slots);
+    set_pointer(b, class_offset + offsetof(class_file_t, table.field_slots), field_slots);
+    translate(b, class_offset + offsetof(class_file_t, this_class));
+
+    for (uint16_t i = 0; i + 1 < cls->constant_pool_count; i++) {
+        size_t entry = constant_pool + i * sizeof(cp_info_t);
+        if (cls->constant_pool[i].tag == CONSTANT_Utf8) {
+            translate(b, entry + offsetof(cp_info_t, info.utf8.bytes));
+        }
+        translate(b, entry + offsetof(cp_info_t, resolved));
+    }
+    for (uint16_t i = 0; i < cls->fields_count; i++) {
+        translate(b, fields + i * sizeof(field_t) + offsetof(field_t, name));
+        translate(b, fields + i * sizeof(field_t) + offsetof(field_t, descriptor));
+    }
+    for (uint16_t i = 0; i < cls->methods_count; i++) {
+        archive_method(b, methods + i * sizeof(method_t), &cls->methods[i]);
+    }
+    for (uint32_t i = 0; i <= cls->table.symbols_mask; i++) {
+        translate(b, symbols + i * sizeof(utf8_t *));
+    }
+    return class_offset;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        p += written;
+        size -= (size_t) written;
+    }
+    return true;
+}
+
+bool dump_class_archive(const class_file_t *cls, const char *class_path, const char *path) {
+    struct stat st;
+    if (stat(class_path, &st) != 0) {
+        return false;
+    }
+    builder_t b = {.ok = true};
+    size_t header = reserve(&b, sizeof(archive_header_t));
+    size_t class_offset = build_image(&b, cls);
+    size_t relocs = reserve(&b, b.relocs_count * sizeof(uint64_t));
+    bool ok = b.ok;
+    if (ok) {
+        memcpy(b.image + relocs, b.relocs, b.relocs_count * sizeof(uint64_t));
+        archive_header_t h = {
+            .magic = ARCHIVE_MAGIC,
+            .version = ARCHIVE_VERSION,
+            .class_size = (uint64_t) st.st_size,
+            .class_mtime_sec = st.st_mtim.tv_sec,
+            .class_mtime_nsec = st.st_mtim.tv_nsec,
+            .size = b.size,
+            .class_offset = class_offset,
+            .relocs_offset = relocs,
+            .relocs_count = b.relocs_count,
+        };
+        get_layout(h.layout);
+        memcpy(b.image + header, &h, sizeof(h));
+
+        // Write to a temporary file and rename it, so that a run mapping the
+        // archive never sees it half written
+        size_t length = strlen(path);
+        char *temporary = malloc(length + 5);
+        ok = temporary != NULL;
+        if (ok) {
+            memcpy(temporary, path, length);
+            memcpy(temporary + length, ".tmp", 5);
+            int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            ok = fd >= 0 && write_all(fd, b.image, b.size);
+            if (fd >= 0) {
+                ok = close(fd) == 0 && ok;
+            }
+            ok = ok && rename(temporary, path) == 0;
+            if (!ok) {
+                unlink(temporary);
+            }
+            free(temporary);
+        }
+    }
+    free(b.image);
+    free(b.relocs);
+    return ok;
+}
+
+/** Whether an archive's header is one this build wrote for the current class file */
+static bool is_valid(const archive_header_t *h, size_t file_size, const char *class_path) {
+    uint32_t layout[6];
+    get_layout(layout);
+    if (h->magic != ARCHIVE_MAGIC || h->version != ARCHIVE_VERSION ||
+        memcmp(h->layout, layout, sizeof(layout)) != 0 || h->size != file_size ||
+        h->class_offset + sizeof(class_file_t) > h->size ||
+        h->relocs_offset > h->size ||
+        h->relocs_count > (h->size - h->relocs_offset) / sizeof(uint64_t)) {
+        return false;
+    }
+    struct stat st;
+    return stat(class_path, &st) == 0 && (uint64_t) st.st_size == h->class_size &&
+           st.st_mtim.tv_sec == h->class_mtime_sec && st.st_mtim.tv_nsec == h->class_mtime_nsec;
+}
+
+class_file_t *map_class_archive(const char *path, const char *class_path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    archive_header_t h;
+    if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        !is_valid(&h, (size_t) st.st_size, class_path)) {
+        close(fd);
+        return NULL;
+    }
+    int flags = MAP_PRIVATE;
+#ifdef MAP_FIXED_NOREPLACE
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+    uint8_t *map = mmap((void *) ARCHIVE_BASE, h.size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (map == MAP_FAILED) {
+        // Something else lives at ARCHIVE_BASE
+        map = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    uintptr_t delta = (uintptr_t) map - ARCHIVE_BASE;
+    if (delta != 0) {
+        const uint64_t *relocs = (const uint64_t *) (map + h.relocs_offset);
+        for (uint64_t i = 0; i < h.relocs_count; i++) {
+            if (relocs[i] + sizeof(uintptr_t) > h.relocs_offset) {
+                munmap(map, h.size);
+                return NULL;
+            }
+            uintptr_t address;
+            memcpy(&address, map + relocs[i], sizeof(address));
+            address += delta;
+            memcpy(map + relocs[i], &address, sizeof(address));
+        }
+    }
+    class_file_t *cls = (class_file_t *) (map + h.class_offset);
+    cls->archive = map;
+    cls->archive_size = h.size;
+    return cls;
+}
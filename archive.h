@@ -0,0 +1,51 @@
+// archive.h
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdbool.h>
+
+#include "read_class.h"
+
+/**
+ * Class data sharing. dump_class_archive() writes a loaded and verified
+ * class as one image of the structures in read_class.h: the class file's
+ * bytes, the constant pool with its interned symbols and resolved members,
+ * the symbol and member hash tables, and each method's verification results
+ * (see verify_class()). A later run maps the archive with
+ * map_class_archive() and uses the class in place, with no parsing and no
+ * verification, so startup costs the same whatever the size of the class.
+ *
+ * Pointers in the image hold the address they would have with the archive
+ * mapped at ARCHIVE_BASE, and the archive lists where they are. The file is
+ * mapped copy-on-write at that address if it is free, and only the pages a
+ * run touches are ever read; otherwise it is mapped elsewhere and every
+ * listed pointer is adjusted. Methods are archived without any runtime
+ * state (decoded instructions, counters, compiled code), which each run
+ * builds as before in its private copy of the pages.
+ *
+ * An archive records the size and modification time of the class file it
+ * was made from, and the layout of the structures it holds, so that a stale
+ * archive, or one written by a different build, is refused.
+ */
+
+/** The address archives are laid out for */
+#define ARCHIVE_BASE ((uintptr_t) 0x7a0000000000)
+
+/**
+ * Writes `cls`, which was read from `class_path` and verified, to an archive
+ * at `path`.
+ *
+ * @return false if the archive cannot be written
+ */
+bool dump_class_archive(const class_file_t *cls, const char *class_path, const char *path);
+
+/**
+ * Maps a class from an archive written by dump_class_archive(). The class is
+ * freed with free_class() as usual.
+ *
+ * @param class_path the class file the archive must have been made from
+ * @return the class, or NULL if the archive is missing, invalid or out of date
+ */
+class_file_t *map_class_archive(const char *path, const char *class_path);
+
+#endif
@@ -0,0 +1,49 @@
+// array.h
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** The element types newarray's atype operand names */
+enum {
+    T_BOOLEAN = 4,
+    T_CHAR = 5,
+    T_FLOAT = 6,
+    T_DOUBLE = 7,
+    T_BYTE = 8,
+    T_SHORT = 9,
+    T_INT = 10,
+    T_LONG = 11
+};
+
+/**
+ * The header of every heap array. The elements follow it, packed at their
+ * natural size, starting ARRAY_DATA_OFFSET bytes into the object so that
+ * 8-byte elements stay aligned.
+ */
+typedef struct {
+    int32_t length;
+    uint8_t atype;
+} array_t;
+
+#define ARRAY_DATA_OFFSET 8
+
+static inline bool is_array_type(uint32_t atype) {
+    return atype >= T_BOOLEAN && atype <= T_LONG;
+}
+
+/** The size in bytes of one element of an array of `atype` */
+static inline uint32_t array_element_size(uint8_t atype) {
+    static const uint8_t sizes[] = {
+        [T_BOOLEAN] = 1, [T_CHAR] = 2, [T_FLOAT] = 4, [T_DOUBLE] = 8,
+        [T_BYTE] = 1, [T_SHORT] = 2, [T_INT] = 4, [T_LONG] = 8,
+    };
+    return sizes[atype];
+}
+
+static inline void *array_data(array_t *array) {
+    return (uint8_t *) array + ARRAY_DATA_OFFSET;
+}
+
+#endif
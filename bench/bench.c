@@ -0,0 +1,304 @@
+// bench/bench.c
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "array.h"
+#include "frame.h"
+#include "gc.h"
+#include "heap.h"
+#include "intrinsic.h"
+#include "jit.h"
+#include "jvm.h"
+#include "output.h"
+#include "profile.h"
+#include "read_class.h"
+#include "simd.h"
+#include "superinsn.h"
+#include "verify.h"
+
+/**
+ * The benchmark driver. Each class file runs in a child process of its own,
+ * so that one program's peak RSS, JIT state and statistics do not leak into
+ * the next, and a crash only loses that program's result.
+ *
+ * The child first runs main() once with compilation, superinstructions and
+ * array loop rewriting turned off and the profiler counting instructions:
+ * that run's instruction count is the program's bytecode count, what
+ * bytecodes/sec is measured against. Then it loads the class again and
+ * runs main() `warmup` times untimed and `iterations` times timed, each run
+ * with a fresh heap. The program's output goes to /dev/null.
+ */
+
+#define DEFAULT_ITERATIONS 10
+#define DEFAULT_WARMUP 1
+
+/** What a child measured, sent to the parent through a pipe */
+typedef struct {
+    bool ok;
+    /** The instructions one run of main() executes */
+    uint64_t bytecodes;
+    /** Over the timed runs */
+    uint64_t wall_ns;
+    uint64_t min_ns;
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    uint64_t collections;
+    /** Time spent in collections, and the longest single collection */
+    uint64_t gc_pause_ns;
+    uint64_t max_gc_pause_ns;
+} result_t;
+
+static void usage(const char *program) {
+    fprintf(stderr, "USAGE: %s [options] <class file>...\n", program);
+    fprintf(stderr, "  --iterations=N  time N runs of each program (default %d)\n",
+            DEFAULT_ITERATIONS);
+    fprintf(stderr, "  --warmup=N      run each program N times before timing it (default %d)\n",
+            DEFAULT_WARMUP);
+    fprintf(stderr, "  --output=FILE   write the JSON report to FILE rather than stdout\n");
+    fprintf(stderr, "  --gc-threads=N  collect with N threads (default 1)\n");
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+static class_file_t *load_class(const char *path) {
+    FILE *class_file = fopen(path, "r");
+    if (!class_file) {
+        return NULL;
+    }
+    class_file_t *class = get_class(class_file);
+    fclose(class_file);
+    if (class) {
+        verify_class(class);
+    }
+    return class;
+}
+
+/** Runs main() on a fresh heap, adding the heap's statistics to `result` */
+static bool run_main(class_file_t *class, vm_stack_t *vm_stack, result_t *result) {
+    method_t *main_method = find_method(MAIN_METHOD, MAIN_DESCRIPTOR, class);
+    if (!main_method) {
+        return false;
+    }
+    heap_t *heap = heap_init(gc_nursery_size);
+    int32_t *locals = vm_stack_free_slots(vm_stack);
+    memset(locals, 0, main_method->code.max_locals * sizeof(int32_t));
+    if (main_method->code.max_locals > 0) {
+        locals[0] = gc_new_array(heap, vm_stack, T_INT, 0);
+    }
+    optional_value_t value = execute(main_method, locals, class, heap, vm_stack);
+    result->allocations += heap->total_arrays;
+    result->allocated_bytes += heap->total_bytes;
+    result->collections += heap->collections;
+    result->gc_pause_ns += heap->pause_ns;
+    if (heap->max_pause_ns > result->max_gc_pause_ns) {
+        result->max_gc_pause_ns = heap->max_pause_ns;
+    }
+    heap_free(heap);
+    return value.exception == EXC_NONE;
+}
+
+/** Counts the instructions one interpreted run of main() dispatches */
+static bool count_bytecodes(const char *path, vm_stack_t *vm_stack, uint64_t *bytecodes) {
+    uint32_t threshold = jit_threshold;
+    uint32_t fusions = enabled_fusions;
+    jit_threshold = 0;
+    enabled_fusions = 0;
+    array_loops_enabled = false;
+    class_file_t *class = load_class(path);
+    bool ok = class != NULL && profile_start();
+    if (ok) {
+        memset(profile_opcodes, 0, sizeof(profile_opcodes));
+        result_t ignored = {0};
+        ok = run_main(class, vm_stack, &ignored);
+        profile_finish(NULL, NULL);
+    }
+    *bytecodes = 0;
+    for (uint16_t op = 0; op < NUM_INSNS; op++) {
+        *bytecodes += profile_opcodes[op];
+    }
+    if (class) {
+        free_class(class);
+    }
+    jit_threshold = threshold;
+    enabled_fusions = fusions;
+    array_loops_enabled = true;
+    return ok;
+}
+
+static result_t run_benchmark(const char *path, uint32_t warmup, uint32_t iterations) {
+    result_t result = {.min_ns = UINT64_MAX};
+    vm_stack_t *vm_stack = vm_stack_init(VM_STACK_RESERVE, VM_STACK_MAX_DEPTH);
+    if (!vm_stack || !count_bytecodes(path, vm_stack, &result.bytecodes)) {
+        return result;
+    }
+    class_file_t *class = load_class(path);
+    if (!class) {
+        return result;
+    }
+    result_t ignored = {0};
+    result.ok = true;
+    for (uint32_t i = 0; result.ok && i < warmup; i++) {
+        result.ok = run_main(class, vm_stack, &ignored);
+    }
+    for (uint32_t i = 0; result.ok && i < iterations; i++) {
+        uint64_t start = now_ns();
+        result.ok = run_main(class, vm_stack, &result);
+        uint64_t elapsed = now_ns() - start;
+        result.wall_ns += elapsed;
+        if (elapsed < result.min_ns) {
+            result.min_ns = elapsed;
+        }
+    }
+    free_class(class);
+    vm_stack_free(vm_stack);
+    return result;
+}
+
+/** The class file's name without its directory or ".class" */
+static void write_name(FILE *out, const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    size_t length = strlen(name);
+    if (length > 6 && strcmp(name + length - 6, ".class") == 0) {
+        length -= 6;
+    }
+    fputc('"', out);
+    for (size_t i = 0; i < length; i++) {
+        if (name[i] == '"' || name[i] == '\\') {
+            fputc('\\', out);
+        }
+        fputc(name[i], out);
+    }
+    fputc('"', out);
+}
+
+/**
+ * Runs one benchmark in a child process and writes its JSON object.
+ *
+ * @return whether the benchmark ran to completion
+ */
+static bool bench(FILE *out, const char *path, uint32_t warmup, uint32_t iterations) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return false;
+    }
+    fflush(NULL);
+    pid_t child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        output_init();
+        result_t result = run_benchmark(path, warmup, iterations);
+        output_flush();
+        ssize_t written = write(fds[1], &result, sizeof(result));
+        _exit(written == sizeof(result) ? 0 : 1);
+    }
+    close(fds[1]);
+    result_t result = {0};
+    bool received = child > 0 && read(fds[0], &result, sizeof(result)) == sizeof(result);
+    close(fds[0]);
+    int status = 0;
+    struct rusage usage = {0};
+    if (child > 0) {
+        wait4(child, &status, 0, &usage);
+    }
+    bool ok = received && result.ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    fprintf(out, "    {\"name\": ");
+    write_name(out, path);
+    if (!ok) {
+        fprintf(out, ", \"error\": true}");
+        return false;
+    }
+    double seconds = (double) result.wall_ns / 1e9;
+    fprintf(out, ", \"iterations\": %" PRIu32, iterations);
+    fprintf(out, ", \"wall_ns\": %" PRIu64, result.wall_ns);
+    fprintf(out, ", \"mean_ns\": %" PRIu64, iterations ? result.wall_ns / iterations : 0);
+    fprintf(out, ", \"min_ns\": %" PRIu64, iterations ? result.min_ns : 0);
+    fprintf(out, ", \"bytecodes\": %" PRIu64, result.bytecodes);
+    fprintf(out, ", \"bytecodes_per_sec\": %.0f",
+            seconds > 0 ? (double) result.bytecodes * iterations / seconds : 0.0);
+    fprintf(out, ", \"allocations\": %" PRIu64, result.allocations);
+    fprintf(out, ", \"allocated_bytes\": %" PRIu64, result.allocated_bytes);
+    fprintf(out, ", \"collections\": %" PRIu64, result.collections);
+    fprintf(out, ", \"gc_pause_ns\": %" PRIu64, result.gc_pause_ns);
+    fprintf(out, ", \"max_gc_pause_ns\": %" PRIu64, result.max_gc_pause_ns);
+    // ru_maxrss is in kilobytes on Linux
+    fprintf(out, ", \"peak_rss_kb\": %ld}", usage.ru_maxrss);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t iterations = DEFAULT_ITERATIONS;
+    uint32_t warmup = DEFAULT_WARMUP;
+    const char *output_path = NULL;
+    int first_class = argc;
+    simd_init();
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--iterations=", 13) == 0) {
+            iterations = (uint32_t) strtoul(argv[i] + 13, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            warmup = (uint32_t) strtoul(argv[i] + 9, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--output=", 9) == 0) {
+            output_path = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--gc-threads=", 13) == 0) {
+            gc_threads = (uint32_t) strtoul(argv[i] + 13, NULL, 10);
+            if (gc_threads == 0) {
+                gc_threads = 1;
+            }
+        }
+        else if (argv[i][0] != '-') {
+            first_class = i;
+            break;
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (first_class == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *out = output_path ? fopen(output_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Failed to open %s\n", output_path);
+        return 1;
+    }
+    bool ok = true;
+    fprintf(out, "{\n  \"warmup\": %" PRIu32 ",\n  \"gc_threads\": %" PRIu32
+            ",\n  \"benchmarks\": [\n", warmup, gc_threads);
+    for (int i = first_class; i < argc; i++) {
+        if (!bench(out, argv[i], warmup, iterations)) {
+            fprintf(stderr, "%s failed\n", argv[i]);
+            ok = false;
+        }
+        fprintf(out, i + 1 < argc ? ",\n" : "\n");
+    }
+    fprintf(out, "  ]\n}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+    return ok ? 0 : 1;
+}
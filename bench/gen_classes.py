@@ -0,0 +1,535 @@
+#!/usr/bin/env python3
+# gen_classes.py
+"""
+Writes the benchmark class files into this directory.
+
+The classes are checked in so that building and benchmarking need no JDK.
+Each one is assembled here, instruction for instruction as javac would
+compile the Java source in the comment above it. Regenerating them gives
+byte-identical files:
+
+    python3 bench/gen_classes.py
+"""
+import os
+import struct
+
+OPCODES = {
+    'iconst_m1': 0x02, 'iconst_0': 0x03, 'iconst_1': 0x04, 'iconst_2': 0x05,
+    'iconst_3': 0x06, 'iconst_4': 0x07, 'iconst_5': 0x08,
+    'bipush': 0x10, 'sipush': 0x11, 'ldc': 0x12,
+    'iload': 0x15, 'aload': 0x19,
+    'iload_0': 0x1a, 'iload_1': 0x1b, 'iload_2': 0x1c, 'iload_3': 0x1d,
+    'aload_0': 0x2a, 'aload_1': 0x2b, 'aload_2': 0x2c, 'aload_3': 0x2d,
+    'iaload': 0x2e, 'baload': 0x33,
+    'istore': 0x36, 'astore': 0x3a,
+    'istore_0': 0x3b, 'istore_1': 0x3c, 'istore_2': 0x3d, 'istore_3': 0x3e,
+    'astore_0': 0x4b, 'astore_1': 0x4c, 'astore_2': 0x4d, 'astore_3': 0x4e,
+    'iastore': 0x4f, 'bastore': 0x54,
+    'iadd': 0x60, 'isub': 0x64, 'imul': 0x68, 'idiv': 0x6c, 'irem': 0x70,
+    'iushr': 0x7c, 'ixor': 0x82, 'iinc': 0x84,
+    'ifeq': 0x99, 'ifne': 0x9a, 'iflt': 0x9b, 'ifge': 0x9c, 'ifgt': 0x9d, 'ifle': 0x9e,
+    'if_icmpeq': 0x9f, 'if_icmpne': 0xa0, 'if_icmplt': 0xa1, 'if_icmpge': 0xa2,
+    'if_icmpgt': 0xa3, 'if_icmple': 0xa4, 'goto': 0xa7,
+    'ireturn': 0xac, 'areturn': 0xb0, 'return': 0xb1,
+    'getstatic': 0xb2, 'invokevirtual': 0xb6, 'invokestatic': 0xb8,
+    'newarray': 0xbc, 'arraylength': 0xbe,
+}
+BRANCHES = {op for op in OPCODES if op.startswith('if') or op == 'goto'}
+ONE_BYTE_OPERAND = {'bipush', 'ldc', 'iload', 'aload', 'istore', 'astore', 'newarray'}
+TWO_BYTE_OPERAND = {'sipush', 'iinc', 'getstatic', 'invokevirtual', 'invokestatic'} | BRANCHES
+
+T_BOOLEAN = 4
+T_INT = 10
+
+MAIN = ('main', '([Ljava/lang/String;)V')
+
+
+class ConstantPool:
+    def __init__(self):
+        self.entries = []
+        self.indices = {}
+
+    def add(self, key, data):
+        if key not in self.indices:
+            self.entries.append(data)
+            self.indices[key] = len(self.entries)
+        return self.indices[key]
+
+    def utf8(self, text):
+        data = text.encode()
+        return self.add(('utf8', text), b'\x01' + struct.pack('>H', len(data)) + data)
+
+    def cls(self, name):
+        return self.add(('class', name), b'\x07' + struct.pack('>H', self.utf8(name)))
+
+    def name_and_type(self, name, descriptor):
+        return self.add(('nat', name, descriptor),
+                        b'\x0c' + struct.pack('>HH', self.utf8(name), self.utf8(descriptor)))
+
+    def methodref(self, cls, name, descriptor):
+        return self.add(('method', cls, name, descriptor),
+                        b'\x0a' + struct.pack('>HH', self.cls(cls), self.name_and_type(name, descriptor)))
+
+    def fieldref(self, cls, name, descriptor):
+        return self.add(('field', cls, name, descriptor),
+                        b'\x09' + struct.pack('>HH', self.cls(cls), self.name_and_type(name, descriptor)))
+
+    def integer(self, value):
+        return self.add(('int', value), b'\x03' + struct.pack('>i', value))
+
+    def serialize(self):
+        return struct.pack('>H', len(self.entries) + 1) + b''.join(self.entries)
+
+
+def instruction_length(insn):
+    op = insn[0]
+    if op in TWO_BYTE_OPERAND:
+        return 3
+    if op in ONE_BYTE_OPERAND:
+        return 2
+    return 1
+
+
+def assemble(pool, class_name, code):
+    """Assembles a list of instructions and "label:" strings."""
+    labels = {}
+    insns = []
+    pc = 0
+    for item in code:
+        if isinstance(item, str) and item.endswith(':'):
+            labels[item[:-1]] = pc
+            continue
+        insn = (item,) if isinstance(item, str) else item
+        insns.append((pc, insn))
+        pc += instruction_length(insn)
+    out = b''
+    for pc, insn in insns:
+        op = insn[0]
+        out += bytes([OPCODES[op]])
+        if op in BRANCHES:
+            out += struct.pack('>h', labels[insn[1]] - pc)
+        elif op == 'bipush':
+            out += struct.pack('>b', insn[1])
+        elif op == 'sipush':
+            out += struct.pack('>h', insn[1])
+        elif op == 'ldc':
+            out += bytes([pool.integer(insn[1])])
+        elif op in ONE_BYTE_OPERAND:
+            out += bytes([insn[1]])
+        elif op == 'iinc':
+            out += struct.pack('>Bb', insn[1], insn[2])
+        elif op == 'getstatic':
+            out += struct.pack('>H', pool.fieldref('java/lang/System', 'out', 'Ljava/io/PrintStream;'))
+        elif op == 'invokevirtual':
+            out += struct.pack('>H', pool.methodref('java/io/PrintStream', 'println', '(I)V'))
+        elif op == 'invokestatic':
+            out += struct.pack('>H', pool.methodref(class_name, *insn[1]))
+    return out
+
+
+def write_class(class_name, methods):
+    """Writes <class_name>.class; methods are (name, descriptor, max_stack, max_locals, code)."""
+    pool = ConstantPool()
+    this_class = pool.cls(class_name)
+    super_class = pool.cls('java/lang/Object')
+    body = b''
+    for name, descriptor, max_stack, max_locals, code in methods:
+        bytecode = assemble(pool, class_name, code)
+        attribute = (struct.pack('>HHI', max_stack, max_locals, len(bytecode)) + bytecode +
+                     struct.pack('>HH', 0, 0))
+        # public static, one Code attribute
+        body += struct.pack('>HHHH', 0x0009, pool.utf8(name), pool.utf8(descriptor), 1)
+        body += struct.pack('>HI', pool.utf8('Code'), len(attribute)) + attribute
+    out = struct.pack('>IHH', 0xCAFEBABE, 0, 52) + pool.serialize()
+    out += struct.pack('>HHHHH', 0x0021, this_class, super_class, 0, 0)
+    out += struct.pack('>H', len(methods)) + body + struct.pack('>H', 0)
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), class_name + '.class')
+    with open(path, 'wb') as f:
+        f.write(out)
+
+
+# static int fib(int n) {
+#     if (n < 2) return n;
+#     return fib(n - 1) + fib(n - 2);
+# }
+# public static void main(String[] args) {
+#     System.out.println(fib(27));
+# }
+FIB = ('fib', '(I)I')
+write_class('Fib', [
+    FIB + (3, 1, [
+        'iload_0', 'iconst_2', ('if_icmpge', 'recurse'),
+        'iload_0', 'ireturn',
+        'recurse:',
+        'iload_0', 'iconst_1', 'isub', ('invokestatic', FIB),
+        'iload_0', 'iconst_2', 'isub', ('invokestatic', FIB),
+        'iadd', 'ireturn',
+    ]),
+    MAIN + (2, 1, [
+        'getstatic', ('bipush', 27), ('invokestatic', FIB), 'invokevirtual',
+        'return',
+    ]),
+])
+
+# static int countPrimes(int n) {
+#     boolean[] composite = new boolean[n + 1];
+#     int count = 0;
+#     for (int i = 2; i <= n; i++) {
+#         if (!composite[i]) {
+#             count++;
+#             if (i <= n / i) {
+#                 for (int j = i * i; j <= n; j += i) composite[j] = true;
+#             }
+#         }
+#     }
+#     return count;
+# }
+# public static void main(String[] args) {
+#     System.out.println(countPrimes(1000000));
+# }
+COUNT_PRIMES = ('countPrimes', '(I)I')
+write_class('Sieve', [
+    COUNT_PRIMES + (3, 5, [
+        'iload_0', 'iconst_1', 'iadd', ('newarray', T_BOOLEAN), 'astore_1',
+        'iconst_0', 'istore_2',
+        'iconst_2', 'istore_3',
+        'outer:',
+        'iload_3', 'iload_0', ('if_icmpgt', 'done'),
+        'aload_1', 'iload_3', 'baload', ('ifne', 'next'),
+        ('iinc', 2, 1),
+        'iload_3', 'iload_0', 'iload_3', 'idiv', ('if_icmpgt', 'next'),
+        'iload_3', 'iload_3', 'imul', ('istore', 4),
+        'inner:',
+        ('iload', 4), 'iload_0', ('if_icmpgt', 'next'),
+        'aload_1', ('iload', 4), 'iconst_1', 'bastore',
+        ('iload', 4), 'iload_3', 'iadd', ('istore', 4),
+        ('goto', 'inner'),
+        'next:',
+        ('iinc', 3, 1),
+        ('goto', 'outer'),
+        'done:',
+        'iload_2', 'ireturn',
+    ]),
+    MAIN + (2, 1, [
+        'getstatic', ('ldc', 1000000), ('invokestatic', COUNT_PRIMES), 'invokevirtual',
+        'return',
+    ]),
+])
+
+# static int run(int n) {
+#     int sum = 0;
+#     for (int i = 0; i < n; i++)
+#         for (int j = 0; j < n; j++)
+#             for (int k = 0; k < n; k++)
+#                 sum += (i * j) ^ k;
+#     return sum;
+# }
+# public static void main(String[] args) {
+#     System.out.println(run(200));
+# }
+RUN = ('run', '(I)I')
+write_class('NestedLoops', [
+    RUN + (4, 5, [
+        'iconst_0', 'istore_1',
+        'iconst_0', 'istore_2',
+        'i:',
+        'iload_2', 'iload_0', ('if_icmpge', 'i_done'),
+        'iconst_0', 'istore_3',
+        'j:',
+        'iload_3', 'iload_0', ('if_icmpge', 'j_done'),
+        'iconst_0', ('istore', 4),
+        'k:',
+        ('iload', 4), 'iload_0', ('if_icmpge', 'k_done'),
+        'iload_1', 'iload_2', 'iload_3', 'imul', ('iload', 4), 'ixor', 'iadd', 'istore_1',
+        ('iinc', 4, 1),
+        ('goto', 'k'),
+        'k_done:',
+        ('iinc', 3, 1),
+        ('goto', 'j'),
+        'j_done:',
+        ('iinc', 2, 1),
+        ('goto', 'i'),
+        'i_done:',
+        'iload_1', 'ireturn',
+    ]),
+    MAIN + (2, 1, [
+        'getstatic', ('sipush', 200), ('invokestatic', RUN), 'invokevirtual',
+        'return',
+    ]),
+])
+
+# static void fill(int[] a, int seed) {
+#     for (int i = 0; i < a.length; i++) {
+#         seed = seed * 1103515245 + 12345;
+#         a[i] = seed >>> 8;
+#     }
+# }
+# static void sort(int[] a) {
+#     for (int i = a.length - 1; i > 0; i--)
+#         for (int j = 0; j < i; j++)
+#             if (a[j] > a[j + 1]) {
+#                 int t = a[j];
+#                 a[j] = a[j + 1];
+#                 a[j + 1] = t;
+#             }
+# }
+# static int checksum(int[] a) {
+#     int h = 0;
+#     for (int i = 0; i < a.length; i++) h = h * 31 + a[i];
+#     return h;
+# }
+# public static void main(String[] args) {
+#     int[] a = new int[2000];
+#     fill(a, 42);
+#     sort(a);
+#     System.out.println(checksum(a));
+# }
+FILL = ('fill', '([II)V')
+SORT = ('sort', '([I)V')
+CHECKSUM = ('checksum', '([I)I')
+write_class('BubbleSort', [
+    FILL + (4, 3, [
+        'iconst_0', 'istore_2',
+        'loop:',
+        'iload_2', 'aload_0', 'arraylength', ('if_icmpge', 'done'),
+        'iload_1', ('ldc', 1103515245), 'imul', ('sipush', 12345), 'iadd', 'istore_1',
+        'aload_0', 'iload_2', 'iload_1', ('bipush', 8), 'iushr', 'iastore',
+        ('iinc', 2, 1),
+        ('goto', 'loop'),
+        'done:',
+        'return',
+    ]),
+    SORT + (5, 4, [
+        'aload_0', 'arraylength', 'iconst_1', 'isub', 'istore_1',
+        'i:',
+        'iload_1', ('ifle', 'i_done'),
+        'iconst_0', 'istore_2',
+        'j:',
+        'iload_2', 'iload_1', ('if_icmpge', 'j_done'),
+        'aload_0', 'iload_2', 'iaload', 'aload_0', 'iload_2', 'iconst_1', 'iadd', 'iaload',
+        ('if_icmple', 'next'),
+        'aload_0', 'iload_2', 'iaload', 'istore_3',
+        'aload_0', 'iload_2', 'aload_0', 'iload_2', 'iconst_1', 'iadd', 'iaload', 'iastore',
+        'aload_0', 'iload_2', 'iconst_1', 'iadd', 'iload_3', 'iastore',
+        'next:',
+        ('iinc', 2, 1),
+        ('goto', 'j'),
+        'j_done:',
+        ('iinc', 1, -1),
+        ('goto', 'i'),
+        'i_done:',
+        'return',
+    ]),
+    CHECKSUM + (3, 3, [
+        'iconst_0', 'istore_1',
+        'iconst_0', 'istore_2',
+        'loop:',
+        'iload_2', 'aload_0', 'arraylength', ('if_icmpge', 'done'),
+        'iload_1', ('bipush', 31), 'imul', 'aload_0', 'iload_2', 'iaload', 'iadd', 'istore_1',
+        ('iinc', 2, 1),
+        ('goto', 'loop'),
+        'done:',
+        'iload_1', 'ireturn',
+    ]),
+    MAIN + (2, 2, [
+        ('sipush', 2000), ('newarray', T_INT), 'astore_1',
+        'aload_1', ('bipush', 42), ('invokestatic', FILL),
+        'aload_1', ('invokestatic', SORT),
+        'getstatic', 'aload_1', ('invokestatic', CHECKSUM), 'invokevirtual',
+        'return',
+    ]),
+])
+
+# static int sum(int[] a) {
+#     int s = 0;
+#     for (int i = 0; i < a.length; i++) s += a[i];
+#     return s;
+# }
+# public static void main(String[] args) {
+#     int[] a = new int[1 << 20];
+#     for (int i = 0; i < a.length; i++) a[i] = i;
+#     int total = 0;
+#     for (int r = 0; r < 20; r++) total += sum(a);
+#     System.out.println(total);
+# }
+SUM = ('sum', '([I)I')
+write_class('ArraySum', [
+    SUM + (3, 3, [
+        'iconst_0', 'istore_1',
+        'iconst_0', 'istore_2',
+        'loop:',
+        'iload_2', 'aload_0', 'arraylength', ('if_icmpge', 'done'),
+        'iload_1', 'aload_0', 'iload_2', 'iaload', 'iadd', 'istore_1',
+        ('iinc', 2, 1),
+        ('goto', 'loop'),
+        'done:',
+        'iload_1', 'ireturn',
+    ]),
+    MAIN + (3, 5, [
+        ('ldc', 1 << 20), ('newarray', T_INT), 'astore_1',
+        'iconst_0', 'istore_2',
+        'fill:',
+        'iload_2', 'aload_1', 'arraylength', ('if_icmpge', 'filled'),
+        'aload_1', 'iload_2', 'iload_2', 'iastore',
+        ('iinc', 2, 1),
+        ('goto', 'fill'),
+        'filled:',
+        'iconst_0', 'istore_3',
+        'iconst_0', ('istore', 4),
+        'repeat:',
+        ('iload', 4), ('bipush', 20), ('if_icmpge', 'done'),
+        'iload_3', 'aload_1', ('invokestatic', SUM), 'iadd', 'istore_3',
+        ('iinc', 4, 1),
+        ('goto', 'repeat'),
+        'done:',
+        'getstatic', 'iload_3', 'invokevirtual',
+        'return',
+    ]),
+])
+
+# static int[] matrix(int n, int seed) {
+#     int[] m = new int[n * n];
+#     for (int i = 0; i < m.length; i++) m[i] = i * seed % 17 - 8;
+#     return m;
+# }
+# static int[] multiply(int[] a, int[] b, int n) {
+#     int[] c = new int[n * n];
+#     for (int i = 0; i < n; i++)
+#         for (int j = 0; j < n; j++) {
+#             int s = 0;
+#             for (int k = 0; k < n; k++) s += a[i * n + k] * b[k * n + j];
+#             c[i * n + j] = s;
+#         }
+#     return c;
+# }
+# public static void main(String[] args) {
+#     int n = 120;
+#     int[] a = matrix(n, 3);
+#     int[] b = matrix(n, 7);
+#     int[] c = multiply(a, b, n);
+#     int sum = 0;
+#     for (int i = 0; i < c.length; i++) sum += c[i];
+#     System.out.println(sum);
+# }
+MATRIX = ('matrix', '(II)[I')
+MULTIPLY = ('multiply', '([I[II)[I')
+write_class('MatrixMultiply', [
+    MATRIX + (4, 4, [
+        'iload_0', 'iload_0', 'imul', ('newarray', T_INT), 'astore_2',
+        'iconst_0', 'istore_3',
+        'loop:',
+        'iload_3', 'aload_2', 'arraylength', ('if_icmpge', 'done'),
+        'aload_2', 'iload_3', 'iload_3', 'iload_1', 'imul', ('bipush', 17), 'irem',
+        ('bipush', 8), 'isub', 'iastore',
+        ('iinc', 3, 1),
+        ('goto', 'loop'),
+        'done:',
+        'aload_2', 'areturn',
+    ]),
+    MULTIPLY + (5, 8, [
+        'iload_2', 'iload_2', 'imul', ('newarray', T_INT), 'astore_3',
+        'iconst_0', ('istore', 4),
+        'i:',
+        ('iload', 4), 'iload_2', ('if_icmpge', 'i_done'),
+        'iconst_0', ('istore', 5),
+        'j:',
+        ('iload', 5), 'iload_2', ('if_icmpge', 'j_done'),
+        'iconst_0', ('istore', 6),
+        'iconst_0', ('istore', 7),
+        'k:',
+        ('iload', 7), 'iload_2', ('if_icmpge', 'k_done'),
+        ('iload', 6),
+        'aload_0', ('iload', 4), 'iload_2', 'imul', ('iload', 7), 'iadd', 'iaload',
+        'aload_1', ('iload', 7), 'iload_2', 'imul', ('iload', 5), 'iadd', 'iaload',
+        'imul', 'iadd', ('istore', 6),
+        ('iinc', 7, 1),
+        ('goto', 'k'),
+        'k_done:',
+        'aload_3', ('iload', 4), 'iload_2', 'imul', ('iload', 5), 'iadd', ('iload', 6), 'iastore',
+        ('iinc', 5, 1),
+        ('goto', 'j'),
+        'j_done:',
+        ('iinc', 4, 1),
+        ('goto', 'i'),
+        'i_done:',
+        'aload_3', 'areturn',
+    ]),
+    MAIN + (3, 7, [
+        ('bipush', 120), 'istore_1',
+        'iload_1', 'iconst_3', ('invokestatic', MATRIX), 'astore_2',
+        'iload_1', ('bipush', 7), ('invokestatic', MATRIX), 'astore_3',
+        'aload_2', 'aload_3', 'iload_1', ('invokestatic', MULTIPLY), ('astore', 4),
+        'iconst_0', ('istore', 5),
+        'iconst_0', ('istore', 6),
+        'loop:',
+        ('iload', 6), ('aload', 4), 'arraylength', ('if_icmpge', 'done'),
+        ('iload', 5), ('aload', 4), ('iload', 6), 'iaload', 'iadd', ('istore', 5),
+        ('iinc', 6, 1),
+        ('goto', 'loop'),
+        'done:',
+        'getstatic', ('iload', 5), 'invokevirtual',
+        'return',
+    ]),
+])
+
+# The collector's pause on a large live heap: HOLD_DEPTH frames each keep
+# HOLD_ARRAYS arrays alive while the innermost one allocates short-lived
+# arrays, so every collection scans HOLD_DEPTH * HOLD_ARRAYS root slots
+# and full ones sweep as many live arrays. Run it under several
+# --gc-threads values (the bench-gc target) to see the pauses scale.
+#
+# static int hold(int depth) {
+#     int[] a1 = new int[4], a2 = new int[4], ..., a200 = new int[4];
+#     int r = depth > 0 ? hold(depth - 1) : churn(1000000);
+#     return r + a1.length + a2.length + ... + a200.length;
+# }
+# static int churn(int n) {
+#     int sum = 0;
+#     for (int i = 0; i < n; i++) {
+#         int[] t = new int[8];
+#         t[0] = i;
+#         sum += t[0];
+#     }
+#     return sum;
+# }
+# public static void main(String[] args) {
+#     System.out.println(hold(2000));
+# }
+HOLD = ('hold', '(I)I')
+CHURN = ('churn', '(I)I')
+HOLD_DEPTH = 2000
+HOLD_ARRAYS = 200
+write_class('GcPause', [
+    HOLD + (3, HOLD_ARRAYS + 2,
+            [insn for k in range(1, HOLD_ARRAYS + 1)
+             for insn in ('iconst_4', ('newarray', T_INT), ('astore', k))] + [
+        'iload_0', ('ifle', 'bottom'),
+        'iload_0', 'iconst_1', 'isub', ('invokestatic', HOLD),
+        ('goto', 'held'),
+        'bottom:',
+        ('ldc', 1000000), ('invokestatic', CHURN),
+        'held:',
+        ('istore', HOLD_ARRAYS + 1),
+        ('iload', HOLD_ARRAYS + 1)] +
+            [insn for k in range(1, HOLD_ARRAYS + 1)
+             for insn in (('aload', k), 'arraylength', 'iadd')] + [
+        'ireturn',
+    ]),
+    CHURN + (3, 4, [
+        'iconst_0', 'istore_1',
+        'iconst_0', 'istore_2',
+        'loop:',
+        'iload_2', 'iload_0', ('if_icmpge', 'done'),
+        ('bipush', 8), ('newarray', T_INT), 'astore_3',
+        'aload_3', 'iconst_0', 'iload_2', 'iastore',
+        'iload_1', 'aload_3', 'iconst_0', 'iaload', 'iadd', 'istore_1',
+        ('iinc', 2, 1),
+        ('goto', 'loop'),
+        'done:',
+        'iload_1', 'ireturn',
+    ]),
+    MAIN + (2, 1, [
+        'getstatic', ('sipush', HOLD_DEPTH), ('invokestatic', HOLD), 'invokevirtual',
+        'return',
+    ]),
+])
@@ -0,0 +1,500 @@
+// bounds.c
+#include "bounds.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+#include "intrinsic.h"
+#include "jvm.h"
+#include "verify.h"
+
+/**
+ * What is known about one local or operand stack slot. Locals are referred
+ * to as 1 + their index, so 0 means none.
+ */
+typedef struct {
+    /** Known to be >= 0 */
+    bool nonneg;
+    /** Known to be below some int, so adding 1 cannot overflow */
+    bool bounded;
+    /** Known to be below the length of the array in this local */
+    uint16_t below;
+    /** Known to be the length of the array in this local */
+    uint16_t length_of;
+    /** Stack only: the array loaded from this local, which still holds it */
+    uint16_t array;
+    /** Stack only: the value loaded from this local, which still holds it */
+    uint16_t local;
+} range_t;
+
+/** Methods whose analysis would need more states than this are skipped */
+#define MAX_RANGES (1u << 22)
+
+typedef struct {
+    method_t *method;
+    class_file_t *cls;
+    const uint8_t *code;
+    uint32_t length;
+    uint16_t max_locals;
+    /** max_locals + max_stack */
+    uint32_t slots;
+    /** The stack depth before each instruction, or UNREACHED_DEPTH */
+    uint16_t *depths;
+    /** What is known before each instruction: `slots` ranges per offset */
+    range_t *ranges;
+    /** The state being transformed by the current instruction, and its stack depth */
+    range_t *current;
+    uint32_t depth;
+    /** The state on a branch's taken edge */
+    range_t *taken;
+    uint32_t *worklist;
+    bool *queued;
+    uint32_t pending;
+} analyzer_t;
+
+static inline int16_t read_s2(const uint8_t *p) {
+    return (int16_t)((uint16_t) p[0] << 8 | p[1]);
+}
+
+static inline uint16_t read_u2(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/** Keeps only what is known in both `a` and `b` */
+static bool meet(range_t *a, const range_t *b) {
+    range_t old = *a;
+    a->nonneg = a->nonneg && b->nonneg;
+    a->bounded = a->bounded && b->bounded;
+    a->below = a->below == b->below ? a->below : 0;
+    a->length_of = a->length_of == b->length_of ? a->length_of : 0;
+    a->array = a->array == b->array ? a->array : 0;
+    a->local = a->local == b->local ? a->local : 0;
+    return memcmp(&old, a, sizeof(range_t)) != 0;
+}
+
+static void merge(analyzer_t *a, uint32_t pc, uint32_t depth, const range_t *state) {
+    range_t *ranges = &a->ranges[(size_t) pc * a->slots];
+    bool changed = false;
+    if (a->depths[pc] == UNREACHED_DEPTH) {
+        a->depths[pc] = (uint16_t) depth;
+        memcpy(ranges, state, a->slots * sizeof(range_t));
+        changed = true;
+    }
+    else {
+        for (uint32_t i = 0; i < a->max_locals + depth; i++) {
+            changed |= meet(&ranges[i], &state[i]);
+        }
+    }
+    if (changed && !a->queued[pc]) {
+        a->queued[pc] = true;
+        a->worklist[a->pending++] = pc;
+    }
+}
+
+static void push(analyzer_t *a, range_t range) {
+    a->current[a->max_locals + a->depth++] = range;
+}
+
+static range_t pop(analyzer_t *a) {
+    return a->current[a->max_locals + --a->depth];
+}
+
+/** Forgets that stack values are copies of `local`, which is being overwritten */
+static void forget_local(analyzer_t *a, uint32_t local) {
+    for (uint32_t i = 0; i < a->depth; i++) {
+        range_t *r = &a->current[a->max_locals + i];
+        if (r->local == local + 1) {
+            r->local = 0;
+        }
+    }
+}
+
+/** Forgets everything about the array in `local`, which is being overwritten */
+static void forget_array(analyzer_t *a, uint32_t local) {
+    for (uint32_t i = 0; i < a->max_locals + a->depth; i++) {
+        range_t *r = &a->current[i];
+        if (r->below == local + 1) {
+            r->below = 0;
+        }
+        if (r->length_of == local + 1) {
+            r->length_of = 0;
+        }
+        if (r->array == local + 1) {
+            r->array = 0;
+        }
+    }
+}
+
+/** Records in `state` that `x` < `y` */
+static void less_than(range_t *state, range_t x, range_t y) {
+    if (x.local) {
+        state[x.local - 1].bounded = true;
+        uint16_t bound = y.length_of ? y.length_of : y.below;
+        if (bound) {
+            state[x.local - 1].below = bound;
+        }
+    }
+    if (y.local && x.nonneg) {
+        state[y.local - 1].nonneg = true;
+    }
+}
+
+/** Records in `state` that `x` >= `y` */
+static void at_least(range_t *state, range_t x, range_t y) {
+    if (x.local && y.nonneg) {
+        state[x.local - 1].nonneg = true;
+    }
+}
+
+/** Whether an array access with this array and index is in bounds */
+static bool in_bounds(range_t array, range_t index) {
+    return array.array && index.nonneg && index.below == array.array;
+}
+
+/**
+ * Applies the instruction at `pc` to the state before it and merges the
+ * result into its successors. With `safe` set, only checks whether the
+ * instruction is an array access that is in bounds.
+ */
+static void analyze_insn(analyzer_t *a, uint32_t pc, bool *safe) {
+    const uint8_t *code = a->code;
+    uint8_t op = code[pc];
+    memcpy(a->current, &a->ranges[(size_t) pc * a->slots], a->slots * sizeof(range_t));
+    a->depth = a->depths[pc];
+    range_t *locals = a->current;
+    const range_t *stack = &a->current[a->max_locals];
+    if (safe) {
+        uint32_t d = a->depth;
+        switch (op) {
+            case i_iaload:
+            case i_baload:
+            case i_caload:
+            case i_saload:
+            case i_laload:
+                *safe = in_bounds(stack[d - 2], stack[d - 1]);
+                break;
+            case i_iastore:
+            case i_bastore:
+            case i_castore:
+            case i_sastore:
+                *safe = in_bounds(stack[d - 3], stack[d - 2]);
+                break;
+            case i_lastore:
+                *safe = in_bounds(stack[d - 4], stack[d - 3]);
+                break;
+            default:
+                *safe = false;
+                break;
+        }
+        return;
+    }
+
+    range_t none = {0};
+    range_t zero = {.nonneg = true};
+    bool branches = false;
+    bool falls_through = true;
+    uint32_t target = 0;
+    switch (op) {
+        case i_nop:
+        case i_getstatic:
+            break;
+        case i_iconst_m1:
+            push(a, none);
+            break;
+        case i_iconst_0:
+        case i_iconst_1:
+        case i_iconst_2:
+        case i_iconst_3:
+        case i_iconst_4:
+        case i_iconst_5:
+            push(a, zero);
+            break;
+        case i_bipush:
+            push(a, (range_t){.nonneg = (int8_t) code[pc + 1] >= 0});
+            break;
+        case i_sipush:
+            push(a, (range_t){.nonneg = read_s2(&code[pc + 1]) >= 0});
+            break;
+        case i_ldc: {
+            const cp_info_t *constant = &a->cls->constant_pool[code[pc + 1] - 1];
+            push(a, (range_t){.nonneg = constant->tag == CONSTANT_Integer &&
+                                        constant->info.integer >= 0});
+            break;
+        }
+        case i_iload:
+        case i_iload_0:
+        case i_iload_1:
+        case i_iload_2:
+        case i_iload_3: {
+            uint16_t index = op == i_iload ? code[pc + 1] : (uint16_t)(op - i_iload_0);
+            range_t value = locals[index];
+            value.local = index + 1;
+            push(a, value);
+            break;
+        }
+        case i_aload:
+        case i_aload_0:
+        case i_aload_1:
+        case i_aload_2:
+        case i_aload_3: {
+            uint16_t index = op == i_aload ? code[pc + 1] : (uint16_t)(op - i_aload_0);
+            push(a, (range_t){.array = index + 1});
+            break;
+        }
+        case i_istore:
+        case i_istore_0:
+        case i_istore_1:
+        case i_istore_2:
+        case i_istore_3: {
+            uint16_t index = op == i_istore ? code[pc + 1] : (uint16_t)(op - i_istore_0);
+            range_t value = pop(a);
+            forget_local(a, index);
+            forget_array(a, index);
+            locals[index] =
+                (range_t){.nonneg = value.nonneg, .bounded = value.bounded, .below = value.below};
+            break;
+        }
+        case i_astore:
+        case i_astore_0:
+        case i_astore_1:
+        case i_astore_2:
+        case i_astore_3: {
+            uint16_t index = op == i_astore ? code[pc + 1] : (uint16_t)(op - i_astore_0);
+            pop(a);
+            forget_local(a, index);
+            forget_array(a, index);
+            locals[index] = none;
+            break;
+        }
+        case i_iinc: {
+            uint8_t index = code[pc + 1];
+            int8_t delta = (int8_t) code[pc + 2];
+            forget_local(a, index);
+            if (delta > 0) {
+                // i + delta may overflow, but not i + 1 if i < some int
+                locals[index].nonneg = locals[index].nonneg && locals[index].bounded && delta == 1;
+                locals[index].below = 0;
+            }
+            else if (delta < 0) {
+                // i - 1 < n still holds unless i was negative and wraps
+                if (!locals[index].nonneg) {
+                    locals[index].below = 0;
+                }
+                locals[index].nonneg = false;
+            }
+            locals[index].bounded = false;
+            break;
+        }
+        case i_iadd:
+        case i_isub:
+        case i_imul:
+        case i_idiv:
+        case i_irem:
+        case i_ishl:
+        case i_ishr:
+        case i_iushr:
+        case i_iand:
+        case i_ior:
+        case i_ixor:
+            pop(a);
+            pop(a);
+            push(a, none);
+            break;
+        case i_ineg:
+            pop(a);
+            push(a, none);
+            break;
+        case i_dup: {
+            range_t value = pop(a);
+            push(a, value);
+            push(a, value);
+            break;
+        }
+        case i_ifeq:
+        case i_ifne:
+        case i_iflt:
+        case i_ifge:
+        case i_ifgt:
+        case i_ifle:
+        case i_if_icmpeq:
+        case i_if_icmpne:
+        case i_if_icmplt:
+        case i_if_icmpge:
+        case i_if_icmpgt:
+        case i_if_icmple: {
+            bool unary = op <= i_ifle;
+            range_t y = unary ? zero : pop(a);
+            range_t x = pop(a);
+            memcpy(a->taken, a->current, a->slots * sizeof(range_t));
+            // Compare x with y; `taken` is the state where the test holds
+            switch (unary ? op - i_ifeq : op - i_if_icmpeq) {
+                case 0: // ==
+                    at_least(a->taken, x, y);
+                    at_least(a->taken, y, x);
+                    break;
+                case 2: // <
+                    less_than(a->taken, x, y);
+                    at_least(locals, x, y);
+                    break;
+                case 3: // >=
+                    at_least(a->taken, x, y);
+                    less_than(locals, x, y);
+                    break;
+                case 4: // >
+                    less_than(a->taken, y, x);
+                    at_least(locals, y, x);
+                    break;
+                case 5: // <=
+                    at_least(a->taken, y, x);
+                    less_than(locals, y, x);
+                    break;
+                default:
+                    break;
+            }
+            branches = true;
+            target = (uint32_t)((int32_t) pc + read_s2(&code[pc + 1]));
+            break;
+        }
+        case i_goto:
+            memcpy(a->taken, a->current, a->slots * sizeof(range_t));
+            branches = true;
+            falls_through = false;
+            target = (uint32_t)((int32_t) pc + read_s2(&code[pc + 1]));
+            break;
+        case i_invokestatic: {
+            uint16_t index = read_u2(&code[pc + 1]);
+            method_t *callee = find_method_from_index(index, a->cls);
+            uint32_t slots;
+            bool result;
+            if (callee) {
+                slots = get_number_of_parameters(callee);
+                result = returns_value(callee);
+            }
+            else {
+                // Verified, so this is an intrinsic
+                const intrinsic_t *intrinsic = &intrinsics[find_intrinsic(index, a->cls)];
+                slots = intrinsic->slots;
+                result = intrinsic->returns_value;
+            }
+            for (uint32_t i = 0; i < slots; i++) {
+                pop(a);
+            }
+            if (result) {
+                push(a, none);
+            }
+            break;
+        }
+        case i_invokevirtual:
+        case i_monitorenter:
+        case i_monitorexit:
+            pop(a);
+            break;
+        case i_newarray:
+            pop(a);
+            push(a, none);
+            break;
+        case i_arraylength: {
+            range_t array = pop(a);
+            push(a, (range_t){.nonneg = true, .length_of = array.array});
+            break;
+        }
+        case i_iaload:
+        case i_baload:
+        case i_caload:
+        case i_saload:
+            pop(a);
+            pop(a);
+            push(a, (range_t){.nonneg = op == i_caload});
+            break;
+        case i_laload:
+            pop(a);
+            pop(a);
+            push(a, none);
+            push(a, none);
+            break;
+        case i_lastore:
+            pop(a);
+            // fall through
+        case i_iastore:
+        case i_bastore:
+        case i_castore:
+        case i_sastore:
+            pop(a);
+            pop(a);
+            pop(a);
+            break;
+        default:
+            // Returns, and anything the verifier rejected
+            falls_through = false;
+            break;
+    }
+    if (branches) {
+        merge(a, target, a->depth, a->taken);
+    }
+    if (falls_through) {
+        merge(a, pc + bytecode_length(code, pc, a->length), a->depth, a->current);
+    }
+}
+
+uint8_t *find_in_bounds_accesses(method_t *method, class_file_t *cls) {
+    const code_attribute_t *attr = &method->code;
+    analyzer_t a = {
+        .method = method,
+        .cls = cls,
+        .code = attr->code,
+        .length = attr->code_length,
+        .max_locals = attr->max_locals,
+        .slots = (uint32_t) attr->max_locals + attr->max_stack,
+    };
+    if (!method->verified || (size_t) a.length * a.slots > MAX_RANGES) {
+        return NULL;
+    }
+    a.depths = malloc(a.length * sizeof(uint16_t));
+    a.ranges = calloc((size_t) a.length * a.slots + 1, sizeof(range_t));
+    a.current = malloc((a.slots + 1) * sizeof(range_t));
+    a.taken = malloc((a.slots + 1) * sizeof(range_t));
+    a.worklist = malloc(a.length * sizeof(uint32_t));
+    a.queued = calloc(a.length, sizeof(bool));
+    uint8_t *in_bounds = NULL;
+    bool found = false;
+    if (a.depths && a.ranges && a.current && a.taken && a.worklist && a.queued) {
+        for (uint32_t pc = 0; pc < a.length; pc++) {
+            a.depths[pc] = UNREACHED_DEPTH;
+        }
+        // Nothing is known about parameters, or on entry to a handler
+        memset(a.current, 0, a.slots * sizeof(range_t));
+        merge(&a, 0, 0, a.current);
+        const uint8_t *entry = attr->exception_table;
+        for (uint16_t i = 0; i < attr->exception_table_length; i++, entry += 8) {
+            merge(&a, read_u2(&entry[4]), 1, a.current);
+        }
+        while (a.pending > 0) {
+            uint32_t pc = a.worklist[--a.pending];
+            a.queued[pc] = false;
+            analyze_insn(&a, pc, NULL);
+        }
+        in_bounds = calloc((a.length + 7) / 8, 1);
+    }
+    for (uint32_t pc = 0; in_bounds && pc < a.length; pc++) {
+        bool safe = false;
+        if (a.depths[pc] != UNREACHED_DEPTH) {
+            analyze_insn(&a, pc, &safe);
+        }
+        if (safe) {
+            in_bounds[pc / 8] |= (uint8_t)(1u << (pc % 8));
+            found = true;
+        }
+    }
+    if (!found) {
+        free(in_bounds);
+        in_bounds = NULL;
+    }
+    free(a.depths);
+    free(a.ranges);
+    free(a.current);
+    free(a.taken);
+    free(a.worklist);
+    free(a.queued);
+    return in_bounds;
+}
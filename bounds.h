@@ -0,0 +1,35 @@
+// bounds.h
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "read_class.h"
+
+/**
+ * Finds the array loads and stores of a verified method whose index is
+ * always in bounds, so that compiled code can skip their bounds checks.
+ *
+ * A forward dataflow pass tracks, for each int local and operand stack
+ * slot, whether it is known to be non-negative and whether it is known to
+ * be below the length of the array held in some local. Constants, lengths
+ * and increments by one of a value already known to be below some int
+ * establish the first; any other increment may overflow. Comparisons against
+ * an arraylength (the iload/aload/arraylength/if_icmpge test of a counted
+ * loop) establish the second on the edge where they hold. Storing to the
+ * array's local, or incrementing the index, forgets what was known; a
+ * decrement keeps the second only if the index was non-negative, as a
+ * negative one may wrap around.
+ *
+ * @return a bitmap of code_length bits with the bit of each such
+ *   instruction's offset set, or NULL if none were found
+ */
+uint8_t *find_in_bounds_accesses(method_t *method, class_file_t *cls);
+
+/** Whether the array access at `pc` was found to be in bounds */
+static inline bool access_in_bounds(const method_t *method, uint16_t pc) {
+    return method->in_bounds && method->in_bounds[pc / 8] & (1u << (pc % 8));
+}
+
+#endif
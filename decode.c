@@ -0,0 +1,618 @@
+// decode.c
+#include "decode.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "escape.h"
+#include "intrinsic.h"
+#include "jvm.h"
+#include "superinsn.h"
+#include "thread.h"
+
+#define UNMAPPED UINT32_MAX
+
+const uint8_t insn_flags[NUM_INSNS] = {
+    [q_ifeq] = INSN_BRANCH,
+    [q_ifne] = INSN_BRANCH,
+    [q_iflt] = INSN_BRANCH,
+    [q_ifge] = INSN_BRANCH,
+    [q_ifgt] = INSN_BRANCH,
+    [q_ifle] = INSN_BRANCH,
+    [q_if_icmpeq] = INSN_BRANCH,
+    [q_if_icmpne] = INSN_BRANCH,
+    [q_if_icmplt] = INSN_BRANCH,
+    [q_if_icmpge] = INSN_BRANCH,
+    [q_if_icmpgt] = INSN_BRANCH,
+    [q_if_icmple] = INSN_BRANCH,
+    [q_goto] = INSN_BRANCH | INSN_NO_FALLTHROUGH,
+    [q_ireturn] = INSN_NO_FALLTHROUGH,
+    [q_return] = INSN_NO_FALLTHROUGH,
+    [q_invalid] = INSN_NO_FALLTHROUGH,
+    [q_iinc_goto] = INSN_BRANCH | INSN_NO_FALLTHROUGH,
+    [q_iload_if_icmpeq] = INSN_BRANCH,
+    [q_iload_if_icmpne] = INSN_BRANCH,
+    [q_iload_if_icmplt] = INSN_BRANCH,
+    [q_iload_if_icmpge] = INSN_BRANCH,
+    [q_iload_if_icmpgt] = INSN_BRANCH,
+    [q_iload_if_icmple] = INSN_BRANCH,
+    [q_iload_iload_if_icmpeq] = INSN_BRANCH,
+    [q_iload_iload_if_icmpne] = INSN_BRANCH,
+    [q_iload_iload_if_icmplt] = INSN_BRANCH,
+    [q_iload_iload_if_icmpge] = INSN_BRANCH,
+    [q_iload_iload_if_icmpgt] = INSN_BRANCH,
+    [q_iload_iload_if_icmple] = INSN_BRANCH,
+    [q_array_loop] = INSN_BRANCH,
+};
+
+const insn_effect_t insn_effects[NUM_INSNS] = {
+    [q_iconst] = {0, 1, 0},
+    [q_iload] = {0, 1, LOCAL_A},
+    [q_istore] = {1, 0, LOCAL_A},
+    [q_iinc] = {0, 0, LOCAL_A},
+    [q_iadd] = {2, 1, 0},
+    [q_isub] = {2, 1, 0},
+    [q_imul] = {2, 1, 0},
+    [q_idiv] = {2, 1, 0},
+    [q_irem] = {2, 1, 0},
+    [q_ineg] = {1, 1, 0},
+    [q_ishl] = {2, 1, 0},
+    [q_ishr] = {2, 1, 0},
+    [q_iushr] = {2, 1, 0},
+    [q_iand] = {2, 1, 0},
+    [q_ior] = {2, 1, 0},
+    [q_ixor] = {2, 1, 0},
+    [q_dup] = {1, 2, 0},
+    [q_ifeq] = {1, 0, 0},
+    [q_ifne] = {1, 0, 0},
+    [q_iflt] = {1, 0, 0},
+    [q_ifge] = {1, 0, 0},
+    [q_ifgt] = {1, 0, 0},
+    [q_ifle] = {1, 0, 0},
+    [q_if_icmpeq] = {2, 0, 0},
+    [q_if_icmpne] = {2, 0, 0},
+    [q_if_icmplt] = {2, 0, 0},
+    [q_if_icmpge] = {2, 0, 0},
+    [q_if_icmpgt] = {2, 0, 0},
+    [q_if_icmple] = {2, 0, 0},
+    [q_println] = {1, 0, 0},
+    [q_monitorenter] = {1, 0, 0},
+    [q_monitorexit] = {1, 0, 0},
+    [q_newarray] = {1, 1, 0},
+    [q_newarray_frame] = {1, 1, 0},
+    [q_arraylength] = {1, 1, 0},
+    [q_iaload] = {2, 1, 0},
+    [q_iastore] = {3, 0, 0},
+    [q_baload] = {2, 1, 0},
+    [q_bastore] = {3, 0, 0},
+    [q_caload] = {2, 1, 0},
+    [q_castore] = {3, 0, 0},
+    [q_saload] = {2, 1, 0},
+    [q_sastore] = {3, 0, 0},
+    [q_laload] = {2, 2, 0},
+    [q_lastore] = {4, 0, 0},
+    [q_array_loop] = {0, 1, LOCAL_A},
+    [q_ireturn] = {1, 0, 0},
+    [q_iload_iload_iadd_istore] = {0, 0, LOCAL_A | LOCAL_B | LOCAL_C},
+    [q_iinc_goto] = {0, 0, LOCAL_A},
+    [q_iload_if_icmpeq] = {1, 0, LOCAL_A},
+    [q_iload_if_icmpne] = {1, 0, LOCAL_A},
+    [q_iload_if_icmplt] = {1, 0, LOCAL_A},
+    [q_iload_if_icmpge] = {1, 0, LOCAL_A},
+    [q_iload_if_icmpgt] = {1, 0, LOCAL_A},
+    [q_iload_if_icmple] = {1, 0, LOCAL_A},
+    [q_iload_iload_if_icmpeq] = {0, 0, LOCAL_A | LOCAL_B},
+    [q_iload_iload_if_icmpne] = {0, 0, LOCAL_A | LOCAL_B},
+    [q_iload_iload_if_icmplt] = {0, 0, LOCAL_A | LOCAL_B},
+    [q_iload_iload_if_icmpge] = {0, 0, LOCAL_A | LOCAL_B},
+    [q_iload_iload_if_icmpgt] = {0, 0, LOCAL_A | LOCAL_B},
+    [q_iload_iload_if_icmple] = {0, 0, LOCAL_A | LOCAL_B},
+};
+
+const char *const insn_names[NUM_INSNS] = {
+#define INSN_NAME(op) [op] = #op + 2,
+    FOR_EACH_INSN(INSN_NAME)
+#undef INSN_NAME
+};
+
+static inline int16_t read_s2(const uint8_t *p) {
+    return (int16_t)((uint16_t) p[0] << 8 | p[1]);
+}
+
+static inline uint16_t read_u2(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+uint32_t bytecode_length(const uint8_t *code, uint32_t pc, uint32_t length) {
+    uint32_t n;
+    switch (code[pc]) {
+        case i_bipush:
+        case i_ldc:
+        case i_iload:
+        case i_istore:
+        case i_aload:
+        case i_astore:
+        case i_newarray:
+            n = 2;
+            break;
+        case i_sipush:
+        case i_iinc:
+        case i_ifeq:
+        case i_ifne:
+        case i_iflt:
+        case i_ifge:
+        case i_ifgt:
+        case i_ifle:
+        case i_if_icmpeq:
+        case i_if_icmpne:
+        case i_if_icmplt:
+        case i_if_icmpge:
+        case i_if_icmpgt:
+        case i_if_icmple:
+        case i_goto:
+        case i_getstatic:
+        case i_invokestatic:
+        case i_invokevirtual:
+            n = 3;
+            break;
+        case i_nop:
+        case i_iconst_m1:
+        case i_iconst_0:
+        case i_iconst_1:
+        case i_iconst_2:
+        case i_iconst_3:
+        case i_iconst_4:
+        case i_iconst_5:
+        case i_iload_0:
+        case i_iload_1:
+        case i_iload_2:
+        case i_iload_3:
+        case i_aload_0:
+        case i_aload_1:
+        case i_aload_2:
+        case i_aload_3:
+        case i_istore_0:
+        case i_istore_1:
+        case i_istore_2:
+        case i_istore_3:
+        case i_astore_0:
+        case i_astore_1:
+        case i_astore_2:
+        case i_astore_3:
+        case i_iadd:
+        case i_isub:
+        case i_imul:
+        case i_idiv:
+        case i_irem:
+        case i_ineg:
+        case i_ishl:
+        case i_ishr:
+        case i_iushr:
+        case i_iand:
+        case i_ior:
+        case i_ixor:
+        case i_dup:
+        case i_arraylength:
+        case i_iaload:
+        case i_iastore:
+        case i_baload:
+        case i_bastore:
+        case i_caload:
+        case i_castore:
+        case i_saload:
+        case i_sastore:
+        case i_laload:
+        case i_lastore:
+        case i_ireturn:
+        case i_areturn:
+        case i_return:
+        case i_monitorenter:
+        case i_monitorexit:
+            n = 1;
+            break;
+        default:
+            return 0;
+    }
+    return pc + n <= length ? n : 0;
+}
+
+/**
+ * Whether an instruction produces no internal instruction. Any getstatic
+ * other than System.out's stays, to decode to a q_invalid.
+ */
+static bool is_elided(const uint8_t *code, uint32_t pc, class_file_t *cls) {
+    return code[pc] == i_nop ||
+           (code[pc] == i_getstatic && is_system_out(read_u2(&code[pc + 1]), cls));
+}
+
+/**
+ * Fills in `insn` for the supported bytecode instruction at `pc`.
+ * `targets` maps bytecode offsets to decoded instructions.
+ */
+static void decode_insn(insn_t *insn, const uint8_t *code, uint32_t pc,
+                        uint32_t length, insn_t **targets, method_t *method,
+                        class_file_t *cls) {
+    uint8_t op = code[pc];
+    insn->pc = (uint16_t) pc;
+    switch (op) {
+        case i_iconst_m1:
+        case i_iconst_0:
+        case i_iconst_1:
+        case i_iconst_2:
+        case i_iconst_3:
+        case i_iconst_4:
+        case i_iconst_5:
+            insn->op = q_iconst;
+            insn->a = (int32_t) op - i_iconst_0;
+            break;
+        case i_bipush:
+            insn->op = q_iconst;
+            insn->a = (int8_t) code[pc + 1];
+            break;
+        case i_sipush:
+            insn->op = q_iconst;
+            insn->a = read_s2(&code[pc + 1]);
+            break;
+        case i_ldc: {
+            uint8_t index = code[pc + 1];
+            cp_info_t *entry = index > 0 && index < cls->constant_pool_count
+                                   ? &cls->constant_pool[index - 1]
+                                   : NULL;
+            if (entry && (entry->tag == CONSTANT_Integer || entry->tag == CONSTANT_Float)) {
+                insn->op = q_iconst;
+                insn->a = entry->info.integer;
+            }
+            else {
+                insn->op = q_invalid;
+            }
+            break;
+        }
+        case i_iload:
+        case i_aload:
+            insn->op = q_iload;
+            insn->a = code[pc + 1];
+            break;
+        case i_iload_0:
+        case i_iload_1:
+        case i_iload_2:
+        case i_iload_3:
+            insn->op = q_iload;
+            insn->a = op - i_iload_0;
+            break;
+        case i_aload_0:
+        case i_aload_1:
+        case i_aload_2:
+        case i_aload_3:
+            insn->op = q_iload;
+            insn->a = op - i_aload_0;
+            break;
+        case i_istore:
+        case i_astore:
+            insn->op = q_istore;
+            insn->a = code[pc + 1];
+            break;
+        case i_istore_0:
+        case i_istore_1:
+        case i_istore_2:
+        case i_istore_3:
+            insn->op = q_istore;
+            insn->a = op - i_istore_0;
+            break;
+        case i_astore_0:
+        case i_astore_1:
+        case i_astore_2:
+        case i_astore_3:
+            insn->op = q_istore;
+            insn->a = op - i_astore_0;
+            break;
+        case i_iinc:
+            insn->op = q_iinc;
+            insn->a = code[pc + 1];
+            insn->b = (int8_t) code[pc + 2];
+            break;
+        case i_iadd:
+            insn->op = q_iadd;
+            break;
+        case i_isub:
+            insn->op = q_isub;
+            break;
+        case i_imul:
+            insn->op = q_imul;
+            break;
+        case i_idiv:
+            insn->op = q_idiv;
+            break;
+        case i_irem:
+            insn->op = q_irem;
+            break;
+        case i_ineg:
+            insn->op = q_ineg;
+            break;
+        case i_ishl:
+            insn->op = q_ishl;
+            break;
+        case i_ishr:
+            insn->op = q_ishr;
+            break;
+        case i_iushr:
+            insn->op = q_iushr;
+            break;
+        case i_iand:
+            insn->op = q_iand;
+            break;
+        case i_ior:
+            insn->op = q_ior;
+            break;
+        case i_ixor:
+            insn->op = q_ixor;
+            break;
+        case i_dup:
+            insn->op = q_dup;
+            break;
+        case i_ifeq:
+        case i_ifne:
+        case i_iflt:
+        case i_ifge:
+        case i_ifgt:
+        case i_ifle:
+        case i_if_icmpeq:
+        case i_if_icmpne:
+        case i_if_icmplt:
+        case i_if_icmpge:
+        case i_if_icmpgt:
+        case i_if_icmple:
+        case i_goto: {
+            static const uint16_t branch_ops[] = {
+                [i_ifeq - i_ifeq] = q_ifeq,
+                [i_ifne - i_ifeq] = q_ifne,
+                [i_iflt - i_ifeq] = q_iflt,
+                [i_ifge - i_ifeq] = q_ifge,
+                [i_ifgt - i_ifeq] = q_ifgt,
+                [i_ifle - i_ifeq] = q_ifle,
+                [i_if_icmpeq - i_ifeq] = q_if_icmpeq,
+                [i_if_icmpne - i_ifeq] = q_if_icmpne,
+                [i_if_icmplt - i_ifeq] = q_if_icmplt,
+                [i_if_icmpge - i_ifeq] = q_if_icmpge,
+                [i_if_icmpgt - i_ifeq] = q_if_icmpgt,
+                [i_if_icmple - i_ifeq] = q_if_icmple,
+                [i_goto - i_ifeq] = q_goto,
+            };
+            int32_t target = (int32_t) pc + read_s2(&code[pc + 1]);
+            insn->op = branch_ops[op - i_ifeq];
+            if (target < 0 || (uint32_t) target > length) {
+                target = (int32_t) length;
+            }
+            insn->target = targets[target];
+            break;
+        }
+        case i_invokestatic: {
+            uint16_t index = read_u2(&code[pc + 1]);
+            int32_t intrinsic;
+            insn->method = find_method_from_index(index, cls);
+            // The arguments become the callee's first locals in place
+            if (insn->method &&
+                get_number_of_parameters(insn->method) <= insn->method->code.max_locals) {
+                insn->op = q_invokestatic;
+                insn->a = get_number_of_parameters(insn->method);
+                insn->b = returns_value(insn->method);
+            }
+            else if (!insn->method && (intrinsic = find_intrinsic(index, cls)) >= 0 &&
+                     !intrinsics[intrinsic].is_virtual) {
+                insn->op = is_thread_intrinsic(&intrinsics[intrinsic]) ? q_thread : q_intrinsic;
+                insn->a = intrinsics[intrinsic].slots;
+                insn->b = intrinsics[intrinsic].returns_value;
+                insn->c = intrinsic;
+                if (intrinsics[intrinsic].kind == INTRINSIC_THREAD_START) {
+                    // The started thread runs the class's run(int[], int)
+                    insn->method = find_method(THREAD_RUN_METHOD, THREAD_RUN_DESCRIPTOR, cls);
+                    if (!insn->method || insn->method->code.max_locals < insn->a) {
+                        insn->op = q_invalid;
+                    }
+                }
+            }
+            else {
+                insn->op = q_invalid;
+            }
+            break;
+        }
+        case i_invokevirtual: {
+            // Object.wait() and the like on an array, or System.out.println(int)
+            int32_t intrinsic = find_intrinsic(read_u2(&code[pc + 1]), cls);
+            if (intrinsic >= 0 && intrinsics[intrinsic].is_virtual) {
+                insn->op = q_thread;
+                insn->a = intrinsics[intrinsic].slots;
+                insn->b = intrinsics[intrinsic].returns_value;
+                insn->c = intrinsic;
+            }
+            else if (is_println(read_u2(&code[pc + 1]), cls)) {
+                insn->op = q_println;
+            }
+            else {
+                insn->op = q_invalid;
+            }
+            break;
+        }
+        case i_monitorenter:
+            insn->op = q_monitorenter;
+            break;
+        case i_monitorexit:
+            insn->op = q_monitorexit;
+            break;
+        case i_newarray:
+            insn->op = is_array_type(code[pc + 1]) ? q_newarray : q_invalid;
+            if (insn->op == q_newarray && is_frame_array(method, (uint16_t) pc)) {
+                insn->op = q_newarray_frame;
+            }
+            insn->a = code[pc + 1];
+            break;
+        case i_arraylength:
+            insn->op = q_arraylength;
+            break;
+        case i_iaload:
+            insn->op = q_iaload;
+            break;
+        case i_iastore:
+            insn->op = q_iastore;
+            break;
+        case i_baload:
+            insn->op = q_baload;
+            break;
+        case i_bastore:
+            insn->op = q_bastore;
+            break;
+        case i_caload:
+            insn->op = q_caload;
+            break;
+        case i_castore:
+            insn->op = q_castore;
+            break;
+        case i_saload:
+            insn->op = q_saload;
+            break;
+        case i_sastore:
+            insn->op = q_sastore;
+            break;
+        case i_laload:
+            insn->op = q_laload;
+            break;
+        case i_lastore:
+            insn->op = q_lastore;
+            break;
+        case i_ireturn:
+        case i_areturn:
+            // Callers push a return value according to the descriptor
+            insn->op = returns_value(method) ? q_ireturn : q_invalid;
+            break;
+        case i_return:
+            insn->op = returns_value(method) ? q_invalid : q_return;
+            break;
+        default:
+            insn->op = q_invalid;
+            break;
+    }
+}
+
+bool decode_method(method_t *method, class_file_t *cls) {
+    const uint8_t *code = method->code.code;
+    uint32_t length = method->code.code_length;
+    if (length > UINT16_MAX) {
+        return false;
+    }
+
+    // First pass: number the instructions. Branches can only target offsets
+    // that start an instruction; everything else maps to the trailing q_invalid.
+    uint32_t *index_of = malloc((length + 1) * sizeof(uint32_t));
+    if (!index_of) {
+        return false;
+    }
+    uint32_t count = 0;
+    uint32_t pc = 0;
+    for (uint32_t i = 0; i <= length; i++) {
+        index_of[i] = UNMAPPED;
+    }
+    while (pc < length) {
+        uint32_t n = bytecode_length(code, pc, length);
+        if (n == 0) {
+            break;
+        }
+        index_of[pc] = count;
+        if (!is_elided(code, pc, cls)) {
+            count++;
+        }
+        pc += n;
+    }
+    uint32_t end = pc;
+
+    insn_t *insns = calloc(count + 1, sizeof(insn_t));
+    insn_t **targets = malloc((length + 1) * sizeof(insn_t *));
+    if (!insns || !targets) {
+        free(insns);
+        free(targets);
+        free(index_of);
+        return false;
+    }
+    for (uint32_t i = 0; i <= length; i++) {
+        targets[i] = &insns[index_of[i] == UNMAPPED ? count : index_of[i]];
+    }
+
+    // Second pass: emit
+    for (pc = 0; pc < end; pc += bytecode_length(code, pc, length)) {
+        if (!is_elided(code, pc, cls)) {
+            decode_insn(&insns[index_of[pc]], code, pc, length, targets, method, cls);
+        }
+    }
+    insns[count].op = q_invalid;
+    insns[count].pc = (uint16_t) end;
+    free(targets);
+    free(index_of);
+
+    // Handlers are entered by pc, so keep every instruction boundary intact
+    // in methods that have them.
+    count++;
+    if (!match_array_loops(method, insns, count)) {
+        free(insns);
+        return false;
+    }
+    if (method->code.exception_table_length == 0) {
+        count = fuse_superinstructions(insns, count);
+    }
+    method->insns = insns;
+    method->insns_count = count;
+#ifdef TINYJVM_TRAIN
+    method->insn_counts = calloc(count, sizeof(uint64_t));
+    if (!method->insn_counts) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+/** Whether the Class constant at `index` names one of `class_names` */
+static bool catches(class_file_t *cls, uint16_t index, const char *const *class_names) {
+    if (index == 0) {
+        // A catch-all (finally) handler
+        return true;
+    }
+    if (index >= cls->constant_pool_count ||
+        cls->constant_pool[index - 1].tag != CONSTANT_Class) {
+        return false;
+    }
+    uint16_t name_index = cls->constant_pool[index - 1].info.index;
+    if (name_index == 0 || name_index >= cls->constant_pool_count ||
+        cls->constant_pool[name_index - 1].tag != CONSTANT_Utf8) {
+        return false;
+    }
+    const utf8_t *name = &cls->constant_pool[name_index - 1].info.utf8;
+    for (; *class_names; class_names++) {
+        if (strlen(*class_names) == name->length &&
+            memcmp(*class_names, name->bytes, name->length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const insn_t *find_exception_handler(method_t *method, uint16_t pc,
+                                     const char *const *class_names,
+                                     class_file_t *cls) {
+    const uint8_t *entry = method->code.exception_table;
+    for (uint16_t i = 0; i < method->code.exception_table_length; i++, entry += 8) {
+        uint16_t start_pc = read_u2(&entry[0]);
+        uint16_t end_pc = read_u2(&entry[2]);
+        uint16_t handler_pc = read_u2(&entry[4]);
+        if (pc < start_pc || pc >= end_pc || !catches(cls, read_u2(&entry[6]), class_names)) {
+            continue;
+        }
+        // Methods with handlers are not fused, so every bytecode instruction
+        // other than nop and getstatic of System.out has an insn with its pc.
+        for (uint32_t j = 0; j < method->insns_count; j++) {
+            if (method->insns[j].pc >= handler_pc) {
+                return &method->insns[j];
+            }
+        }
+        return NULL;
+    }
+    return NULL;
+}
@@ -0,0 +1,179 @@
+// decode.h
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "read_class.h"
+
+/**
+ * The internal instruction set execute() runs. Each method's bytecode is
+ * translated once, on first execution, into an array of fixed-size insn_t:
+ * immediates are sign-extended, local slots and constants resolved, branch
+ * targets turned into insn pointers and invoked methods into method_t pointers.
+ * Operand usage is noted per instruction.
+ */
+#define FOR_EACH_INSN(X)                                                       \
+    X(q_iconst)      /* push a */                                              \
+    X(q_iload)       /* push locals[a] (also aload) */                         \
+    X(q_istore)      /* locals[a] = pop (also astore) */                       \
+    X(q_iinc)        /* locals[a] += b */                                      \
+    X(q_iadd)                                                                  \
+    X(q_isub)                                                                  \
+    X(q_imul)                                                                  \
+    X(q_idiv)                                                                  \
+    X(q_irem)                                                                  \
+    X(q_ineg)                                                                  \
+    X(q_ishl)                                                                  \
+    X(q_ishr)                                                                  \
+    X(q_iushr)                                                                 \
+    X(q_iand)                                                                  \
+    X(q_ior)                                                                   \
+    X(q_ixor)                                                                  \
+    X(q_dup)                                                                   \
+    X(q_ifeq)        /* branch to target */                                    \
+    X(q_ifne)                                                                  \
+    X(q_iflt)                                                                  \
+    X(q_ifge)                                                                  \
+    X(q_ifgt)                                                                  \
+    X(q_ifle)                                                                  \
+    X(q_if_icmpeq)                                                             \
+    X(q_if_icmpne)                                                             \
+    X(q_if_icmplt)                                                             \
+    X(q_if_icmpge)                                                             \
+    X(q_if_icmpgt)                                                             \
+    X(q_if_icmple)                                                             \
+    X(q_goto)                                                                  \
+    X(q_invokestatic) /* call method (a arg slots; b = returns a value) */     \
+    X(q_intrinsic)   /* call intrinsics[c] (a and b as for invokestatic) */    \
+    X(q_println)     /* print pop (getstatic System.out is dropped) */         \
+    X(q_monitorenter)                                                          \
+    X(q_monitorexit)                                                           \
+    X(q_thread)      /* thread method intrinsics[c] (see thread.h); a and b   \
+                        as for invokestatic, method = Threads.start's run() */ \
+    X(q_newarray)    /* a = atype */                                           \
+    X(q_newarray_frame) /* newarray on the VM stack (see escape.h) */          \
+    X(q_arraylength)                                                           \
+    X(q_iaload)                                                                \
+    X(q_iastore)                                                               \
+    X(q_baload)      /* byte and boolean arrays */                             \
+    X(q_bastore)                                                               \
+    X(q_caload)                                                                \
+    X(q_castore)                                                               \
+    X(q_saload)                                                                \
+    X(q_sastore)                                                               \
+    X(q_laload)      /* a long is two slots, low word first */                 \
+    X(q_lastore)                                                               \
+    X(q_array_loop)  /* run array_loops[b] to target, else as iload a */       \
+    X(q_ireturn)     /* also areturn */                                        \
+    X(q_return)                                                                \
+    X(q_invalid)     /* unsupported or malformed bytecode at pc */             \
+    /* Superinstructions, see superinsn.h. The branches keep their branch's */ \
+    /* bytecode offset in c (see safepoint_pc) */                              \
+    X(q_iload_iload_iadd_istore) /* locals[c] = locals[a] + locals[b] */       \
+    X(q_iinc_goto)   /* locals[a] += b, then jump to target */                 \
+    X(q_iload_if_icmpeq) /* compare pop with locals[a] */                      \
+    X(q_iload_if_icmpne)                                                       \
+    X(q_iload_if_icmplt)                                                       \
+    X(q_iload_if_icmpge)                                                       \
+    X(q_iload_if_icmpgt)                                                       \
+    X(q_iload_if_icmple)                                                       \
+    X(q_iload_iload_if_icmpeq) /* compare locals[a] with locals[b] */          \
+    X(q_iload_iload_if_icmpne)                                                 \
+    X(q_iload_iload_if_icmplt)                                                 \
+    X(q_iload_iload_if_icmpge)                                                 \
+    X(q_iload_iload_if_icmpgt)                                                 \
+    X(q_iload_iload_if_icmple)
+
+typedef enum {
+#define INSN_ENUM(op) op,
+    FOR_EACH_INSN(INSN_ENUM)
+#undef INSN_ENUM
+    NUM_INSNS
+} insn_op_t;
+
+/** Control-flow properties of each internal instruction, see insn_flags */
+enum {
+    /** Uses `target` */
+    INSN_BRANCH = 1 << 0,
+    /** Never continues with the next instruction */
+    INSN_NO_FALLTHROUGH = 1 << 1
+};
+
+extern const uint8_t insn_flags[NUM_INSNS];
+
+/** Which of an instruction's operands are local variable indices */
+enum {
+    LOCAL_A = 1 << 0,
+    LOCAL_B = 1 << 1,
+    LOCAL_C = 1 << 2
+};
+
+/**
+ * How an instruction uses the operand stack and locals. q_invokestatic,
+ * q_intrinsic and q_thread pop their `a` arguments and push `b` values
+ * instead of what is listed here.
+ */
+typedef struct {
+    uint8_t pops;
+    uint8_t pushes;
+    uint8_t locals;
+} insn_effect_t;
+
+extern const insn_effect_t insn_effects[NUM_INSNS];
+extern const char *const insn_names[NUM_INSNS];
+
+typedef struct insn {
+    uint16_t op;
+    /** Offset of the bytecode instruction this was decoded from */
+    uint16_t pc;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+    union {
+        const struct insn *target;
+        method_t *method;
+    };
+} insn_t;
+
+/**
+ * The bytecode offset whose reference map describes a thread stopped at
+ * `insn` (see verify.h). That is the instruction's own, except for a fused
+ * backward branch, which stops at its branch rather than its first load.
+ */
+static inline uint16_t safepoint_pc(const insn_t *insn) {
+    bool fused_branch = insn->op >= q_iinc_goto && insn->op <= q_iload_iload_if_icmple;
+    return fused_branch ? (uint16_t) insn->c : insn->pc;
+}
+
+/**
+ * Returns the length of the bytecode instruction at `pc`, or 0 if the VM
+ * does not support it or it is truncated.
+ */
+uint32_t bytecode_length(const uint8_t *code, uint32_t pc, uint32_t length);
+
+/**
+ * Translates a method's bytecode into internal instructions, stored in
+ * `method->insns` and `method->insns_count`, and fuses superinstructions.
+ * Decoding stops at the first unsupported opcode, which becomes a q_invalid;
+ * a q_invalid is also appended after the last instruction, and branches to
+ * anything that is not an instruction boundary go there.
+ *
+ * @return false if out of memory
+ */
+bool decode_method(method_t *method, class_file_t *cls);
+
+/**
+ * Finds the exception handler in a decoded method that covers the instruction
+ * at bytecode offset `pc` and catches an exception of one of the classes in
+ * `class_names` (a NULL-terminated list of the exception's class and its
+ * superclasses).
+ *
+ * @return the handler's first instruction, or NULL if none applies
+ */
+const insn_t *find_exception_handler(method_t *method, uint16_t pc,
+                                     const char *const *class_names,
+                                     class_file_t *cls);
+
+#endif
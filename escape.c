@@ -0,0 +1,388 @@
+// escape.c
+#include "escape.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+#include "intrinsic.h"
+#include "jvm.h"
+#include "verify.h"
+
+/**
+ * The allocation sites a local or operand stack slot may hold an array
+ * from, one bit per site. Only the first MAX_SITES newarrays are tracked.
+ */
+typedef uint64_t sites_t;
+
+#define MAX_SITES 64
+
+/** Methods whose analysis would need more states than this are skipped */
+#define MAX_STATES (1u << 22)
+
+typedef struct {
+    class_file_t *cls;
+    const code_attribute_t *attr;
+    const uint8_t *code;
+    uint32_t length;
+    uint16_t max_locals;
+    /** max_locals + max_stack */
+    uint32_t slots;
+    /** The site number of the newarray at each offset, or -1 */
+    int8_t *site_of;
+    /** The stack depth before each instruction, or UNREACHED_DEPTH */
+    uint16_t *depths;
+    /** The sites before each instruction: `slots` per offset */
+    sites_t *states;
+    /** The state being transformed by the current instruction, and its stack depth */
+    sites_t *current;
+    uint32_t depth;
+    /** The sites whose arrays escape */
+    sites_t escaped;
+    uint32_t *worklist;
+    bool *queued;
+    uint32_t pending;
+} analyzer_t;
+
+static inline int16_t read_s2(const uint8_t *p) {
+    return (int16_t)((uint16_t) p[0] << 8 | p[1]);
+}
+
+static inline uint16_t read_u2(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static void merge(analyzer_t *a, uint32_t pc, uint32_t depth, const sites_t *state) {
+    sites_t *sites = &a->states[(size_t) pc * a->slots];
+    bool changed = false;
+    if (a->depths[pc] == UNREACHED_DEPTH) {
+        a->depths[pc] = (uint16_t) depth;
+        memcpy(sites, state, a->slots * sizeof(sites_t));
+        changed = true;
+    }
+    else {
+        for (uint32_t i = 0; i < a->max_locals + depth; i++) {
+            changed |= (state[i] & ~sites[i]) != 0;
+            sites[i] |= state[i];
+        }
+    }
+    if (changed && !a->queued[pc]) {
+        a->queued[pc] = true;
+        a->worklist[a->pending++] = pc;
+    }
+}
+
+static void push(analyzer_t *a, sites_t sites) {
+    a->current[a->max_locals + a->depth++] = sites;
+}
+
+static sites_t pop(analyzer_t *a) {
+    return a->current[a->max_locals + --a->depth];
+}
+
+static void pop_n(analyzer_t *a, uint32_t n) {
+    a->depth -= n;
+}
+
+/**
+ * Enters the handlers covering `pc` with the locals before it: anything the
+ * instruction throws is caught there with the exception as the only operand.
+ */
+static void merge_handlers(analyzer_t *a, uint32_t pc) {
+    const uint8_t *entry = a->attr->exception_table;
+    for (uint16_t i = 0; i < a->attr->exception_table_length; i++, entry += 8) {
+        if (pc >= read_u2(&entry[0]) && pc < read_u2(&entry[2])) {
+            sites_t exception = a->current[a->max_locals];
+            a->current[a->max_locals] = 0;
+            merge(a, read_u2(&entry[4]), 1, a->current);
+            a->current[a->max_locals] = exception;
+        }
+    }
+}
+
+/** Applies the instruction at `pc` to the state before it and merges the result into its successors */
+static void analyze_insn(analyzer_t *a, uint32_t pc) {
+    const uint8_t *code = a->code;
+    uint8_t op = code[pc];
+    memcpy(a->current, &a->states[(size_t) pc * a->slots], a->slots * sizeof(sites_t));
+    a->depth = a->depths[pc];
+    merge_handlers(a, pc);
+    sites_t *locals = a->current;
+
+    bool branches = false;
+    bool falls_through = true;
+    uint32_t target = 0;
+    switch (op) {
+        case i_nop:
+        case i_getstatic:
+            break;
+        case i_iconst_m1:
+        case i_iconst_0:
+        case i_iconst_1:
+        case i_iconst_2:
+        case i_iconst_3:
+        case i_iconst_4:
+        case i_iconst_5:
+        case i_bipush:
+        case i_sipush:
+        case i_ldc:
+            push(a, 0);
+            break;
+        case i_iload:
+        case i_iload_0:
+        case i_iload_1:
+        case i_iload_2:
+        case i_iload_3:
+            push(a, 0);
+            break;
+        case i_aload:
+        case i_aload_0:
+        case i_aload_1:
+        case i_aload_2:
+        case i_aload_3: {
+            uint16_t index = op == i_aload ? code[pc + 1] : (uint16_t)(op - i_aload_0);
+            push(a, locals[index]);
+            break;
+        }
+        case i_istore:
+        case i_istore_0:
+        case i_istore_1:
+        case i_istore_2:
+        case i_istore_3: {
+            uint16_t index = op == i_istore ? code[pc + 1] : (uint16_t)(op - i_istore_0);
+            pop(a);
+            locals[index] = 0;
+            break;
+        }
+        case i_astore:
+        case i_astore_0:
+        case i_astore_1:
+        case i_astore_2:
+        case i_astore_3: {
+            uint16_t index = op == i_astore ? code[pc + 1] : (uint16_t)(op - i_astore_0);
+            locals[index] = pop(a);
+            break;
+        }
+        case i_iinc:
+            break;
+        case i_iadd:
+        case i_isub:
+        case i_imul:
+        case i_idiv:
+        case i_irem:
+        case i_ishl:
+        case i_ishr:
+        case i_iushr:
+        case i_iand:
+        case i_ior:
+        case i_ixor:
+            pop_n(a, 2);
+            push(a, 0);
+            break;
+        case i_ineg:
+            pop(a);
+            push(a, 0);
+            break;
+        case i_dup: {
+            sites_t value = pop(a);
+            push(a, value);
+            push(a, value);
+            break;
+        }
+        case i_ifeq:
+        case i_ifne:
+        case i_iflt:
+        case i_ifge:
+        case i_ifgt:
+        case i_ifle:
+            pop(a);
+            branches = true;
+            target = (uint32_t)((int32_t) pc + read_s2(&code[pc + 1]));
+            break;
+        case i_if_icmpeq:
+        case i_if_icmpne:
+        case i_if_icmplt:
+        case i_if_icmpge:
+        case i_if_icmpgt:
+        case i_if_icmple:
+            pop_n(a, 2);
+            branches = true;
+            target = (uint32_t)((int32_t) pc + read_s2(&code[pc + 1]));
+            break;
+        case i_goto:
+            branches = true;
+            falls_through = false;
+            target = (uint32_t)((int32_t) pc + read_s2(&code[pc + 1]));
+            break;
+        case i_invokestatic: {
+            uint16_t index = read_u2(&code[pc + 1]);
+            method_t *callee = find_method_from_index(index, a->cls);
+            uint32_t slots;
+            bool result;
+            bool escapes = callee != NULL;
+            if (callee) {
+                slots = get_number_of_parameters(callee);
+                result = returns_value(callee);
+            }
+            else {
+                // Verified, so this is an intrinsic
+                const intrinsic_t *intrinsic = &intrinsics[find_intrinsic(index, a->cls)];
+                slots = intrinsic->slots;
+                result = intrinsic->returns_value;
+                // A started thread may outlive the frame
+                escapes = intrinsic->kind == INTRINSIC_THREAD_START;
+            }
+            for (uint32_t i = 0; i < slots; i++) {
+                sites_t argument = pop(a);
+                if (escapes) {
+                    a->escaped |= argument;
+                }
+            }
+            if (result) {
+                push(a, 0);
+            }
+            break;
+        }
+        case i_invokevirtual:
+        case i_monitorenter:
+        case i_monitorexit:
+            pop(a);
+            break;
+        case i_newarray: {
+            int8_t site = a->site_of[pc];
+            pop(a);
+            push(a, site < 0 ? 0 : (sites_t) 1 << site);
+            break;
+        }
+        case i_arraylength:
+            pop(a);
+            push(a, 0);
+            break;
+        case i_iaload:
+        case i_baload:
+        case i_caload:
+        case i_saload:
+            pop_n(a, 2);
+            push(a, 0);
+            break;
+        case i_laload:
+            pop_n(a, 2);
+            push(a, 0);
+            push(a, 0);
+            break;
+        case i_iastore:
+        case i_bastore:
+        case i_castore:
+        case i_sastore:
+            pop_n(a, 3);
+            break;
+        case i_lastore:
+            pop_n(a, 4);
+            break;
+        case i_areturn:
+            a->escaped |= pop(a);
+            falls_through = false;
+            break;
+        default:
+            // Other returns, and anything the verifier rejected
+            falls_through = false;
+            break;
+    }
+    if (branches) {
+        merge(a, target, a->depth, a->current);
+    }
+    if (falls_through) {
+        merge(a, pc + bytecode_length(code, pc, a->length), a->depth, a->current);
+    }
+}
+
+/**
+ * Whether the instruction at `site` can run more than once per invocation.
+ * Falling through only moves forward, so every cycle through it contains a
+ * backward branch, or a handler at or before it, spanning its offset.
+ */
+static bool in_loop(const analyzer_t *a, uint32_t site) {
+    for (uint32_t pc = 0; pc < a->length; pc += bytecode_length(a->code, pc, a->length)) {
+        uint8_t op = a->code[pc];
+        if ((op >= i_ifeq && op <= i_if_icmple) || op == i_goto) {
+            uint32_t target = (uint32_t)((int32_t) pc + read_s2(&a->code[pc + 1]));
+            if (target <= site && site <= pc) {
+                return true;
+            }
+        }
+    }
+    const uint8_t *entry = a->attr->exception_table;
+    for (uint16_t i = 0; i < a->attr->exception_table_length; i++, entry += 8) {
+        if (read_u2(&entry[4]) <= site && site < read_u2(&entry[2])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t *find_frame_arrays(method_t *method, class_file_t *cls) {
+    const code_attribute_t *attr = &method->code;
+    analyzer_t a = {
+        .cls = cls,
+        .attr = attr,
+        .code = attr->code,
+        .length = attr->code_length,
+        .max_locals = attr->max_locals,
+        .slots = (uint32_t) attr->max_locals + attr->max_stack,
+    };
+    if (!method->verified || (size_t) a.length * a.slots > MAX_STATES) {
+        return NULL;
+    }
+    a.site_of = malloc(a.length);
+    uint32_t sites = 0;
+    for (uint32_t pc = 0; a.site_of && pc < a.length;
+         pc += bytecode_length(a.code, pc, a.length)) {
+        bool tracked = a.code[pc] == i_newarray && sites < MAX_SITES;
+        a.site_of[pc] = tracked ? (int8_t) sites++ : -1;
+    }
+    if (sites == 0) {
+        free(a.site_of);
+        return NULL;
+    }
+    a.depths = malloc(a.length * sizeof(uint16_t));
+    a.states = calloc((size_t) a.length * a.slots + 1, sizeof(sites_t));
+    a.current = malloc((a.slots + 1) * sizeof(sites_t));
+    a.worklist = malloc(a.length * sizeof(uint32_t));
+    a.queued = calloc(a.length, sizeof(bool));
+    uint8_t *frame_arrays = NULL;
+    bool found = false;
+    if (a.site_of && a.depths && a.states && a.current && a.worklist && a.queued) {
+        for (uint32_t pc = 0; pc < a.length; pc++) {
+            a.depths[pc] = UNREACHED_DEPTH;
+        }
+        // Parameters hold no array allocated here
+        memset(a.current, 0, a.slots * sizeof(sites_t));
+        merge(&a, 0, 0, a.current);
+        while (a.pending > 0) {
+            uint32_t pc = a.worklist[--a.pending];
+            a.queued[pc] = false;
+            analyze_insn(&a, pc);
+        }
+        frame_arrays = calloc((a.length + 7) / 8, 1);
+    }
+    for (uint32_t pc = 0; frame_arrays && pc < a.length;
+         pc += bytecode_length(a.code, pc, a.length)) {
+        int8_t site = a.site_of[pc];
+        if (site >= 0 && a.depths[pc] != UNREACHED_DEPTH &&
+            !(a.escaped & (sites_t) 1 << site) && !in_loop(&a, pc)) {
+            frame_arrays[pc / 8] |= (uint8_t)(1u << (pc % 8));
+            found = true;
+        }
+    }
+    if (!found) {
+        free(frame_arrays);
+        frame_arrays = NULL;
+    }
+    free(a.site_of);
+    free(a.depths);
+    free(a.states);
+    free(a.current);
+    free(a.worklist);
+    free(a.queued);
+    return frame_arrays;
+}
@@ -0,0 +1,32 @@
+// escape.h
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "read_class.h"
+
+/**
+ * Finds the newarray instructions of a verified method whose arrays never
+ * outlive its frame, so that they can be allocated on the VM stack (see
+ * gc_new_frame_array()) and freed when the method returns.
+ *
+ * A forward dataflow pass tracks which allocation sites each local and
+ * operand stack slot may hold an array from. An array escapes if it reaches
+ * an areturn or is passed to an invokestatic; intrinsics keep no references,
+ * so passing an array to one does not count. Arrays only hold primitives, so
+ * none can be stored into another. A site inside a loop could run any number
+ * of times per invocation, so only sites that run at most once qualify.
+ *
+ * @return a bitmap of code_length bits with the bit of each such
+ *   instruction's offset set, or NULL if none were found
+ */
+uint8_t *find_frame_arrays(method_t *method, class_file_t *cls);
+
+/** Whether the newarray at `pc` was found to allocate a frame array */
+static inline bool is_frame_array(const method_t *method, uint16_t pc) {
+    return method->frame_arrays && method->frame_arrays[pc / 8] & (1u << (pc % 8));
+}
+
+#endif
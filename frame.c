@@ -0,0 +1,38 @@
+// frame.c
+#include "frame.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+vm_stack_t *vm_stack_init(size_t reserve, uint32_t max_depth) {
+    vm_stack_t *vm_stack = malloc(sizeof(vm_stack_t));
+    if (!vm_stack) {
+        return NULL;
+    }
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void *base = mmap(NULL, reserve, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (base == MAP_FAILED) {
+        free(vm_stack);
+        return NULL;
+    }
+    vm_stack->base = base;
+    vm_stack->top = base;
+    vm_stack->limit = vm_stack->base + reserve;
+    vm_stack->end = vm_stack->limit;
+    vm_stack->frame_arrays = 0;
+    vm_stack->current = NULL;
+    vm_stack->depth = 0;
+    vm_stack->max_depth = max_depth;
+    vm_stack->native_depth = 0;
+    vm_stack->thread = NULL;
+    vm_stack->preempt = false;
+    return vm_stack;
+}
+
+void vm_stack_free(vm_stack_t *vm_stack) {
+    munmap(vm_stack->base, (size_t)(vm_stack->end - vm_stack->base));
+    free(vm_stack);
+}
@@ -0,0 +1,122 @@
+// frame.h
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decode.h"
+#include "read_class.h"
+
+/**
+ * An activation record on the VM stack. Frames are laid out contiguously:
+ *
+ *     locals[max_locals] | frame_t | operand stack[max_stack]
+ *
+ * A callee's locals start at the first argument on its caller's operand
+ * stack, so arguments are passed in place without copying. Frame arrays
+ * (see gc_new_frame_array()) are allocated from the other end of the
+ * region, and freed along with the frame that allocated them.
+ */
+typedef struct frame {
+    method_t *method;
+    struct frame *caller;
+    int32_t *locals;
+    int32_t *stack;
+    /** While this frame is calling another: where to resume and the operand depth */
+    const insn_t *ip;
+    uint32_t top;
+    /** The VM stack's limit and frame array count when this frame was pushed */
+    uint8_t *limit;
+    uint32_t frame_arrays;
+} frame_t;
+
+/**
+ * One reserved region of virtual memory holding every frame of a thread.
+ * The region is mapped without reserving swap, so pages are only backed once
+ * frames reach them and pushing or popping a frame is a pointer bump.
+ */
+typedef struct {
+    uint8_t *base;
+    uint8_t *top;
+    /** Where the frame arrays start, below the end of the region */
+    uint8_t *limit;
+    uint8_t *end;
+    /** How many frame arrays are live: the heap slots they use */
+    uint32_t frame_arrays;
+    frame_t *current;
+    /** The number of frames on the stack, and how many are allowed */
+    uint32_t depth;
+    uint32_t max_depth;
+    /** How many compiled frames are running nested on the native stack */
+    uint32_t native_depth;
+    /** The green thread running on this stack, or NULL without a scheduler (see thread.h) */
+    struct vm_thread *thread;
+    /** Set when the thread should stop at its next safepoint; accessed atomically */
+    bool preempt;
+} vm_stack_t;
+
+/** The default amount of address space reserved for a VM stack */
+#define VM_STACK_RESERVE ((size_t) 256 << 20)
+/** The default maximum number of frames */
+#define VM_STACK_MAX_DEPTH (1u << 20)
+
+vm_stack_t *vm_stack_init(size_t reserve, uint32_t max_depth);
+void vm_stack_free(vm_stack_t *vm_stack);
+
+/**
+ * Returns where the next frame's locals would start if there is no caller
+ * operand stack to pass arguments on (e.g. for main()).
+ */
+static inline int32_t *vm_stack_free_slots(vm_stack_t *vm_stack) {
+    return (int32_t *) vm_stack->top;
+}
+
+/**
+ * Pushes a frame for `method` whose locals start at `locals`, which must be
+ * at or below the top of the VM stack (normally the caller's arguments).
+ *
+ * @return the new frame, or NULL if that would exceed the maximum depth or
+ *   the reserved region
+ */
+static inline frame_t *push_frame(vm_stack_t *vm_stack, method_t *method,
+                                  int32_t *locals) {
+    uintptr_t header = (uintptr_t)(locals + method->code.max_locals);
+    header = (header + _Alignof(frame_t) - 1) & ~(uintptr_t)(_Alignof(frame_t) - 1);
+    frame_t *frame = (frame_t *) header;
+    int32_t *stack = (int32_t *)(frame + 1);
+    uint8_t *end = (uint8_t *)(stack + method->code.max_stack);
+    if (end > vm_stack->limit || vm_stack->depth >= vm_stack->max_depth) {
+        return NULL;
+    }
+    frame->method = method;
+    frame->caller = vm_stack->current;
+    frame->locals = locals;
+    frame->stack = stack;
+    frame->ip = NULL;
+    frame->top = 0;
+    frame->limit = vm_stack->limit;
+    frame->frame_arrays = vm_stack->frame_arrays;
+    vm_stack->current = frame;
+    vm_stack->top = end;
+    vm_stack->depth++;
+    return frame;
+}
+
+/**
+ * Pops the current frame, making its caller's operand stack the top again
+ * and freeing the frame arrays it allocated
+ */
+static inline void pop_frame(vm_stack_t *vm_stack) {
+    frame_t *frame = vm_stack->current;
+    frame_t *caller = frame->caller;
+    vm_stack->limit = frame->limit;
+    vm_stack->frame_arrays = frame->frame_arrays;
+    vm_stack->current = caller;
+    vm_stack->depth--;
+    vm_stack->top = caller ? (uint8_t *)(caller->stack + caller->method->code.max_stack)
+                           : vm_stack->base;
+}
+
+#endif
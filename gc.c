@@ -0,0 +1,318 @@
+// gc.c
+#include "gc.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "array.h"
+#include "jvm.h"
+#include "thread.h"
+#include "verify.h"
+#include "worksteal.h"
+
+size_t gc_threshold = GC_DEFAULT_THRESHOLD;
+size_t gc_nursery_size = GC_DEFAULT_NURSERY_SIZE;
+uint32_t gc_threads = 1;
+bool gc_verbose = false;
+
+/**
+ * The threads that collect with the caller when gc_threads is above 1,
+ * started by the first such collection. Heaps collected at once, by
+ * isolates on different threads, take turns using it.
+ */
+static work_pool_t *gc_pool;
+static pthread_once_t gc_pool_once = PTHREAD_ONCE_INIT;
+
+static void start_gc_pool(void) {
+    gc_pool = work_pool_create(gc_threads);
+}
+
+/** The number of root slots in a frame: its locals, then its operand stack */
+static uint32_t frame_slots(const frame_t *frame) {
+    return frame->method->code.max_locals + frame->top;
+}
+
+/** Marks the references in slots [begin, end) of one frame */
+static void mark_frame(heap_t *heap, const frame_t *frame, uint32_t begin, uint32_t end,
+                       bool young_only) {
+    const method_t *method = frame->method;
+    uint16_t max_locals = method->code.max_locals;
+    const uint8_t *bits = NULL;
+    size_t first = 0;
+    if (method->ref_maps && frame->ip) {
+        bits = find_ref_map(method->ref_maps, safepoint_pc(frame->ip), &first);
+        // A method only has maps once verified, and then one at every safepoint
+        assert(bits != NULL);
+    }
+    for (uint32_t i = begin; i < end; i++) {
+        size_t bit = first + i;
+        if (!bits || bits[bit / 8] & (1u << (bit % 8))) {
+            heap_mark(heap, i < max_locals ? frame->locals[i] : frame->stack[i - max_locals],
+                      young_only);
+        }
+    }
+}
+
+typedef struct {
+    heap_t *heap;
+    bool young_only;
+    const frame_t **frames;
+    /** The index of each frame's first slot among all root slots, then their number */
+    uint32_t *first_slots;
+    uint32_t frame_count;
+    /** Sweeping: each chunk's freed slots start at its first slot's index */
+    int32_t *freed;
+    uint32_t *freed_counts;
+    size_t *live;
+} collection_t;
+
+/**
+ * The root slots each mark task scans, whether they lie in a few large
+ * frames or many small ones
+ */
+#define MARK_CHUNK 4096
+
+static void mark_task(void *ctx, uint32_t i, uint32_t worker) {
+    (void) worker;
+    collection_t *c = ctx;
+    uint32_t total = c->first_slots[c->frame_count];
+    uint32_t begin = i * MARK_CHUNK;
+    uint32_t end = begin + MARK_CHUNK < total ? begin + MARK_CHUNK : total;
+    // The last frame starting at or before `begin`
+    uint32_t low = 0, high = c->frame_count - 1;
+    while (low < high) {
+        uint32_t mid = (low + high + 1) / 2;
+        if (c->first_slots[mid] <= begin) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    for (uint32_t f = low; f < c->frame_count && c->first_slots[f] < end; f++) {
+        uint32_t first = c->first_slots[f];
+        uint32_t from = begin > first ? begin - first : 0;
+        uint32_t to = end - first < frame_slots(c->frames[f]) ? end - first
+                                                              : frame_slots(c->frames[f]);
+        mark_frame(c->heap, c->frames[f], from, to, c->young_only);
+    }
+}
+
+/** The slots each sweep task covers */
+#define SWEEP_CHUNK (64 * HEAP_SWEEP_ALIGN)
+
+static void sweep_task(void *ctx, uint32_t i, uint32_t worker) {
+    collection_t *c = ctx;
+    uint32_t begin = i * SWEEP_CHUNK;
+    uint32_t end = begin + SWEEP_CHUNK < c->heap->size ? begin + SWEEP_CHUNK : c->heap->size;
+    uint32_t freed_count;
+    c->live[worker] += heap_sweep_range(c->heap, begin, end, &c->freed[begin], &freed_count);
+    c->freed_counts[i] = freed_count;
+}
+
+/** Sweeps the old space on the collector's pool */
+static void parallel_sweep(heap_t *heap, collection_t *c) {
+    uint32_t chunks = (heap->size + SWEEP_CHUNK - 1) / SWEEP_CHUNK;
+    uint32_t threads = work_pool_threads(gc_pool);
+    c->freed = malloc((heap->size ? heap->size : 1) * sizeof(int32_t));
+    c->freed_counts = malloc((chunks ? chunks : 1) * sizeof(uint32_t));
+    c->live = calloc(threads, sizeof(size_t));
+    if (!c->freed || !c->freed_counts || !c->live) {
+        heap_sweep(heap);
+    }
+    else {
+        work_pool_run(gc_pool, chunks, sweep_task, c);
+        size_t live = 0;
+        for (uint32_t t = 0; t < threads; t++) {
+            live += c->live[t];
+        }
+        // Pack the freed slots together
+        uint32_t freed_count = 0;
+        for (uint32_t i = 0; i < chunks; i++) {
+            memmove(&c->freed[freed_count], &c->freed[i * SWEEP_CHUNK],
+                    c->freed_counts[i] * sizeof(int32_t));
+            freed_count += c->freed_counts[i];
+        }
+        heap_sweep_done(heap, c->freed, freed_count, live);
+    }
+    free(c->freed);
+    free(c->freed_counts);
+    free(c->live);
+}
+
+void gc_collect(heap_t *heap, vm_stack_t *vm_stack, bool full) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (gc_threads > 1) {
+        pthread_once(&gc_pool_once, start_gc_pool);
+    }
+    // Threads sharing the heap each have roots on their own stack
+    vm_stack_t **stacks = &vm_stack;
+    uint32_t stack_count = 1;
+    if (heap->scheduler) {
+        stacks = scheduler_stacks(heap->scheduler, &stack_count);
+    }
+    uint32_t depth = 0;
+    for (uint32_t i = 0; i < stack_count; i++) {
+        depth += stacks[i]->depth;
+    }
+    collection_t c = {.heap = heap, .young_only = !full};
+    if (gc_pool && depth > 0) {
+        c.frames = malloc(depth * sizeof(frame_t *));
+        c.first_slots = malloc((depth + 1) * sizeof(uint32_t));
+    }
+    if (c.frames && c.first_slots) {
+        uint32_t slots = 0;
+        for (uint32_t i = 0; i < stack_count; i++) {
+            for (const frame_t *frame = stacks[i]->current; frame; frame = frame->caller) {
+                c.first_slots[c.frame_count] = slots;
+                c.frames[c.frame_count++] = frame;
+                slots += frame_slots(frame);
+            }
+        }
+        c.first_slots[c.frame_count] = slots;
+        work_pool_run(gc_pool, (slots + MARK_CHUNK - 1) / MARK_CHUNK, mark_task, &c);
+    }
+    else {
+        for (uint32_t i = 0; i < stack_count; i++) {
+            for (const frame_t *frame = stacks[i]->current; frame; frame = frame->caller) {
+                mark_frame(heap, frame, 0, frame_slots(frame), !full);
+            }
+        }
+    }
+    free(c.frames);
+    free(c.first_slots);
+    if (stacks != &vm_stack) {
+        free(stacks);
+    }
+    if (full) {
+        if (gc_pool) {
+            parallel_sweep(heap, &c);
+        }
+        else {
+            heap_sweep(heap);
+        }
+    }
+    heap_evacuate(heap);
+    heap->collections++;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+                  (uint64_t)(end.tv_nsec - start.tv_nsec);
+    heap->pause_ns += ns;
+    if (ns > heap->max_pause_ns) {
+        heap->max_pause_ns = ns;
+    }
+    if (gc_verbose) {
+        fprintf(stderr, "[gc %s: %u slots, %zu bytes live, %lu us]\n", full ? "full" : "minor",
+                heap->size - heap->free_count, heap->live, (unsigned long)(ns / 1000));
+    }
+}
+
+/** Whether the old space has grown enough since the last full collection */
+static bool old_space_full(const heap_t *heap, size_t size) {
+    size_t trigger = heap->live > gc_threshold ? heap->live : gc_threshold;
+    return heap->allocated + size > trigger;
+}
+
+/** Allocates `size` bytes for an array, collecting first if need be */
+static int32_t allocate(heap_t *heap, vm_stack_t *vm_stack, size_t size) {
+    int32_t ref = -1;
+    if (size <= (size_t)(heap->nursery_end - heap->nursery) / 4) {
+        ref = heap_add_young(heap, size);
+        if (ref < 0) {
+            gc_collect(heap, vm_stack, old_space_full(heap, 0));
+            ref = heap_add_young(heap, size);
+        }
+    }
+    if (ref < 0) {
+        if (old_space_full(heap, size)) {
+            gc_collect(heap, vm_stack, true);
+        }
+        void *arr = calloc(1, size);
+        if (!arr) {
+            exit(ERROR);
+        }
+        ref = heap_add(heap, arr, size);
+    }
+    return ref;
+}
+
+/**
+ * Allocates `size` bytes for an array if that needs no collection and
+ * leaves `data` where it is, else returns -1
+ */
+static int32_t try_allocate(heap_t *heap, size_t size) {
+    if (!heap_has_room(heap)) {
+        return -1;
+    }
+    if (size <= (size_t)(heap->nursery_end - heap->nursery) / 4) {
+        return heap_add_young(heap, size);
+    }
+    if (old_space_full(heap, size)) {
+        return -1;
+    }
+    void *arr = calloc(1, size);
+    if (!arr) {
+        exit(ERROR);
+    }
+    return heap_add(heap, arr, size);
+}
+
+static void init_array(heap_t *heap, int32_t ref, uint8_t atype, int32_t count, size_t size) {
+    array_t *array = heap->data[ref];
+    array->length = count;
+    array->atype = atype;
+    heap->total_arrays++;
+    heap->total_bytes += size;
+}
+
+int32_t gc_new_array(heap_t *heap, vm_stack_t *vm_stack, uint8_t atype, int32_t count) {
+    size_t size = ARRAY_DATA_OFFSET + (size_t) count * array_element_size(atype);
+    if (!heap->scheduler) {
+        int32_t ref = allocate(heap, vm_stack, size);
+        init_array(heap, ref, atype, count, size);
+        return ref;
+    }
+    // Other threads read `data` without a lock, so only allocations that
+    // leave it alone go ahead while they run
+    struct scheduler *scheduler = heap->scheduler;
+    scheduler_lock_heap(scheduler);
+    int32_t ref = try_allocate(heap, size);
+    if (ref >= 0) {
+        init_array(heap, ref, atype, count, size);
+        scheduler_unlock_heap(scheduler);
+        return ref;
+    }
+    scheduler_unlock_heap(scheduler);
+    scheduler_stop_world(scheduler);
+    ref = allocate(heap, vm_stack, size);
+    init_array(heap, ref, atype, count, size);
+    scheduler_start_world(scheduler);
+    return ref;
+}
+
+int32_t gc_new_frame_array(heap_t *heap, vm_stack_t *vm_stack, uint8_t atype, int32_t count) {
+    size_t size = ARRAY_DATA_OFFSET + (size_t) count * array_element_size(atype);
+    // Keep arrays 8-byte aligned, for long elements
+    size = (size + 7) & ~(size_t) 7;
+    // Frame array slots are numbered per VM stack, so threads sharing a heap
+    // would collide
+    if (heap->scheduler || size > GC_FRAME_ARRAY_MAX ||
+        vm_stack->frame_arrays == HEAP_FRAME_SLOTS ||
+        (size_t)(vm_stack->limit - vm_stack->top) < size) {
+        return gc_new_array(heap, vm_stack, atype, count);
+    }
+    vm_stack->limit -= size;
+    memset(vm_stack->limit, 0, size);
+    int32_t ref = HEAP_FRAME_REF(vm_stack->frame_arrays++);
+    heap->data[ref] = vm_stack->limit;
+    array_t *array = heap->data[ref];
+    array->length = count;
+    array->atype = atype;
+    return ref;
+}
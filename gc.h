@@ -0,0 +1,77 @@
+// gc.h
+#ifndef GC_H
+#define GC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "heap.h"
+
+/**
+ * A generational, precise garbage collector. Arrays are bump-allocated in a
+ * nursery; when it fills up, a minor collection copies the young arrays
+ * that are still referenced to the old space and empties it. The old space
+ * is collected by mark-sweep once the bytes promoted into it since the last
+ * full collection reach the larger of `gc_threshold` and what survived that
+ * collection, so it stays within about twice the live data. Arrays larger
+ * than a quarter of the nursery go straight to the old space.
+ *
+ * Arrays hold only primitives, so the live objects are exactly those referenced
+ * from a frame on the VM stack, and no old object can refer to a young one:
+ * minor collections need no remembered set and no write barrier. Frames of
+ * verified methods are scanned with their reference maps (see verify.h) at
+ * the safepoint recorded in `frame->ip`; frames of unverified methods are
+ * scanned conservatively, treating every slot as a possible reference.
+ *
+ * When green threads share the heap (see thread.h), every thread's VM
+ * stack holds roots, and collections happen with the world stopped.
+ *
+ * With `gc_threads` above 1, marking and sweeping are split into tasks (a
+ * run of root slots to scan, a range of heap slots to sweep) that a
+ * work-stealing pool of that many threads shares (see worksteal.h); mark
+ * bits are set atomically. The pool is started by the first collection and
+ * its threads wait between collections.
+ */
+
+/** The default number of bytes promoted before the first full collection */
+#define GC_DEFAULT_THRESHOLD ((size_t) 4 << 20)
+/** The default size of the nursery */
+#define GC_DEFAULT_NURSERY_SIZE ((size_t) 1 << 20)
+
+extern size_t gc_threshold;
+extern size_t gc_nursery_size;
+/** How many threads mark and sweep */
+extern uint32_t gc_threads;
+/** Whether to log each collection and its pause time to stderr */
+extern bool gc_verbose;
+
+/**
+ * Allocates a zeroed array of `count` elements of type `atype` (see
+ * array.h), collecting first if the nursery is full.
+ * The current frame's `ip` and `top` must describe the allocating
+ * instruction, without the count on the stack.
+ *
+ * @return the new array's reference
+ */
+int32_t gc_new_array(heap_t *heap, vm_stack_t *vm_stack, uint8_t atype, int32_t count);
+
+/** Frame arrays larger than this many bytes are allocated on the heap instead */
+#define GC_FRAME_ARRAY_MAX ((size_t) 64 << 10)
+
+/**
+ * Allocates a zeroed array like gc_new_array(), but on the VM stack for the
+ * current frame, where it is freed when the frame is popped (see escape.h).
+ * It has a frame array reference (see heap.h) that the collector ignores.
+ * Arrays over GC_FRAME_ARRAY_MAX bytes, or that do not fit, go on the heap.
+ */
+int32_t gc_new_frame_array(heap_t *heap, vm_stack_t *vm_stack, uint8_t atype, int32_t count);
+
+/**
+ * Frees every heap object not referenced from the VM stack (every thread's,
+ * if the heap is shared), promoting young survivors. A minor collection (`full` false) only looks at the nursery.
+ */
+void gc_collect(heap_t *heap, vm_stack_t *vm_stack, bool full);
+
+#endif
@@ -1,34 +1,194 @@
 // heap.c
 #include "heap.h"
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
-heap_t *heap_init(void) {
-    heap_t *h = malloc(sizeof(heap_t));
-    h->data = NULL;
-    h->size = 0;
-    h->capacity = 0;
+/** The slots below `data`: the frame arrays', and -1's, which stays NULL */
+#define DATA_PREFIX (HEAP_FRAME_SLOTS + 1)
+
+heap_t *heap_init(size_t nursery_size) {
+    heap_t *h = calloc(1, sizeof(heap_t));
+    assert(h != NULL);
+    void **prefix = calloc(DATA_PREFIX, sizeof(void *));
+    assert(prefix != NULL);
+    h->data = prefix + DATA_PREFIX;
+    nursery_size &= ~(size_t) 7;
+    h->nursery = calloc(nursery_size ? nursery_size : 1, 1);
+    assert(h->nursery != NULL);
+    h->nursery_top = h->nursery;
+    h->nursery_end = h->nursery + nursery_size;
     return h;
 }
 
-int32_t heap_add(heap_t *heap, void *ptr) {
+static int32_t heap_slot(heap_t *heap) {
+    if (heap->free_count > 0) {
+        return heap->free_slots[--heap->free_count];
+    }
     if (heap->size == heap->capacity) {
         heap->capacity = heap->capacity ? heap->capacity * 2 : 4;
-        heap->data = realloc(heap->data, heap->capacity * sizeof(void *));
+        void **prefix = realloc(heap->data - DATA_PREFIX,
+                                (DATA_PREFIX + heap->capacity) * sizeof(void *));
+        assert(prefix != NULL);
+        heap->data = prefix + DATA_PREFIX;
+        heap->sizes = realloc(heap->sizes, heap->capacity * sizeof(size_t));
+        heap->flags = realloc(heap->flags, heap->capacity * sizeof(uint8_t));
+        heap->free_slots = realloc(heap->free_slots, heap->capacity * sizeof(int32_t));
+        size_t words = (heap->size + 63) / 64;
+        heap->marks = realloc(heap->marks, (heap->capacity + 63) / 64 * sizeof(uint64_t));
+        assert(heap->data && heap->sizes && heap->flags && heap->free_slots && heap->marks);
+        for (size_t i = words; i < (heap->capacity + 63) / 64; i++) {
+            atomic_init(&heap->marks[i], 0);
+        }
     }
-    heap->data[heap->size] = ptr;
-    return heap->size++;
+    // heap_contains() reads the size without the lock a shared heap's
+    // allocations hold (see thread.h)
+    uint32_t slot = heap->size;
+    __atomic_store_n(&heap->size, slot + 1, __ATOMIC_RELAXED);
+    return (int32_t) slot;
+}
+
+int32_t heap_add(heap_t *heap, void *ptr, size_t size) {
+    int32_t ref = heap_slot(heap);
+    heap->data[ref] = ptr;
+    heap->sizes[ref] = size;
+    heap->flags[ref] = 0;
+    heap->allocated += size;
+    return ref;
+}
+
+int32_t heap_add_young(heap_t *heap, size_t size) {
+    // Keep objects 8-byte aligned, for long and double elements
+    size = (size + 7) & ~(size_t) 7;
+    if ((size_t)(heap->nursery_end - heap->nursery_top) < size) {
+        return -1;
+    }
+    if (heap->young_count == heap->young_capacity) {
+        heap->young_capacity = heap->young_capacity ? heap->young_capacity * 2 : 64;
+        heap->young = realloc(heap->young, heap->young_capacity * sizeof(int32_t));
+        assert(heap->young != NULL);
+    }
+    int32_t ref = heap_slot(heap);
+    heap->data[ref] = heap->nursery_top;
+    heap->sizes[ref] = size;
+    heap->flags[ref] = HEAP_YOUNG;
+    heap->nursery_top += size;
+    heap->young[heap->young_count++] = ref;
+    return ref;
 }
 
 void *heap_get(heap_t *heap, int32_t ref) {
-    assert(ref >= 0 && ref < (int32_t)heap->size);
+    assert(heap_contains(heap, ref));
     return heap->data[ref];
 }
 
+bool heap_contains(heap_t *heap, int32_t ref) {
+    uint32_t size = __atomic_load_n(&heap->size, __ATOMIC_RELAXED);
+    return ref >= HEAP_FRAME_REF(HEAP_FRAME_SLOTS - 1) && ref < (int64_t) size &&
+           heap->data[ref] != NULL;
+}
+
+void heap_mark(heap_t *heap, int32_t ref, bool young_only) {
+    if (ref >= 0 && (uint32_t) ref < heap->size && heap->data[ref] != NULL &&
+        (!young_only || heap->flags[ref] & HEAP_YOUNG)) {
+        uint64_t bit = (uint64_t) 1 << (ref % 64);
+        // Most roots are already marked; skip the locked instruction for those
+        if (!(atomic_load_explicit(&heap->marks[ref / 64], memory_order_relaxed) & bit)) {
+            atomic_fetch_or_explicit(&heap->marks[ref / 64], bit, memory_order_relaxed);
+        }
+    }
+}
+
+static bool heap_is_marked(heap_t *heap, int32_t ref) {
+    uint64_t word = atomic_load_explicit(&heap->marks[ref / 64], memory_order_relaxed);
+    return word >> (ref % 64) & 1;
+}
+
+size_t heap_sweep_range(heap_t *heap, uint32_t begin, uint32_t end,
+                        int32_t *freed, uint32_t *freed_count) {
+    size_t live = 0;
+    *freed_count = 0;
+    for (uint32_t w = begin / 64; w * 64 < end; w++) {
+        uint64_t marks = atomic_load_explicit(&heap->marks[w], memory_order_relaxed);
+        // Young marks are cleared by heap_evacuate()
+        uint64_t young_marks = 0;
+        uint32_t last = w * 64 + 64 < end ? w * 64 + 64 : end;
+        for (uint32_t i = w * 64 > begin ? w * 64 : begin; i < last; i++) {
+            uint64_t bit = (uint64_t) 1 << (i % 64);
+            if (heap->data[i] == NULL) {
+                continue;
+            }
+            if (heap->flags[i] & HEAP_YOUNG) {
+                young_marks |= marks & bit;
+            }
+            else if (marks & bit) {
+                live += heap->sizes[i];
+            }
+            else {
+                free(heap->data[i]);
+                heap->data[i] = NULL;
+                freed[(*freed_count)++] = (int32_t) i;
+            }
+        }
+        atomic_store_explicit(&heap->marks[w], young_marks, memory_order_relaxed);
+    }
+    return live;
+}
+
+void heap_sweep_done(heap_t *heap, const int32_t *freed, uint32_t freed_count, size_t live) {
+    memcpy(&heap->free_slots[heap->free_count], freed, freed_count * sizeof(int32_t));
+    heap->free_count += freed_count;
+    heap->allocated = 0;
+    heap->live = live;
+}
+
+size_t heap_sweep(heap_t *heap) {
+    // Freed slots are never on the free list already, so they fit after it
+    uint32_t freed_count;
+    int32_t *freed = &heap->free_slots[heap->free_count];
+    size_t live = heap_sweep_range(heap, 0, heap->size, freed, &freed_count);
+    heap->free_count += freed_count;
+    heap->allocated = 0;
+    heap->live = live;
+    return live;
+}
+
+void heap_evacuate(heap_t *heap) {
+    for (uint32_t i = 0; i < heap->young_count; i++) {
+        int32_t ref = heap->young[i];
+        if (heap_is_marked(heap, ref)) {
+            atomic_fetch_and_explicit(&heap->marks[ref / 64], ~((uint64_t) 1 << (ref % 64)),
+                                      memory_order_relaxed);
+            void *copy = malloc(heap->sizes[ref]);
+            assert(copy != NULL);
+            memcpy(copy, heap->data[ref], heap->sizes[ref]);
+            heap->data[ref] = copy;
+            heap->flags[ref] = 0;
+            heap->allocated += heap->sizes[ref];
+        }
+        else {
+            heap->data[ref] = NULL;
+            heap->free_slots[heap->free_count++] = ref;
+        }
+    }
+    heap->young_count = 0;
+    // Zero the nursery now so that allocating from it is only a pointer bump
+    memset(heap->nursery, 0, (size_t)(heap->nursery_top - heap->nursery));
+    heap->nursery_top = heap->nursery;
+}
+
 void heap_free(heap_t *heap) {
     for (uint32_t i = 0; i < heap->size; i++) {
-        free(heap->data[i]);
+        if (!(heap->flags[i] & HEAP_YOUNG)) {
+            free(heap->data[i]);
+        }
     }
-    free(heap->data);
+    free(heap->data - DATA_PREFIX);
+    free(heap->sizes);
+    free(heap->flags);
+    free(heap->free_slots);
+    free(heap->marks);
+    free(heap->nursery);
+    free(heap->young);
     free(heap);
 }
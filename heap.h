@@ -2,17 +2,131 @@
 #ifndef HEAP_H
 #define HEAP_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/**
+ * The table of heap objects. A reference is an index into `data`, which
+ * stays the same for the object's whole life even though the object itself
+ * may move: new objects are bump-allocated in the nursery and copied to the
+ * old space if they survive a minor collection (see gc.h). Slots freed by
+ * the garbage collector are reused by later allocations, so the table only
+ * grows when every slot is live.
+ *
+ * Arrays allocated on the VM stack (see gc_new_frame_array()) have negative
+ * references instead, from -2 down, naming HEAP_FRAME_SLOTS slots kept just
+ * below `data` so that reading `data[ref]` finds either kind. The collector
+ * never sees them; -1 is never a reference.
+ */
 typedef struct {
+    /** The object each reference points to, or NULL for an unused slot */
     void **data;
     uint32_t size;
     uint32_t capacity;
+    /** The size in bytes of each object */
+    size_t *sizes;
+    /** HEAP_YOUNG for each slot */
+    uint8_t *flags;
+    /**
+     * The collector's mark bits, one per slot in a side bitmap, so that
+     * several threads can mark at once
+     */
+    _Atomic uint64_t *marks;
+    /** Unused slots below `size`, reused last-freed first */
+    int32_t *free_slots;
+    uint32_t free_count;
+
+    /** The nursery region and its allocation pointer; the rest is zeroed */
+    uint8_t *nursery;
+    uint8_t *nursery_top;
+    uint8_t *nursery_end;
+    /** The references of the objects in the nursery */
+    int32_t *young;
+    uint32_t young_count;
+    uint32_t young_capacity;
+
+    /** Bytes added to the old space since the last full collection, and the bytes that survived it */
+    size_t allocated;
+    size_t live;
+
+    /**
+     * Totals over the heap's life: arrays allocated, their bytes, collections,
+     * and the time collections took, and the longest one
+     */
+    uint64_t total_arrays;
+    uint64_t total_bytes;
+    uint64_t collections;
+    uint64_t pause_ns;
+    uint64_t max_pause_ns;
+
+    /** The scheduler whose threads share the heap, or NULL (see thread.h) */
+    struct scheduler *scheduler;
 } heap_t;
 
-heap_t *heap_init(void);
-int32_t heap_add(heap_t *heap, void *ptr);
+#define HEAP_YOUNG 1
+
+/** The number of frame arrays that can be live at once */
+#define HEAP_FRAME_SLOTS 4096
+/** The reference of frame array slot `slot` */
+#define HEAP_FRAME_REF(slot) (-2 - (int32_t)(slot))
+
+/** Sweep ranges must start at a multiple of this, so each owns its mark words */
+#define HEAP_SWEEP_ALIGN 64
+
+/**
+ * Whether the next object added reuses a slot or fills spare capacity, so
+ * that `data` stays where it is
+ */
+static inline bool heap_has_room(const heap_t *heap) {
+    return heap->free_count > 0 || heap->size < heap->capacity;
+}
+
+/** Creates a heap whose nursery holds `nursery_size` bytes */
+heap_t *heap_init(size_t nursery_size);
+/** Adds an old-space object of `size` bytes, which the heap now owns, and returns its reference */
+int32_t heap_add(heap_t *heap, void *ptr, size_t size);
+/**
+ * Allocates `size` zeroed bytes in the nursery.
+ *
+ * @return the new object's reference, or -1 if the nursery is full
+ */
+int32_t heap_add_young(heap_t *heap, size_t size);
 void *heap_get(heap_t *heap, int32_t ref);
+/** Whether `ref` refers to an object, on the heap or the VM stack */
+bool heap_contains(heap_t *heap, int32_t ref);
+/**
+ * Marks the object `ref` refers to as live, if it is young or `young_only`
+ * is false; values that are not references, and frame arrays, are ignored.
+ * Safe to call from
+ * several threads at once.
+ */
+void heap_mark(heap_t *heap, int32_t ref, bool young_only);
+/**
+ * Frees every old-space object that was not marked since the last sweep and
+ * clears the marks. Young objects are left to heap_evacuate().
+ *
+ * @return the bytes still in use in the old space
+ */
+size_t heap_sweep(heap_t *heap);
+/**
+ * Sweeps the old-space slots in [begin, end) like heap_sweep(), but leaves
+ * the freed slots in `freed` (room for end - begin) instead of reusing them
+ * and does not update the heap's totals. Ranges starting at multiples of
+ * HEAP_SWEEP_ALIGN can be swept by different threads at once.
+ *
+ * @return the bytes still in use in the range
+ */
+size_t heap_sweep_range(heap_t *heap, uint32_t begin, uint32_t end,
+                        int32_t *freed, uint32_t *freed_count);
+/** Makes slots freed by heap_sweep_range() reusable and sets the old space's live bytes */
+void heap_sweep_done(heap_t *heap, const int32_t *freed, uint32_t freed_count, size_t live);
+/**
+ * Copies every marked nursery object to the old space, frees the slots of
+ * the rest and empties the nursery.
+ */
+void heap_evacuate(heap_t *heap);
 void heap_free(heap_t *heap);
 
 #endif
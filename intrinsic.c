@@ -0,0 +1,364 @@
+// intrinsic.c
+#include "intrinsic.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "simd.h"
+
+/** fill, equals and hashCode of java.util.Arrays for arrays of `c` (a descriptor) */
+#define ARRAYS_METHODS(c, atype, value_slots)                                          \
+    {"java/util/Arrays", "fill", "([" c c ")V", INTRINSIC_FILL, atype, 1 + value_slots, \
+     false, false},                                                                     \
+    {"java/util/Arrays", "equals", "([" c "[" c ")Z", INTRINSIC_EQUALS, atype, 2, true, \
+     false},                                                                            \
+    {"java/util/Arrays", "hashCode", "([" c ")I", INTRINSIC_HASH_CODE, atype, 1, true,  \
+     false}
+
+const intrinsic_t intrinsics[] = {
+    {"java/lang/System", "arraycopy", "(Ljava/lang/Object;ILjava/lang/Object;II)V",
+     INTRINSIC_ARRAYCOPY, 0, 5, false, false},
+    ARRAYS_METHODS("Z", T_BOOLEAN, 1),
+    ARRAYS_METHODS("B", T_BYTE, 1),
+    ARRAYS_METHODS("C", T_CHAR, 1),
+    ARRAYS_METHODS("S", T_SHORT, 1),
+    ARRAYS_METHODS("I", T_INT, 1),
+    ARRAYS_METHODS("J", T_LONG, 2),
+    {"tinyjvm/Threads", "start", "([II)I", INTRINSIC_THREAD_START, T_INT, 2, true, false},
+    {"tinyjvm/Threads", "join", "(I)V", INTRINSIC_THREAD_JOIN, 0, 1, false, false},
+    {"java/lang/Thread", "yield", "()V", INTRINSIC_THREAD_YIELD, 0, 0, false, false},
+    {"java/lang/Object", "wait", "()V", INTRINSIC_WAIT, 0, 1, false, true},
+    {"java/lang/Object", "notify", "()V", INTRINSIC_NOTIFY, 0, 1, false, true},
+    {"java/lang/Object", "notifyAll", "()V", INTRINSIC_NOTIFY_ALL, 0, 1, false, true},
+};
+
+#define NUM_INTRINSICS (sizeof(intrinsics) / sizeof(intrinsics[0]))
+
+/** The Utf8 constant at `index`, or NULL if it is not one */
+static const utf8_t *utf8_at(class_file_t *cls, uint16_t index) {
+    if (index == 0 || index >= cls->constant_pool_count ||
+        cls->constant_pool[index - 1].tag != CONSTANT_Utf8) {
+        return NULL;
+    }
+    return &cls->constant_pool[index - 1].info.utf8;
+}
+
+static bool utf8_is(const utf8_t *s, const char *str) {
+    return s && strlen(str) == s->length && memcmp(s->bytes, str, s->length) == 0;
+}
+
+/**
+ * Looks up the class, name and descriptor of a Fieldref or Methodref
+ * constant, as `tag` says.
+ *
+ * @return false if `index` is not a well-formed constant of that kind
+ */
+static bool ref_symbols(uint16_t index, uint8_t tag, class_file_t *cls, const utf8_t **class_name,
+                        const utf8_t **name, const utf8_t **descriptor) {
+    if (index == 0 || index >= cls->constant_pool_count ||
+        cls->constant_pool[index - 1].tag != tag) {
+        return false;
+    }
+    const cp_info_t *ref = &cls->constant_pool[index - 1];
+    uint16_t class_index = ref->info.ref.class_index;
+    uint16_t nat_index = ref->info.ref.name_and_type_index;
+    if (class_index == 0 || class_index >= cls->constant_pool_count ||
+        nat_index == 0 || nat_index >= cls->constant_pool_count ||
+        cls->constant_pool[class_index - 1].tag != CONSTANT_Class ||
+        cls->constant_pool[nat_index - 1].tag != CONSTANT_NameAndType) {
+        return false;
+    }
+    const cp_info_t *nat = &cls->constant_pool[nat_index - 1];
+    *class_name = utf8_at(cls, cls->constant_pool[class_index - 1].info.index);
+    *name = utf8_at(cls, nat->info.name_and_type.name_index);
+    *descriptor = utf8_at(cls, nat->info.name_and_type.descriptor_index);
+    return true;
+}
+
+int32_t find_intrinsic(uint16_t index, class_file_t *cls) {
+    const utf8_t *class_name, *name, *descriptor;
+    if (!ref_symbols(index, CONSTANT_Methodref, cls, &class_name, &name, &descriptor)) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < NUM_INTRINSICS; i++) {
+        if (utf8_is(class_name, intrinsics[i].class_name) && utf8_is(name, intrinsics[i].name) &&
+            utf8_is(descriptor, intrinsics[i].descriptor)) {
+            return (int32_t) i;
+        }
+    }
+    return -1;
+}
+
+bool is_system_out(uint16_t index, class_file_t *cls) {
+    const utf8_t *class_name, *name, *descriptor;
+    return ref_symbols(index, CONSTANT_Fieldref, cls, &class_name, &name, &descriptor) &&
+           utf8_is(class_name, "java/lang/System") && utf8_is(name, "out") &&
+           utf8_is(descriptor, "Ljava/io/PrintStream;");
+}
+
+bool is_println(uint16_t index, class_file_t *cls) {
+    const utf8_t *class_name, *name, *descriptor;
+    return ref_symbols(index, CONSTANT_Methodref, cls, &class_name, &name, &descriptor) &&
+           utf8_is(class_name, "java/io/PrintStream") && utf8_is(name, "println") &&
+           utf8_is(descriptor, "(I)V");
+}
+
+/**
+ * The array `ref` refers to, if it is one with elements of `atype` (any if
+ * 0; T_BYTE also matches boolean arrays); otherwise NULL
+ */
+static array_t *array_of(heap_t *heap, int32_t ref, uint8_t atype) {
+    if (!heap_contains(heap, ref)) {
+        return NULL;
+    }
+    array_t *array = heap_get(heap, ref);
+    bool matches = atype == 0 || array->atype == atype ||
+                   (atype == T_BYTE && array->atype == T_BOOLEAN);
+    return matches ? array : NULL;
+}
+
+/** The address of element `index` of `array` */
+static uint8_t *element(array_t *array, int32_t index) {
+    return (uint8_t *) array_data(array) + (size_t) index * array_element_size(array->atype);
+}
+
+exception_t run_intrinsic(const intrinsic_t *intrinsic, int32_t *args, heap_t *heap) {
+    // Element types must match exactly: a boolean[] is no byte[] here
+    uint8_t atype = intrinsic->atype;
+    array_t *array = array_of(heap, args[0], atype);
+    if (!array || (atype != 0 && array->atype != atype)) {
+        return EXC_ARRAY_STORE;
+    }
+    switch (intrinsic->kind) {
+        case INTRINSIC_ARRAYCOPY: {
+            array_t *dst = array_of(heap, args[2], 0);
+            int32_t src_pos = args[1];
+            int32_t dst_pos = args[3];
+            int32_t length = args[4];
+            if (!dst || dst->atype != array->atype) {
+                return EXC_ARRAY_STORE;
+            }
+            if (src_pos < 0 || dst_pos < 0 || length < 0 || length > array->length - src_pos ||
+                length > dst->length - dst_pos) {
+                return EXC_ARRAY_INDEX_OUT_OF_BOUNDS;
+            }
+            simd_copy(element(dst, dst_pos), element(array, src_pos),
+                      (size_t) length * array_element_size(array->atype));
+            break;
+        }
+        case INTRINSIC_FILL: {
+            // A long is two slots, low word first
+            uint64_t value = (uint32_t) args[1];
+            if (atype == T_LONG) {
+                value |= (uint64_t)(uint32_t) args[2] << 32;
+            }
+            else if (atype == T_BOOLEAN) {
+                value &= 1;
+            }
+            simd_fill(array_data(array), array_element_size(atype), value,
+                      (size_t) array->length);
+            break;
+        }
+        case INTRINSIC_EQUALS: {
+            array_t *other = array_of(heap, args[1], atype);
+            if (!other || other->atype != atype) {
+                return EXC_ARRAY_STORE;
+            }
+            args[0] = other->length == array->length &&
+                      simd_equals(array_data(array), array_data(other),
+                                  (size_t) array->length * array_element_size(atype));
+            break;
+        }
+        case INTRINSIC_HASH_CODE:
+            args[0] = simd_hash_code(array_data(array), atype, (size_t) array->length);
+            break;
+        default:
+            // Thread methods run in thread.c
+            break;
+    }
+    return EXC_NONE;
+}
+
+/** The atype a decoded array load or store takes, or 0 if it is not one of those */
+static uint8_t access_atype(uint16_t op, bool store) {
+    switch (op) {
+        case q_iaload:
+        case q_iastore:
+            return (op == q_iastore) == store ? T_INT : 0;
+        case q_baload:
+        case q_bastore:
+            return (op == q_bastore) == store ? T_BYTE : 0;
+        case q_caload:
+        case q_castore:
+            return (op == q_castore) == store ? T_CHAR : 0;
+        case q_saload:
+        case q_sastore:
+            return (op == q_sastore) == store ? T_SHORT : 0;
+        default:
+            return 0;
+    }
+}
+
+static bool is_load(const insn_t *insn, uint16_t local) {
+    return insn->op == q_iload && insn->a == local;
+}
+
+/**
+ * Matches an array loop whose test starts at `in[0]`, with `n` instructions
+ * from there to the end of the method.
+ *
+ * @return the loop's exit, or NULL if this is not an array loop
+ */
+static const insn_t *match_loop(const insn_t *in, uint32_t n, uint16_t max_locals,
+                                array_loop_t *loop) {
+    memset(loop, 0, sizeof(*loop));
+    // The test: iload index; (iload array; arraylength | iload bound); if_icmpge exit
+    uint32_t b;
+    if (n < 3 || in[0].op != q_iload || in[1].op != q_iload) {
+        return NULL;
+    }
+    loop->index = (uint16_t) in[0].a;
+    loop->bound = (uint16_t) in[1].a;
+    if (n > 3 && in[2].op == q_arraylength && in[3].op == q_if_icmpge) {
+        loop->bound_is_length = true;
+        b = 4;
+    }
+    else if (in[2].op == q_if_icmpge && loop->bound != loop->index) {
+        b = 3;
+    }
+    else {
+        return NULL;
+    }
+    const insn_t *exit = in[b - 1].target;
+
+    // The body, then iinc index 1; goto test
+    uint32_t length;
+    if (n >= b + 6 && in[b].op == q_iload && is_load(&in[b + 1], loop->index) &&
+        (in[b + 2].op == q_iconst ||
+         (in[b + 2].op == q_iload && in[b + 2].a != loop->index)) &&
+        access_atype(in[b + 3].op, true)) {
+        loop->kind = ARRAY_LOOP_FILL;
+        loop->array = (uint16_t) in[b].a;
+        loop->constant = in[b + 2].op == q_iconst;
+        loop->constant_value = in[b + 2].a;
+        loop->value = loop->constant ? 0 : (uint16_t) in[b + 2].a;
+        loop->atype = access_atype(in[b + 3].op, true);
+        length = 4;
+    }
+    else if (n >= b + 8 && in[b].op == q_iload && is_load(&in[b + 1], loop->index) &&
+             in[b + 2].op == q_iload && is_load(&in[b + 3], loop->index) &&
+             access_atype(in[b + 4].op, false) &&
+             access_atype(in[b + 4].op, false) == access_atype(in[b + 5].op, true)) {
+        loop->kind = ARRAY_LOOP_COPY;
+        loop->array = (uint16_t) in[b].a;
+        loop->source = (uint16_t) in[b + 2].a;
+        loop->atype = access_atype(in[b + 5].op, true);
+        length = 6;
+    }
+    else if (n >= b + 8 && in[b].op == q_iload && in[b + 1].op == q_iload &&
+             is_load(&in[b + 2], loop->index) && access_atype(in[b + 3].op, false) &&
+             in[b + 4].op == q_iadd && in[b + 5].op == q_istore && in[b + 5].a == in[b].a) {
+        loop->kind = ARRAY_LOOP_SUM;
+        loop->value = (uint16_t) in[b].a;
+        loop->array = (uint16_t) in[b + 1].a;
+        loop->atype = access_atype(in[b + 3].op, false);
+        // The only local the body writes must not be one the loop reads
+        if (loop->value == loop->index || loop->value == loop->array ||
+            loop->value == loop->bound) {
+            return NULL;
+        }
+        length = 6;
+    }
+    else {
+        return NULL;
+    }
+    const insn_t *step = &in[b + length];
+    if (step[0].op != q_iinc || step[0].a != loop->index || step[0].b != 1 ||
+        step[1].op != q_goto || step[1].target != in) {
+        return NULL;
+    }
+    uint16_t locals[] = {loop->index, loop->array, loop->source, loop->value, loop->bound};
+    for (uint32_t i = 0; i < sizeof(locals) / sizeof(locals[0]); i++) {
+        if (locals[i] >= max_locals) {
+            return NULL;
+        }
+    }
+    return exit;
+}
+
+bool array_loops_enabled = true;
+
+bool match_array_loops(method_t *method, insn_t *insns, uint32_t count) {
+    if (!array_loops_enabled) {
+        return true;
+    }
+    array_loop_t *loops = NULL;
+    uint32_t loops_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        array_loop_t loop;
+        const insn_t *exit = match_loop(&insns[i], count - i, method->code.max_locals, &loop);
+        if (!exit) {
+            continue;
+        }
+        array_loop_t *grown = realloc(loops, (loops_count + 1) * sizeof(array_loop_t));
+        if (!grown) {
+            free(loops);
+            return false;
+        }
+        loops = grown;
+        loops[loops_count] = loop;
+        insns[i].op = q_array_loop;
+        insns[i].b = (int32_t) loops_count++;
+        insns[i].target = exit;
+    }
+    method->array_loops = loops;
+    return true;
+}
+
+bool run_array_loop(const array_loop_t *loop, int32_t *locals, heap_t *heap) {
+    int32_t index = locals[loop->index];
+    int32_t bound = locals[loop->bound];
+    if (loop->bound_is_length) {
+        array_t *array = array_of(heap, bound, 0);
+        if (!array) {
+            return false;
+        }
+        bound = array->length;
+    }
+    if (index >= bound) {
+        return true;
+    }
+    array_t *array = array_of(heap, locals[loop->array], loop->atype);
+    if (index < 0 || !array || array->length < bound) {
+        return false;
+    }
+    size_t count = (size_t)(bound - index);
+    uint32_t size = array_element_size(array->atype);
+    switch (loop->kind) {
+        case ARRAY_LOOP_FILL: {
+            int32_t value = loop->constant ? loop->constant_value : locals[loop->value];
+            // boolean arrays only keep the low bit
+            if (array->atype == T_BOOLEAN) {
+                value &= 1;
+            }
+            simd_fill(element(array, index), size, (uint32_t) value, count);
+            break;
+        }
+        case ARRAY_LOOP_COPY: {
+            array_t *source = array_of(heap, locals[loop->source], loop->atype);
+            if (!source || source->atype != array->atype || source->length < bound) {
+                return false;
+            }
+            simd_copy(element(array, index), element(source, index), count * size);
+            break;
+        }
+        case ARRAY_LOOP_SUM:
+            locals[loop->value] = (int32_t)((uint32_t) locals[loop->value] +
+                                            (uint32_t) simd_sum(element(array, index),
+                                                                array->atype, count));
+            break;
+    }
+    locals[loop->index] = bound;
+    return true;
+}
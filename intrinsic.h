@@ -0,0 +1,143 @@
+// intrinsic.h
+#ifndef INTRINSIC_H
+#define INTRINSIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "decode.h"
+#include "heap.h"
+#include "jvm.h"
+#include "read_class.h"
+
+/**
+ * Library methods the VM implements itself: array methods with the bulk
+ * kernels in simd.h, and the thread methods of thread.h. An invokestatic of
+ * one decodes to q_intrinsic (q_thread for thread methods) instead of
+ * failing to resolve. Each method is listed once per element type it takes.
+ */
+typedef enum {
+    /** System.arraycopy(Object, int, Object, int, int) */
+    INTRINSIC_ARRAYCOPY,
+    /** Arrays.fill(T[], T) */
+    INTRINSIC_FILL,
+    /** Arrays.equals(T[], T[]) */
+    INTRINSIC_EQUALS,
+    /** Arrays.hashCode(T[]) */
+    INTRINSIC_HASH_CODE,
+    /** Threads.start(int[], int), see thread.h */
+    INTRINSIC_THREAD_START,
+    /** Threads.join(int) */
+    INTRINSIC_THREAD_JOIN,
+    /** Thread.yield() */
+    INTRINSIC_THREAD_YIELD,
+    /** Object.wait(), on an array */
+    INTRINSIC_WAIT,
+    /** Object.notify() */
+    INTRINSIC_NOTIFY,
+    /** Object.notifyAll() */
+    INTRINSIC_NOTIFY_ALL
+} intrinsic_kind_t;
+
+typedef struct {
+    const char *class_name;
+    const char *name;
+    const char *descriptor;
+    intrinsic_kind_t kind;
+    /** The atype of the arrays it takes, or 0 for any */
+    uint8_t atype;
+    /** The argument slots it pops, the receiver's included */
+    uint8_t slots;
+    bool returns_value;
+    /** Called with invokevirtual on an array, rather than invokestatic */
+    bool is_virtual;
+} intrinsic_t;
+
+/** Whether an intrinsic is one of the thread methods, which run as q_thread */
+static inline bool is_thread_intrinsic(const intrinsic_t *intrinsic) {
+    return intrinsic->kind >= INTRINSIC_THREAD_START;
+}
+
+extern const intrinsic_t intrinsics[];
+
+/**
+ * Finds the intrinsic a Methodref constant names.
+ *
+ * @return its index in `intrinsics`, or -1 if it names none
+ */
+int32_t find_intrinsic(uint16_t index, class_file_t *cls);
+
+/**
+ * Whether a Fieldref constant is System.out. The only output the VM has is
+ * System.out.println(int): its getstatic decodes to nothing, and the
+ * invokevirtual to q_println.
+ */
+bool is_system_out(uint16_t index, class_file_t *cls);
+
+/** Whether a Methodref constant is PrintStream.println(int) */
+bool is_println(uint16_t index, class_file_t *cls);
+
+/**
+ * Runs an array intrinsic on its arguments, args[0] to args[slots - 1], and
+ * writes its result, if any, to args[0].
+ *
+ * @return the exception it threw, or EXC_NONE
+ */
+exception_t run_intrinsic(const intrinsic_t *intrinsic, int32_t *args, heap_t *heap);
+
+typedef enum {
+    /** array[index] = value (a local, or a constant) */
+    ARRAY_LOOP_FILL,
+    /** array[index] = source[index] */
+    ARRAY_LOOP_COPY,
+    /** value += array[index] */
+    ARRAY_LOOP_SUM
+} array_loop_kind_t;
+
+/**
+ * A counted loop over an array, as javac compiles
+ * `for (; index < bound; index++) body` with one of the bodies above, where
+ * `bound` is a local or the length of an array in a local. Locals are named
+ * by index.
+ */
+typedef struct array_loop {
+    array_loop_kind_t kind;
+    /** The atype the body's array instructions take; T_BYTE also covers boolean */
+    uint8_t atype;
+    uint16_t index;
+    uint16_t array;
+    /** ARRAY_LOOP_COPY: the array read from */
+    uint16_t source;
+    /** ARRAY_LOOP_FILL: the local holding the value; ARRAY_LOOP_SUM: the sum */
+    uint16_t value;
+    /** ARRAY_LOOP_FILL: the value is `constant_value` rather than a local */
+    bool constant;
+    int32_t constant_value;
+    /** The local holding the bound, or the array whose length it is */
+    uint16_t bound;
+    bool bound_is_length;
+} array_loop_t;
+
+/** Whether match_array_loops() looks for loops; on by default */
+extern bool array_loops_enabled;
+
+/**
+ * Finds array loops in a decoded method, before superinstructions are fused,
+ * and turns the `iload index` that starts each one's test into a
+ * q_array_loop, which runs the whole loop with one kernel call where it can
+ * and is that iload otherwise. The loops are stored in `method->array_loops`.
+ *
+ * @return false if out of memory
+ */
+bool match_array_loops(method_t *method, insn_t *insns, uint32_t count);
+
+/**
+ * Runs an array loop from its test to its exit, if the index is
+ * non-negative and every array it touches has the right element type and
+ * is long enough: exactly the cases in which the loop cannot throw.
+ *
+ * @return false if nothing was done and the loop must run as bytecode
+ */
+bool run_array_loop(const array_loop_t *loop, int32_t *locals, heap_t *heap);
+
+#endif
@@ -0,0 +1,120 @@
+// isolate.c
+#include "isolate.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "decode.h"
+#include "gc.h"
+#include "output.h"
+#include "worksteal.h"
+
+bool isolate_init(isolate_t *isolate, size_t nursery_size, uint32_t max_depth) {
+    isolate->heap = heap_init(nursery_size);
+    isolate->vm_stack = vm_stack_init(VM_STACK_RESERVE, max_depth);
+    if (!isolate->heap || !isolate->vm_stack) {
+        isolate_free(isolate);
+        return false;
+    }
+    return true;
+}
+
+void isolate_free(isolate_t *isolate) {
+    if (isolate->heap) {
+        heap_free(isolate->heap);
+        isolate->heap = NULL;
+    }
+    if (isolate->vm_stack) {
+        vm_stack_free(isolate->vm_stack);
+        isolate->vm_stack = NULL;
+    }
+}
+
+void share_class(class_file_t *cls) {
+    // execute() decodes methods as they are first called; doing it now means
+    // no two threads ever race to decode the same one. A method that cannot
+    // be decoded for want of memory is left for execute() to report.
+    for (uint16_t i = 0; i < cls->methods_count; i++) {
+        method_t *method = &cls->methods[i];
+        if (!method->insns) {
+            decode_method(method, cls);
+        }
+    }
+}
+
+optional_value_t isolate_run(isolate_t *isolate, class_file_t *cls, method_t *method,
+                             const int32_t *args, uint32_t arg_count) {
+    int32_t *locals = vm_stack_free_slots(isolate->vm_stack);
+    memset(locals, 0, method->code.max_locals * sizeof(int32_t));
+    if (method == find_method(MAIN_METHOD, MAIN_DESCRIPTOR, cls)) {
+        if (method->code.max_locals > 0) {
+            locals[0] = gc_new_array(isolate->heap, isolate->vm_stack, T_INT, 0);
+        }
+    }
+    else if (arg_count > 0) {
+        memcpy(locals, args, arg_count * sizeof(int32_t));
+    }
+    return execute(method, locals, cls, isolate->heap, isolate->vm_stack);
+}
+
+typedef struct {
+    batch_job_t *jobs;
+    isolate_t *isolates;
+    /** Whether each isolate was set up, which its own worker does lazily */
+    bool *ready;
+    size_t nursery_size;
+    uint32_t max_depth;
+} batch_t;
+
+static void run_job(void *ctx, uint32_t i, uint32_t worker) {
+    batch_t *batch = ctx;
+    batch_job_t *job = &batch->jobs[i];
+    isolate_t *isolate = &batch->isolates[worker];
+    // A worker's isolate is only ever touched by that worker, so its heap
+    // and VM stack come from the memory of the thread that uses them
+    if (!batch->ready[worker]) {
+        batch->ready[worker] =
+            isolate_init(isolate, batch->nursery_size, batch->max_depth);
+        if (!batch->ready[worker]) {
+            return;
+        }
+    }
+    job->result = isolate_run(isolate, job->class, job->method, job->args, job->arg_count);
+    job->ran = true;
+    // Nothing flushes a worker thread's buffer once the batch is over
+    output_flush();
+}
+
+void run_batch(batch_job_t *jobs, uint32_t count, uint32_t threads, size_t nursery_size,
+               uint32_t max_depth) {
+    if (threads == 0) {
+        threads = 1;
+    }
+    if (threads > count) {
+        threads = count ? count : 1;
+    }
+    batch_t batch = {
+        .jobs = jobs,
+        .isolates = calloc(threads, sizeof(isolate_t)),
+        .ready = calloc(threads, sizeof(bool)),
+        .nursery_size = nursery_size,
+        .max_depth = max_depth,
+    };
+    if (!batch.isolates || !batch.ready) {
+        free(batch.isolates);
+        free(batch.ready);
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        jobs[i].ran = false;
+    }
+    run_work_stealing(threads, count, run_job, &batch);
+    for (uint32_t i = 0; i < threads; i++) {
+        if (batch.ready[i]) {
+            isolate_free(&batch.isolates[i]);
+        }
+    }
+    free(batch.isolates);
+    free(batch.ready);
+}
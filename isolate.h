@@ -0,0 +1,78 @@
+// isolate.h
+#ifndef ISOLATE_H
+#define ISOLATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "heap.h"
+#include "jvm.h"
+#include "read_class.h"
+
+/**
+ * Isolates: independent execution contexts, each a heap and a VM stack,
+ * that run programs concurrently on separate threads. The loaded classes
+ * are shared between them. share_class() decodes every method up front so
+ * that running a class writes nothing to it but its methods' counters and,
+ * under a lock, their compiled code (see jit.h); each isolate's arrays,
+ * frames and collections are its own, and so is each thread's output
+ * buffer (see output.h).
+ *
+ * run_batch() fans a list of jobs out over a pool of threads with one
+ * isolate each, using the work-stealing scheduler in worksteal.h. Each
+ * isolate's heap persists from one job to the next.
+ *
+ * The profilers (profile.h, sampler.h) follow a single thread and must not
+ * be used with more than one isolate; neither should TINYJVM_TRAIN builds,
+ * whose instruction counts are not updated atomically.
+ */
+
+typedef struct {
+    heap_t *heap;
+    vm_stack_t *vm_stack;
+} isolate_t;
+
+/**
+ * Sets up an isolate with a heap whose nursery has `nursery_size` bytes and
+ * a stack of at most `max_depth` frames.
+ *
+ * @return false if their memory cannot be reserved
+ */
+bool isolate_init(isolate_t *isolate, size_t nursery_size, uint32_t max_depth);
+void isolate_free(isolate_t *isolate);
+
+/** Prepares a loaded, verified class to be run by several isolates at once */
+void share_class(class_file_t *cls);
+
+/**
+ * Runs a method in an isolate.
+ *
+ * @param args the method's arguments; if `method` is main(), it is passed an
+ *   empty String[] instead
+ */
+optional_value_t isolate_run(isolate_t *isolate, class_file_t *cls, method_t *method,
+                             const int32_t *args, uint32_t arg_count);
+
+/** A method invocation for run_batch() */
+typedef struct {
+    /** A class prepared with share_class() */
+    class_file_t *class;
+    method_t *method;
+    const int32_t *args;
+    uint32_t arg_count;
+    /** Set by run_batch() */
+    optional_value_t result;
+    /** Whether an isolate could be set up to run the job */
+    bool ran;
+} batch_job_t;
+
+/**
+ * Runs every job on `threads` threads, each with its own isolate, and
+ * returns once all are done.
+ */
+void run_batch(batch_job_t *jobs, uint32_t count, uint32_t threads, size_t nursery_size,
+               uint32_t max_depth);
+
+#endif
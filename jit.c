@@ -0,0 +1,997 @@
+// jit.c
+#include "jit.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "array.h"
+#include "bounds.h"
+#include "decode.h"
+#include "gc.h"
+#include "intrinsic.h"
+#include "output.h"
+#include "profile.h"
+#include "thread.h"
+#include "verify.h"
+
+#ifdef TINYJVM_TRAIN
+uint32_t jit_threshold = 0;
+#else
+uint32_t jit_threshold = JIT_DEFAULT_THRESHOLD;
+#endif
+uint32_t jit_backedge_threshold = JIT_DEFAULT_BACKEDGE_THRESHOLD;
+
+bool jit_run(method_t *method, int32_t *locals, jit_runtime_t *rt) {
+    frame_t *frame = push_frame(rt->vm_stack, method, locals);
+    if (!frame) {
+        rt->exception = EXC_STACK_OVERFLOW;
+        return false;
+    }
+    profile_enter(method);
+    rt->vm_stack->native_depth++;
+    bool ok = jit_code_of(method)(frame, rt);
+    rt->vm_stack->native_depth--;
+    pop_frame(rt->vm_stack);
+    profile_leave();
+    return ok;
+}
+
+#if defined(__x86_64__) && !defined(TINYJVM_NO_JIT)
+
+/** Held while a method is being compiled */
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/*
+ * Register assignment in compiled code. RAX, RCX and RDX are scratch, RDI and
+ * RSI pass helper arguments. The callee-saved registers hold the frame and the
+ * cached locals; the bottom operand stack slots live in caller-saved
+ * registers and are spilled to the frame around helper calls.
+ */
+#define REG_RT R12
+#define REG_LOCALS R13
+#define REG_STACK RBX
+static const int local_regs[] = {R14, R15, RBP};
+static const int stack_regs[] = {R8, R9, R10, R11};
+#define NUM_LOCAL_REGS 3
+#define NUM_STACK_REGS 4
+
+/* Opcodes, with the ModRM reg field for the group opcodes */
+enum {
+    OP_ADD = 0x01,     /* r/m += reg */
+    OP_OR = 0x09,
+    OP_AND = 0x21,
+    OP_SUB = 0x29,
+    OP_XOR = 0x31,
+    OP_CMP = 0x39,
+    OP_MOVSXD = 0x63,  /* reg = sign-extended r/m */
+    OP_TEST_BYTE = 0x84,
+    OP_TEST = 0x85,
+    OP_GROUP1_BYTE_IMM8 = 0x80, /* r/m8 `op` imm8, /7 cmp */
+    OP_GROUP1_IMM8 = 0x83,
+    OP_GROUP1_IMM32 = 0x81, /* /0 add, /5 sub, /7 cmp */
+    OP_MOV_STORE = 0x89, /* r/m = reg */
+    OP_MOV_LOAD = 0x8b,  /* reg = r/m */
+    OP_LEA = 0x8d,
+    OP_MOV_IMM = 0xc7,   /* /0 */
+    OP_SHIFT_CL = 0xd3,  /* /4 shl, /5 shr, /7 sar */
+    OP_GROUP3 = 0xf7,    /* /3 neg, /7 idiv */
+    OP_CALL = 0xff,      /* /2 */
+    OP_MOV_STORE_BYTE = 0x88, /* r/m8 = reg8; r/m16 with OPERAND_SIZE_16 */
+    OP_MOVSX_BYTE = 0x0fbe,   /* reg = sign-extended r/m8 */
+    OP_MOVSX_WORD = 0x0fbf,   /* reg = sign-extended r/m16 */
+    OP_MOVZX_WORD = 0x0fb7,   /* reg = zero-extended r/m16 */
+    OP_IMUL = 0x0faf     /* reg *= r/m */
+};
+
+/** The prefix that makes a 32-bit instruction operate on 16 bits */
+#define OPERAND_SIZE_16 0x66
+
+/* Condition codes */
+enum { CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf };
+#define CC_ALWAYS (-1)
+
+/** Java comparisons in FOR_EACH_INSN order: eq, ne, lt, ge, gt, le */
+static const int java_cc[] = {CC_E, CC_NE, CC_L, CC_GE, CC_G, CC_LE};
+
+typedef struct {
+    uint8_t *code;
+    size_t length;
+    size_t capacity;
+    /** Cleared if the buffer could not grow; emitting then does nothing */
+    bool ok;
+} code_buffer_t;
+
+static void emit_u8(code_buffer_t *b, uint8_t v) {
+    if (!b->ok) {
+        return;
+    }
+    if (b->length == b->capacity) {
+        size_t capacity = b->capacity ? b->capacity * 2 : 1024;
+        uint8_t *code = realloc(b->code, capacity);
+        if (!code) {
+            b->ok = false;
+            return;
+        }
+        b->code = code;
+        b->capacity = capacity;
+    }
+    b->code[b->length++] = v;
+}
+
+static void emit_u32(code_buffer_t *b, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        emit_u8(b, (uint8_t)(v >> (8 * i)));
+    }
+}
+
+static void emit_u64(code_buffer_t *b, uint64_t v) {
+    emit_u32(b, (uint32_t) v);
+    emit_u32(b, (uint32_t)(v >> 32));
+}
+
+static void emit_rex(code_buffer_t *b, bool wide, int reg, int index, int base) {
+    uint8_t rex = (uint8_t)(0x40 | wide << 3 | (reg & 8) >> 1 | (index & 8) >> 2 |
+                            (base & 8) >> 3);
+    if (rex != 0x40) {
+        emit_u8(b, rex);
+    }
+}
+
+static void emit_opcode(code_buffer_t *b, uint32_t opcode) {
+    if (opcode > 0xff) {
+        emit_u8(b, (uint8_t)(opcode >> 8));
+    }
+    emit_u8(b, (uint8_t) opcode);
+}
+
+static void emit_disp(code_buffer_t *b, uint8_t mod, int32_t disp) {
+    if (mod == 0x40) {
+        emit_u8(b, (uint8_t) disp);
+    }
+    else if (mod == 0x80) {
+        emit_u32(b, (uint32_t) disp);
+    }
+}
+
+static uint8_t disp_mod(int base, int32_t disp) {
+    if (disp == 0 && (base & 7) != RBP) {
+        return 0x00;
+    }
+    return disp >= -128 && disp <= 127 ? 0x40 : 0x80;
+}
+
+/** An instruction whose operands are registers `reg` and `rm` */
+static void emit_rr(code_buffer_t *b, bool wide, uint32_t opcode, int reg, int rm) {
+    emit_rex(b, wide, reg, 0, rm);
+    emit_opcode(b, opcode);
+    emit_u8(b, (uint8_t)(0xc0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+/** An instruction whose operands are register `reg` and memory at [base + disp] */
+static void emit_rm(code_buffer_t *b, bool wide, uint32_t opcode, int reg, int base,
+                    int32_t disp) {
+    uint8_t mod = disp_mod(base, disp);
+    emit_rex(b, wide, reg, 0, base);
+    emit_opcode(b, opcode);
+    emit_u8(b, (uint8_t)(mod | (reg & 7) << 3 | (base & 7)));
+    if ((base & 7) == RSP) {
+        emit_u8(b, 0x24);
+    }
+    emit_disp(b, mod, disp);
+}
+
+/** Like emit_rm(), for memory at [base + index * 2^scale + disp] */
+static void emit_rsib(code_buffer_t *b, bool wide, uint32_t opcode, int reg, int base,
+                      int index, int scale, int32_t disp) {
+    uint8_t mod = disp_mod(base, disp);
+    emit_rex(b, wide, reg, index, base);
+    emit_opcode(b, opcode);
+    emit_u8(b, (uint8_t)(mod | (reg & 7) << 3 | 4));
+    emit_u8(b, (uint8_t)(scale << 6 | (index & 7) << 3 | (base & 7)));
+    emit_disp(b, mod, disp);
+}
+
+static void emit_push(code_buffer_t *b, int reg) {
+    emit_rex(b, false, 0, 0, reg);
+    emit_u8(b, (uint8_t)(0x50 + (reg & 7)));
+}
+
+static void emit_pop(code_buffer_t *b, int reg) {
+    emit_rex(b, false, 0, 0, reg);
+    emit_u8(b, (uint8_t)(0x58 + (reg & 7)));
+}
+
+/** Calls a C function; the stack is kept 16-byte aligned throughout compiled code */
+static void emit_call(code_buffer_t *b, uintptr_t function) {
+    emit_rex(b, true, 0, 0, RAX);
+    emit_u8(b, 0xb8);
+    emit_u64(b, function);
+    emit_rr(b, false, OP_CALL, 2, RAX);
+}
+
+/**
+ * Emits a jump (or a conditional jump on `cc`) with a zero displacement.
+ * @return the offset of the displacement, for patch_jump()
+ */
+static size_t emit_jump(code_buffer_t *b, int cc) {
+    if (cc == CC_ALWAYS) {
+        emit_u8(b, 0xe9);
+    }
+    else {
+        emit_u8(b, 0x0f);
+        emit_u8(b, (uint8_t)(0x80 | cc));
+    }
+    size_t at = b->length;
+    emit_u32(b, 0);
+    return at;
+}
+
+static void patch_jump(code_buffer_t *b, size_t at, size_t target) {
+    if (b->ok) {
+        uint32_t rel = (uint32_t)((int64_t) target - (int64_t)(at + 4));
+        memcpy(&b->code[at], &rel, sizeof(rel));
+    }
+}
+
+/** Where a local or operand stack slot lives: a register, or memory at [base + disp] */
+typedef struct {
+    int reg;
+    int base;
+    int32_t disp;
+} loc_t;
+
+#define IN_MEMORY (-1)
+
+static loc_t local_loc(uint32_t index) {
+    if (index < NUM_LOCAL_REGS) {
+        return (loc_t){local_regs[index], 0, 0};
+    }
+    return (loc_t){IN_MEMORY, REG_LOCALS, (int32_t)(index * sizeof(int32_t))};
+}
+
+static loc_t stack_loc(uint32_t depth) {
+    if (depth < NUM_STACK_REGS) {
+        return (loc_t){stack_regs[depth], 0, 0};
+    }
+    return (loc_t){IN_MEMORY, REG_STACK, (int32_t)(depth * sizeof(int32_t))};
+}
+
+/** reg = src */
+static void emit_load(code_buffer_t *b, int reg, loc_t src) {
+    if (src.reg == IN_MEMORY) {
+        emit_rm(b, false, OP_MOV_LOAD, reg, src.base, src.disp);
+    }
+    else if (src.reg != reg) {
+        emit_rr(b, false, OP_MOV_STORE, src.reg, reg);
+    }
+}
+
+/** dst = reg */
+static void emit_store(code_buffer_t *b, loc_t dst, int reg) {
+    if (dst.reg == IN_MEMORY) {
+        emit_rm(b, false, OP_MOV_STORE, reg, dst.base, dst.disp);
+    }
+    else if (dst.reg != reg) {
+        emit_rr(b, false, OP_MOV_STORE, reg, dst.reg);
+    }
+}
+
+static void emit_move(code_buffer_t *b, loc_t dst, loc_t src) {
+    if (dst.reg != IN_MEMORY) {
+        emit_load(b, dst.reg, src);
+    }
+    else if (src.reg != IN_MEMORY) {
+        emit_store(b, dst, src.reg);
+    }
+    else {
+        emit_load(b, RAX, src);
+        emit_store(b, dst, RAX);
+    }
+}
+
+static void emit_move_imm(code_buffer_t *b, loc_t dst, int32_t value) {
+    if (dst.reg == IN_MEMORY) {
+        emit_rm(b, false, OP_MOV_IMM, 0, dst.base, dst.disp);
+    }
+    else {
+        emit_rex(b, false, 0, 0, dst.reg);
+        emit_u8(b, (uint8_t)(0xb8 + (dst.reg & 7)));
+    }
+    emit_u32(b, (uint32_t) value);
+}
+
+/** Returns the register holding `src`, loading it into `scratch` if it is in memory */
+static int emit_in_reg(code_buffer_t *b, loc_t src, int scratch) {
+    if (src.reg != IN_MEMORY) {
+        return src.reg;
+    }
+    emit_load(b, scratch, src);
+    return scratch;
+}
+
+/** A group opcode (selected by `ext` in the ModRM reg field) applied to `dst` */
+static void emit_group(code_buffer_t *b, uint32_t opcode, int ext, loc_t dst) {
+    if (dst.reg == IN_MEMORY) {
+        emit_rm(b, false, opcode, ext, dst.base, dst.disp);
+    }
+    else {
+        emit_rr(b, false, opcode, ext, dst.reg);
+    }
+}
+
+/** dst = dst `op` src, for the ALU opcodes whose destination may be memory */
+static void emit_alu(code_buffer_t *b, uint32_t opcode, loc_t dst, loc_t src) {
+    int reg = emit_in_reg(b, src, RCX);
+    if (dst.reg == IN_MEMORY) {
+        emit_rm(b, false, opcode, reg, dst.base, dst.disp);
+    }
+    else {
+        emit_rr(b, false, opcode, reg, dst.reg);
+    }
+}
+
+/** Writes the operand stack slots below `depth` that live in registers to the frame */
+static void emit_spill(code_buffer_t *b, uint32_t depth) {
+    for (uint32_t d = 0; d < depth && d < NUM_STACK_REGS; d++) {
+        emit_rm(b, false, OP_MOV_STORE, stack_regs[d], REG_STACK, (int32_t)(d * sizeof(int32_t)));
+    }
+}
+
+static void emit_reload(code_buffer_t *b, uint32_t depth) {
+    for (uint32_t d = 0; d < depth && d < NUM_STACK_REGS; d++) {
+        emit_rm(b, false, OP_MOV_LOAD, stack_regs[d], REG_STACK, (int32_t)(d * sizeof(int32_t)));
+    }
+}
+
+/** Writes the locals cached in registers to the frame */
+static void emit_sync_locals(code_buffer_t *b, uint16_t max_locals) {
+    for (uint32_t i = 0; i < max_locals && i < NUM_LOCAL_REGS; i++) {
+        emit_rm(b, false, OP_MOV_STORE, local_regs[i], REG_LOCALS, (int32_t)(i * sizeof(int32_t)));
+    }
+}
+
+/** Loads the locals cached in registers from the frame */
+static void emit_load_locals(code_buffer_t *b, uint16_t max_locals) {
+    for (uint32_t i = 0; i < max_locals && i < NUM_LOCAL_REGS; i++) {
+        emit_rm(b, false, OP_MOV_LOAD, local_regs[i], REG_LOCALS, (int32_t)(i * sizeof(int32_t)));
+    }
+}
+
+/** RAX = the array that the reference in `ref` points to; clobbers RCX */
+static void emit_array_address(code_buffer_t *b, int ref) {
+    emit_rm(b, true, OP_MOV_LOAD, RAX, REG_RT, offsetof(jit_runtime_t, heap));
+    emit_rm(b, true, OP_MOV_LOAD, RAX, RAX, offsetof(heap_t, data));
+    emit_rr(b, true, OP_MOVSXD, RCX, ref);
+    emit_rsib(b, true, OP_MOV_LOAD, RAX, RAX, RCX, 3, 0);
+}
+
+/**
+ * Checks the index in EDX against the length of the array at RAX, unless
+ * the access was found to be in bounds. A negative index compares as a
+ * large unsigned one.
+ *
+ * @return the displacement of the jump to the bounds stub, or SIZE_MAX
+ */
+static size_t emit_bounds_check(code_buffer_t *b, const method_t *method, const insn_t *insn) {
+    if (access_in_bounds(method, insn->pc)) {
+        return SIZE_MAX;
+    }
+    emit_rm(b, false, OP_CMP, RDX, RAX, 0);
+    return emit_jump(b, CC_BE);
+}
+
+/**
+ * Records in the frame which instruction is calling out of compiled code and
+ * how deep its operand stack is below the call, so that the garbage
+ * collector can find the frame's references; clobbers RAX and RCX.
+ */
+static void emit_safepoint(code_buffer_t *b, const insn_t *insn, uint32_t top) {
+    emit_rm(b, true, OP_MOV_LOAD, RAX, REG_RT, offsetof(jit_runtime_t, vm_stack));
+    emit_rm(b, true, OP_MOV_LOAD, RAX, RAX, offsetof(vm_stack_t, current));
+    emit_rex(b, true, 0, 0, RCX);
+    emit_u8(b, 0xb8 + RCX);
+    emit_u64(b, (uintptr_t) insn);
+    emit_rm(b, true, OP_MOV_STORE, RCX, RAX, offsetof(frame_t, ip));
+    emit_rm(b, false, OP_MOV_IMM, 0, RAX, offsetof(frame_t, top));
+    emit_u32(b, top);
+}
+
+/* Helpers called from compiled code */
+
+static bool jit_invoke(jit_runtime_t *rt, method_t *callee, int32_t *args) {
+    // Compiled callees are called directly, the rest go through the interpreter
+    if (jit_code_of(callee) && rt->vm_stack->native_depth < JIT_MAX_NATIVE_DEPTH) {
+        if (!jit_run(callee, args, rt)) {
+            return false;
+        }
+        args[0] = rt->value;
+        return true;
+    }
+    optional_value_t result = execute(callee, args, rt->class, rt->heap, rt->vm_stack);
+    if (result.exception != EXC_NONE) {
+        rt->exception = result.exception;
+        return false;
+    }
+    if (result.has_value) {
+        args[0] = result.value;
+    }
+    return true;
+}
+
+static bool jit_intrinsic(jit_runtime_t *rt, const intrinsic_t *intrinsic, int32_t *args) {
+    exception_t exception = run_intrinsic(intrinsic, args, rt->heap);
+    if (exception != EXC_NONE) {
+        rt->exception = exception;
+        return false;
+    }
+    return true;
+}
+
+static bool jit_array_loop(jit_runtime_t *rt, const array_loop_t *loop, int32_t *locals) {
+    return run_array_loop(loop, locals, rt->heap);
+}
+
+static int32_t jit_newarray(jit_runtime_t *rt, int32_t count, int32_t atype) {
+    return gc_new_array(rt->heap, rt->vm_stack, (uint8_t) atype, count);
+}
+
+static int32_t jit_newarray_frame(jit_runtime_t *rt, int32_t count, int32_t atype) {
+    return gc_new_frame_array(rt->heap, rt->vm_stack, (uint8_t) atype, count);
+}
+
+static void jit_safepoint(jit_runtime_t *rt) {
+    thread_safepoint(rt->vm_stack);
+}
+
+/**
+ * Lets the thread stop before a backward branch if it was asked to, as
+ * execute() does (see thread.h); clobbers RAX and RCX
+ */
+static void emit_backedge_poll(code_buffer_t *b, const method_t *method, const insn_t *insn,
+                               uint32_t depth) {
+    emit_rm(b, true, OP_MOV_LOAD, RAX, REG_RT, offsetof(jit_runtime_t, vm_stack));
+    emit_rm(b, false, OP_GROUP1_BYTE_IMM8, 7, RAX, offsetof(vm_stack_t, preempt));
+    emit_u8(b, 0);
+    size_t running = emit_jump(b, CC_E);
+    emit_spill(b, depth);
+    emit_sync_locals(b, method->code.max_locals);
+    emit_safepoint(b, insn, depth);
+    emit_rr(b, true, OP_MOV_STORE, REG_RT, RDI);
+    emit_call(b, (uintptr_t) jit_safepoint);
+    emit_reload(b, depth);
+    patch_jump(b, running, b->length);
+}
+
+#define UNKNOWN_DEPTH UINT32_MAX
+
+/**
+ * Looks up the operand stack depth before each decoded instruction from the
+ * verifier, or UNKNOWN_DEPTH for unreachable ones.
+ *
+ * @return false if the method does not verify
+ */
+static bool compute_depths(method_t *method, class_file_t *cls, uint32_t *depths) {
+    uint16_t *pc_depths = malloc(method->code.code_length * sizeof(uint16_t));
+    bool ok = pc_depths && method->verified && verify_method(method, cls, pc_depths);
+    for (uint32_t i = 0; ok && i < method->insns_count; i++) {
+        const insn_t *insn = &method->insns[i];
+        // The trailing q_invalid is never reached in verified code
+        bool reached = insn->op != q_invalid && pc_depths[insn->pc] != UNREACHED_DEPTH;
+        depths[i] = reached ? pc_depths[insn->pc] : UNKNOWN_DEPTH;
+    }
+    free(pc_depths);
+    return ok;
+}
+
+/**
+ * Translates one instruction at operand stack depth `depth`. With `poll`, a
+ * backward branch first checks whether the thread is to be preempted.
+ *
+ * @return the displacement of the instruction's jump to be patched (see
+ *   jit_compile()), or SIZE_MAX if it has none
+ */
+static size_t compile_insn(code_buffer_t *b, const method_t *method, const insn_t *insn,
+                           uint32_t depth, bool poll) {
+    uint16_t op = insn->op;
+    size_t jump = SIZE_MAX;
+    loc_t top = depth > 0 ? stack_loc(depth - 1) : (loc_t){0};
+    loc_t second = depth > 1 ? stack_loc(depth - 2) : (loc_t){0};
+    if (poll && (insn_flags[op] & INSN_BRANCH) && insn->target <= insn) {
+        emit_backedge_poll(b, method, insn, depth);
+    }
+    switch (op) {
+        case q_iconst:
+            emit_move_imm(b, stack_loc(depth), insn->a);
+            break;
+        case q_iload:
+            emit_move(b, stack_loc(depth), local_loc((uint32_t) insn->a));
+            break;
+        case q_istore:
+            emit_move(b, local_loc((uint32_t) insn->a), top);
+            break;
+        case q_iinc:
+        case q_iinc_goto:
+            emit_group(b, OP_GROUP1_IMM32, 0, local_loc((uint32_t) insn->a));
+            emit_u32(b, (uint32_t) insn->b);
+            if (op == q_iinc_goto) {
+                jump = emit_jump(b, CC_ALWAYS);
+            }
+            break;
+        case q_iadd:
+            emit_alu(b, OP_ADD, second, top);
+            break;
+        case q_isub:
+            emit_alu(b, OP_SUB, second, top);
+            break;
+        case q_iand:
+            emit_alu(b, OP_AND, second, top);
+            break;
+        case q_ior:
+            emit_alu(b, OP_OR, second, top);
+            break;
+        case q_ixor:
+            emit_alu(b, OP_XOR, second, top);
+            break;
+        case q_imul: {
+            int dst = emit_in_reg(b, second, RAX);
+            int src = emit_in_reg(b, top, RCX);
+            emit_rr(b, false, OP_IMUL, dst, src);
+            emit_store(b, second, dst);
+            break;
+        }
+        case q_idiv:
+        case q_irem: {
+            emit_load(b, RAX, second);
+            int divisor = emit_in_reg(b, top, RCX);
+            emit_rr(b, false, OP_TEST, divisor, divisor);
+            jump = emit_jump(b, CC_E);
+            // idiv faults on INT_MIN / -1; Java defines it as INT_MIN rem 0
+            emit_rr(b, false, OP_GROUP1_IMM8, 7, divisor);
+            emit_u8(b, 0xff);
+            size_t not_minus_one = emit_jump(b, CC_NE);
+            if (op == q_idiv) {
+                emit_rr(b, false, OP_GROUP3, 3, RAX);
+            }
+            else {
+                emit_rr(b, false, OP_XOR, RAX, RAX);
+            }
+            size_t done = emit_jump(b, CC_ALWAYS);
+            patch_jump(b, not_minus_one, b->length);
+            emit_u8(b, 0x99); // cdq
+            emit_rr(b, false, OP_GROUP3, 7, divisor);
+            if (op == q_irem) {
+                emit_rr(b, false, OP_MOV_STORE, RDX, RAX);
+            }
+            patch_jump(b, done, b->length);
+            emit_store(b, second, RAX);
+            break;
+        }
+        case q_ineg:
+            emit_group(b, OP_GROUP3, 3, top);
+            break;
+        case q_ishl:
+        case q_ishr:
+        case q_iushr:
+            // x86 masks the count to 5 bits, as Java does
+            emit_load(b, RCX, top);
+            emit_group(b, OP_SHIFT_CL, op == q_ishl ? 4 : op == q_ishr ? 7 : 5, second);
+            break;
+        case q_dup:
+            emit_move(b, stack_loc(depth), top);
+            break;
+        case q_ifeq:
+        case q_ifne:
+        case q_iflt:
+        case q_ifge:
+        case q_ifgt:
+        case q_ifle: {
+            int reg = emit_in_reg(b, top, RAX);
+            emit_rr(b, false, OP_TEST, reg, reg);
+            jump = emit_jump(b, java_cc[op - q_ifeq]);
+            break;
+        }
+        case q_if_icmpeq:
+        case q_if_icmpne:
+        case q_if_icmplt:
+        case q_if_icmpge:
+        case q_if_icmpgt:
+        case q_if_icmple:
+            emit_alu(b, OP_CMP, second, top);
+            jump = emit_jump(b, java_cc[op - q_if_icmpeq]);
+            break;
+        case q_iload_if_icmpeq:
+        case q_iload_if_icmpne:
+        case q_iload_if_icmplt:
+        case q_iload_if_icmpge:
+        case q_iload_if_icmpgt:
+        case q_iload_if_icmple:
+            emit_alu(b, OP_CMP, top, local_loc((uint32_t) insn->a));
+            jump = emit_jump(b, java_cc[op - q_iload_if_icmpeq]);
+            break;
+        case q_iload_iload_if_icmpeq:
+        case q_iload_iload_if_icmpne:
+        case q_iload_iload_if_icmplt:
+        case q_iload_iload_if_icmpge:
+        case q_iload_iload_if_icmpgt:
+        case q_iload_iload_if_icmple:
+            emit_alu(b, OP_CMP, local_loc((uint32_t) insn->a), local_loc((uint32_t) insn->b));
+            jump = emit_jump(b, java_cc[op - q_iload_iload_if_icmpeq]);
+            break;
+        case q_iload_iload_iadd_istore:
+            emit_load(b, RAX, local_loc((uint32_t) insn->a));
+            emit_rr(b, false, OP_ADD, emit_in_reg(b, local_loc((uint32_t) insn->b), RCX), RAX);
+            emit_store(b, local_loc((uint32_t) insn->c), RAX);
+            break;
+        case q_goto:
+            jump = emit_jump(b, CC_ALWAYS);
+            break;
+        case q_invokestatic: {
+            // The arguments must be in the frame: they become the callee's locals
+            uint32_t args = depth - (uint32_t) insn->a;
+            emit_spill(b, depth);
+            emit_sync_locals(b, method->code.max_locals);
+            emit_safepoint(b, insn, args);
+            emit_rr(b, true, OP_MOV_STORE, REG_RT, RDI);
+            emit_rex(b, true, 0, 0, RSI);
+            emit_u8(b, 0xb8 + (RSI & 7));
+            emit_u64(b, (uintptr_t) insn->method);
+            emit_rm(b, true, OP_LEA, RDX, REG_STACK, (int32_t)(args * sizeof(int32_t)));
+            emit_call(b, (uintptr_t) jit_invoke);
+            emit_rr(b, false, OP_TEST_BYTE, RAX, RAX);
+            jump = emit_jump(b, CC_E);
+            emit_reload(b, args + (uint32_t) insn->b);
+            break;
+        }
+        case q_intrinsic: {
+            // Like an invoke, but intrinsics never allocate: no safepoint
+            uint32_t args = depth - (uint32_t) insn->a;
+            emit_spill(b, depth);
+            emit_rr(b, true, OP_MOV_STORE, REG_RT, RDI);
+            emit_rex(b, true, 0, 0, RSI);
+            emit_u8(b, 0xb8 + (RSI & 7));
+            emit_u64(b, (uintptr_t) &intrinsics[insn->c]);
+            emit_rm(b, true, OP_LEA, RDX, REG_STACK, (int32_t)(args * sizeof(int32_t)));
+            emit_call(b, (uintptr_t) jit_intrinsic);
+            emit_rr(b, false, OP_TEST_BYTE, RAX, RAX);
+            jump = emit_jump(b, CC_E);
+            emit_reload(b, args + (uint32_t) insn->b);
+            break;
+        }
+        case q_array_loop:
+            // The kernel works on the locals in the frame
+            emit_spill(b, depth);
+            emit_sync_locals(b, method->code.max_locals);
+            emit_rr(b, true, OP_MOV_STORE, REG_RT, RDI);
+            emit_rex(b, true, 0, 0, RSI);
+            emit_u8(b, 0xb8 + (RSI & 7));
+            emit_u64(b, (uintptr_t) &method->array_loops[insn->b]);
+            emit_rr(b, true, OP_MOV_STORE, REG_LOCALS, RDX);
+            emit_call(b, (uintptr_t) jit_array_loop);
+            emit_load_locals(b, method->code.max_locals);
+            emit_reload(b, depth);
+            emit_rr(b, false, OP_TEST_BYTE, RAX, RAX);
+            jump = emit_jump(b, CC_NE);
+            emit_move(b, stack_loc(depth), local_loc((uint32_t) insn->a));
+            break;
+        case q_println:
+            emit_spill(b, depth - 1);
+            emit_load(b, RDI, top);
+            emit_call(b, (uintptr_t) output_int);
+            emit_reload(b, depth - 1);
+            break;
+        case q_newarray:
+        case q_newarray_frame:
+            emit_load(b, RSI, top);
+            emit_rr(b, false, OP_TEST, RSI, RSI);
+            jump = emit_jump(b, CC_L);
+            emit_spill(b, depth - 1);
+            emit_sync_locals(b, method->code.max_locals);
+            emit_safepoint(b, insn, depth - 1);
+            emit_rr(b, true, OP_MOV_STORE, REG_RT, RDI);
+            emit_u8(b, 0xb8 + RDX);
+            emit_u32(b, (uint32_t) insn->a);
+            emit_call(b, (uintptr_t)(op == q_newarray ? jit_newarray : jit_newarray_frame));
+            emit_reload(b, depth - 1);
+            emit_store(b, top, RAX);
+            break;
+        case q_arraylength:
+            emit_array_address(b, emit_in_reg(b, top, RCX));
+            emit_rm(b, false, OP_MOV_LOAD, RAX, RAX, 0);
+            emit_store(b, top, RAX);
+            break;
+        case q_iaload:
+        case q_baload:
+        case q_caload:
+        case q_saload: {
+            // The load's opcode and log2 of the element size
+            static const uint32_t loads[][2] = {
+                {OP_MOV_LOAD, 2}, {OP_MOVSX_BYTE, 0}, {OP_MOVZX_WORD, 1}, {OP_MOVSX_WORD, 1},
+            };
+            uint32_t kind = op == q_iaload ? 0 : op == q_baload ? 1 : op == q_caload ? 2 : 3;
+            emit_rr(b, true, OP_MOVSXD, RDX, emit_in_reg(b, top, RDX));
+            emit_array_address(b, emit_in_reg(b, second, RCX));
+            jump = emit_bounds_check(b, method, insn);
+            emit_rsib(b, false, loads[kind][0], RAX, RAX, RDX, (int) loads[kind][1],
+                      ARRAY_DATA_OFFSET);
+            emit_store(b, second, RAX);
+            break;
+        }
+        case q_iastore:
+            emit_rr(b, true, OP_MOVSXD, RDX, emit_in_reg(b, second, RDX));
+            emit_array_address(b, emit_in_reg(b, stack_loc(depth - 3), RCX));
+            jump = emit_bounds_check(b, method, insn);
+            emit_rsib(b, false, OP_MOV_STORE, emit_in_reg(b, top, RCX), RAX, RDX, 2,
+                      ARRAY_DATA_OFFSET);
+            break;
+        case q_castore:
+        case q_sastore:
+            emit_rr(b, true, OP_MOVSXD, RDX, emit_in_reg(b, second, RDX));
+            emit_array_address(b, emit_in_reg(b, stack_loc(depth - 3), RCX));
+            jump = emit_bounds_check(b, method, insn);
+            emit_load(b, RCX, top);
+            emit_u8(b, OPERAND_SIZE_16);
+            emit_rsib(b, false, OP_MOV_STORE, RCX, RAX, RDX, 1, ARRAY_DATA_OFFSET);
+            break;
+        case q_bastore: {
+            emit_rr(b, true, OP_MOVSXD, RDX, emit_in_reg(b, second, RDX));
+            emit_array_address(b, emit_in_reg(b, stack_loc(depth - 3), RCX));
+            jump = emit_bounds_check(b, method, insn);
+            emit_load(b, RCX, top);
+            // boolean arrays only keep the low bit
+            emit_rm(b, false, OP_GROUP1_BYTE_IMM8, 7, RAX, offsetof(array_t, atype));
+            emit_u8(b, T_BOOLEAN);
+            size_t not_boolean = emit_jump(b, CC_NE);
+            emit_rr(b, false, OP_GROUP1_IMM8, 4, RCX);
+            emit_u8(b, 1);
+            patch_jump(b, not_boolean, b->length);
+            emit_rsib(b, false, OP_MOV_STORE_BYTE, RCX, RAX, RDX, 0, ARRAY_DATA_OFFSET);
+            break;
+        }
+        case q_ireturn:
+            emit_rm(b, false, OP_MOV_STORE, emit_in_reg(b, top, RAX), REG_RT,
+                    offsetof(jit_runtime_t, value));
+            jump = emit_jump(b, CC_ALWAYS);
+            break;
+        case q_return:
+            jump = emit_jump(b, CC_ALWAYS);
+            break;
+        default:
+            b->ok = false;
+            break;
+    }
+    return jump;
+}
+
+static const int saved_regs[] = {RBX, RBP, R12, R13, R14, R15};
+#define NUM_SAVED_REGS 6
+
+static void emit_prologue(code_buffer_t *b, const method_t *method) {
+    for (int i = 0; i < NUM_SAVED_REGS; i++) {
+        emit_push(b, saved_regs[i]);
+    }
+    // Six pushes and the return address: realign the stack for calls
+    emit_rr(b, true, OP_GROUP1_IMM8, 5, RSP);
+    emit_u8(b, 8);
+    emit_rr(b, true, OP_MOV_STORE, RSI, REG_RT);
+    emit_rm(b, true, OP_MOV_LOAD, REG_LOCALS, RDI, offsetof(frame_t, locals));
+    emit_rm(b, true, OP_MOV_LOAD, REG_STACK, RDI, offsetof(frame_t, stack));
+    emit_load_locals(b, method->code.max_locals);
+}
+
+/** Returns `result` (0 or 1) from compiled code */
+static void emit_epilogue(code_buffer_t *b, uint32_t result) {
+    emit_rex(b, false, 0, 0, RAX);
+    emit_u8(b, 0xb8 + RAX);
+    emit_u32(b, result);
+    emit_rr(b, true, OP_GROUP1_IMM8, 0, RSP);
+    emit_u8(b, 8);
+    for (int i = NUM_SAVED_REGS - 1; i >= 0; i--) {
+        emit_pop(b, saved_regs[i]);
+    }
+    emit_u8(b, 0xc3);
+}
+
+/** Returns false from compiled code, having thrown `exception` */
+static void emit_throw(code_buffer_t *b, exception_t exception) {
+    emit_rm(b, false, OP_MOV_IMM, 0, REG_RT, offsetof(jit_runtime_t, exception));
+    emit_u32(b, exception);
+    emit_epilogue(b, 0);
+}
+
+/** Copies finished code into its own executable mapping */
+static void *install_code(const code_buffer_t *b, size_t *size) {
+    long page = sysconf(_SC_PAGESIZE);
+    *size = (b->length + (size_t) page - 1) & ~((size_t) page - 1);
+    void *code = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(code, b->code, b->length);
+    if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, *size);
+        return NULL;
+    }
+    return code;
+}
+
+/** Compiles a method; the caller holds compile_lock */
+static bool compile_method(method_t *method, class_file_t *cls) {
+    if (method->jit_code || method->jit_failed) {
+        return method->jit_code != NULL;
+    }
+    method->jit_failed = true;
+    if (method->code.exception_table_length > 0 ||
+        (!method->insns && !decode_method(method, cls))) {
+        return false;
+    }
+    uint32_t count = method->insns_count;
+    uint32_t *depths = malloc(count * sizeof(uint32_t));
+    // Native offset of each instruction, then of the return and throw exits
+    // and the division-by-zero, out-of-bounds and negative size stubs
+    size_t *offsets = malloc((count + 5) * sizeof(size_t));
+    size_t *jumps = malloc(count * sizeof(size_t));
+    uint32_t *jump_targets = malloc(count * sizeof(uint32_t));
+    uint32_t *osr_offsets = calloc(count, sizeof(uint32_t));
+    code_buffer_t b = {.ok = true};
+    if (!depths || !offsets || !jumps || !jump_targets || !osr_offsets ||
+        !compute_depths(method, cls, depths)) {
+        goto done;
+    }
+    uint32_t return_label = count, throw_label = count + 1, div_label = count + 2,
+             bounds_label = count + 3, size_label = count + 4;
+    // Only threads can be preempted; other loops are spared the check
+    bool poll = class_starts_threads(cls);
+
+    emit_prologue(&b, method);
+    for (uint32_t i = 0; i < count; i++) {
+        offsets[i] = b.length;
+        jumps[i] = SIZE_MAX;
+        if (depths[i] == UNKNOWN_DEPTH) {
+            continue;
+        }
+        const insn_t *insn = &method->insns[i];
+        jumps[i] = compile_insn(&b, method, insn, depths[i], poll);
+        // Divisions jump to the division-by-zero stub, array accesses to the
+        // out-of-bounds stub, allocations to the negative size stub, invokes
+        // out if the callee threw, and returns to the exit; array loops
+        // branch like the loop test they replace
+        switch (insn->op) {
+            case q_idiv:
+            case q_irem:
+                jump_targets[i] = div_label;
+                break;
+            case q_newarray:
+            case q_newarray_frame:
+                jump_targets[i] = size_label;
+                break;
+            case q_iaload:
+            case q_baload:
+            case q_caload:
+            case q_saload:
+            case q_iastore:
+            case q_bastore:
+            case q_castore:
+            case q_sastore:
+                jump_targets[i] = bounds_label;
+                break;
+            case q_invokestatic:
+            case q_intrinsic:
+                jump_targets[i] = throw_label;
+                break;
+            case q_ireturn:
+            case q_return:
+                jump_targets[i] = return_label;
+                break;
+            default:
+                if (insn_flags[insn->op] & INSN_BRANCH) {
+                    jump_targets[i] = (uint32_t)(insn->target - method->insns);
+                }
+                break;
+        }
+    }
+    offsets[return_label] = b.length;
+    emit_epilogue(&b, 1);
+    offsets[throw_label] = b.length;
+    emit_epilogue(&b, 0);
+    // Compiled methods have no handlers, so the exceptions they throw leave
+    offsets[div_label] = b.length;
+    emit_throw(&b, EXC_ARITHMETIC);
+    offsets[bounds_label] = b.length;
+    emit_throw(&b, EXC_ARRAY_INDEX_OUT_OF_BOUNDS);
+    offsets[size_label] = b.length;
+    emit_throw(&b, EXC_NEGATIVE_ARRAY_SIZE);
+    for (uint32_t i = 0; i < count; i++) {
+        if (jumps[i] != SIZE_MAX) {
+            patch_jump(&b, jumps[i], offsets[jump_targets[i]]);
+        }
+    }
+
+    // On-stack replacement entries for loop headers: the interpreter's frame
+    // already holds the locals and operand stack, so load the cached ones
+    // and jump into the body
+    for (uint32_t i = 0; i < count; i++) {
+        const insn_t *insn = &method->insns[i];
+        if (depths[i] == UNKNOWN_DEPTH || !(insn_flags[insn->op] & INSN_BRANCH) ||
+            insn->target > insn) {
+            continue;
+        }
+        uint32_t header = (uint32_t)(insn->target - method->insns);
+        if (osr_offsets[header] == 0) {
+            osr_offsets[header] = (uint32_t) b.length;
+            emit_prologue(&b, method);
+            emit_reload(&b, depths[header]);
+            patch_jump(&b, emit_jump(&b, CC_ALWAYS), offsets[header]);
+        }
+    }
+
+    void *code = b.ok ? install_code(&b, &method->jit_code_size) : NULL;
+    if (code) {
+        method->jit_osr_offsets = osr_offsets;
+        osr_offsets = NULL;
+        method->jit_failed = false;
+        __atomic_store_n(&method->jit_code, code, __ATOMIC_RELEASE);
+    }
+
+done:
+    free(depths);
+    free(offsets);
+    free(jumps);
+    free(jump_targets);
+    free(osr_offsets);
+    free(b.code);
+    return method->jit_code != NULL;
+}
+
+bool jit_compile(method_t *method, class_file_t *cls) {
+    if (jit_code_of(method)) {
+        return true;
+    }
+    pthread_mutex_lock(&compile_lock);
+    bool compiled = compile_method(method, cls);
+    pthread_mutex_unlock(&compile_lock);
+    return compiled;
+}
+
+jit_code_t jit_osr_entry(method_t *method, const insn_t *ip) {
+    jit_code_t code = jit_code_of(method);
+    if (!code) {
+        return NULL;
+    }
+    uint32_t offset = method->jit_osr_offsets[ip - method->insns];
+    return offset ? (jit_code_t)((uint8_t *) code + offset) : NULL;
+}
+
+void jit_release(method_t *method) {
+    if (method->jit_code) {
+        munmap(method->jit_code, method->jit_code_size);
+        method->jit_code = NULL;
+    }
+    free(method->jit_osr_offsets);
+    method->jit_osr_offsets = NULL;
+}
+
+#else
+
+bool jit_compile(method_t *method, class_file_t *cls) {
+    (void) cls;
+    method->jit_failed = true;
+    return false;
+}
+
+jit_code_t jit_osr_entry(method_t *method, const insn_t *ip) {
+    (void) method;
+    (void) ip;
+    return NULL;
+}
+
+void jit_release(method_t *method) {
+    (void) method;
+}
+
+#endif
@@ -0,0 +1,108 @@
+// jit.h
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "heap.h"
+#include "jvm.h"
+#include "read_class.h"
+
+/**
+ * A template JIT. Once a method has been invoked `jit_threshold` times, its
+ * decoded instructions are translated one by one into x86-64 machine code,
+ * which execute() runs instead of interpreting the method. A method stuck in
+ * a long loop is compiled once it takes `jit_backedge_threshold` backward
+ * branches, and the running invocation moves into compiled code at the loop
+ * header (on-stack replacement). Methods using
+ * anything the JIT cannot translate, or with exception handlers, stay in the
+ * interpreter. On other architectures, or when built with -DTINYJVM_NO_JIT,
+ * jit_compile() always fails.
+ *
+ * Compiled code keeps the method's frame on the VM stack, so its locals and
+ * the arguments it passes are where the interpreter would have them. The
+ * first few locals and operand stack slots are cached in registers; they are
+ * written back to the frame before every call out of compiled code.
+ */
+
+/** What compiled code needs from the VM */
+typedef struct {
+    class_file_t *class;
+    heap_t *heap;
+    vm_stack_t *vm_stack;
+    /** The exception compiled code threw, when it returns false */
+    exception_t exception;
+    /** The value compiled code returned, when it returns true */
+    int32_t value;
+} jit_runtime_t;
+
+/**
+ * The entry point of a compiled method. `frame` must already be pushed.
+ *
+ * @return false if the method threw an exception
+ */
+typedef bool (*jit_code_t)(frame_t *frame, jit_runtime_t *rt);
+
+/** The default number of invocations after which a method is compiled */
+#define JIT_DEFAULT_THRESHOLD 1000
+/** The default number of loop iterations after which a running method is compiled */
+#define JIT_DEFAULT_BACKEDGE_THRESHOLD 10000
+/**
+ * Compiled code calls other methods on the native stack, so only this many
+ * compiled frames may be nested; deeper calls are interpreted.
+ */
+#define JIT_MAX_NATIVE_DEPTH 1024
+
+/** The invocation count that triggers compilation; 0 disables the JIT */
+extern uint32_t jit_threshold;
+/** The backward branch count that triggers on-stack replacement */
+extern uint32_t jit_backedge_threshold;
+
+/**
+ * Bumps one of a method's invocation and backward branch counters and
+ * returns the new count. Isolates on other threads may run the same method
+ * (see isolate.h); a lost count only delays compilation a little, so the
+ * counters use relaxed atomic loads and stores rather than locked increments.
+ */
+static inline uint32_t jit_count(uint32_t *counter) {
+    uint32_t count = __atomic_load_n(counter, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(counter, count, __ATOMIC_RELAXED);
+    return count;
+}
+
+/** A method's compiled code, or NULL if it has none yet */
+static inline jit_code_t jit_code_of(const method_t *method) {
+    // Pairs with the release in jit_compile(), which fills in the rest first
+    return (jit_code_t) __atomic_load_n(&method->jit_code, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Compiles a method, setting `method->jit_code` on success or
+ * `method->jit_failed` if it cannot be compiled. Compilations are
+ * serialized, so threads running the same method compile it once.
+ *
+ * @return whether the method now has compiled code
+ */
+bool jit_compile(method_t *method, class_file_t *cls);
+
+/**
+ * Runs a method's compiled code in a new frame whose locals start at `locals`.
+ *
+ * @return false if the method threw; `rt->exception` says what
+ */
+bool jit_run(method_t *method, int32_t *locals, jit_runtime_t *rt);
+
+/**
+ * Returns an entry into a compiled method that continues at the decoded
+ * instruction `ip`, or NULL if there is none. The entry takes the frame of
+ * the running invocation, whose operand stack must hold as many values as
+ * compiled code expects at `ip`; backward branch targets have one.
+ */
+jit_code_t jit_osr_entry(method_t *method, const insn_t *ip);
+
+/** Frees a method's compiled code, if any */
+void jit_release(method_t *method);
+
+#endif
@@ -1,14 +1,21 @@
 #include "jvm.h"
 
-#include <assert.h>
-#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 
+#include "array.h"
+#include "decode.h"
+#include "frame.h"
+#include "gc.h"
 #include "heap.h"
+#include "intrinsic.h"
+#include "jit.h"
+#include "output.h"
+#include "profile.h"
 #include "read_class.h"
+#include "thread.h"
+#include "verify.h"
 
 const int ERROR = 99;
 /** The name of the method to invoke to run the class file */
@@ -22,59 +29,267 @@ const char MAIN_METHOD[] = "main";
 const char MAIN_DESCRIPTOR[] = "([Ljava/lang/String;)V";
 
 /**
- * Represents the return value of a Java method: either void or an int or a reference.
- * For simplification, we represent a reference as an index into a heap-allocated array.
- * (In a real JVM, methods could also return object references or other primitives.)
+ * The class of each exception followed by its superclasses, for matching
+ * exception handlers' catch types.
  */
-typedef struct {
-    /** Whether this returned value is an int */
-    bool has_value;
-    /** The returned value (only valid if `has_value` is true) */
-    int32_t value;
-} optional_value_t;
+static const char *const EXCEPTION_CLASSES[][6] = {
+    [EXC_STACK_OVERFLOW] = {"java/lang/StackOverflowError", "java/lang/VirtualMachineError",
+                            "java/lang/Error", "java/lang/Throwable", NULL},
+    [EXC_ARRAY_INDEX_OUT_OF_BOUNDS] = {"java/lang/ArrayIndexOutOfBoundsException",
+                                       "java/lang/IndexOutOfBoundsException",
+                                       "java/lang/RuntimeException", "java/lang/Exception",
+                                       "java/lang/Throwable", NULL},
+    [EXC_ARRAY_STORE] = {"java/lang/ArrayStoreException", "java/lang/RuntimeException",
+                         "java/lang/Exception", "java/lang/Throwable", NULL},
+    [EXC_ILLEGAL_MONITOR_STATE] = {"java/lang/IllegalMonitorStateException",
+                                   "java/lang/RuntimeException", "java/lang/Exception",
+                                   "java/lang/Throwable", NULL},
+    [EXC_ARITHMETIC] = {"java/lang/ArithmeticException", "java/lang/RuntimeException",
+                        "java/lang/Exception", "java/lang/Throwable", NULL},
+    [EXC_NEGATIVE_ARRAY_SIZE] = {"java/lang/NegativeArraySizeException",
+                                 "java/lang/RuntimeException", "java/lang/Exception",
+                                 "java/lang/Throwable", NULL},
+};
 
-void binary_arithmetic(uint8_t op, int32_t *stack, uint32_t *top) {
-    if (*top < 2) {
-        exit(ERROR);
+const char *exception_class_name(exception_t exception) {
+    return EXCEPTION_CLASSES[exception][0];
+}
+
+void print_uncaught_exception(const char *thread_name, exception_t exception) {
+    // Print the class name the way Java does, e.g. java.lang.StackOverflowError
+    char name[64];
+    size_t i = 0;
+    for (const char *c = exception_class_name(exception); *c && i < sizeof(name) - 1; c++) {
+        name[i++] = *c == '/' ? '.' : *c;
     }
-    int32_t b = stack[--(*top)];
-    int32_t a = stack[--(*top)];
-    int32_t result;
-    switch (op) {
-        case i_iadd:
-            result = a + b;
-            break;
-        case i_isub:
-            result = a - b;
-            break;
-        case i_imul:
-            result = a * b;
+    name[i] = '\0';
+    // One call, so that threads reporting at once do not mix their lines
+    fprintf(stderr, "Exception in thread \"%s\" %s\n", thread_name, name);
+}
+
+/**
+ * The VM has no exception objects, so a handler finds this placeholder
+ * reference on its operand stack.
+ */
+#define EXCEPTION_REF (-1)
+
+/**
+ * Instruction dispatch. With GCC/Clang labels-as-values, every handler ends in
+ * its own indirect jump through a table of label addresses (direct threading),
+ * so each jump site gets its own branch-predictor history. Without the
+ * extension, or when built with -DTINYJVM_SWITCH_DISPATCH, the handlers are
+ * cases of a single switch instead.
+ */
+#if defined(__GNUC__) && !defined(TINYJVM_SWITCH_DISPATCH)
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
+
+/* TINYJVM_TRAIN builds count every executed instruction for superinsn.h */
+#ifdef TINYJVM_TRAIN
+#define COUNT_INSN() frame->method->insn_counts[ip - frame->method->insns]++
+#else
+#define COUNT_INSN()
+#endif
+
+/*
+ * Handlers do no operand stack or local index checks: verified methods (see
+ * verify.h) cannot need them. Instructions of any other method go through
+ * insn_is_safe() first, selected per frame by SELECT_DISPATCH(). With
+ * --profile, every instruction goes through profile_insn first instead.
+ */
+#if USE_COMPUTED_GOTO
+#define TARGET(op) L_##op:
+#define DISPATCH()               \
+    do {                         \
+        COUNT_INSN();            \
+        goto *dispatch[ip->op];  \
+    } while (0)
+#define SELECT_DISPATCH() \
+    dispatch = frame->method->verified ? verified_dispatch : unverified_dispatch
+#else
+#define TARGET(op) case op:
+#define DISPATCH() continue
+#define SELECT_DISPATCH() verified = frame->method->verified
+#endif
+
+/*
+ * Handler bodies shared by several instructions. They end in DISPATCH(), so
+ * they are not wrapped in do/while(0): `continue` must reach the dispatch loop.
+ */
+
+/**
+ * Jumps to the instruction's target. Taken backward branches are counted as
+ * loop iterations of the running method; once there are enough of them the
+ * method continues in compiled code (see on_stack_replacement). They are
+ * also where a preempted thread stops (see thread.h).
+ */
+#define BRANCH()                                                              \
+    if (ip->target <= ip) {                                                   \
+        if (jit_count(&frame->method->backedges) >= jit_backedge_threshold) { \
+            ip = ip->target;                                                  \
+            goto on_stack_replacement;                                        \
+        }                                                                     \
+        if (thread_preempted(vm_stack)) {                                     \
+            goto backedge_safepoint;                                          \
+        }                                                                     \
+    }                                                                         \
+    ip = ip->target;                                                          \
+    DISPATCH()
+
+/** Pops ints `a` and `b`, pushes `expr` and moves to the next instruction */
+#define BINARY_OP(expr)        \
+    int32_t b = stack[--top];  \
+    int32_t a = stack[--top];  \
+    stack[top++] = (expr);     \
+    ip++;                      \
+    DISPATCH()
+
+/**
+ * Throws ArrayIndexOutOfBoundsException unless `index` is within `array`.
+ * A negative index compares as a large unsigned one.
+ */
+#define CHECK_INDEX(array, index)                             \
+    if ((uint32_t)(index) >= (uint32_t)(array)->length) {     \
+        exception = EXC_ARRAY_INDEX_OUT_OF_BOUNDS;            \
+        goto throw_exception;                                 \
+    }
+
+/** Pops an index and an array reference and pushes the element, stored as a C `type` */
+#define ARRAY_LOAD(type)                                      \
+    int32_t index = stack[--top];                             \
+    array_t *array = heap_get(heap, stack[top - 1]);          \
+    CHECK_INDEX(array, index);                                \
+    stack[top - 1] = ((type *) array_data(array))[index];     \
+    ip++;                                                     \
+    DISPATCH()
+
+/** Pops a value, an index and an array reference and stores the value as a C `type` */
+#define ARRAY_STORE(type)                                     \
+    int32_t value = stack[--top];                             \
+    int32_t index = stack[--top];                             \
+    array_t *array = heap_get(heap, stack[--top]);            \
+    CHECK_INDEX(array, index);                                \
+    ((type *) array_data(array))[index] = (type) value;       \
+    ip++;                                                     \
+    DISPATCH()
+
+/** Pops an int `a` and branches to the instruction's target if `cond` holds */
+#define UNARY_BRANCH(cond)              \
+    int32_t a = stack[--top];           \
+    if (cond) {                         \
+        BRANCH();                       \
+    }                                   \
+    ip++;                               \
+    DISPATCH()
+
+/** Pops ints `a` and `b` and branches to the instruction's target if `cond` holds */
+#define BINARY_BRANCH(cond)             \
+    int32_t b = stack[--top];           \
+    int32_t a = stack[--top];           \
+    if (cond) {                         \
+        BRANCH();                       \
+    }                                   \
+    ip++;                               \
+    DISPATCH()
+
+/** Pops `a`, compares it with `b` = locals[ip->a] and branches if `cond` holds */
+#define ILOAD_BRANCH(cond)                  \
+    int32_t b = locals[ip->a];              \
+    int32_t a = stack[--top];               \
+    if (cond) {                             \
+        BRANCH();                           \
+    }                                       \
+    ip++;                                   \
+    DISPATCH()
+
+/** Compares `a` = locals[ip->a] with `b` = locals[ip->b] and branches if `cond` holds */
+#define ILOAD_ILOAD_BRANCH(cond)            \
+    int32_t a = locals[ip->a];              \
+    int32_t b = locals[ip->b];              \
+    if (cond) {                             \
+        BRANCH();                           \
+    }                                       \
+    ip++;                                   \
+    DISPATCH()
+
+/**
+ * Whether an array instruction's array operand, the deepest value it pops,
+ * is an array it may access
+ */
+static bool array_operand_is_safe(const insn_t *ip, const int32_t *stack, uint32_t top,
+                                  heap_t *heap) {
+    uint8_t atype;
+    uint8_t other = 0;
+    switch (ip->op) {
+        case q_arraylength:
+            atype = 0;
             break;
-        case i_idiv:
-            if (b == 0) {
-                exit(ERROR);
-            }
-            result = a / b;
+        case q_iaload:
+        case q_iastore:
+            atype = T_INT;
             break;
-        case i_irem:
-            if (b == 0) {
-                exit(ERROR);
-            }
-            result = a % b;
+        case q_baload:
+        case q_bastore:
+            atype = T_BYTE;
+            other = T_BOOLEAN;
             break;
-        case i_iand:
-            result = a & b;
+        case q_caload:
+        case q_castore:
+            atype = T_CHAR;
             break;
-        case i_ior:
-            result = a | b;
+        case q_saload:
+        case q_sastore:
+            atype = T_SHORT;
             break;
-        case i_ixor:
-            result = a ^ b;
+        case q_laload:
+        case q_lastore:
+            atype = T_LONG;
             break;
         default:
-            exit(ERROR);
+            return true;
     }
-    stack[(*top)++] = result;
+    int32_t ref = stack[top - insn_effects[ip->op].pops];
+    if (!heap_contains(heap, ref)) {
+        return false;
+    }
+    array_t *array = heap_get(heap, ref);
+    return atype == 0 || array->atype == atype || (other && array->atype == other);
+}
+
+/**
+ * Whether an instruction of an unverified method can run: the operand stack
+ * holds what it pops and has room for what it pushes, the locals it names
+ * exist and the arrays it accesses have the right element type.
+ */
+static inline bool insn_is_safe(const insn_t *ip, const int32_t *stack, uint32_t top,
+                                const method_t *method, heap_t *heap) {
+    insn_effect_t effect = insn_effects[ip->op];
+    uint32_t pops = effect.pops;
+    uint32_t pushes = effect.pushes;
+    if (ip->op == q_invokestatic || ip->op == q_intrinsic || ip->op == q_thread) {
+        pops = (uint32_t) ip->a;
+        pushes = (uint32_t) ip->b;
+    }
+    uint16_t max_locals = method->code.max_locals;
+    return top >= pops && top - pops + pushes <= method->code.max_stack &&
+           !((effect.locals & LOCAL_A) && (uint32_t) ip->a >= max_locals) &&
+           !((effect.locals & LOCAL_B) && (uint32_t) ip->b >= max_locals) &&
+           !((effect.locals & LOCAL_C) && (uint32_t) ip->c >= max_locals) &&
+           array_operand_is_safe(ip, stack, top, heap);
+}
+
+/** Counts an invocation of `method`, compiling it once it is hot */
+static inline void count_invocation(method_t *method, class_file_t *class) {
+    if (jit_count(&method->invocations) == jit_threshold && jit_threshold != 0) {
+        jit_compile(method, class);
+    }
+}
+
+/** Whether a call to `method` should run its compiled code */
+static inline bool use_compiled(method_t *method, vm_stack_t *vm_stack) {
+    return jit_code_of(method) && vm_stack->native_depth < JIT_MAX_NATIVE_DEPTH;
 }
 
 /**
@@ -82,545 +297,532 @@ void binary_arithmetic(uint8_t op, int32_t *stack, uint32_t *top) {
  *
  * @param method the method to run
  * @param locals the array of local variables, including the method parameters.
- *   Except for parameters, the locals are uninitialized.
+ *   Except for parameters, the locals are uninitialized. They must lie at the
+ *   top of `vm_stack`; the method's frame is pushed right after them.
  * @param class the class file the method belongs to
  * @param heap an array of heap-allocated pointers, useful for references
- * @return an optional int containing the method's return value
+ * @param vm_stack the stack that holds every frame
+ * @return an optional int containing the method's return value, or the
+ *   exception it threw
  */
 optional_value_t execute(method_t *method, int32_t *locals, class_file_t *class,
-                         heap_t *heap) {
-    uint8_t *code = method->code.code;
-    int32_t *stack = (int32_t *) malloc(method->code.max_stack * sizeof(int32_t));
-    if (!stack) {
+                         heap_t *heap, vm_stack_t *vm_stack) {
+    optional_value_t result = {.has_value = false, .exception = EXC_NONE};
+    if (!method->insns && !decode_method(method, class)) {
         exit(ERROR);
     }
-
+    jit_runtime_t rt = {.class = class, .heap = heap, .vm_stack = vm_stack};
+    count_invocation(method, class);
+    if (use_compiled(method, vm_stack)) {
+        if (jit_run(method, locals, &rt)) {
+            result.has_value = returns_value(method);
+            result.value = rt.value;
+        }
+        else {
+            result.exception = rt.exception;
+        }
+        return result;
+    }
+    // Calls made by this method push frames onto vm_stack and continue in
+    // this loop; only returning from (or unwinding) `entry` leaves it.
+    frame_t *entry = push_frame(vm_stack, method, locals);
+    if (!entry) {
+        result.exception = EXC_STACK_OVERFLOW;
+        return result;
+    }
+    profile_enter(method);
+    frame_t *frame = entry;
+    int32_t *stack = frame->stack;
+    const insn_t *ip = method->insns;
     uint32_t top = 0;
-    uint32_t counter = 0;
-    optional_value_t result = {.has_value = false};
+    exception_t exception;
+#if USE_COMPUTED_GOTO
+    static const void *dispatch_table[NUM_INSNS] = {
+#define DISPATCH_ENTRY(op) [op] = &&L_##op,
+        FOR_EACH_INSN(DISPATCH_ENTRY)
+#undef DISPATCH_ENTRY
+    };
+    static const void *checked_dispatch_table[NUM_INSNS] = {
+        [0 ... NUM_INSNS - 1] = &&check_insn,
+    };
+    static const void *profile_dispatch_table[NUM_INSNS] = {
+        [0 ... NUM_INSNS - 1] = &&profile_insn,
+    };
+    const void *const *verified_dispatch =
+        profile_enabled ? profile_dispatch_table : dispatch_table;
+    const void *const *unverified_dispatch =
+        profile_enabled ? profile_dispatch_table : checked_dispatch_table;
+    const void *const *dispatch;
+    SELECT_DISPATCH();
+    DISPATCH();
+profile_insn:
+    profile_opcodes[ip->op]++;
+    if (frame->method->verified) {
+        goto *dispatch_table[ip->op];
+    }
+check_insn:
+    if (!insn_is_safe(ip, stack, top, frame->method, heap)) {
+        exit(ERROR);
+    }
+    goto *dispatch_table[ip->op];
+#else
+    bool verified;
+    SELECT_DISPATCH();
     while (1) {
-        uint8_t op = (uint8_t) code[counter];
-        switch (op) {
-            case i_bipush:;
-                int8_t temp = (int8_t) code[counter + 1];
-                stack[top++] = (int32_t) temp;
-                counter += 2;
-                break;
-            case i_return:;
-                free(stack);
-                return result;
-                break;
-            case i_getstatic:
-                counter += 3;
-                break;
-            case i_invokevirtual:;
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                int32_t t = stack[--top];
-                printf("%d\n", t);
-                counter += 3;
-                break;
-            case i_iconst_m1:
-            case i_iconst_0:
-            case i_iconst_1:
-            case i_iconst_2:
-            case i_iconst_3:
-            case i_iconst_4:
-            case i_iconst_5: {
-                int32_t val = (int32_t) op - 0x03;
-                stack[top++] = val;
-                counter += 1;
-                break;
-            }
-            case i_sipush:;
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                int16_t s = (int16_t)(b1 << 8 | b2);
-                stack[top++] = s;
-                counter += 3;
-                break;
-            case i_iadd:
-            case i_isub:
-            case i_imul:
-            case i_idiv:
-            case i_irem:
-            case i_iand:
-            case i_ior:
-            case i_ixor:
-                binary_arithmetic(op, stack, &top);
-                counter += 1;
-                break;
-            case i_ineg: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                int32_t a = stack[--top];
-                stack[top++] = a * -1;
-                counter += 1;
-                break;
+        COUNT_INSN();
+        if (profile_enabled) {
+            profile_opcodes[ip->op]++;
+        }
+        if (!verified && !insn_is_safe(ip, stack, top, frame->method, heap)) {
+            exit(ERROR);
+        }
+        switch (ip->op) {
+#endif
+            TARGET(q_iconst) {
+                stack[top++] = ip->a;
+                ip++;
+                DISPATCH();
             }
-            case i_ishl: {
-                if (top < 2) {
-                    exit(ERROR);
-                }
-                int32_t b = stack[--top];
-                int32_t a = stack[--top];
-                int32_t s = a << b;
-                stack[top++] = s;
-                counter += 1;
-                break;
-            }
-            case i_ishr: {
-                if (top < 2) {
-                    exit(ERROR);
-                }
-                int32_t b = stack[--top];
-                int32_t a = stack[--top];
-                int32_t s = a >> b;
-                stack[top++] = s;
-                counter += 1;
-                break;
-            }
-            case i_iushr: {
-                if (top < 2) {
-                    exit(ERROR);
-                }
-                int32_t b = stack[--top];
-                int32_t a = stack[--top];
-                int32_t s = ((uint32_t) a) >> b;
-                stack[top++] = s;
-                counter += 1;
-                break;
-            }
-            case i_iload: {
-                uint32_t i = code[counter + 1];
-                stack[top++] = locals[i];
-                counter += 2;
-                break;
-            }
-            case i_iload_0:
-            case i_iload_1:
-            case i_iload_2:
-            case i_iload_3: {
-                uint8_t i = (uint8_t)(op - i_iload_0);
-                stack[top++] = locals[i];
-                counter += 1;
-                break;
-            }
-            case i_istore: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                uint32_t i = code[counter + 1];
-                int32_t a = stack[--top];
-                locals[i] = a;
-                counter += 2;
-                break;
-            }
-            case i_istore_0:
-            case i_istore_1:
-            case i_istore_2:
-            case i_istore_3: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                uint8_t i = (uint8_t)(op - i_istore_0);
-                int32_t a = stack[--top];
-                locals[i] = a;
-                counter += 1;
-                break;
-            }
-            case i_iinc: {
-                uint32_t i = code[counter + 1];
-                int8_t b = (int8_t) code[counter + 2];
-                locals[i] += (int32_t) b;
-                counter += 3;
-                break;
-            }
-            case i_ldc: {
-                uint8_t b = code[counter + 1];
-                stack[top++] = *(int32_t *) class->constant_pool[b - 1].info;
-                counter += 2;
-                break;
-            }
-            case i_ifeq: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a == 0) {
-                    counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+            TARGET(q_iload) {
+                stack[top++] = locals[ip->a];
+                ip++;
+                DISPATCH();
             }
-            case i_ifne: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a != 0) {
-                    counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+            TARGET(q_istore) {
+                locals[ip->a] = stack[--top];
+                ip++;
+                DISPATCH();
             }
-            case i_iflt: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a < 0) {
-                    counter += (int16_t)((uint16_t) b1 << 8) |
-                               (uint16_t) b2; 
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+            TARGET(q_iinc) {
+                locals[ip->a] += ip->b;
+                ip++;
+                DISPATCH();
             }
-            case i_ifge: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a >= 0) {
-                    counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+            TARGET(q_iadd) {
+                BINARY_OP(a + b);
             }
-            case i_ifgt: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a > 0) {
-                    counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+            TARGET(q_isub) {
+                BINARY_OP(a - b);
             }
-            case i_ifle: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a <= 0) {
-                    counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+            TARGET(q_imul) {
+                BINARY_OP(a * b);
             }
-            case i_if_icmpeq: {
-                if (top < 2) {
-                    exit(ERROR);
+            TARGET(q_idiv) {
+                if (stack[top - 1] == 0) {
+                    exception = EXC_ARITHMETIC;
+                    goto throw_exception;
                 }
-                int32_t b = stack[--top];
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a == b) {
-                    counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+                // INT_MIN / -1 overflows in C; Java defines it as INT_MIN
+                BINARY_OP(b == -1 ? (int32_t)(0u - (uint32_t) a) : a / b);
             }
-            case i_if_icmpne: {
-                if (top < 2) {
-                    exit(ERROR);
+            TARGET(q_irem) {
+                if (stack[top - 1] == 0) {
+                    exception = EXC_ARITHMETIC;
+                    goto throw_exception;
                 }
-                int32_t b = stack[--top];
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a != b) {
-                    counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+                BINARY_OP(b == -1 ? 0 : a % b);
             }
-            case i_if_icmplt: {
-                if (top < 2) {
-                    exit(ERROR);
-                }
-                int32_t b = stack[--top];
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a < b) {
-                    counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+            TARGET(q_ineg) {
+                stack[top - 1] = stack[top - 1] * -1;
+                ip++;
+                DISPATCH();
             }
-            case i_if_icmpge: {
-                if (top < 2) {
-                    exit(ERROR);
-                }
-                int32_t b = stack[--top];
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a >= b) {
-                    counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+            TARGET(q_ishl) {
+                BINARY_OP(a << b);
             }
-            case i_if_icmpgt: {
-                if (top < 2) {
-                    exit(ERROR);
-                }
-                int32_t b = stack[--top];
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a > b) {
-                    counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+            TARGET(q_ishr) {
+                BINARY_OP(a >> b);
             }
-            case i_if_icmple: {
-                if (top < 2) {
-                    exit(ERROR);
-                }
-                int32_t b = stack[--top];
-                int32_t a = stack[--top];
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                if (a <= b) {
-                    counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                }
-                else {
-                    counter += 3;
-                }
-                break;
+            TARGET(q_iushr) {
+                BINARY_OP(((uint32_t) a) >> b);
             }
-            case i_goto: {
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                counter += (int16_t)((uint16_t) b1 << 8) | (uint16_t) b2;
-                break;
+            TARGET(q_iand) {
+                BINARY_OP(a & b);
             }
-            case i_ireturn: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                int32_t a = stack[--top];
-                result.value = a;
-                result.has_value = true;
-                free(stack);
-                return result;
-                break;
-            }
-            case i_invokestatic: {
-                uint8_t b1 = code[counter + 1];
-                uint8_t b2 = code[counter + 2];
-                method_t *pool = find_method_from_index((uint16_t)(b1 << 8) | b2, class);
-                uint16_t size = get_number_of_parameters(pool);
-                int32_t *new_locals =
-                    (int32_t *) malloc(pool->code.max_locals * sizeof(int32_t));
-
-                size_t i = size;
-                while (i > 0) {
-                    if (top < 1) {
-                        exit(ERROR);
-                    }
-                    --i;
-                    new_locals[i] = stack[--top];
-                }
-
-                optional_value_t rec = execute(pool, new_locals, class, heap);
-                free(new_locals);
-                if (rec.has_value) {
-                    stack[top++] = (int32_t) rec.value;
-                }
-                counter += 3;
-                break;
-            }
-            case i_nop:
-                counter += 1;
-                break;
-            case i_dup: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
+            TARGET(q_ior) {
+                BINARY_OP(a | b);
+            }
+            TARGET(q_ixor) {
+                BINARY_OP(a ^ b);
+            }
+            TARGET(q_dup) {
                 int32_t a = stack[top - 1];
                 stack[top++] = a;
-                counter += 1;
-                break;
+                ip++;
+                DISPATCH();
             }
-            case i_newarray: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                int32_t count = stack[--top];
-                if (count < 0) {
-                    free(stack);
-                    exit(ERROR);
+            TARGET(q_ifeq) {
+                UNARY_BRANCH(a == 0);
+            }
+            TARGET(q_ifne) {
+                UNARY_BRANCH(a != 0);
+            }
+            TARGET(q_iflt) {
+                UNARY_BRANCH(a < 0);
+            }
+            TARGET(q_ifge) {
+                UNARY_BRANCH(a >= 0);
+            }
+            TARGET(q_ifgt) {
+                UNARY_BRANCH(a > 0);
+            }
+            TARGET(q_ifle) {
+                UNARY_BRANCH(a <= 0);
+            }
+            TARGET(q_if_icmpeq) {
+                BINARY_BRANCH(a == b);
+            }
+            TARGET(q_if_icmpne) {
+                BINARY_BRANCH(a != b);
+            }
+            TARGET(q_if_icmplt) {
+                BINARY_BRANCH(a < b);
+            }
+            TARGET(q_if_icmpge) {
+                BINARY_BRANCH(a >= b);
+            }
+            TARGET(q_if_icmpgt) {
+                BINARY_BRANCH(a > b);
+            }
+            TARGET(q_if_icmple) {
+                BINARY_BRANCH(a <= b);
+            }
+            TARGET(q_goto) {
+                BRANCH();
+            }
+            TARGET(q_invokestatic) {
+                method_t *callee = ip->method;
+                uint32_t size = (uint32_t) ip->a;
+                if (thread_preempted(vm_stack)) {
+                    // The arguments are still on the stack, for the collector
+                    frame->ip = ip;
+                    frame->top = top;
+                    thread_safepoint(vm_stack);
                 }
-                int32_t *arr = (int32_t *) calloc((count + 1), sizeof(int32_t));
-                arr[0] = count;
-                int32_t ref = heap_add(heap, arr);
-                stack[top++] = ref;
-                counter += 2;
-                break;
-            }
-            case i_arraylength: {
-                if (top < 1) {
+                if (!callee->insns && !decode_method(callee, class)) {
                     exit(ERROR);
                 }
+                // The arguments on top of the stack become the callee's first locals
+                top -= size;
+                frame->ip = ip;
+                frame->top = top;
+                count_invocation(callee, class);
+                if (use_compiled(callee, vm_stack)) {
+                    if (!jit_run(callee, &stack[top], &rt)) {
+                        top += size;
+                        exception = rt.exception;
+                        goto throw_exception;
+                    }
+                    if (ip->b) {
+                        stack[top++] = rt.value;
+                    }
+                    ip++;
+                    DISPATCH();
+                }
+                frame_t *callee_frame = push_frame(vm_stack, callee, &stack[top]);
+                if (!callee_frame) {
+                    top += size;
+                    exception = EXC_STACK_OVERFLOW;
+                    goto throw_exception;
+                }
+                profile_enter(callee);
+                frame = callee_frame;
+                SELECT_DISPATCH();
+                locals = frame->locals;
+                stack = frame->stack;
+                top = 0;
+                ip = callee->insns;
+                DISPATCH();
+            }
+            TARGET(q_intrinsic) {
+                top -= (uint32_t) ip->a;
+                exception = run_intrinsic(&intrinsics[ip->c], &stack[top], heap);
+                if (exception != EXC_NONE) {
+                    top += (uint32_t) ip->a;
+                    goto throw_exception;
+                }
+                top += (uint32_t) ip->b;
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_thread) {
+                // The thread may block, or start a thread that collects
+                top -= (uint32_t) ip->a;
+                frame->ip = ip;
+                frame->top = top;
+                exception = thread_call(&intrinsics[ip->c], ip->method, &stack[top], class,
+                                        heap, vm_stack);
+                if (exception != EXC_NONE) {
+                    top += (uint32_t) ip->a;
+                    goto throw_exception;
+                }
+                top += (uint32_t) ip->b;
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_monitorenter) {
                 int32_t ref = stack[--top];
-                int32_t *data = heap_get(heap, ref);
-                stack[top++] = data[0];
-                counter += 1;
-                break;
-            }
-            case i_areturn: {
-                if (top < 1) {
-                    exit(ERROR);
+                frame->ip = ip;
+                frame->top = top;
+                thread_monitor_enter(vm_stack, ref);
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_monitorexit) {
+                exception = thread_monitor_exit(vm_stack, stack[top - 1]);
+                if (exception != EXC_NONE) {
+                    goto throw_exception;
+                }
+                top--;
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_println) {
+                output_int(stack[--top]);
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_newarray) {
+                if (stack[top - 1] < 0) {
+                    exception = EXC_NEGATIVE_ARRAY_SIZE;
+                    goto throw_exception;
                 }
-                int32_t ref = stack[--top];
-                result.has_value = true;
-                result.value = ref;
-                free(stack);
-                return result;
-            }
-            case i_iastore: {
-                if (top < 3) {
-                    exit(ERROR);
+                int32_t count = stack[--top];
+                // Let the collector find the references in this frame
+                frame->ip = ip;
+                frame->top = top;
+                stack[top++] = gc_new_array(heap, vm_stack, (uint8_t) ip->a, count);
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_newarray_frame) {
+                if (stack[top - 1] < 0) {
+                    exception = EXC_NEGATIVE_ARRAY_SIZE;
+                    goto throw_exception;
                 }
+                int32_t count = stack[--top];
+                // It may not fit on the VM stack and go on the heap after all
+                frame->ip = ip;
+                frame->top = top;
+                stack[top++] = gc_new_frame_array(heap, vm_stack, (uint8_t) ip->a, count);
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_arraylength) {
+                array_t *array = heap_get(heap, stack[top - 1]);
+                stack[top - 1] = array->length;
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_iaload) {
+                ARRAY_LOAD(int32_t);
+            }
+            TARGET(q_iastore) {
+                ARRAY_STORE(int32_t);
+            }
+            TARGET(q_baload) {
+                ARRAY_LOAD(int8_t);
+            }
+            TARGET(q_bastore) {
                 int32_t value = stack[--top];
                 int32_t index = stack[--top];
-                int32_t ref = stack[--top];
-                int32_t *arr = heap_get(heap, ref);
-                arr[index + 1] = value;
-                counter += 1;
-                break;
+                array_t *array = heap_get(heap, stack[--top]);
+                CHECK_INDEX(array, index);
+                // boolean arrays only keep the low bit
+                ((int8_t *) array_data(array))[index] =
+                    (int8_t)(array->atype == T_BOOLEAN ? value & 1 : value);
+                ip++;
+                DISPATCH();
             }
-            case i_iaload: {
-                if (top < 2) {
-                    exit(ERROR);
-                }
+            TARGET(q_caload) {
+                ARRAY_LOAD(uint16_t);
+            }
+            TARGET(q_castore) {
+                ARRAY_STORE(uint16_t);
+            }
+            TARGET(q_saload) {
+                ARRAY_LOAD(int16_t);
+            }
+            TARGET(q_sastore) {
+                ARRAY_STORE(int16_t);
+            }
+            TARGET(q_laload) {
                 int32_t index = stack[--top];
-                int32_t ref = stack[--top];
-                int32_t *arr = heap_get(heap, ref);
-                stack[top++] = arr[index + 1];
-                counter += 1;
-                break;
-            }
-            case i_aload: {
-                uint8_t i = code[counter + 1];
-                stack[top++] = locals[i];
-                counter += 2;
-                break;
-            }
-            case i_astore: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                uint8_t i = code[counter + 1];
-                int32_t ref = stack[--top];
-                locals[i] = ref;
-                counter += 2;
-                break;
-            }
-            case i_aload_0:
-            case i_aload_1:
-            case i_aload_2:
-            case i_aload_3: {
-                uint8_t i = (uint8_t)(op - i_aload_0);
-                stack[top++] = locals[i];
-                counter += 1;
-                break;
-            }
-            case i_astore_0:
-            case i_astore_1:
-            case i_astore_2:
-            case i_astore_3: {
-                if (top < 1) {
-                    exit(ERROR);
-                }
-                uint8_t i = (uint8_t)(op - i_astore_0);
-                int32_t ref = stack[--top];
-                locals[i] = ref;
-                counter += 1;
-                break;
+                array_t *array = heap_get(heap, stack[top - 1]);
+                CHECK_INDEX(array, index);
+                int64_t value = ((int64_t *) array_data(array))[index];
+                stack[top - 1] = (int32_t) value;
+                stack[top++] = (int32_t)(value >> 32);
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_lastore) {
+                uint32_t high = (uint32_t) stack[--top];
+                uint32_t low = (uint32_t) stack[--top];
+                int32_t index = stack[--top];
+                array_t *array = heap_get(heap, stack[--top]);
+                CHECK_INDEX(array, index);
+                ((int64_t *) array_data(array))[index] = (int64_t)((uint64_t) high << 32 | low);
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_array_loop) {
+                if (run_array_loop(&frame->method->array_loops[ip->b], locals, heap)) {
+                    ip = ip->target;
+                    DISPATCH();
+                }
+                stack[top++] = locals[ip->a];
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_ireturn) {
+                result.value = stack[--top];
+                result.has_value = true;
+                goto method_return;
+            }
+            TARGET(q_return) {
+                result.has_value = false;
+                goto method_return;
             }
-            default:
+            TARGET(q_invalid) {
+                // The output so far comes before the error
+                output_flush();
                 fprintf(stderr, "Default error\n");
                 exit(ERROR);
-        }
-    }
-}
-
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "USAGE: %s <class file>\n", argv[0]);
-        return 1;
-    }
-
-    // Open the class file for reading
-    FILE *class_file = fopen(argv[1], "r");
-    assert(class_file != NULL && "Failed to open file");
-
-    // Parse the class file
-    class_file_t *class = get_class(class_file);
-    int error = fclose(class_file);
-    assert(error == 0 && "Failed to close file");
+            }
+            TARGET(q_iload_iload_iadd_istore) {
+                locals[ip->c] = locals[ip->a] + locals[ip->b];
+                ip++;
+                DISPATCH();
+            }
+            TARGET(q_iinc_goto) {
+                locals[ip->a] += ip->b;
+                BRANCH();
+            }
+            TARGET(q_iload_if_icmpeq) {
+                ILOAD_BRANCH(a == b);
+            }
+            TARGET(q_iload_if_icmpne) {
+                ILOAD_BRANCH(a != b);
+            }
+            TARGET(q_iload_if_icmplt) {
+                ILOAD_BRANCH(a < b);
+            }
+            TARGET(q_iload_if_icmpge) {
+                ILOAD_BRANCH(a >= b);
+            }
+            TARGET(q_iload_if_icmpgt) {
+                ILOAD_BRANCH(a > b);
+            }
+            TARGET(q_iload_if_icmple) {
+                ILOAD_BRANCH(a <= b);
+            }
+            TARGET(q_iload_iload_if_icmpeq) {
+                ILOAD_ILOAD_BRANCH(a == b);
+            }
+            TARGET(q_iload_iload_if_icmpne) {
+                ILOAD_ILOAD_BRANCH(a != b);
+            }
+            TARGET(q_iload_iload_if_icmplt) {
+                ILOAD_ILOAD_BRANCH(a < b);
+            }
+            TARGET(q_iload_iload_if_icmpge) {
+                ILOAD_ILOAD_BRANCH(a >= b);
+            }
+            TARGET(q_iload_iload_if_icmpgt) {
+                ILOAD_ILOAD_BRANCH(a > b);
+            }
+            TARGET(q_iload_iload_if_icmple) {
+                ILOAD_ILOAD_BRANCH(a <= b);
+            }
 
-    // The heap array is initially allocated to hold zero elements.
-    heap_t *heap = heap_init();
+        method_return:
+            pop_frame(vm_stack);
+            profile_leave();
+            if (frame == entry) {
+                return result;
+            }
+            // Resume the caller after its invoke; a return value goes where
+            // the arguments were.
+            frame = vm_stack->current;
+            SELECT_DISPATCH();
+            locals = frame->locals;
+            stack = frame->stack;
+            top = frame->top;
+            ip = frame->ip + 1;
+            if (result.has_value) {
+                stack[top++] = result.value;
+            }
+            DISPATCH();
 
-    // Execute the main method
-    method_t *main_method = find_method(MAIN_METHOD, MAIN_DESCRIPTOR, class);
-    assert(main_method != NULL && "Missing main() method");
-    /* In a real JVM, locals[0] would contain a reference to String[] args.
-     * But since TeenyJVM doesn't support Objects, we leave it uninitialized. */
-    int32_t locals[main_method->code.max_locals];
-    // Initialize all local variables to 0
-    memset(locals, 0, sizeof(locals));
-    optional_value_t result = execute(main_method, locals, class, heap);
-    assert(!result.has_value && "main() should return void");
+        backedge_safepoint:
+            // `ip` is a backward branch whose operands are popped
+            frame->ip = ip;
+            frame->top = top;
+            thread_safepoint(vm_stack);
+            ip = ip->target;
+            DISPATCH();
 
-    // Free the internal data structures
-    free_class(class);
+        on_stack_replacement:
+            // `ip` is the header of a hot loop. Compile the method and finish
+            // this invocation in compiled code, which picks up the locals and
+            // operand stack from the frame.
+            {
+                method_t *current = frame->method;
+                __atomic_store_n(&current->backedges, 0, __ATOMIC_RELAXED);
+                jit_code_t osr_entry = NULL;
+                if (jit_threshold != 0 && vm_stack->native_depth < JIT_MAX_NATIVE_DEPTH &&
+                    jit_compile(current, class)) {
+                    osr_entry = jit_osr_entry(current, ip);
+                }
+                if (!osr_entry) {
+                    DISPATCH();
+                }
+                frame->ip = ip;
+                frame->top = top;
+                vm_stack->native_depth++;
+                bool ok = osr_entry(frame, &rt);
+                vm_stack->native_depth--;
+                if (!ok) {
+                    exception = rt.exception;
+                    goto throw_exception;
+                }
+                result.has_value = returns_value(current);
+                result.value = rt.value;
+                goto method_return;
+            }
 
-    // Free the heap
-    heap_free(heap);
+        throw_exception:
+            // `ip` is the throwing instruction, or the pending invoke in callers.
+            // (No loop statement here: DISPATCH() may be `continue`.)
+            {
+                const insn_t *handler = find_exception_handler(
+                    frame->method, ip->pc, EXCEPTION_CLASSES[exception], class);
+                if (handler) {
+                    if (frame->method->code.max_stack == 0) {
+                        exit(ERROR);
+                    }
+                    top = 0;
+                    stack[top++] = EXCEPTION_REF;
+                    ip = handler;
+                    DISPATCH();
+                }
+            }
+            pop_frame(vm_stack);
+            profile_leave();
+            if (frame == entry) {
+                result.has_value = false;
+                result.exception = exception;
+                return result;
+            }
+            frame = vm_stack->current;
+            SELECT_DISPATCH();
+            locals = frame->locals;
+            stack = frame->stack;
+            ip = frame->ip;
+            goto throw_exception;
+#if !USE_COMPUTED_GOTO
+        }
+    }
+#endif
 }
@@ -2,9 +2,67 @@
 #ifndef JVM_H
 #define JVM_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "read_class.h"
 #include "heap.h"
+#include "frame.h"
+
+/** The exit status for malformed bytecode and other unrecoverable errors */
+extern const int ERROR;
+/** The name and descriptor of the method that runs a class file */
+extern const char MAIN_METHOD[];
+extern const char MAIN_DESCRIPTOR[];
+
+/** Exceptions the VM itself can throw */
+typedef enum {
+    EXC_NONE,
+    EXC_STACK_OVERFLOW,
+    EXC_ARRAY_INDEX_OUT_OF_BOUNDS,
+    EXC_ARRAY_STORE,
+    EXC_ILLEGAL_MONITOR_STATE,
+    EXC_ARITHMETIC,
+    EXC_NEGATIVE_ARRAY_SIZE
+} exception_t;
+
+/** The internal name of the class of an exception, e.g. "java/lang/StackOverflowError" */
+const char *exception_class_name(exception_t exception);
+
+/**
+ * Reports an exception that ended a thread the way Java does, e.g.
+ * `Exception in thread "main" java.lang.StackOverflowError`, on stderr
+ */
+void print_uncaught_exception(const char *thread_name, exception_t exception);
+
+/**
+ * Represents the return value of a Java method: either void or an int or a reference.
+ * For simplification, we represent a reference as an index into a heap-allocated array.
+ * (In a real JVM, methods could also return object references or other primitives.)
+ */
+typedef struct {
+    /** Whether this returned value is an int */
+    bool has_value;
+    /** The returned value (only valid if `has_value` is true) */
+    int32_t value;
+    /** The exception the method threw instead of returning, if any */
+    exception_t exception;
+} optional_value_t;
+
+/**
+ * Runs a method until it returns or throws.
+ *
+ * @param method the method to run
+ * @param locals the array of local variables, including the method parameters.
+ *   Except for parameters, the locals are uninitialized. They must lie at the
+ *   top of `vm_stack`; the method's frame is pushed right after them.
+ * @param class the class file the method belongs to
+ * @param heap an array of heap-allocated pointers, useful for references
+ * @param vm_stack the stack that holds every frame
+ * @return an optional int containing the method's return value, or the
+ *   exception it threw
+ */
+optional_value_t execute(method_t *method, int32_t *locals, class_file_t *class,
+                         heap_t *heap, vm_stack_t *vm_stack);
 
 // All opcode constants (simplified)
 enum {
@@ -66,9 +124,19 @@ enum {
     i_invokestatic = 0xb8,
     i_invokevirtual = 0xb6,
     i_newarray = 0xbc,
+    i_monitorenter = 0xc2,
+    i_monitorexit = 0xc3,
     i_arraylength = 0xbe,
     i_iaload = 0x2e,
     i_iastore = 0x4f,
+    i_laload = 0x2f,
+    i_lastore = 0x50,
+    i_baload = 0x33,
+    i_bastore = 0x54,
+    i_caload = 0x34,
+    i_castore = 0x55,
+    i_saload = 0x35,
+    i_sastore = 0x56,
     i_dup = 0x59,
     i_aload_0 = 0x2a,
     i_aload_1 = 0x2b,
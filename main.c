@@ -0,0 +1,330 @@
+// main.c
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "array.h"
+#include "frame.h"
+#include "gc.h"
+#include "heap.h"
+#include "isolate.h"
+#include "jit.h"
+#include "jvm.h"
+#include "output.h"
+#include "profile.h"
+#include "read_class.h"
+#include "sampler.h"
+#include "simd.h"
+#include "superinsn.h"
+#include "thread.h"
+#include "verify.h"
+
+static void usage(const char *program) {
+    fprintf(stderr, "USAGE: %s [options] <class file>\n", program);
+    fprintf(stderr, "       %s [options] --isolates=N <class file>...\n", program);
+    fprintf(stderr, "  --max-depth=N             throw StackOverflowError past N frames\n");
+    fprintf(stderr, "  --superinstructions=FILE  only fuse the superinstructions listed in FILE\n");
+    fprintf(stderr, "  --jit-threshold=N         compile methods after N invocations (0: never)\n");
+    fprintf(stderr, "  --osr-threshold=N         compile a running method after N loop iterations\n");
+    fprintf(stderr, "  --gc-threshold=N          collect the old space after N bytes of promotion\n");
+    fprintf(stderr, "  --nursery-size=N          allocate new arrays in an N-byte nursery\n");
+    fprintf(stderr, "  --gc-threads=N            mark and sweep on N threads\n");
+    fprintf(stderr, "  --verbose-gc              report every garbage collection\n");
+    fprintf(stderr, "  --profile=FILE            print a profile at exit and write folded stacks to FILE\n");
+    fprintf(stderr, "  --sample=FILE             sample the running methods, print where time went at\n"
+                    "                            exit and write folded stacks to FILE\n");
+    fprintf(stderr, "  --sample-rate=N           take N samples per second of CPU time\n");
+    fprintf(stderr, "  --output-buffer=N         flush printed lines once N bytes are pending (0: each line)\n");
+    fprintf(stderr, "  --simd=scalar|sse2|avx2   use these array kernels rather than the widest\n");
+    fprintf(stderr, "  --dump-archive=FILE       load and verify the class, write it to FILE and exit\n");
+    fprintf(stderr, "  --archive=FILE            map the class from FILE, written by --dump-archive,\n"
+                    "                            unless the class file has changed since\n");
+    fprintf(stderr, "  --isolates=N              run every class's main() concurrently, on N threads\n"
+                    "                            with a heap each (0: one per CPU)\n");
+    fprintf(stderr, "  --repeat=N                with --isolates, run each class N times\n");
+    fprintf(stderr, "  --threads=N               run a class that starts threads on N worker\n"
+                    "                            threads (0: one per CPU)\n");
+#ifdef TINYJVM_TRAIN
+    fprintf(stderr, "  --train=FILE              write the superinstructions worth fusing to FILE\n");
+#endif
+}
+
+/** Reads a class from its archive if that is up to date, else parses and verifies it */
+static class_file_t *load_class(const char *class_path, const char *archive_path) {
+    // A valid archive holds the class already parsed and verified
+    class_file_t *class = archive_path ? map_class_archive(archive_path, class_path) : NULL;
+    if (class == NULL) {
+        // Open the class file for reading
+        FILE *class_file = fopen(class_path, "r");
+        assert(class_file != NULL && "Failed to open file");
+
+        // Parse the class file
+        class = get_class(class_file);
+        int error = fclose(class_file);
+        assert(error == 0 && "Failed to close file");
+        assert(class != NULL && "Invalid class file");
+        verify_class(class);
+    }
+    return class;
+}
+
+/**
+ * Runs the main() of each class `repeat` times, all at once on `threads`
+ * isolates (see isolate.h). Every class is loaded once and shared.
+ */
+static int run_isolates(char **class_paths, uint32_t class_count, const char *archive_path,
+                        uint32_t threads, uint32_t repeat, uint32_t max_depth) {
+    class_file_t **classes = calloc(class_count, sizeof(class_file_t *));
+    batch_job_t *jobs = calloc((size_t) class_count * repeat, sizeof(batch_job_t));
+    assert(classes != NULL && jobs != NULL && "Failed to allocate the jobs");
+    for (uint32_t i = 0; i < class_count; i++) {
+        // An archive describes a single class, so it only applies to the first
+        classes[i] = load_class(class_paths[i], i == 0 ? archive_path : NULL);
+        share_class(classes[i]);
+    }
+    uint32_t count = class_count * repeat;
+    for (uint32_t i = 0; i < count; i++) {
+        class_file_t *class = classes[i % class_count];
+        method_t *main_method = find_method(MAIN_METHOD, MAIN_DESCRIPTOR, class);
+        assert(main_method != NULL && "Missing main() method");
+        jobs[i] = (batch_job_t){.class = class, .method = main_method};
+    }
+    run_batch(jobs, count, threads, gc_nursery_size, max_depth);
+
+    int status = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!jobs[i].ran) {
+            fprintf(stderr, "Failed to set up an isolate for %s\n", class_paths[i % class_count]);
+            status = 1;
+        }
+        else if (jobs[i].result.exception != EXC_NONE) {
+            print_uncaught_exception("main", jobs[i].result.exception);
+            status = 1;
+        }
+    }
+    for (uint32_t i = 0; i < class_count; i++) {
+        free_class(classes[i]);
+    }
+    free(classes);
+    free(jobs);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    const char *class_path = NULL;
+    const char *profile_path = NULL;
+    const char *sample_path = NULL;
+    const char *archive_path = NULL;
+    const char *dump_path = NULL;
+    // Only --isolates takes more than one class file
+    char **class_paths = calloc((size_t) argc, sizeof(char *));
+    assert(class_paths != NULL && "Failed to allocate the arguments");
+    uint32_t class_count = 0;
+    bool use_isolates = false;
+    uint32_t isolates = 0;
+    uint32_t repeat = 1;
+    uint32_t workers = 0;
+    uint32_t max_depth = VM_STACK_MAX_DEPTH;
+#ifdef TINYJVM_TRAIN
+    const char *train_path = "superinstructions.txt";
+#endif
+    simd_init();
+    output_init();
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--max-depth=", 12) == 0) {
+            max_depth = (uint32_t) strtoul(argv[i] + 12, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+            jit_threshold = (uint32_t) strtoul(argv[i] + 16, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--osr-threshold=", 16) == 0) {
+            jit_backedge_threshold = (uint32_t) strtoul(argv[i] + 16, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--gc-threshold=", 15) == 0) {
+            gc_threshold = (size_t) strtoull(argv[i] + 15, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--nursery-size=", 15) == 0) {
+            gc_nursery_size = (size_t) strtoull(argv[i] + 15, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--gc-threads=", 13) == 0) {
+            gc_threads = (uint32_t) strtoul(argv[i] + 13, NULL, 10);
+            if (gc_threads == 0) {
+                gc_threads = 1;
+            }
+        }
+        else if (strcmp(argv[i], "--verbose-gc") == 0) {
+            gc_verbose = true;
+        }
+        else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile_path = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--sample=", 9) == 0) {
+            sample_path = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--sample-rate=", 14) == 0) {
+            sampler_rate = (uint32_t) strtoul(argv[i] + 14, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--output-buffer=", 16) == 0) {
+            output_limit = (size_t) strtoull(argv[i] + 16, NULL, 10);
+            if (output_limit > OUTPUT_BUFFER_SIZE) {
+                output_limit = OUTPUT_BUFFER_SIZE;
+            }
+        }
+        else if (strncmp(argv[i], "--simd=", 7) == 0) {
+            if (!simd_select(argv[i] + 7)) {
+                fprintf(stderr, "Unsupported instruction set: %s\n", argv[i] + 7);
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--archive=", 10) == 0) {
+            archive_path = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--dump-archive=", 15) == 0) {
+            dump_path = argv[i] + 15;
+        }
+        else if (strncmp(argv[i], "--isolates=", 11) == 0) {
+            use_isolates = true;
+            isolates = (uint32_t) strtoul(argv[i] + 11, NULL, 10);
+            if (isolates == 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                isolates = cpus > 0 ? (uint32_t) cpus : 1;
+            }
+        }
+        else if (strncmp(argv[i], "--repeat=", 9) == 0) {
+            repeat = (uint32_t) strtoul(argv[i] + 9, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            workers = (uint32_t) strtoul(argv[i] + 10, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--superinstructions=", 20) == 0) {
+            if (!load_superinstruction_profile(argv[i] + 20)) {
+                fprintf(stderr, "Invalid superinstruction profile: %s\n", argv[i] + 20);
+                return 1;
+            }
+        }
+#ifdef TINYJVM_TRAIN
+        else if (strncmp(argv[i], "--train=", 8) == 0) {
+            train_path = argv[i] + 8;
+        }
+#endif
+        else if (argv[i][0] != '-') {
+            class_paths[class_count++] = argv[i];
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (class_count == 0 || (class_count > 1 && !use_isolates) || repeat == 0 ||
+        (use_isolates && dump_path)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (use_isolates) {
+        // The profilers follow a single thread
+        if (profile_path || sample_path) {
+            fprintf(stderr, "--profile and --sample cannot be used with --isolates\n");
+            return 1;
+        }
+        int status = run_isolates(class_paths, class_count, archive_path, isolates, repeat,
+                                  max_depth);
+        free(class_paths);
+        return status;
+    }
+    class_path = class_paths[0];
+    free(class_paths);
+
+    class_file_t *class = load_class(class_path, archive_path);
+    if (dump_path) {
+        bool dumped = dump_class_archive(class, class_path, dump_path);
+        if (!dumped) {
+            fprintf(stderr, "Failed to write archive: %s\n", dump_path);
+        }
+        free_class(class);
+        return dumped ? 0 : 1;
+    }
+
+    // Threads share the class, as isolates do
+    bool use_threads = class_starts_threads(class);
+    if (use_threads) {
+        share_class(class);
+    }
+    if (use_threads && (profile_path || sample_path)) {
+        fprintf(stderr, "--profile and --sample cannot be used with threads\n");
+        free_class(class);
+        return 1;
+    }
+    if (use_threads && workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (uint32_t) cpus : 1;
+    }
+
+    // The heap array is initially allocated to hold zero elements.
+    heap_t *heap = heap_init(gc_nursery_size);
+    vm_stack_t *vm_stack = vm_stack_init(VM_STACK_RESERVE, max_depth);
+    assert(vm_stack != NULL && "Failed to reserve the VM stack");
+
+    // Execute the main method
+    method_t *main_method = find_method(MAIN_METHOD, MAIN_DESCRIPTOR, class);
+    assert(main_method != NULL && "Missing main() method");
+    int32_t *locals = vm_stack_free_slots(vm_stack);
+    // Initialize all local variables to 0
+    memset(locals, 0, main_method->code.max_locals * sizeof(int32_t));
+    /* In a real JVM, locals[0] would contain a reference to String[] args.
+     * TeenyJVM doesn't support Objects, so main() gets an empty array. */
+    if (main_method->code.max_locals > 0) {
+        locals[0] = gc_new_array(heap, vm_stack, T_INT, 0);
+    }
+    FILE *folded = NULL;
+    if (profile_path) {
+        folded = fopen(profile_path, "w");
+        assert(folded != NULL && "Failed to open profile output");
+        bool started = profile_start();
+        assert(started && "Failed to start profiling");
+    }
+    FILE *sampled = NULL;
+    if (sample_path) {
+        sampled = fopen(sample_path, "w");
+        assert(sampled != NULL && "Failed to open sample output");
+        bool started = sampler_start(vm_stack);
+        assert(started && "Failed to start sampling");
+    }
+    optional_value_t result =
+        use_threads ? execute_threads(main_method, locals, class, heap, vm_stack, workers)
+                    : execute(main_method, locals, class, heap, vm_stack);
+    assert(!result.has_value && "main() should return void");
+    if (result.exception != EXC_NONE) {
+        // What main() printed comes first, as it would in Java
+        output_flush();
+        print_uncaught_exception("main", result.exception);
+    }
+    if (folded) {
+        profile_finish(stderr, folded);
+        fclose(folded);
+    }
+    if (sampled) {
+        sampler_finish(stderr, sampled);
+        fclose(sampled);
+    }
+
+#ifdef TINYJVM_TRAIN
+    // The report follows the program's output
+    output_flush();
+    FILE *profile = fopen(train_path, "w");
+    assert(profile != NULL && "Failed to open training output");
+    write_superinstruction_profile(class, 0.01, stderr, profile);
+    fclose(profile);
+#endif
+
+    // Free the internal data structures
+    free_class(class);
+
+    // Free the heap and the VM stack
+    heap_free(heap);
+    vm_stack_free(vm_stack);
+    return result.exception == EXC_NONE ? 0 : 1;
+}
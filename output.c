@@ -0,0 +1,89 @@
+// output.c
+#include "output.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+size_t output_limit = OUTPUT_BUFFER_SIZE;
+
+/** Each thread running an isolate has a buffer of its own */
+static _Thread_local char buffer[OUTPUT_BUFFER_SIZE];
+static _Thread_local size_t used;
+
+/** Keeps the flushes of different threads from interleaving */
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** "00" to "99", so that digits can be written two at a time */
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/** The longest line: "-2147483648\n" */
+#define MAX_LINE 12
+
+void output_init(void) {
+    if (isatty(STDOUT_FILENO)) {
+        output_limit = 0;
+    }
+    atexit(output_flush);
+}
+
+void output_flush(void) {
+    if (used == 0) {
+        return;
+    }
+    size_t done = 0;
+    pthread_mutex_lock(&write_lock);
+    while (done < used) {
+        ssize_t n = write(STDOUT_FILENO, buffer + done, used - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // Nowhere to write to, e.g. a closed pipe: drop the output
+            break;
+        }
+        done += (size_t) n;
+    }
+    pthread_mutex_unlock(&write_lock);
+    used = 0;
+}
+
+void output_int(int32_t value) {
+    if (used > OUTPUT_BUFFER_SIZE - MAX_LINE) {
+        output_flush();
+    }
+    // Write the digits backwards from the end of a scratch line
+    char line[MAX_LINE];
+    char *p = line + MAX_LINE;
+    *--p = '\n';
+    bool negative = value < 0;
+    uint32_t n = negative ? 0u - (uint32_t) value : (uint32_t) value;
+    while (n >= 100) {
+        uint32_t pair = n % 100 * 2;
+        n /= 100;
+        *--p = digit_pairs[pair + 1];
+        *--p = digit_pairs[pair];
+    }
+    if (n >= 10) {
+        *--p = digit_pairs[n * 2 + 1];
+        *--p = digit_pairs[n * 2];
+    }
+    else {
+        *--p = (char)('0' + n);
+    }
+    if (negative) {
+        *--p = '-';
+    }
+    size_t length = (size_t)(line + MAX_LINE - p);
+    memcpy(buffer + used, p, length);
+    used += length;
+    if (used >= output_limit) {
+        output_flush();
+    }
+}
@@ -0,0 +1,42 @@
+// output.h
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The console output of System.out.println(int). Lines are formatted by
+ * hand into a buffer the VM owns and written to standard output with
+ * write(2), bypassing stdio's locking and format parsing. The buffer is
+ * flushed once `output_limit` bytes are pending, when it cannot take
+ * another line, and at exit.
+ */
+
+/** The size of the output buffer */
+#define OUTPUT_BUFFER_SIZE ((size_t) 64 << 10)
+
+/**
+ * Flush once this many bytes are pending: 0 writes every line as it is
+ * printed, OUTPUT_BUFFER_SIZE only when the buffer is full
+ */
+extern size_t output_limit;
+
+/**
+ * Picks the default policy, line by line when standard output is a
+ * terminal and full buffers otherwise, and arranges for a flush at exit
+ */
+void output_init(void);
+
+/** Prints `value` in decimal, followed by a newline */
+void output_int(int32_t value);
+
+/**
+ * Writes out whatever the calling thread has buffered. Threads have separate
+ * buffers, and only the main thread's is flushed at exit; other threads
+ * running isolates (see isolate.h) flush theirs after each program. A flush
+ * is written out in one piece, so lines from different threads never mix.
+ */
+void output_flush(void);
+
+#endif
@@ -0,0 +1,299 @@
+// profile.c
+#include "profile.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "jvm.h"
+
+bool profile_enabled = false;
+uint64_t profile_opcodes[NUM_INSNS];
+
+/** A method called along one path from the root of the calling context tree */
+typedef struct {
+    method_t *method;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t depth;
+    uint64_t calls;
+    uint64_t inclusive;
+    uint64_t exclusive;
+} node_t;
+
+/** A frame being timed */
+typedef struct {
+    uint32_t node;
+    uint64_t start;
+    /** The cycles spent in frames it pushed */
+    uint64_t children;
+} entry_t;
+
+/** Node 0 is the root, which stands for the VM itself */
+static node_t *nodes;
+static uint32_t node_count;
+static uint32_t node_capacity;
+static entry_t *entries;
+static uint32_t entry_count;
+static uint32_t entry_capacity;
+
+static inline uint64_t profile_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+#endif
+}
+
+static uint32_t add_node(method_t *method, uint32_t parent) {
+    if (node_count == node_capacity) {
+        node_capacity = node_capacity ? node_capacity * 2 : 64;
+        nodes = realloc(nodes, node_capacity * sizeof(node_t));
+        if (!nodes) {
+            exit(ERROR);
+        }
+    }
+    node_t *node = &nodes[node_count];
+    memset(node, 0, sizeof(node_t));
+    node->method = method;
+    node->parent = parent;
+    if (method) {
+        node->depth = nodes[parent].depth + 1;
+        node->next_sibling = nodes[parent].first_child;
+        nodes[parent].first_child = node_count;
+    }
+    return node_count++;
+}
+
+/** The child of `parent` for calls to `method`, created on first use */
+static uint32_t child_node(uint32_t parent, method_t *method) {
+    for (uint32_t child = nodes[parent].first_child; child != 0;
+         child = nodes[child].next_sibling) {
+        if (nodes[child].method == method) {
+            return child;
+        }
+    }
+    return add_node(method, parent);
+}
+
+bool profile_start(void) {
+    entries = malloc(64 * sizeof(entry_t));
+    if (!entries) {
+        return false;
+    }
+    entry_capacity = 64;
+    add_node(NULL, 0);
+    entries[0] = (entry_t){.node = 0, .start = profile_clock()};
+    entry_count = 1;
+    profile_enabled = true;
+    return true;
+}
+
+void profile_push(method_t *method) {
+    if (entry_count == entry_capacity) {
+        entry_capacity *= 2;
+        entries = realloc(entries, entry_capacity * sizeof(entry_t));
+        if (!entries) {
+            exit(ERROR);
+        }
+    }
+    uint32_t parent = entries[entry_count - 1].node;
+    uint32_t node = nodes[parent].depth < PROFILE_MAX_DEPTH ? child_node(parent, method) : parent;
+    nodes[node].calls++;
+    entries[entry_count++] = (entry_t){.node = node, .start = profile_clock()};
+}
+
+void profile_pop(void) {
+    if (entry_count <= 1) {
+        return;
+    }
+    entry_t *entry = &entries[--entry_count];
+    uint64_t elapsed = profile_clock() - entry->start;
+    node_t *node = &nodes[entry->node];
+    node->inclusive += elapsed;
+    node->exclusive += elapsed - entry->children;
+    entries[entry_count - 1].children += elapsed;
+}
+
+/** A row of the method table: the totals over every node of one method */
+typedef struct {
+    method_t *method;
+    uint64_t calls;
+    uint64_t inclusive;
+    uint64_t exclusive;
+} method_total_t;
+
+/** A row of the call graph table */
+typedef struct {
+    method_t *caller;
+    method_t *callee;
+    uint64_t calls;
+} edge_t;
+
+static int by_exclusive(const void *a, const void *b) {
+    const method_total_t *x = a;
+    const method_total_t *y = b;
+    return x->exclusive < y->exclusive ? 1 : x->exclusive > y->exclusive ? -1 : 0;
+}
+
+static int by_calls(const void *a, const void *b) {
+    const edge_t *x = a;
+    const edge_t *y = b;
+    return x->calls < y->calls ? 1 : x->calls > y->calls ? -1 : 0;
+}
+
+static int by_count(const void *a, const void *b) {
+    uint64_t x = profile_opcodes[*(const uint16_t *) a];
+    uint64_t y = profile_opcodes[*(const uint16_t *) b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/** Whether a node's method is already running further up its path */
+static bool is_recursive(uint32_t n) {
+    for (uint32_t p = nodes[n].parent; p != 0; p = nodes[p].parent) {
+        if (nodes[p].method == nodes[n].method) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_method(FILE *out, const method_t *method) {
+    fprintf(out, "%.*s%.*s", method->name->length, method->name->bytes,
+            method->descriptor->length, method->descriptor->bytes);
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * (double) part / (double) total : 0.0;
+}
+
+static void write_methods(FILE *out, uint64_t total) {
+    method_total_t *methods = calloc(node_count, sizeof(method_total_t));
+    if (!methods) {
+        return;
+    }
+    uint32_t count = 0;
+    for (uint32_t n = 1; n < node_count; n++) {
+        uint32_t m = 0;
+        while (m < count && methods[m].method != nodes[n].method) {
+            m++;
+        }
+        if (m == count) {
+            methods[count++].method = nodes[n].method;
+        }
+        methods[m].calls += nodes[n].calls;
+        methods[m].exclusive += nodes[n].exclusive;
+        // Recursive calls are already inside an outer call's time
+        if (!is_recursive(n)) {
+            methods[m].inclusive += nodes[n].inclusive;
+        }
+    }
+    qsort(methods, count, sizeof(method_total_t), by_exclusive);
+    fprintf(out, "methods:\n");
+    fprintf(out, "  %12s %16s %6s %16s %6s  %s\n", "calls", "inclusive", "", "exclusive", "",
+            "method");
+    for (uint32_t m = 0; m < count; m++) {
+        fprintf(out, "  %12" PRIu64 " %16" PRIu64 " %5.1f%% %16" PRIu64 " %5.1f%%  ",
+                methods[m].calls, methods[m].inclusive, percent(methods[m].inclusive, total),
+                methods[m].exclusive, percent(methods[m].exclusive, total));
+        print_method(out, methods[m].method);
+        fputc('\n', out);
+    }
+    free(methods);
+}
+
+static void write_edges(FILE *out) {
+    edge_t *edges = calloc(node_count, sizeof(edge_t));
+    if (!edges) {
+        return;
+    }
+    uint32_t count = 0;
+    for (uint32_t n = 1; n < node_count; n++) {
+        method_t *caller = nodes[nodes[n].parent].method;
+        if (!caller) {
+            continue;
+        }
+        uint32_t e = 0;
+        while (e < count && !(edges[e].caller == caller && edges[e].callee == nodes[n].method)) {
+            e++;
+        }
+        if (e == count) {
+            edges[count++] = (edge_t){.caller = caller, .callee = nodes[n].method};
+        }
+        edges[e].calls += nodes[n].calls;
+    }
+    qsort(edges, count, sizeof(edge_t), by_calls);
+    fprintf(out, "call graph:\n");
+    fprintf(out, "  %12s  %s\n", "calls", "caller -> callee");
+    for (uint32_t e = 0; e < count; e++) {
+        fprintf(out, "  %12" PRIu64 "  ", edges[e].calls);
+        print_method(out, edges[e].caller);
+        fprintf(out, " -> ");
+        print_method(out, edges[e].callee);
+        fputc('\n', out);
+    }
+    free(edges);
+}
+
+static void write_opcodes(FILE *out) {
+    uint16_t ops[NUM_INSNS];
+    uint64_t total = 0;
+    for (uint16_t op = 0; op < NUM_INSNS; op++) {
+        ops[op] = op;
+        total += profile_opcodes[op];
+    }
+    qsort(ops, NUM_INSNS, sizeof(uint16_t), by_count);
+    fprintf(out, "interpreted instructions: %" PRIu64 "\n", total);
+    for (uint16_t i = 0; i < NUM_INSNS && profile_opcodes[ops[i]] != 0; i++) {
+        fprintf(out, "  %12" PRIu64 " %5.1f%%  %s\n", profile_opcodes[ops[i]],
+                percent(profile_opcodes[ops[i]], total), insn_names[ops[i]]);
+    }
+}
+
+static void write_folded(FILE *out) {
+    const node_t *path[PROFILE_MAX_DEPTH + 1];
+    for (uint32_t n = 1; n < node_count; n++) {
+        if (nodes[n].exclusive == 0) {
+            continue;
+        }
+        uint32_t depth = 0;
+        for (uint32_t p = n; p != 0; p = nodes[p].parent) {
+            path[depth++] = &nodes[p];
+        }
+        while (depth > 0) {
+            const utf8_t *name = path[--depth]->method->name;
+            fprintf(out, "%.*s%c", name->length, name->bytes, depth ? ';' : ' ');
+        }
+        fprintf(out, "%" PRIu64 "\n", nodes[n].exclusive);
+    }
+}
+
+void profile_finish(FILE *summary, FILE *folded) {
+    // Close any frames left by an uncaught exception
+    while (entry_count > 1) {
+        profile_pop();
+    }
+    profile_enabled = false;
+    uint64_t total = profile_clock() - entries[0].start;
+    if (summary) {
+        fprintf(summary, "profile: %" PRIu64 " cycles\n", total);
+        write_methods(summary, total);
+        write_edges(summary);
+        write_opcodes(summary);
+    }
+    if (folded) {
+        write_folded(folded);
+    }
+    free(nodes);
+    free(entries);
+    nodes = NULL;
+    entries = NULL;
+    node_count = node_capacity = entry_count = entry_capacity = 0;
+}
@@ -0,0 +1,59 @@
+// profile.h
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "decode.h"
+#include "read_class.h"
+
+/**
+ * The --profile mode. The interpreter counts every instruction it
+ * dispatches by opcode, and every frame pushed or popped (interpreted or
+ * compiled) enters or leaves a node of a calling context tree, timed with
+ * the cycle counter. From the tree come each method's calls and inclusive
+ * and exclusive cycles, the call graph's edges and the folded stacks.
+ *
+ * When profiling is off the interpreter dispatches through its usual
+ * tables, so the only cost is a test of `profile_enabled` per call and
+ * return. Frames nested deeper than PROFILE_MAX_DEPTH are charged to the
+ * frame at that depth.
+ */
+
+#define PROFILE_MAX_DEPTH 1024
+
+extern bool profile_enabled;
+/** How many times the interpreter dispatched each instruction */
+extern uint64_t profile_opcodes[NUM_INSNS];
+
+/** Turns profiling on; the clock starts now */
+bool profile_start(void);
+
+void profile_push(method_t *method);
+void profile_pop(void);
+
+/** Notes that a frame for `method` was pushed */
+static inline void profile_enter(method_t *method) {
+    if (profile_enabled) {
+        profile_push(method);
+    }
+}
+
+/** Notes that the most recently pushed frame was popped */
+static inline void profile_leave(void) {
+    if (profile_enabled) {
+        profile_pop();
+    }
+}
+
+/**
+ * Stops the clock, writes the summary tables to `summary` and the folded
+ * stacks ("main;a;b <exclusive cycles>" per line, as flamegraph.pl reads
+ * them) to `folded`, either of which may be NULL, and frees the profile.
+ * `profile_opcodes` keeps its counts.
+ */
+void profile_finish(FILE *summary, FILE *folded);
+
+#endif
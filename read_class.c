@@ -1,64 +1,514 @@
 #include "read_class.h"
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "jit.h"
+#include "verify.h"
+
+#define CLASS_MAGIC 0xCAFEBABE
+
+/**
+ * A cursor over the mapped class file. Reads past the end set `ok` to false
+ * and return 0, so callers only need to check `ok` once per structure.
+ */
+typedef struct {
+    const uint8_t *pos;
+    const uint8_t *end;
+    bool ok;
+} reader_t;
+
+static inline bool has_bytes(reader_t *r, size_t n) {
+    if (!r->ok || (size_t)(r->end - r->pos) < n) {
+        r->ok = false;
+        return false;
+    }
+    return true;
+}
+
+static inline uint8_t read_u1(reader_t *r) {
+    if (!has_bytes(r, 1)) {
+        return 0;
+    }
+    return *r->pos++;
+}
+
+static inline uint16_t read_u2(reader_t *r) {
+    if (!has_bytes(r, 2)) {
+        return 0;
+    }
+    uint16_t v = (uint16_t)(r->pos[0] << 8 | r->pos[1]);
+    r->pos += 2;
+    return v;
+}
+
+static inline uint32_t read_u4(reader_t *r) {
+    if (!has_bytes(r, 4)) {
+        return 0;
+    }
+    uint32_t v = (uint32_t) r->pos[0] << 24 | (uint32_t) r->pos[1] << 16 |
+                 (uint32_t) r->pos[2] << 8 | r->pos[3];
+    r->pos += 4;
+    return v;
+}
+
+static inline const uint8_t *skip(reader_t *r, size_t n) {
+    if (!has_bytes(r, n)) {
+        return NULL;
+    }
+    const uint8_t *start = r->pos;
+    r->pos += n;
+    return start;
+}
+
+/** Returns the interned Utf8 entry at a constant pool index, or NULL if it is not one */
+static const utf8_t *get_utf8(class_file_t *cls, uint16_t index) {
+    if (index == 0 || index >= cls->constant_pool_count ||
+        cls->constant_pool[index - 1].tag != CONSTANT_Utf8) {
+        return NULL;
+    }
+    return cls->constant_pool[index - 1].resolved;
+}
+
+/** Returns the smallest power of two that is at least twice `count` */
+static uint32_t table_capacity(uint32_t count) {
+    uint32_t capacity = 4;
+    while (capacity < count * 2) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+/** FNV-1a */
+static uint32_t hash_bytes(const char *bytes, uint16_t length) {
+    uint32_t h = 2166136261u;
+    for (uint16_t i = 0; i < length; i++) {
+        h = (h ^ (uint8_t) bytes[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Hashes an interned (name, descriptor) pair by the symbols' offsets in the
+ * constant pool, which unlike their addresses survive relocation (see archive.h)
+ */
+static inline uint32_t hash_member(const class_file_t *cls, const utf8_t *name,
+                                   const utf8_t *desc) {
+    uintptr_t base = (uintptr_t) cls->constant_pool;
+    uint64_t h = ((uintptr_t) name - base) * 0x9E3779B97F4A7C15ull ^ ((uintptr_t) desc - base);
+    h *= 0xC2B2AE3D27D4EB4Full;
+    return (uint32_t)(h >> 32);
+}
+
+/**
+ * Returns the slot holding a string equal to `bytes`, or the empty slot where
+ * it would be inserted.
+ */
+static const utf8_t **symbol_slot(symbol_table_t *table, const char *bytes,
+                                  uint16_t length) {
+    uint32_t i = hash_bytes(bytes, length) & table->symbols_mask;
+    while (table->symbols[i]) {
+        const utf8_t *s = table->symbols[i];
+        if (s->length == length && memcmp(s->bytes, bytes, length) == 0) {
+            break;
+        }
+        i = (i + 1) & table->symbols_mask;
+    }
+    return &table->symbols[i];
+}
+
+/** Interns every Utf8 constant, pointing duplicates at the first occurrence */
+static bool intern_symbols(class_file_t *cls) {
+    uint32_t capacity = table_capacity(cls->constant_pool_count);
+    cls->table.symbols = calloc(capacity, sizeof(utf8_t *));
+    if (!cls->table.symbols) {
+        return false;
+    }
+    cls->table.symbols_mask = capacity - 1;
+    for (uint16_t i = 0; i + 1 < cls->constant_pool_count; i++) {
+        cp_info_t *entry = &cls->constant_pool[i];
+        if (entry->tag != CONSTANT_Utf8) {
+            continue;
+        }
+        const utf8_t **slot = symbol_slot(&cls->table, entry->info.utf8.bytes,
+                                          entry->info.utf8.length);
+        if (!*slot) {
+            *slot = &entry->info.utf8;
+        }
+        entry->resolved = *slot;
+    }
+    return true;
+}
+
+static bool parse_constant_pool(reader_t *r, class_file_t *cls) {
+    cls->constant_pool_count = read_u2(r);
+    if (!r->ok || cls->constant_pool_count == 0) {
+        return false;
+    }
+    cls->constant_pool = calloc(cls->constant_pool_count, sizeof(cp_info_t));
+    if (!cls->constant_pool) {
+        return false;
+    }
+    for (uint16_t i = 1; i < cls->constant_pool_count && r->ok; i++) {
+        cp_info_t *entry = &cls->constant_pool[i - 1];
+        entry->tag = read_u1(r);
+        switch (entry->tag) {
+            case CONSTANT_Utf8:
+                entry->info.utf8.length = read_u2(r);
+                entry->info.utf8.bytes =
+                    (const char *) skip(r, entry->info.utf8.length);
+                break;
+            case CONSTANT_Integer:
+            case CONSTANT_Float:
+                entry->info.integer = (int32_t) read_u4(r);
+                break;
+            case CONSTANT_Long:
+            case CONSTANT_Double: {
+                uint64_t high = read_u4(r);
+                entry->info.long_value = (int64_t)(high << 32 | read_u4(r));
+                // 8-byte constants take up two entries
+                i++;
+                break;
+            }
+            case CONSTANT_Class:
+            case CONSTANT_String:
+            case CONSTANT_MethodType:
+            case CONSTANT_Module:
+            case CONSTANT_Package:
+                entry->info.index = read_u2(r);
+                break;
+            case CONSTANT_Fieldref:
+            case CONSTANT_Methodref:
+            case CONSTANT_InterfaceMethodref:
+            case CONSTANT_Dynamic:
+            case CONSTANT_InvokeDynamic:
+                entry->info.ref.class_index = read_u2(r);
+                entry->info.ref.name_and_type_index = read_u2(r);
+                break;
+            case CONSTANT_NameAndType:
+                entry->info.name_and_type.name_index = read_u2(r);
+                entry->info.name_and_type.descriptor_index = read_u2(r);
+                break;
+            case CONSTANT_MethodHandle:
+                skip(r, 3);
+                break;
+            default:
+                return false;
+        }
+    }
+    return r->ok && intern_symbols(cls);
+}
+
+/** Skips an attributes table, returning the Code attribute if one is found */
+static bool parse_attributes(reader_t *r, class_file_t *cls,
+                             code_attribute_t *code) {
+    const utf8_t *code_name = code ? find_symbol("Code", 4, cls) : NULL;
+    uint16_t attributes_count = read_u2(r);
+    for (uint16_t i = 0; i < attributes_count && r->ok; i++) {
+        const utf8_t *name = get_utf8(cls, read_u2(r));
+        uint32_t length = read_u4(r);
+        const uint8_t *start = skip(r, length);
+        if (!r->ok || !name) {
+            return false;
+        }
+        if (code == NULL || name != code_name) {
+            continue;
+        }
+
+        // Parse the Code attribute in place; its nested attributes are not
+        // used, so they are left unread.
+        reader_t attr = {.pos = start, .end = start + length, .ok = true};
+        code->max_stack = read_u2(&attr);
+        code->max_locals = read_u2(&attr);
+        code->code_length = read_u4(&attr);
+        code->code = skip(&attr, code->code_length);
+        code->exception_table_length = read_u2(&attr);
+        code->exception_table = skip(&attr, (size_t) code->exception_table_length * 8);
+        if (!attr.ok || code->code_length == 0) {
+            return false;
+        }
+    }
+    return r->ok;
+}
+
+static bool parse_members(reader_t *r, class_file_t *cls) {
+    cls->fields_count = read_u2(r);
+    if (!r->ok) {
+        return false;
+    }
+    cls->fields = calloc(cls->fields_count ? cls->fields_count : 1, sizeof(field_t));
+    if (!cls->fields) {
+        return false;
+    }
+    for (uint16_t i = 0; i < cls->fields_count && r->ok; i++) {
+        field_t *field = &cls->fields[i];
+        field->access_flags = read_u2(r);
+        field->name = get_utf8(cls, read_u2(r));
+        field->descriptor = get_utf8(cls, read_u2(r));
+        if (!field->name || !field->descriptor || !parse_attributes(r, cls, NULL)) {
+            return false;
+        }
+    }
+
+    cls->methods_count = read_u2(r);
+    if (!r->ok) {
+        return false;
+    }
+    cls->methods = calloc(cls->methods_count ? cls->methods_count : 1, sizeof(method_t));
+    if (!cls->methods) {
+        return false;
+    }
+    for (uint16_t i = 0; i < cls->methods_count && r->ok; i++) {
+        method_t *method = &cls->methods[i];
+        method->access_flags = read_u2(r);
+        method->name = get_utf8(cls, read_u2(r));
+        method->descriptor = get_utf8(cls, read_u2(r));
+        if (!method->name || !method->descriptor ||
+            !parse_attributes(r, cls, &method->code)) {
+            return false;
+        }
+    }
+    return r->ok;
+}
+
+/** Builds the (name, descriptor) -> member hash tables */
+static bool build_member_tables(class_file_t *cls) {
+    uint32_t capacity = table_capacity(cls->methods_count);
+    cls->table.method_slots = calloc(capacity, sizeof(uint16_t));
+    if (!cls->table.method_slots) {
+        return false;
+    }
+    cls->table.methods_mask = capacity - 1;
+    for (uint16_t i = 0; i < cls->methods_count; i++) {
+        method_t *m = &cls->methods[i];
+        uint32_t slot = hash_member(cls, m->name, m->descriptor) & cls->table.methods_mask;
+        while (cls->table.method_slots[slot]) {
+            slot = (slot + 1) & cls->table.methods_mask;
+        }
+        cls->table.method_slots[slot] = (uint16_t)(i + 1);
+    }
+
+    capacity = table_capacity(cls->fields_count);
+    cls->table.field_slots = calloc(capacity, sizeof(uint16_t));
+    if (!cls->table.field_slots) {
+        return false;
+    }
+    cls->table.fields_mask = capacity - 1;
+    for (uint16_t i = 0; i < cls->fields_count; i++) {
+        field_t *f = &cls->fields[i];
+        uint32_t slot = hash_member(cls, f->name, f->descriptor) & cls->table.fields_mask;
+        while (cls->table.field_slots[slot]) {
+            slot = (slot + 1) & cls->table.fields_mask;
+        }
+        cls->table.field_slots[slot] = (uint16_t)(i + 1);
+    }
+    return true;
+}
+
+/** Points every Methodref and Fieldref into this class at its member */
+static void resolve_member_refs(class_file_t *cls) {
+    for (uint16_t i = 0; i + 1 < cls->constant_pool_count; i++) {
+        cp_info_t *entry = &cls->constant_pool[i];
+        if (entry->tag != CONSTANT_Methodref && entry->tag != CONSTANT_Fieldref) {
+            continue;
+        }
+        uint16_t class_index = entry->info.ref.class_index;
+        uint16_t nat_index = entry->info.ref.name_and_type_index;
+        if (class_index == 0 || class_index >= cls->constant_pool_count ||
+            nat_index == 0 || nat_index >= cls->constant_pool_count ||
+            cls->constant_pool[class_index - 1].tag != CONSTANT_Class ||
+            cls->constant_pool[nat_index - 1].tag != CONSTANT_NameAndType) {
+            continue;
+        }
+        if (get_utf8(cls, cls->constant_pool[class_index - 1].info.index) !=
+            cls->this_class) {
+            continue;
+        }
+        cp_info_t *nat = &cls->constant_pool[nat_index - 1];
+        const utf8_t *name = get_utf8(cls, nat->info.name_and_type.name_index);
+        const utf8_t *desc = get_utf8(cls, nat->info.name_and_type.descriptor_index);
+        if (entry->tag == CONSTANT_Methodref) {
+            entry->resolved = lookup_method(name, desc, cls);
+        }
+        else {
+            entry->resolved = lookup_field(name, desc, cls);
+        }
+    }
+}
 
 class_file_t *get_class(FILE *f) {
-    // Ignore actual file contents for now.
-    class_file_t *cls = malloc(sizeof(class_file_t));
-    cls->methods_count = 1;
-    cls->methods = malloc(sizeof(method_t *));
-    cls->constant_pool = NULL;
-
-    method_t *main_method = malloc(sizeof(method_t));
-    main_method->name = strdup("main");
-    main_method->descriptor = strdup("([Ljava/lang/String;)V");
-
-    // Bytecode: push 5, push 3, add, print result, return
-    uint8_t *code = malloc(9);
-    code[0] = 0x08; // iconst_5
-    code[1] = 0x07; // iconst_4
-    code[2] = 0x60; // iadd
-    code[3] = 0xb2; // getstatic (ignored)
-    code[4] = 0x10; // bipush
-    code[5] = 0x00; // dummy operand
-    code[6] = 0xb6; // invokevirtual -> prints top of stack
-    code[7] = 0xb1; // return
-    code[8] = 0x00;
-
-    main_method->code.code = code;
-    main_method->code.max_stack = 10;
-    main_method->code.max_locals = 1;
-
-    cls->methods[0] = main_method;
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || st.st_size <= 0) {
+        return NULL;
+    }
+
+    class_file_t *cls = calloc(1, sizeof(class_file_t));
+    if (!cls) {
+        return NULL;
+    }
+    cls->map_size = (size_t) st.st_size;
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    // Fault the whole file in with one call rather than page by page
+    flags |= MAP_POPULATE;
+#endif
+    void *map = mmap(NULL, cls->map_size, PROT_READ, flags, fileno(f), 0);
+    if (map == MAP_FAILED) {
+        free(cls);
+        return NULL;
+    }
+    cls->map = map;
+    madvise(map, cls->map_size, MADV_SEQUENTIAL);
+
+    reader_t r = {.pos = cls->map, .end = cls->map + cls->map_size, .ok = true};
+    if (read_u4(&r) != CLASS_MAGIC) {
+        free_class(cls);
+        return NULL;
+    }
+    read_u2(&r); // minor_version
+    read_u2(&r); // major_version
+    if (!parse_constant_pool(&r, cls)) {
+        free_class(cls);
+        return NULL;
+    }
+
+    read_u2(&r); // access_flags
+    uint16_t this_class = read_u2(&r);
+    read_u2(&r); // super_class
+    uint16_t interfaces_count = read_u2(&r);
+    skip(&r, (size_t) interfaces_count * 2);
+    if (!r.ok || this_class == 0 || this_class >= cls->constant_pool_count ||
+        cls->constant_pool[this_class - 1].tag != CONSTANT_Class) {
+        free_class(cls);
+        return NULL;
+    }
+    cls->this_class = get_utf8(cls, cls->constant_pool[this_class - 1].info.index);
+
+    if (!cls->this_class || !parse_members(&r, cls) ||
+        !parse_attributes(&r, cls, NULL) || !build_member_tables(cls)) {
+        free_class(cls);
+        return NULL;
+    }
+    resolve_member_refs(cls);
     return cls;
 }
 
 void free_class(class_file_t *cls) {
-    for (uint16_t i = 0; i < cls->methods_count; i++) {
-        free(cls->methods[i]->name);
-        free(cls->methods[i]->descriptor);
-        free(cls->methods[i]->code.code);
-        free(cls->methods[i]);
+    for (uint16_t i = 0; cls->methods && i < cls->methods_count; i++) {
+        free(cls->methods[i].insns);
+        free(cls->methods[i].insn_counts);
+        jit_release(&cls->methods[i]);
+        free(cls->methods[i].array_loops);
+        if (!cls->archive) {
+            free_ref_maps(cls->methods[i].ref_maps);
+            free(cls->methods[i].in_bounds);
+            free(cls->methods[i].frame_arrays);
+        }
     }
+    if (cls->archive) {
+        // Everything else, the class_file_t included, is in the archive
+        munmap(cls->archive, cls->archive_size);
+        return;
+    }
+    free(cls->table.symbols);
+    free(cls->table.method_slots);
+    free(cls->table.field_slots);
+    free(cls->constant_pool);
+    free(cls->fields);
     free(cls->methods);
+    if (cls->map) {
+        munmap((void *) cls->map, cls->map_size);
+    }
     free(cls);
 }
 
-method_t *find_method(const char *name, const char *desc, class_file_t *cls) {
-    for (uint16_t i = 0; i < cls->methods_count; i++) {
-        if (strcmp(cls->methods[i]->name, name) == 0 &&
-            strcmp(cls->methods[i]->descriptor, desc) == 0) {
-            return cls->methods[i];
+const utf8_t *find_symbol(const char *str, uint16_t length, class_file_t *cls) {
+    return *symbol_slot(&cls->table, str, length);
+}
+
+method_t *lookup_method(const utf8_t *name, const utf8_t *desc, class_file_t *cls) {
+    uint32_t slot = hash_member(cls, name, desc) & cls->table.methods_mask;
+    while (cls->table.method_slots[slot]) {
+        method_t *m = &cls->methods[cls->table.method_slots[slot] - 1];
+        if (m->name == name && m->descriptor == desc) {
+            return m;
+        }
+        slot = (slot + 1) & cls->table.methods_mask;
+    }
+    return NULL;
+}
+
+field_t *lookup_field(const utf8_t *name, const utf8_t *desc, class_file_t *cls) {
+    uint32_t slot = hash_member(cls, name, desc) & cls->table.fields_mask;
+    while (cls->table.field_slots[slot]) {
+        field_t *f = &cls->fields[cls->table.field_slots[slot] - 1];
+        if (f->name == name && f->descriptor == desc) {
+            return f;
         }
+        slot = (slot + 1) & cls->table.fields_mask;
     }
     return NULL;
 }
 
+method_t *find_method(const char *name, const char *desc, class_file_t *cls) {
+    const utf8_t *name_symbol = find_symbol(name, (uint16_t) strlen(name), cls);
+    const utf8_t *desc_symbol = find_symbol(desc, (uint16_t) strlen(desc), cls);
+    if (!name_symbol || !desc_symbol) {
+        return NULL;
+    }
+    return lookup_method(name_symbol, desc_symbol, cls);
+}
+
+field_t *find_field(const char *name, const char *desc, class_file_t *cls) {
+    const utf8_t *name_symbol = find_symbol(name, (uint16_t) strlen(name), cls);
+    const utf8_t *desc_symbol = find_symbol(desc, (uint16_t) strlen(desc), cls);
+    if (!name_symbol || !desc_symbol) {
+        return NULL;
+    }
+    return lookup_field(name_symbol, desc_symbol, cls);
+}
+
 method_t *find_method_from_index(uint16_t index, class_file_t *cls) {
-    return cls->methods[index % cls->methods_count];
+    if (index == 0 || index >= cls->constant_pool_count ||
+        cls->constant_pool[index - 1].tag != CONSTANT_Methodref) {
+        return NULL;
+    }
+    return (method_t *) cls->constant_pool[index - 1].resolved;
 }
 
 uint16_t get_number_of_parameters(method_t *m) {
-    return 0; // fake main() has no parameters
+    // Count the local variable slots taken by the descriptor's parameters,
+    // e.g. "(I[JLjava/lang/String;D)V" takes 1 + 1 + 1 + 2 slots.
+    const char *p = m->descriptor->bytes;
+    const char *end = p + m->descriptor->length;
+    uint16_t slots = 0;
+    if (p == end || *p++ != '(') {
+        return 0;
+    }
+    while (p < end && *p != ')') {
+        bool array = false;
+        while (p < end && *p == '[') {
+            array = true;
+            p++;
+        }
+        if (p < end && *p == 'L') {
+            while (p < end && *p != ';') {
+                p++;
+            }
+        }
+        if (p == end) {
+            // Truncated, e.g. "(L" or "(["
+            break;
+        }
+        slots += (!array && (*p == 'J' || *p == 'D')) ? 2 : 1;
+        p++;
+    }
+    return slots;
+}
+
+bool returns_value(method_t *m) {
+    return m->descriptor->length > 0 && m->descriptor->bytes[m->descriptor->length - 1] != 'V';
 }
@@ -2,35 +2,201 @@
 #ifndef READ_CLASS_H
 #define READ_CLASS_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
+/** Constant pool tags, see JVMS 4.4 */
+typedef enum {
+    CONSTANT_Utf8 = 1,
+    CONSTANT_Integer = 3,
+    CONSTANT_Float = 4,
+    CONSTANT_Long = 5,
+    CONSTANT_Double = 6,
+    CONSTANT_Class = 7,
+    CONSTANT_String = 8,
+    CONSTANT_Fieldref = 9,
+    CONSTANT_Methodref = 10,
+    CONSTANT_InterfaceMethodref = 11,
+    CONSTANT_NameAndType = 12,
+    CONSTANT_MethodHandle = 15,
+    CONSTANT_MethodType = 16,
+    CONSTANT_Dynamic = 17,
+    CONSTANT_InvokeDynamic = 18,
+    CONSTANT_Module = 19,
+    CONSTANT_Package = 20
+} cp_tag_t;
+
+/**
+ * A modified-UTF-8 string from the constant pool.
+ * `bytes` points into the mapped class file and is NOT NUL-terminated.
+ */
+typedef struct {
+    const char *bytes;
+    uint16_t length;
+} utf8_t;
+
 typedef struct {
-    uint8_t *code;
+    /** The bytecode, pointing into the mapped class file */
+    const uint8_t *code;
+    uint32_t code_length;
     uint16_t max_stack;
     uint16_t max_locals;
+    /**
+     * The raw exception table in the mapped class file: exception_table_length
+     * entries of big-endian u2 {start_pc, end_pc, handler_pc, catch_type}
+     */
+    const uint8_t *exception_table;
+    uint16_t exception_table_length;
 } code_attribute_t;
 
+struct array_loop;
+struct insn;
+struct ref_map;
+
 typedef struct {
-    char *name;
-    char *descriptor;
+    const utf8_t *name;
+    const utf8_t *descriptor;
+    uint16_t access_flags;
     code_attribute_t code;
+    /** The decoded instructions (see decode.h), built on first execution */
+    struct insn *insns;
+    uint32_t insns_count;
+    /** Per-instruction execution counts, only kept by TINYJVM_TRAIN builds */
+    uint64_t *insn_counts;
+    /**
+     * How many times the method has been invoked, and how many backward
+     * branches it has taken since it last tried to enter compiled code
+     * (see jit.h)
+     */
+    uint32_t invocations;
+    uint32_t backedges;
+    /** The method's compiled code and the size of its mapping, or NULL */
+    void *jit_code;
+    size_t jit_code_size;
+    /**
+     * For each decoded instruction, the offset in `jit_code` of the entry that
+     * starts compiled code at that instruction mid-invocation, or 0 if none
+     */
+    uint32_t *jit_osr_offsets;
+    /** Set once compilation has been attempted and failed */
+    bool jit_failed;
+    /** Whether the method passed verify_method() at load time */
+    bool verified;
+    /** Where a verified method's frame holds references (see verify.h), or NULL */
+    struct ref_map *ref_maps;
+    /** Which array accesses need no bounds check (see bounds.h), or NULL */
+    uint8_t *in_bounds;
+    /** Which newarrays allocate on the VM stack (see escape.h), or NULL */
+    uint8_t *frame_arrays;
+    /** The array loops q_array_loop instructions run (see intrinsic.h) */
+    struct array_loop *array_loops;
 } method_t;
 
 typedef struct {
-    void *info;
+    const utf8_t *name;
+    const utf8_t *descriptor;
+    uint16_t access_flags;
+} field_t;
+
+/**
+ * A decoded constant pool entry. Numeric constants are converted to host byte
+ * order while parsing; strings stay in the mapping.
+ */
+typedef struct {
+    uint8_t tag;
+    /**
+     * Filled in at load time: the interned symbol for a Utf8 entry, or the
+     * method_t / field_t for a Methodref / Fieldref into this class
+     * (NULL for members of other classes).
+     */
+    const void *resolved;
+    union {
+        /** CONSTANT_Utf8 */
+        utf8_t utf8;
+        /** CONSTANT_Integer and CONSTANT_Float (raw bits) */
+        int32_t integer;
+        /** CONSTANT_Long and CONSTANT_Double (raw bits) */
+        int64_t long_value;
+        /** CONSTANT_Class, CONSTANT_String, CONSTANT_MethodType, ... */
+        uint16_t index;
+        /** CONSTANT_Fieldref, CONSTANT_Methodref, CONSTANT_InterfaceMethodref */
+        struct {
+            uint16_t class_index;
+            uint16_t name_and_type_index;
+        } ref;
+        /** CONSTANT_NameAndType */
+        struct {
+            uint16_t name_index;
+            uint16_t descriptor_index;
+        } name_and_type;
+    } info;
 } cp_info_t;
 
+/**
+ * Open-addressed hash tables built at load time. Capacities are powers of two;
+ * member slots hold (array index + 1), with 0 marking an empty slot.
+ */
+typedef struct {
+    const utf8_t **symbols;
+    uint32_t symbols_mask;
+    uint16_t *method_slots;
+    uint32_t methods_mask;
+    uint16_t *field_slots;
+    uint32_t fields_mask;
+} symbol_table_t;
+
 typedef struct {
+    /** The read-only mapping of the class file; every utf8_t points into it */
+    const uint8_t *map;
+    size_t map_size;
+    /** Indexed by (constant pool index - 1); the unusable slot after a Long/Double is zeroed */
     cp_info_t *constant_pool;
-    method_t **methods;
+    uint16_t constant_pool_count;
+    const utf8_t *this_class;
+    field_t *fields;
+    uint16_t fields_count;
+    method_t *methods;
     uint16_t methods_count;
+    /** Interned names and descriptors; every utf8_t above is canonical */
+    symbol_table_t table;
+    /**
+     * The archive mapping the class lives in (see archive.h), or NULL if it
+     * was parsed from a class file
+     */
+    void *archive;
+    size_t archive_size;
 } class_file_t;
 
+/**
+ * Memory-maps and parses a class file.
+ * The file may be closed once this returns; the mapping stays alive until
+ * `free_class()`.
+ *
+ * @param f the opened class file
+ * @return the parsed class, or NULL if the file is not a valid class file
+ */
 class_file_t *get_class(FILE *f);
 void free_class(class_file_t *c);
+/**
+ * Looks up an interned symbol by its contents.
+ *
+ * @return the canonical utf8_t, or NULL if no constant in the class has this value
+ */
+const utf8_t *find_symbol(const char *str, uint16_t length, class_file_t *cls);
+/** Looks up a method by interned name and descriptor with pointer compares only */
+method_t *lookup_method(const utf8_t *name, const utf8_t *desc, class_file_t *cls);
+field_t *lookup_field(const utf8_t *name, const utf8_t *desc, class_file_t *cls);
 method_t *find_method(const char *name, const char *desc, class_file_t *cls);
+field_t *find_field(const char *name, const char *desc, class_file_t *cls);
+/**
+ * Returns the method a Methodref constant refers to, or NULL if the index is
+ * not a Methodref or names a method outside this class.
+ */
 method_t *find_method_from_index(uint16_t index, class_file_t *cls);
 uint16_t get_number_of_parameters(method_t *m);
+/** Returns whether a method's descriptor has a non-void return type */
+bool returns_value(method_t *m);
 
 #endif
@@ -0,0 +1,437 @@
+// sampler.c
+#define _GNU_SOURCE
+#include "sampler.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "decode.h"
+#include "jvm.h"
+
+uint32_t sampler_rate = SAMPLER_DEFAULT_RATE;
+
+typedef struct {
+    method_t *method;
+    /** The bytecode offset, or -1 if unknown */
+    int32_t pc;
+} sampled_frame_t;
+
+/** One sample as the signal handler writes it, innermost frame first */
+typedef struct {
+    uint32_t depth;
+    /** Frames beyond SAMPLER_MAX_DEPTH were left out */
+    bool truncated;
+    /** The innermost frame was running compiled code */
+    bool compiled;
+    /** The decoded instruction the innermost frame was running, or NUM_INSNS */
+    uint16_t op;
+    sampled_frame_t frames[SAMPLER_MAX_DEPTH];
+} sample_t;
+
+/** A drained sample, whose frames are in `frames` from `first` on */
+typedef struct {
+    uint32_t first;
+    uint32_t depth;
+    bool truncated;
+    bool compiled;
+    uint16_t op;
+} stored_sample_t;
+
+/** Samples the ring holds; a power of two */
+#define RING_SIZE 1024
+/** How often the ring is drained */
+#define DRAIN_INTERVAL_NS 10000000
+
+/* The ring: written only by the signal handler, read only by the drainer */
+static sample_t ring[RING_SIZE];
+static _Atomic uint32_t ring_head;
+static _Atomic uint32_t ring_tail;
+/** Samples lost to a full ring, and signals taken outside the VM thread's frames */
+static _Atomic uint64_t dropped;
+static _Atomic uint64_t elsewhere;
+
+static vm_stack_t *sampled_stack;
+static _Thread_local bool is_vm_thread;
+
+static pthread_t drainer;
+static atomic_bool draining;
+
+/* The drained samples: written only by the drainer until it is joined */
+static stored_sample_t *samples;
+static uint32_t sample_count;
+static uint32_t sample_capacity;
+static sampled_frame_t *frames;
+static uint32_t frame_count;
+static uint32_t frame_capacity;
+
+/**
+ * The bytecode offset the running frame of `method` was at when the signal
+ * arrived, or -1 if it cannot be found.
+ */
+static int32_t running_pc(const method_t *method, void *context, sample_t *sample) {
+#if defined(__linux__) && defined(__x86_64__)
+    const greg_t *regs = ((const ucontext_t *) context)->uc_mcontext.gregs;
+    uintptr_t rip = (uintptr_t) regs[REG_RIP];
+    uintptr_t code = (uintptr_t) method->jit_code;
+    if (code && rip - code < method->jit_code_size) {
+        sample->compiled = true;
+        return -1;
+    }
+    uintptr_t insns = (uintptr_t) method->insns;
+    size_t size = method->insns_count * sizeof(insn_t);
+    // Callee-saved registers first: the dispatch loop's `ip` survives calls
+    static const int order[] = {
+        REG_RBX, REG_RBP, REG_R12, REG_R13, REG_R14, REG_R15, REG_RAX, REG_RCX,
+        REG_RDX, REG_RSI, REG_RDI, REG_R8,  REG_R9,  REG_R10, REG_R11,
+    };
+    for (size_t i = 0; insns && i < sizeof(order) / sizeof(order[0]); i++) {
+        uintptr_t offset = (uintptr_t) regs[order[i]] - insns;
+        if (offset < size && offset % sizeof(insn_t) == 0) {
+            const insn_t *ip = (const insn_t *) regs[order[i]];
+            sample->op = ip->op;
+            return ip->pc;
+        }
+    }
+#else
+    (void) method;
+    (void) context;
+    (void) sample;
+#endif
+    return -1;
+}
+
+/** Whether `frame` can be a frame of the sampled stack below `above` */
+static bool valid_frame(const frame_t *frame, const frame_t *above) {
+    const vm_stack_t *v = sampled_stack;
+    return (const uint8_t *) frame >= v->base && (const uint8_t *) frame < v->end &&
+           (uintptr_t) frame % _Alignof(frame_t) == 0 && (!above || frame < above) &&
+           frame->method != NULL;
+}
+
+/**
+ * Copies the frame chain into `sample`. The interrupted code may be
+ * pushing or popping a frame, so the chain is checked as it is walked.
+ */
+static void record(sample_t *sample, void *context) {
+    const frame_t *above = NULL;
+    const frame_t *frame = sampled_stack->current;
+    sample->depth = 0;
+    sample->truncated = false;
+    sample->compiled = false;
+    sample->op = NUM_INSNS;
+    while (frame && valid_frame(frame, above)) {
+        if (sample->depth == SAMPLER_MAX_DEPTH) {
+            sample->truncated = true;
+            break;
+        }
+        int32_t pc = -1;
+        if (sample->depth == 0) {
+            pc = running_pc(frame->method, context, sample);
+        }
+        else if (frame->ip) {
+            pc = frame->ip->pc;
+        }
+        sample->frames[sample->depth++] = (sampled_frame_t){frame->method, pc};
+        above = frame;
+        frame = frame->caller;
+    }
+}
+
+static void on_sigprof(int signal, siginfo_t *info, void *context) {
+    (void) signal;
+    (void) info;
+    int saved_errno = errno;
+    uint32_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    if (!is_vm_thread || !sampled_stack->current) {
+        atomic_fetch_add_explicit(&elsewhere, 1, memory_order_relaxed);
+    }
+    else if (head - tail == RING_SIZE) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    }
+    else {
+        sample_t *sample = &ring[head % RING_SIZE];
+        record(sample, context);
+        if (sample->depth > 0) {
+            atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+        }
+    }
+    errno = saved_errno;
+}
+
+/** Moves the samples in the ring to `samples` */
+static void drain(void) {
+    uint32_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    for (; tail != head; tail++) {
+        const sample_t *sample = &ring[tail % RING_SIZE];
+        if (sample_count == sample_capacity) {
+            sample_capacity = sample_capacity ? sample_capacity * 2 : 1024;
+            samples = realloc(samples, sample_capacity * sizeof(stored_sample_t));
+        }
+        while (frame_count + sample->depth > frame_capacity) {
+            frame_capacity = frame_capacity ? frame_capacity * 2 : 8192;
+            frames = realloc(frames, frame_capacity * sizeof(sampled_frame_t));
+        }
+        if (!samples || !frames) {
+            exit(ERROR);
+        }
+        samples[sample_count++] = (stored_sample_t){
+            .first = frame_count,
+            .depth = sample->depth,
+            .truncated = sample->truncated,
+            .compiled = sample->compiled,
+            .op = sample->op,
+        };
+        memcpy(&frames[frame_count], sample->frames, sample->depth * sizeof(sampled_frame_t));
+        frame_count += sample->depth;
+    }
+    atomic_store_explicit(&ring_tail, tail, memory_order_release);
+}
+
+static void *drain_loop(void *arg) {
+    (void) arg;
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = DRAIN_INTERVAL_NS};
+    while (atomic_load(&draining)) {
+        drain();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/** Sets the profiling timer to fire `rate` times per second, or stops it */
+static void set_timer(uint32_t rate) {
+    struct itimerval timer = {{0, 0}, {0, 0}};
+    if (rate > 0) {
+        long usec = rate >= 1000000 ? 1 : 1000000 / (long) rate;
+        timer.it_interval.tv_sec = usec / 1000000;
+        timer.it_interval.tv_usec = usec % 1000000;
+        timer.it_value = timer.it_interval;
+    }
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+bool sampler_start(vm_stack_t *vm_stack) {
+    sampled_stack = vm_stack;
+    is_vm_thread = true;
+    // The drainer inherits a mask blocking SIGPROF, so the signal only
+    // interrupts threads running the VM
+    sigset_t profiling, old;
+    sigemptyset(&profiling);
+    sigaddset(&profiling, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &profiling, &old);
+    atomic_store(&draining, true);
+    bool started = pthread_create(&drainer, NULL, drain_loop, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!started) {
+        return false;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_sigprof;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) {
+        atomic_store(&draining, false);
+        pthread_join(drainer, NULL);
+        return false;
+    }
+    set_timer(sampler_rate ? sampler_rate : SAMPLER_DEFAULT_RATE);
+    return true;
+}
+
+/** A method's row in the summary */
+typedef struct {
+    method_t *method;
+    uint64_t self;
+    uint64_t total;
+    /** The last sample counted in `total` */
+    uint32_t seen;
+} method_row_t;
+
+/** A bytecode offset's row in the summary */
+typedef struct {
+    method_t *method;
+    int32_t pc;
+    bool compiled;
+    uint16_t op;
+    uint64_t count;
+} offset_row_t;
+
+static int by_self(const void *a, const void *b) {
+    const method_row_t *x = a;
+    const method_row_t *y = b;
+    return x->self < y->self ? 1 : x->self > y->self ? -1 : 0;
+}
+
+static int by_count(const void *a, const void *b) {
+    const offset_row_t *x = a;
+    const offset_row_t *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static int by_string(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void print_method(FILE *out, const method_t *method) {
+    fprintf(out, "%.*s%.*s", method->name->length, method->name->bytes,
+            method->descriptor->length, method->descriptor->bytes);
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * (double) part / (double) total : 0.0;
+}
+
+/** The most offsets listed in the summary */
+#define MAX_OFFSET_ROWS 30
+
+static void write_summary(FILE *out) {
+    method_row_t *methods = calloc(frame_count + 1, sizeof(method_row_t));
+    offset_row_t *offsets = calloc(sample_count + 1, sizeof(offset_row_t));
+    if (!methods || !offsets) {
+        free(methods);
+        free(offsets);
+        return;
+    }
+    uint32_t method_count = 0;
+    uint32_t offset_count = 0;
+    for (uint32_t s = 0; s < sample_count; s++) {
+        const stored_sample_t *sample = &samples[s];
+        for (uint32_t f = 0; f < sample->depth; f++) {
+            method_t *method = frames[sample->first + f].method;
+            uint32_t m = 0;
+            while (m < method_count && methods[m].method != method) {
+                m++;
+            }
+            if (m == method_count) {
+                methods[method_count++] = (method_row_t){.method = method, .seen = UINT32_MAX};
+            }
+            if (f == 0) {
+                methods[m].self++;
+            }
+            // Recursive frames count once towards a sample's total
+            if (methods[m].seen != s) {
+                methods[m].seen = s;
+                methods[m].total++;
+            }
+        }
+        const sampled_frame_t *top = &frames[sample->first];
+        uint32_t o = 0;
+        while (o < offset_count &&
+               !(offsets[o].method == top->method && offsets[o].pc == top->pc &&
+                 offsets[o].compiled == sample->compiled)) {
+            o++;
+        }
+        if (o == offset_count) {
+            offsets[offset_count++] = (offset_row_t){
+                .method = top->method, .pc = top->pc,
+                .compiled = sample->compiled, .op = sample->op,
+            };
+        }
+        offsets[o].count++;
+    }
+    qsort(methods, method_count, sizeof(method_row_t), by_self);
+    qsort(offsets, offset_count, sizeof(offset_row_t), by_count);
+
+    fprintf(out, "samples: %" PRIu32 " (%" PRIu64 " dropped, %" PRIu64 " outside the VM)\n",
+            sample_count, atomic_load(&dropped), atomic_load(&elsewhere));
+    fprintf(out, "methods:\n");
+    fprintf(out, "  %10s %6s %10s %6s  %s\n", "self", "", "total", "", "method");
+    for (uint32_t m = 0; m < method_count; m++) {
+        fprintf(out, "  %10" PRIu64 " %5.1f%% %10" PRIu64 " %5.1f%%  ", methods[m].self,
+                percent(methods[m].self, sample_count), methods[m].total,
+                percent(methods[m].total, sample_count));
+        print_method(out, methods[m].method);
+        fputc('\n', out);
+    }
+    fprintf(out, "offsets:\n");
+    fprintf(out, "  %10s %6s  %s\n", "samples", "", "method, pc: instruction");
+    for (uint32_t o = 0; o < offset_count && o < MAX_OFFSET_ROWS; o++) {
+        fprintf(out, "  %10" PRIu64 " %5.1f%%  ", offsets[o].count,
+                percent(offsets[o].count, sample_count));
+        print_method(out, offsets[o].method);
+        if (offsets[o].compiled) {
+            fprintf(out, ", compiled\n");
+        }
+        else if (offsets[o].pc < 0) {
+            fprintf(out, ", pc unknown\n");
+        }
+        else {
+            fprintf(out, ", %" PRId32 ": %s\n", offsets[o].pc,
+                    offsets[o].op < NUM_INSNS ? insn_names[offsets[o].op] : "?");
+        }
+    }
+    free(methods);
+    free(offsets);
+}
+
+static void write_folded(FILE *out) {
+    // One line per sample, sorted so that identical stacks are adjacent
+    char **lines = calloc(sample_count + 1, sizeof(char *));
+    if (!lines) {
+        return;
+    }
+    for (uint32_t s = 0; s < sample_count; s++) {
+        const stored_sample_t *sample = &samples[s];
+        size_t length = sample->truncated ? 4 : 0;
+        for (uint32_t f = 0; f < sample->depth; f++) {
+            length += frames[sample->first + f].method->name->length + 1u;
+        }
+        char *line = malloc(length + 1);
+        if (!line) {
+            break;
+        }
+        char *p = line;
+        if (sample->truncated) {
+            memcpy(p, "...;", 4);
+            p += 4;
+        }
+        for (uint32_t f = sample->depth; f-- > 0;) {
+            const utf8_t *name = frames[sample->first + f].method->name;
+            memcpy(p, name->bytes, name->length);
+            p += name->length;
+            *p++ = f ? ';' : '\0';
+        }
+        lines[s] = line;
+    }
+    uint32_t count = 0;
+    while (count < sample_count && lines[count]) {
+        count++;
+    }
+    qsort(lines, count, sizeof(char *), by_string);
+    for (uint32_t i = 0, run; i < count; i += run) {
+        for (run = 1; i + run < count && strcmp(lines[i], lines[i + run]) == 0; run++) {
+        }
+        fprintf(out, "%s %" PRIu32 "\n", lines[i], run);
+    }
+    for (uint32_t s = 0; s < sample_count; s++) {
+        free(lines[s]);
+    }
+    free(lines);
+}
+
+void sampler_finish(FILE *summary, FILE *folded) {
+    set_timer(0);
+    signal(SIGPROF, SIG_IGN);
+    atomic_store(&draining, false);
+    pthread_join(drainer, NULL);
+    drain();
+    write_summary(summary);
+    if (folded) {
+        write_folded(folded);
+    }
+    free(samples);
+    free(frames);
+    samples = NULL;
+    frames = NULL;
+    sample_count = sample_capacity = frame_count = frame_capacity = 0;
+}
@@ -0,0 +1,49 @@
+// sampler.h
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "frame.h"
+
+/**
+ * The --sample mode: a statistical profiler that needs nothing from the
+ * code it measures. A SIGPROF timer interrupts the VM thread
+ * `sampler_rate` times per second of CPU time, and the signal handler
+ * copies the VM stack's frame chain (each frame's method and bytecode
+ * offset) into a lock-free single-producer ring buffer. A thread drains the
+ * ring every few milliseconds, and at exit the samples are attributed to
+ * methods and bytecode offsets.
+ *
+ * Callers' offsets are those of their pending invokes. The running
+ * interpreted frame's instruction is found by looking for a pointer into
+ * its decoded instructions among the interrupted registers, where the
+ * interpreter keeps it; samples in compiled code, or in the VM's own
+ * helpers, only name the method. Only the innermost SAMPLER_MAX_DEPTH
+ * frames of a sample are kept.
+ */
+
+#define SAMPLER_MAX_DEPTH 64
+/** The default number of samples per second */
+#define SAMPLER_DEFAULT_RATE 1000
+
+/** Samples per second; the kernel may round the timer to its tick */
+extern uint32_t sampler_rate;
+
+/**
+ * Starts sampling the frames on `vm_stack`, which the calling thread runs.
+ *
+ * @return false if the timer or the draining thread cannot be set up
+ */
+bool sampler_start(vm_stack_t *vm_stack);
+
+/**
+ * Stops sampling, writes the hottest methods and bytecode offsets to
+ * `summary` and the folded stacks ("main;a;b <samples>" per line, as
+ * flamegraph.pl reads them) to `folded`, and frees the samples.
+ */
+void sampler_finish(FILE *summary, FILE *folded);
+
+#endif
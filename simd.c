@@ -0,0 +1,395 @@
+// simd.c
+#include "simd.h"
+
+#include <string.h>
+
+#include "array.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/** One implementation of each kernel; all sizes are in bytes */
+typedef struct {
+    const char *name;
+    /** Fills `dst` with a repeating 8-byte pattern, starting with its first byte */
+    void (*fill)(uint8_t *dst, uint64_t pattern, size_t bytes);
+    void (*copy)(uint8_t *dst, const uint8_t *src, size_t bytes);
+    bool (*equals)(const uint8_t *a, const uint8_t *b, size_t bytes);
+    int32_t (*sum_int)(const int32_t *p, size_t count);
+    int32_t (*sum_byte)(const int8_t *p, size_t count);
+    /** Continues the polynomial hash `h` (h = 31 * h + element) over `count` ints */
+    int32_t (*hash_int)(uint32_t h, const int32_t *p, size_t count);
+} kernels_t;
+
+/** 31 to the power `n`, modulo 2^32 */
+static uint32_t power_of_31(size_t n) {
+    uint32_t result = 1;
+    uint32_t base = 31;
+    for (; n; n >>= 1) {
+        if (n & 1) {
+            result *= base;
+        }
+        base *= base;
+    }
+    return result;
+}
+
+static void fill_scalar(uint8_t *dst, uint64_t pattern, size_t bytes) {
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        memcpy(&dst[i], &pattern, 8);
+    }
+    for (; i < bytes; i++) {
+        dst[i] = (uint8_t)(pattern >> (8 * (i % 8)));
+    }
+}
+
+static void copy_scalar(uint8_t *dst, const uint8_t *src, size_t bytes) {
+    memmove(dst, src, bytes);
+}
+
+static bool equals_scalar(const uint8_t *a, const uint8_t *b, size_t bytes) {
+    return memcmp(a, b, bytes) == 0;
+}
+
+static int32_t sum_int_scalar(const int32_t *p, size_t count) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += (uint32_t) p[i];
+    }
+    return (int32_t) sum;
+}
+
+static int32_t sum_byte_scalar(const int8_t *p, size_t count) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += (uint32_t) p[i];
+    }
+    return (int32_t) sum;
+}
+
+static int32_t hash_int_scalar(uint32_t h, const int32_t *p, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        h = 31 * h + (uint32_t) p[i];
+    }
+    return (int32_t) h;
+}
+
+static const kernels_t scalar_kernels = {
+    "scalar", fill_scalar, copy_scalar, equals_scalar,
+    sum_int_scalar, sum_byte_scalar, hash_int_scalar,
+};
+
+#if defined(__x86_64__)
+
+/**
+ * Whether copying front to back in blocks gives memmove() semantics: each
+ * block is loaded before any store can reach it unless `dst` starts inside
+ * `src`.
+ */
+static bool copies_forward(const uint8_t *dst, const uint8_t *src, size_t bytes) {
+    return (uintptr_t) dst <= (uintptr_t) src || (uintptr_t) dst >= (uintptr_t) src + bytes;
+}
+
+static void fill_sse2(uint8_t *dst, uint64_t pattern, size_t bytes) {
+    __m128i v = _mm_set1_epi64x((int64_t) pattern);
+    size_t i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        _mm_storeu_si128((__m128i *) &dst[i], v);
+    }
+    fill_scalar(&dst[i], pattern, bytes - i);
+}
+
+static void copy_sse2(uint8_t *dst, const uint8_t *src, size_t bytes) {
+    if (!copies_forward(dst, src, bytes)) {
+        memmove(dst, src, bytes);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        _mm_storeu_si128((__m128i *) &dst[i], _mm_loadu_si128((const __m128i *) &src[i]));
+    }
+    for (; i < bytes; i++) {
+        dst[i] = src[i];
+    }
+}
+
+static bool equals_sse2(const uint8_t *a, const uint8_t *b, size_t bytes) {
+    size_t i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) &a[i]);
+        __m128i y = _mm_loadu_si128((const __m128i *) &b[i]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff) {
+            return false;
+        }
+    }
+    return memcmp(&a[i], &b[i], bytes - i) == 0;
+}
+
+static int32_t sum_int_sse2(const int32_t *p, size_t count) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i *) &p[i]));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    return (int32_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+                     (uint32_t) sum_int_scalar(&p[i], count - i));
+}
+
+static int32_t sum_byte_sse2(const int8_t *p, size_t count) {
+    // Biased by 128 the bytes are unsigned, and psadbw adds eight at a time
+    const __m128i bias = _mm_set1_epi8((char) 0x80);
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &p[i]), bias);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, _mm_setzero_si128()));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    uint64_t sum = lanes[0] + lanes[1] - 128 * (uint64_t) i;
+    return (int32_t)((uint32_t) sum + (uint32_t) sum_byte_scalar(&p[i], count - i));
+}
+
+/** Multiplies 32-bit lanes keeping the low halves; pmulld needs SSE4.1 */
+static inline __m128i mullo_sse2(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static int32_t hash_int_sse2(uint32_t h, const int32_t *p, size_t count) {
+    size_t blocks = count / 4;
+    if (blocks > 0) {
+        // Lane j sums the elements 4b + j, scaling what it has by 31^4 each
+        // block; in the hash of all the blocks it then weighs 31^(3 - j)
+        const __m128i step = _mm_set1_epi32((int) power_of_31(4));
+        __m128i acc = _mm_setzero_si128();
+        for (size_t b = 0; b < blocks; b++) {
+            acc = _mm_add_epi32(mullo_sse2(acc, step),
+                                _mm_loadu_si128((const __m128i *) &p[4 * b]));
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *) lanes, acc);
+        h *= power_of_31(4 * blocks);
+        for (uint32_t j = 0; j < 4; j++) {
+            h += lanes[j] * power_of_31(3 - j);
+        }
+    }
+    return hash_int_scalar(h, &p[4 * blocks], count - 4 * blocks);
+}
+
+static const kernels_t sse2_kernels = {
+    "sse2", fill_sse2, copy_sse2, equals_sse2,
+    sum_int_sse2, sum_byte_sse2, hash_int_sse2,
+};
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void fill_avx2(uint8_t *dst, uint64_t pattern, size_t bytes) {
+    __m256i v = _mm256_set1_epi64x((int64_t) pattern);
+    size_t i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        _mm256_storeu_si256((__m256i *) &dst[i], v);
+    }
+    fill_sse2(&dst[i], pattern, bytes - i);
+}
+
+AVX2 static void copy_avx2(uint8_t *dst, const uint8_t *src, size_t bytes) {
+    if (!copies_forward(dst, src, bytes)) {
+        memmove(dst, src, bytes);
+        return;
+    }
+    size_t i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        _mm256_storeu_si256((__m256i *) &dst[i],
+                            _mm256_loadu_si256((const __m256i *) &src[i]));
+    }
+    copy_sse2(&dst[i], &src[i], bytes - i);
+}
+
+AVX2 static bool equals_avx2(const uint8_t *a, const uint8_t *b, size_t bytes) {
+    size_t i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) &a[i]);
+        __m256i y = _mm256_loadu_si256((const __m256i *) &b[i]);
+        if ((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != UINT32_MAX) {
+            return false;
+        }
+    }
+    return equals_sse2(&a[i], &b[i], bytes - i);
+}
+
+AVX2 static int32_t sum_int_avx2(const int32_t *p, size_t count) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc = _mm256_add_epi32(acc, _mm256_loadu_si256((const __m256i *) &p[i]));
+    }
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    uint32_t sum = 0;
+    for (uint32_t j = 0; j < 8; j++) {
+        sum += lanes[j];
+    }
+    return (int32_t)(sum + (uint32_t) sum_int_sse2(&p[i], count - i));
+}
+
+AVX2 static int32_t sum_byte_avx2(const int8_t *p, size_t count) {
+    const __m256i bias = _mm256_set1_epi8((char) 0x80);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &p[i]), bias);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    uint64_t sum = lanes[0] + lanes[1] + lanes[2] + lanes[3] - 128 * (uint64_t) i;
+    return (int32_t)((uint32_t) sum + (uint32_t) sum_byte_sse2(&p[i], count - i));
+}
+
+AVX2 static int32_t hash_int_avx2(uint32_t h, const int32_t *p, size_t count) {
+    size_t blocks = count / 8;
+    if (blocks > 0) {
+        const __m256i step = _mm256_set1_epi32((int) power_of_31(8));
+        __m256i acc = _mm256_setzero_si256();
+        for (size_t b = 0; b < blocks; b++) {
+            acc = _mm256_add_epi32(_mm256_mullo_epi32(acc, step),
+                                   _mm256_loadu_si256((const __m256i *) &p[8 * b]));
+        }
+        uint32_t lanes[8];
+        _mm256_storeu_si256((__m256i *) lanes, acc);
+        h *= power_of_31(8 * blocks);
+        for (uint32_t j = 0; j < 8; j++) {
+            h += lanes[j] * power_of_31(7 - j);
+        }
+    }
+    return hash_int_sse2(h, &p[8 * blocks], count - 8 * blocks);
+}
+
+static const kernels_t avx2_kernels = {
+    "avx2", fill_avx2, copy_avx2, equals_avx2,
+    sum_int_avx2, sum_byte_avx2, hash_int_avx2,
+};
+
+static const kernels_t *kernels = &sse2_kernels;
+
+#else
+
+static const kernels_t *kernels = &scalar_kernels;
+
+#endif
+
+void simd_init(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    kernels = __builtin_cpu_supports("avx2") ? &avx2_kernels : &sse2_kernels;
+#endif
+}
+
+bool simd_select(const char *name) {
+    if (strcmp(name, scalar_kernels.name) == 0) {
+        kernels = &scalar_kernels;
+        return true;
+    }
+#if defined(__x86_64__)
+    if (strcmp(name, sse2_kernels.name) == 0) {
+        kernels = &sse2_kernels;
+        return true;
+    }
+    __builtin_cpu_init();
+    if (strcmp(name, avx2_kernels.name) == 0 && __builtin_cpu_supports("avx2")) {
+        kernels = &avx2_kernels;
+        return true;
+    }
+#endif
+    return false;
+}
+
+const char *simd_name(void) {
+    return kernels->name;
+}
+
+void simd_fill(void *dst, uint32_t size, uint64_t value, size_t count) {
+    // Repeat the element across 8 bytes; starting at an element, the pattern
+    // then lines up with every element that follows
+    uint64_t pattern = size == 1   ? (value & 0xff) * 0x0101010101010101u
+                       : size == 2 ? (value & 0xffff) * 0x0001000100010001u
+                       : size == 4 ? (value & 0xffffffffu) * 0x0000000100000001u
+                                   : value;
+    kernels->fill(dst, pattern, count * size);
+}
+
+void simd_copy(void *dst, const void *src, size_t bytes) {
+    kernels->copy(dst, src, bytes);
+}
+
+bool simd_equals(const void *a, const void *b, size_t bytes) {
+    return kernels->equals(a, b, bytes);
+}
+
+int32_t simd_sum(const void *data, uint8_t atype, size_t count) {
+    uint32_t sum = 0;
+    switch (atype) {
+        case T_INT:
+            return kernels->sum_int(data, count);
+        case T_BYTE:
+        case T_BOOLEAN:
+            return kernels->sum_byte(data, count);
+        case T_CHAR:
+            for (size_t i = 0; i < count; i++) {
+                sum += ((const uint16_t *) data)[i];
+            }
+            break;
+        case T_SHORT:
+            for (size_t i = 0; i < count; i++) {
+                sum += (uint32_t)((const int16_t *) data)[i];
+            }
+            break;
+        default:
+            break;
+    }
+    return (int32_t) sum;
+}
+
+int32_t simd_hash_code(const void *data, uint8_t atype, size_t count) {
+    uint32_t h = 1;
+    switch (atype) {
+        case T_INT:
+            return kernels->hash_int(h, data, count);
+        case T_BOOLEAN:
+            for (size_t i = 0; i < count; i++) {
+                h = 31 * h + (((const uint8_t *) data)[i] ? 1231 : 1237);
+            }
+            break;
+        case T_BYTE:
+            for (size_t i = 0; i < count; i++) {
+                h = 31 * h + (uint32_t)((const int8_t *) data)[i];
+            }
+            break;
+        case T_CHAR:
+            for (size_t i = 0; i < count; i++) {
+                h = 31 * h + ((const uint16_t *) data)[i];
+            }
+            break;
+        case T_SHORT:
+            for (size_t i = 0; i < count; i++) {
+                h = 31 * h + (uint32_t)((const int16_t *) data)[i];
+            }
+            break;
+        case T_LONG:
+            for (size_t i = 0; i < count; i++) {
+                uint64_t e = ((const uint64_t *) data)[i];
+                h = 31 * h + (uint32_t)(e ^ e >> 32);
+            }
+            break;
+        default:
+            break;
+    }
+    return (int32_t) h;
+}
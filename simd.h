@@ -0,0 +1,45 @@
+// simd.h
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bulk kernels over array elements, used by the library intrinsics and the
+ * array loops in intrinsic.h. Each has a portable version, an SSE2 version
+ * (always available on x86-64) and an AVX2 version; simd_init() picks the
+ * widest the CPU supports. Elements are in host byte order, as arrays store
+ * them, and int arithmetic wraps as in Java.
+ */
+
+/** Selects the kernels for the widest instruction set the CPU supports */
+void simd_init(void);
+
+/**
+ * Selects kernels by instruction set: "scalar", "sse2" or "avx2".
+ *
+ * @return false if the name is unknown or the CPU lacks the instructions
+ */
+bool simd_select(const char *name);
+
+/** The instruction set of the selected kernels */
+const char *simd_name(void);
+
+/** Sets `count` elements of `size` (1, 2, 4 or 8) bytes at `dst` to the low bytes of `value` */
+void simd_fill(void *dst, uint32_t size, uint64_t value, size_t count);
+
+/** Copies `bytes` bytes from `src` to `dst`; the ranges may overlap */
+void simd_copy(void *dst, const void *src, size_t bytes);
+
+/** Whether `bytes` bytes at `a` and `b` are equal */
+bool simd_equals(const void *a, const void *b, size_t bytes);
+
+/** The sum of `count` elements of an array of `atype` */
+int32_t simd_sum(const void *data, uint8_t atype, size_t count);
+
+/** What java.util.Arrays.hashCode returns for `count` elements of an array of `atype` */
+int32_t simd_hash_code(const void *data, uint8_t atype, size_t count);
+
+#endif
@@ -0,0 +1,294 @@
+// superinsn.c
+#include "superinsn.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef TINYJVM_TRAIN
+uint32_t enabled_fusions = 0;
+#else
+uint32_t enabled_fusions = (1u << NUM_FUSIONS) - 1;
+#endif
+
+static const char *const fusion_names[NUM_FUSIONS] = {
+#define FUSION_NAME(id, name) [id] = name,
+    FOR_EACH_FUSION(FUSION_NAME)
+#undef FUSION_NAME
+};
+
+/** The six two-operand compares are consecutive in FOR_EACH_INSN */
+static inline bool is_icmp(uint16_t op) {
+    return op >= q_if_icmpeq && op <= q_if_icmple;
+}
+
+/** Marks every instruction that some branch jumps to */
+static bool *find_targets(const insn_t *insns, uint32_t count) {
+    bool *is_target = calloc(count, sizeof(bool));
+    if (!is_target) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (insn_flags[insns[i].op] & INSN_BRANCH) {
+            is_target[insns[i].target - insns] = true;
+        }
+    }
+    return is_target;
+}
+
+/**
+ * Returns how many instructions starting at `in` form `fusion`, or 0 if they
+ * don't. `avail` is the number of instructions left in the method.
+ */
+static uint32_t fusion_length(fusion_t fusion, const insn_t *in, uint32_t avail,
+                              const bool *is_target) {
+    uint32_t n;
+    switch (fusion) {
+        case FUSE_ILOAD_ILOAD_IADD_ISTORE:
+            n = avail >= 4 && in[0].op == q_iload && in[1].op == q_iload &&
+                        in[2].op == q_iadd && in[3].op == q_istore
+                    ? 4
+                    : 0;
+            break;
+        case FUSE_ILOAD_ILOAD_IF_ICMP:
+            n = avail >= 3 && in[0].op == q_iload && in[1].op == q_iload &&
+                        is_icmp(in[2].op)
+                    ? 3
+                    : 0;
+            break;
+        case FUSE_ILOAD_IF_ICMP:
+            n = avail >= 2 && in[0].op == q_iload && is_icmp(in[1].op) ? 2 : 0;
+            break;
+        case FUSE_IINC_GOTO:
+            n = avail >= 2 && in[0].op == q_iinc && in[1].op == q_goto ? 2 : 0;
+            break;
+        default:
+            n = 0;
+            break;
+    }
+    for (uint32_t i = 1; i < n; i++) {
+        if (is_target[i]) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+/** Builds the superinstruction for a matched `fusion` starting at `in` */
+static insn_t make_fused(fusion_t fusion, const insn_t *in) {
+    insn_t fused = in[0];
+    switch (fusion) {
+        case FUSE_ILOAD_ILOAD_IADD_ISTORE:
+            fused.op = q_iload_iload_iadd_istore;
+            fused.b = in[1].a;
+            fused.c = in[3].a;
+            break;
+        case FUSE_ILOAD_ILOAD_IF_ICMP:
+            fused.op = (uint16_t)(q_iload_iload_if_icmpeq + (in[2].op - q_if_icmpeq));
+            fused.b = in[1].a;
+            fused.c = in[2].pc;
+            fused.target = in[2].target;
+            break;
+        case FUSE_ILOAD_IF_ICMP:
+            fused.op = (uint16_t)(q_iload_if_icmpeq + (in[1].op - q_if_icmpeq));
+            fused.c = in[1].pc;
+            fused.target = in[1].target;
+            break;
+        case FUSE_IINC_GOTO:
+            fused.op = q_iinc_goto;
+            fused.c = in[1].pc;
+            fused.target = in[1].target;
+            break;
+        default:
+            break;
+    }
+    return fused;
+}
+
+uint32_t fuse_superinstructions(insn_t *insns, uint32_t count) {
+    if (enabled_fusions == 0) {
+        return count;
+    }
+    bool *is_target = find_targets(insns, count);
+    uint32_t *new_index = malloc(count * sizeof(uint32_t));
+    if (!is_target || !new_index) {
+        // Fusion is only an optimization
+        free(is_target);
+        free(new_index);
+        return count;
+    }
+
+    // Compact the stream in place. Branch targets still point at the old
+    // positions until the fix-up below.
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count;) {
+        uint32_t length = 1;
+        insn_t insn = insns[i];
+        for (fusion_t f = 0; f < NUM_FUSIONS; f++) {
+            if (!(enabled_fusions & (1u << f))) {
+                continue;
+            }
+            uint32_t fused = fusion_length(f, &insns[i], count - i, &is_target[i]);
+            if (fused > 0) {
+                insn = make_fused(f, &insns[i]);
+                length = fused;
+                break;
+            }
+        }
+        for (uint32_t j = 0; j < length; j++) {
+            new_index[i + j] = n;
+        }
+        insns[n++] = insn;
+        i += length;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (insn_flags[insns[i].op] & INSN_BRANCH) {
+            insns[i].target = &insns[new_index[insns[i].target - insns]];
+        }
+    }
+
+    free(is_target);
+    free(new_index);
+    return n;
+}
+
+bool load_superinstruction_profile(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    uint32_t enabled = 0;
+    char line[256];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        char *name = strtok(line, " \t\r\n");
+        if (!name || name[0] == '#') {
+            continue;
+        }
+        ok = false;
+        for (fusion_t i = 0; i < NUM_FUSIONS; i++) {
+            if (strcmp(name, fusion_names[i]) == 0) {
+                enabled |= 1u << i;
+                ok = true;
+            }
+        }
+    }
+    fclose(f);
+    if (ok) {
+        enabled_fusions = enabled;
+    }
+    return ok;
+}
+
+typedef struct {
+    uint64_t count;
+    uint16_t ops[3];
+} sequence_t;
+
+static int compare_sequences(const void *a, const void *b) {
+    uint64_t x = ((const sequence_t *) a)->count;
+    uint64_t y = ((const sequence_t *) b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/** Prints the `limit` most frequent non-zero sequences of `length` ops */
+static void report_sequences(FILE *report, const uint64_t *counts, uint32_t length,
+                             uint64_t total, uint32_t limit) {
+    uint32_t size = length == 2 ? NUM_INSNS * NUM_INSNS
+                                : NUM_INSNS * NUM_INSNS * NUM_INSNS;
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        used += counts[i] != 0;
+    }
+    sequence_t *seqs = malloc((used ? used : 1) * sizeof(sequence_t));
+    if (!seqs) {
+        return;
+    }
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        if (counts[i]) {
+            seqs[n].count = counts[i];
+            seqs[n].ops[0] = (uint16_t)(i % NUM_INSNS);
+            seqs[n].ops[1] = (uint16_t)(i / NUM_INSNS % NUM_INSNS);
+            seqs[n].ops[2] = (uint16_t)(i / NUM_INSNS / NUM_INSNS);
+            n++;
+        }
+    }
+    qsort(seqs, n, sizeof(sequence_t), compare_sequences);
+
+    fprintf(report, "%s:\n", length == 2 ? "pairs" : "triples");
+    for (uint32_t i = 0; i < n && i < limit; i++) {
+        fprintf(report, "  %12" PRIu64 " %5.1f%%  %s %s", seqs[i].count,
+                100.0 * (double) seqs[i].count / (double) total,
+                insn_names[seqs[i].ops[0]], insn_names[seqs[i].ops[1]]);
+        if (length == 3) {
+            fprintf(report, " %s", insn_names[seqs[i].ops[2]]);
+        }
+        fputc('\n', report);
+    }
+    free(seqs);
+}
+
+void write_superinstruction_profile(class_file_t *cls, double threshold,
+                                    FILE *report, FILE *profile) {
+    uint64_t *pairs = calloc(NUM_INSNS * NUM_INSNS, sizeof(uint64_t));
+    uint64_t *triples = calloc(NUM_INSNS * NUM_INSNS * NUM_INSNS, sizeof(uint64_t));
+    uint64_t fused[NUM_FUSIONS] = {0};
+    uint64_t total = 0;
+    if (!pairs || !triples) {
+        free(pairs);
+        free(triples);
+        return;
+    }
+
+    for (uint16_t m = 0; m < cls->methods_count; m++) {
+        method_t *method = &cls->methods[m];
+        if (!method->insns || !method->insn_counts) {
+            continue;
+        }
+        const insn_t *insns = method->insns;
+        const uint64_t *counts = method->insn_counts;
+        uint32_t count = method->insns_count;
+        bool *is_target = find_targets(insns, count);
+        if (!is_target) {
+            continue;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            total += counts[i];
+            // Inside a basic block every execution of an instruction follows
+            // its predecessor, so its count is also the sequence's count.
+            bool pair = i + 1 < count && !is_target[i + 1] &&
+                        !(insn_flags[insns[i].op] & INSN_NO_FALLTHROUGH);
+            if (pair) {
+                pairs[insns[i].op + NUM_INSNS * insns[i + 1].op] += counts[i + 1];
+            }
+            if (pair && i + 2 < count && !is_target[i + 2] &&
+                !(insn_flags[insns[i + 1].op] & INSN_NO_FALLTHROUGH)) {
+                triples[insns[i].op + NUM_INSNS * (insns[i + 1].op +
+                                                   NUM_INSNS * insns[i + 2].op)] +=
+                    counts[i + 2];
+            }
+            for (fusion_t f = 0; f < NUM_FUSIONS; f++) {
+                uint32_t n = fusion_length(f, &insns[i], count - i, &is_target[i]);
+                if (n > 0) {
+                    fused[f] += counts[i + n - 1] * n;
+                }
+            }
+        }
+        free(is_target);
+    }
+
+    fprintf(report, "%" PRIu64 " instructions executed\n", total);
+    report_sequences(report, pairs, 2, total ? total : 1, 20);
+    report_sequences(report, triples, 3, total ? total : 1, 20);
+
+    fprintf(profile, "# superinstructions covering >= %.1f%% of executed instructions\n",
+            100.0 * threshold);
+    for (fusion_t f = 0; f < NUM_FUSIONS; f++) {
+        if (fused[f] > 0 && (double) fused[f] >= threshold * (double) total) {
+            fprintf(profile, "%s %" PRIu64 "\n", fusion_names[f], fused[f]);
+        }
+    }
+    free(pairs);
+    free(triples);
+}
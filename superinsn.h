@@ -0,0 +1,63 @@
+// superinsn.h
+#ifndef SUPERINSN_H
+#define SUPERINSN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "decode.h"
+#include "read_class.h"
+
+/**
+ * Instruction sequences that decode_method() can fuse into one
+ * superinstruction, with the name used in superinstruction profiles.
+ * A sequence is only fused if no branch targets its second or later
+ * instruction.
+ */
+#define FOR_EACH_FUSION(X)                                                     \
+    X(FUSE_ILOAD_ILOAD_IADD_ISTORE, "iload_iload_iadd_istore")                 \
+    X(FUSE_ILOAD_ILOAD_IF_ICMP, "iload_iload_if_icmp")                         \
+    X(FUSE_ILOAD_IF_ICMP, "iload_if_icmp")                                     \
+    X(FUSE_IINC_GOTO, "iinc_goto")
+
+typedef enum {
+#define FUSION_ENUM(id, name) id,
+    FOR_EACH_FUSION(FUSION_ENUM)
+#undef FUSION_ENUM
+    NUM_FUSIONS
+} fusion_t;
+
+/**
+ * Bit set of the fusions decode_method() applies. Defaults to all of them,
+ * or none in TINYJVM_TRAIN builds so that training sees the plain stream.
+ */
+extern uint32_t enabled_fusions;
+
+/**
+ * Fuses the enabled superinstructions in a decoded method in place.
+ *
+ * @param insns the decoded instructions, including the trailing q_invalid
+ * @param count the number of instructions
+ * @return the number of instructions after fusion
+ */
+uint32_t fuse_superinstructions(insn_t *insns, uint32_t count);
+
+/**
+ * Enables exactly the fusions named in a profile written by
+ * write_superinstruction_profile(). Lines are "<name> [count]"; '#' starts
+ * a comment.
+ *
+ * @return false if the file cannot be read or names an unknown fusion
+ */
+bool load_superinstruction_profile(const char *path);
+
+/**
+ * Summarizes a TINYJVM_TRAIN run: writes the most frequently executed
+ * instruction pairs and triples to `report`, and the fusions that cover at
+ * least `threshold` of all executed instructions to `profile`.
+ */
+void write_superinstruction_profile(class_file_t *cls, double threshold,
+                                    FILE *report, FILE *profile);
+
+#endif
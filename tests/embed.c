@@ -0,0 +1,80 @@
+// tests/embed.c
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tinyjvm.h"
+
+/**
+ * Calls into Arithmetic.class through libtinyjvm: exceptions the guest
+ * throws must come back from vm_invoke() rather than end the host, whether
+ * the method is interpreted or compiled. Methods of PrintOnly.class that
+ * call, directly or not, a method that failed verification must be refused
+ * rather than run.
+ *
+ * usage: tinyjvm-embed-test <path to Arithmetic.class> <path to PrintOnly.class>
+ */
+
+static int failures = 0;
+
+static void expect_result(vm_t *vm, vm_method_t *method, int32_t a, int32_t b, int32_t expected) {
+    int32_t args[] = {a, b}, result = 0;
+    vm_status_t status = vm_invoke(vm, method, args, 2, &result);
+    if (status != VM_OK || result != expected) {
+        fprintf(stderr, "(%d, %d): status %d, result %d\n", a, b, status, result);
+        failures++;
+    }
+}
+
+static void expect_exception(vm_t *vm, vm_method_t *method, int32_t a, int32_t b,
+                             const char *expected) {
+    int32_t args[] = {a, b};
+    vm_status_t status = vm_invoke(vm, method, args, 2, NULL);
+    const char *exception = vm_exception(vm);
+    if (status != VM_EXCEPTION || !exception || strcmp(exception, expected) != 0) {
+        fprintf(stderr, "(%d, %d): status %d, exception %s\n", a, b, status,
+                exception ? exception : "none");
+        failures++;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != VM_UNSUPPORTED) {
+        fprintf(stderr, "usage: %s <Arithmetic.class> <PrintOnly.class>\n", argv[0]);
+        return 2;
+    }
+    vm_t *vm = vm_create(NULL);
+    vm_class_t *cls = vm ? vm_load_class(vm, argv[1], NULL) : NULL;
+    vm_method_t *div = cls ? vm_find_method(cls, "div", "(II)I") : NULL;
+    vm_method_t *rem = cls ? vm_find_method(cls, "rem", "(II)I") : NULL;
+    vm_class_t *print_only = vm ? vm_load_class(vm, argv[2], NULL) : NULL;
+    vm_method_t *f = print_only ? vm_find_method(print_only, "f", "(I)I") : NULL;
+    vm_method_t *g = print_only ? vm_find_method(print_only, "g", "(I)I") : NULL;
+    if (!div || !rem || !f || !g) {
+        fprintf(stderr, "cannot load %s or %s\n", argv[1], argv[2]);
+        return 2;
+    }
+    int32_t arg = 5;
+    vm_status_t status = vm_invoke(vm, f, &arg, 1, NULL);
+    if (status != VM_UNSUPPORTED || vm_invoke(vm, g, &arg, 1, NULL) != VM_UNSUPPORTED) {
+        fprintf(stderr, "f() or g() was not refused\n");
+        failures++;
+    }
+    // Enough calls for the methods to be compiled partway through
+    for (int32_t i = 0; i < 20000; i++) {
+        expect_exception(vm, div, i, 0, "java/lang/ArithmeticException");
+        expect_exception(vm, rem, i, 0, "java/lang/ArithmeticException");
+        expect_result(vm, div, INT_MIN, -1, INT_MIN);
+        expect_result(vm, rem, INT_MIN, -1, 0);
+        expect_result(vm, div, i, 3, i / 3);
+        if (failures > 0) {
+            break;
+        }
+    }
+    vm_destroy(vm);
+    if (failures > 0) {
+        return 1;
+    }
+    printf("EMBED OK\n");
+    return 0;
+}
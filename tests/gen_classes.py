@@ -0,0 +1,481 @@
+#!/usr/bin/env python3
+# gen_classes.py
+"""
+Writes the regression test class files into this directory.
+
+Like the benchmarks (see bench/gen_classes.py), the classes are checked in
+so that testing needs no JDK, and each is assembled here as javac would
+compile the Java source in the comment above it. CMakeLists.txt runs each
+one and matches its output. Regenerating them gives byte-identical files:
+
+    python3 tests/gen_classes.py
+"""
+import os
+import struct
+
+OPCODES = {
+    'iconst_m1': 0x02, 'iconst_0': 0x03, 'iconst_1': 0x04, 'iconst_2': 0x05,
+    'iconst_3': 0x06, 'iconst_4': 0x07, 'iconst_5': 0x08,
+    'bipush': 0x10, 'sipush': 0x11, 'ldc': 0x12,
+    'iload': 0x15, 'aload': 0x19,
+    'iload_0': 0x1a, 'iload_1': 0x1b, 'iload_2': 0x1c, 'iload_3': 0x1d,
+    'aload_0': 0x2a, 'aload_1': 0x2b, 'aload_2': 0x2c, 'aload_3': 0x2d,
+    'iaload': 0x2e,
+    'istore': 0x36, 'astore': 0x3a,
+    'istore_0': 0x3b, 'istore_1': 0x3c, 'istore_2': 0x3d, 'istore_3': 0x3e,
+    'astore_0': 0x4b, 'astore_1': 0x4c, 'astore_2': 0x4d, 'astore_3': 0x4e,
+    'iastore': 0x4f,
+    'iadd': 0x60, 'isub': 0x64, 'imul': 0x68, 'idiv': 0x6c, 'irem': 0x70, 'iand': 0x7e,
+    'iinc': 0x84,
+    'ifeq': 0x99, 'ifne': 0x9a, 'iflt': 0x9b, 'ifge': 0x9c, 'ifgt': 0x9d, 'ifle': 0x9e,
+    'if_icmpeq': 0x9f, 'if_icmpne': 0xa0, 'if_icmplt': 0xa1, 'if_icmpge': 0xa2,
+    'if_icmpgt': 0xa3, 'if_icmple': 0xa4, 'goto': 0xa7,
+    'ireturn': 0xac, 'areturn': 0xb0, 'return': 0xb1,
+    'getstatic': 0xb2, 'invokevirtual': 0xb6, 'invokestatic': 0xb8,
+    'newarray': 0xbc, 'arraylength': 0xbe, 'monitorenter': 0xc2, 'monitorexit': 0xc3,
+}
+BRANCHES = {op for op in OPCODES if op.startswith('if') or op == 'goto'}
+ONE_BYTE_OPERAND = {'bipush', 'ldc', 'iload', 'aload', 'istore', 'astore', 'newarray'}
+TWO_BYTE_OPERAND = {'sipush', 'iinc', 'getstatic', 'invokevirtual', 'invokestatic'} | BRANCHES
+
+T_INT = 10
+
+MAIN = ('main', '([Ljava/lang/String;)V')
+# The defaults of getstatic and invokevirtual
+SYSTEM_OUT = ('java/lang/System', 'out', 'Ljava/io/PrintStream;')
+PRINTLN = ('java/io/PrintStream', 'println', '(I)V')
+
+
+class ConstantPool:
+    def __init__(self):
+        self.entries = []
+        self.indices = {}
+
+    def add(self, key, data):
+        if key not in self.indices:
+            self.entries.append(data)
+            self.indices[key] = len(self.entries)
+        return self.indices[key]
+
+    def utf8(self, text):
+        data = text.encode()
+        return self.add(('utf8', text), b'\x01' + struct.pack('>H', len(data)) + data)
+
+    def cls(self, name):
+        return self.add(('class', name), b'\x07' + struct.pack('>H', self.utf8(name)))
+
+    def name_and_type(self, name, descriptor):
+        return self.add(('nat', name, descriptor),
+                        b'\x0c' + struct.pack('>HH', self.utf8(name), self.utf8(descriptor)))
+
+    def methodref(self, cls, name, descriptor):
+        return self.add(('method', cls, name, descriptor),
+                        b'\x0a' + struct.pack('>HH', self.cls(cls), self.name_and_type(name, descriptor)))
+
+    def fieldref(self, cls, name, descriptor):
+        return self.add(('field', cls, name, descriptor),
+                        b'\x09' + struct.pack('>HH', self.cls(cls), self.name_and_type(name, descriptor)))
+
+    def integer(self, value):
+        return self.add(('int', value), b'\x03' + struct.pack('>i', value))
+
+    def serialize(self):
+        return struct.pack('>H', len(self.entries) + 1) + b''.join(self.entries)
+
+
+def instruction_length(insn):
+    op = insn[0]
+    if op in TWO_BYTE_OPERAND:
+        return 3
+    if op in ONE_BYTE_OPERAND:
+        return 2
+    return 1
+
+
+def assemble(pool, class_name, code):
+    """Assembles a list of instructions and "label:" strings; returns the code and labels."""
+    labels = {}
+    insns = []
+    pc = 0
+    for item in code:
+        if isinstance(item, str) and item.endswith(':'):
+            labels[item[:-1]] = pc
+            continue
+        insn = (item,) if isinstance(item, str) else item
+        insns.append((pc, insn))
+        pc += instruction_length(insn)
+    out = b''
+    for pc, insn in insns:
+        op = insn[0]
+        out += bytes([OPCODES[op]])
+        if op in BRANCHES:
+            out += struct.pack('>h', labels[insn[1]] - pc)
+        elif op == 'bipush':
+            out += struct.pack('>b', insn[1])
+        elif op == 'sipush':
+            out += struct.pack('>h', insn[1])
+        elif op == 'ldc':
+            out += bytes([pool.integer(insn[1])])
+        elif op in ONE_BYTE_OPERAND:
+            out += bytes([insn[1]])
+        elif op == 'iinc':
+            out += struct.pack('>Bb', insn[1], insn[2])
+        elif op == 'getstatic':
+            out += struct.pack('>H', pool.fieldref(*(insn[1] if len(insn) > 1 else SYSTEM_OUT)))
+        elif op == 'invokevirtual':
+            out += struct.pack('>H', pool.methodref(*(insn[1] if len(insn) > 1 else PRINTLN)))
+        elif op == 'invokestatic':
+            # (name, descriptor) in this class, or (class, name, descriptor)
+            ref = insn[1] if len(insn[1]) == 3 else (class_name,) + insn[1]
+            out += struct.pack('>H', pool.methodref(*ref))
+    return out, labels
+
+
+def write_class(class_name, methods):
+    """
+    Writes <class_name>.class; methods are (name, descriptor, max_stack,
+    max_locals, code), optionally followed by an exception table of
+    (start, end, handler, catch type) labels and class names.
+    """
+    pool = ConstantPool()
+    this_class = pool.cls(class_name)
+    super_class = pool.cls('java/lang/Object')
+    body = b''
+    for name, descriptor, max_stack, max_locals, code, *handlers in methods:
+        bytecode, labels = assemble(pool, class_name, code)
+        table = b''.join(struct.pack('>HHHH', labels[start], labels[end], labels[handler],
+                                     pool.cls(catch_type))
+                         for start, end, handler, catch_type in (handlers[0] if handlers else []))
+        attribute = (struct.pack('>HHI', max_stack, max_locals, len(bytecode)) + bytecode +
+                     struct.pack('>H', len(table) // 8) + table + struct.pack('>H', 0))
+        # public static, one Code attribute
+        body += struct.pack('>HHHH', 0x0009, pool.utf8(name), pool.utf8(descriptor), 1)
+        body += struct.pack('>HI', pool.utf8('Code'), len(attribute)) + attribute
+    out = struct.pack('>IHH', 0xCAFEBABE, 0, 52) + pool.serialize()
+    out += struct.pack('>HHHHH', 0x0021, this_class, super_class, 0, 0)
+    out += struct.pack('>H', len(methods)) + body + struct.pack('>H', 0)
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), class_name + '.class')
+    with open(path, 'wb') as f:
+        f.write(out)
+
+
+# An index that is >= 0 and incremented may overflow: the bounds check on
+# a[i] must stay once get() is compiled.
+#
+# static int get(int[] a, int i) {
+#     if (i < 0) return -1;
+#     i++;
+#     if (i < a.length) return a[i];
+#     return -1;
+# }
+# public static void main(String[] args) {
+#     int[] a = new int[4];
+#     int sum = 0;
+#     for (int k = 0; k < 20000; k++) sum += get(a, 0);
+#     System.out.println(sum);
+#     System.out.println(get(a, Integer.MAX_VALUE));
+# }
+GET = ('get', '([II)I')
+write_class('BoundsOverflow', [
+    GET + (2, 2, [
+        'iload_1', ('ifge', 'nonneg'),
+        'iconst_m1', 'ireturn',
+        'nonneg:',
+        ('iinc', 1, 1),
+        'iload_1', 'aload_0', 'arraylength', ('if_icmpge', 'out'),
+        'aload_0', 'iload_1', 'iaload', 'ireturn',
+        'out:',
+        'iconst_m1', 'ireturn',
+    ]),
+    MAIN + (3, 4, [
+        'iconst_4', ('newarray', T_INT), 'astore_1',
+        'iconst_0', 'istore_2',
+        'iconst_0', 'istore_3',
+        'loop:',
+        'iload_3', ('sipush', 20000), ('if_icmpge', 'done'),
+        'iload_2', 'aload_1', 'iconst_0', ('invokestatic', GET), 'iadd', 'istore_2',
+        ('iinc', 3, 1),
+        ('goto', 'loop'),
+        'done:',
+        'getstatic', 'iload_2', 'invokevirtual',
+        'getstatic', 'aload_1', ('ldc', 2 ** 31 - 1), ('invokestatic', GET), 'invokevirtual',
+        'return',
+    ]),
+])
+
+# A decremented index that was below the length but maybe negative may wrap
+# to Integer.MAX_VALUE: the bounds check on a[i] must stay once get() is
+# compiled.
+#
+# static int get(int[] a, int i) {
+#     if (i >= a.length) return -1;
+#     i--;
+#     if (i < 0) return -1;
+#     return a[i];
+# }
+# public static void main(String[] args) {
+#     int[] a = new int[4];
+#     int sum = 0;
+#     for (int k = 0; k < 20000; k++) sum += get(a, 1);
+#     System.out.println(sum);
+#     System.out.println(get(a, Integer.MIN_VALUE));
+# }
+write_class('BoundsUnderflow', [
+    GET + (2, 2, [
+        'iload_1', 'aload_0', 'arraylength', ('if_icmplt', 'below'),
+        'iconst_m1', 'ireturn',
+        'below:',
+        ('iinc', 1, -1),
+        'iload_1', ('ifge', 'nonneg'),
+        'iconst_m1', 'ireturn',
+        'nonneg:',
+        'aload_0', 'iload_1', 'iaload', 'ireturn',
+    ]),
+    MAIN + (3, 4, [
+        'iconst_4', ('newarray', T_INT), 'astore_1',
+        'iconst_0', 'istore_2',
+        'iconst_0', 'istore_3',
+        'loop:',
+        'iload_3', ('sipush', 20000), ('if_icmpge', 'done'),
+        'iload_2', 'aload_1', 'iconst_1', ('invokestatic', GET), 'iadd', 'istore_2',
+        ('iinc', 3, 1),
+        ('goto', 'loop'),
+        'done:',
+        'getstatic', 'iload_2', 'invokevirtual',
+        'getstatic', 'aload_1', ('ldc', -2 ** 31), ('invokestatic', GET), 'invokevirtual',
+        'return',
+    ]),
+])
+
+# Division by zero throws, and INT_MIN / -1 wraps, interpreted and compiled.
+#
+# static int div(int a, int b) { return a / b; }
+# static int rem(int a, int b) { return a % b; }
+# static int safeDiv(int a, int b) {
+#     try { return a / b; } catch (ArithmeticException e) { return -1; }
+# }
+# public static void main(String[] args) {
+#     System.out.println(div(Integer.MIN_VALUE, -1));
+#     System.out.println(rem(Integer.MIN_VALUE, -1));
+#     System.out.println(safeDiv(7, 0));
+#     int sum = 0;
+#     for (int k = 1; k < 20000; k++) sum += div(k, -1) + rem(k, -1) + safeDiv(k, k);
+#     System.out.println(div(Integer.MIN_VALUE, -1));
+#     System.out.println(rem(Integer.MIN_VALUE, -1));
+#     System.out.println(div(7, 0));
+# }
+DIV = ('div', '(II)I')
+REM = ('rem', '(II)I')
+SAFE_DIV = ('safeDiv', '(II)I')
+INT_MIN = -2 ** 31
+write_class('Arithmetic', [
+    DIV + (2, 2, ['iload_0', 'iload_1', 'idiv', 'ireturn']),
+    REM + (2, 2, ['iload_0', 'iload_1', 'irem', 'ireturn']),
+    SAFE_DIV + (2, 3, [
+        'start:',
+        'iload_0', 'iload_1', 'idiv',
+        'end:',
+        'ireturn',
+        'handler:',
+        'astore_2', 'iconst_m1', 'ireturn',
+    ], [('start', 'end', 'handler', 'java/lang/ArithmeticException')]),
+    MAIN + (4, 3, [
+        'getstatic', ('ldc', INT_MIN), 'iconst_m1', ('invokestatic', DIV), 'invokevirtual',
+        'getstatic', ('ldc', INT_MIN), 'iconst_m1', ('invokestatic', REM), 'invokevirtual',
+        'getstatic', ('bipush', 7), 'iconst_0', ('invokestatic', SAFE_DIV), 'invokevirtual',
+        'iconst_0', 'istore_1',
+        'iconst_1', 'istore_2',
+        'loop:',
+        'iload_2', ('sipush', 20000), ('if_icmpge', 'done'),
+        'iload_1', 'iload_2', 'iconst_m1', ('invokestatic', DIV), 'iadd',
+        'iload_2', 'iconst_m1', ('invokestatic', REM), 'iadd',
+        'iload_2', 'iload_2', ('invokestatic', SAFE_DIV), 'iadd', 'istore_1',
+        ('iinc', 2, 1),
+        ('goto', 'loop'),
+        'done:',
+        'getstatic', ('ldc', INT_MIN), 'iconst_m1', ('invokestatic', DIV), 'invokevirtual',
+        'getstatic', ('ldc', INT_MIN), 'iconst_m1', ('invokestatic', REM), 'invokevirtual',
+        'getstatic', ('bipush', 7), 'iconst_0', ('invokestatic', DIV), 'invokevirtual',
+        'return',
+    ]),
+])
+
+# A negative array size throws, interpreted and compiled.
+#
+# static int make(int n) { return new int[n].length; }
+# public static void main(String[] args) {
+#     int sum = 0;
+#     for (int k = 0; k < 20000; k++) sum += make(k & 7);
+#     System.out.println(sum);
+#     System.out.println(make(-1));
+# }
+MAKE = ('make', '(I)I')
+write_class('NegativeSize', [
+    MAKE + (1, 1, ['iload_0', ('newarray', T_INT), 'arraylength', 'ireturn']),
+    MAIN + (3, 3, [
+        'iconst_0', 'istore_1',
+        'iconst_0', 'istore_2',
+        'loop:',
+        'iload_2', ('sipush', 20000), ('if_icmpge', 'done'),
+        'iload_1', 'iload_2', ('bipush', 7), 'iand', ('invokestatic', MAKE), 'iadd', 'istore_1',
+        ('iinc', 2, 1),
+        ('goto', 'loop'),
+        'done:',
+        'getstatic', 'iload_1', 'invokevirtual',
+        'getstatic', 'iconst_m1', ('invokestatic', MAKE), 'invokevirtual',
+        'return',
+    ]),
+])
+
+# Threads stopped at a loop's backward branch, which is fused with the iinc
+# before it, keep their arrays while other threads collect.
+#
+# static void run(int[] data, int arg) {
+#     int[] mine = new int[10];
+#     mine[5] = arg;
+#     for (int i = 0; i < 100000; i++) {
+#         int[] garbage = new int[50];
+#         garbage[0] = i;
+#     }
+#     synchronized (data) {
+#         if (mine[5] == arg) data[0]++;
+#     }
+# }
+# public static void main(String[] args) {
+#     int[] data = new int[1];
+#     int[] ids = new int[4];
+#     for (int k = 0; k < 4; k++) ids[k] = Threads.start(data, k);
+#     for (int k = 0; k < 4; k++) Threads.join(ids[k]);
+#     System.out.println(data[0]);
+# }
+RUN = ('run', '([II)V')
+START = ('tinyjvm/Threads', 'start', '([II)I')
+JOIN = ('tinyjvm/Threads', 'join', '(I)V')
+write_class('ThreadRoots', [
+    RUN + (4, 5, [
+        ('bipush', 10), ('newarray', T_INT), 'astore_2',
+        'aload_2', 'iconst_5', 'iload_1', 'iastore',
+        'iconst_0', 'istore_3',
+        'loop:',
+        'iload_3', ('ldc', 100000), ('if_icmpge', 'done'),
+        ('bipush', 50), ('newarray', T_INT), ('astore', 4),
+        ('aload', 4), 'iconst_0', 'iload_3', 'iastore',
+        ('iinc', 3, 1),
+        ('goto', 'loop'),
+        'done:',
+        'aload_0', 'monitorenter',
+        'aload_2', 'iconst_5', 'iaload', 'iload_1', ('if_icmpne', 'unlock'),
+        'aload_0', 'iconst_0', 'aload_0', 'iconst_0', 'iaload', 'iconst_1', 'iadd', 'iastore',
+        'unlock:',
+        'aload_0', 'monitorexit',
+        'return',
+    ]),
+    MAIN + (4, 4, [
+        'iconst_1', ('newarray', T_INT), 'astore_1',
+        'iconst_4', ('newarray', T_INT), 'astore_2',
+        'iconst_0', 'istore_3',
+        'start:',
+        'iload_3', 'iconst_4', ('if_icmpge', 'started'),
+        'aload_2', 'iload_3', 'aload_1', 'iload_3', ('invokestatic', START), 'iastore',
+        ('iinc', 3, 1),
+        ('goto', 'start'),
+        'started:',
+        'iconst_0', 'istore_3',
+        'join:',
+        'iload_3', 'iconst_4', ('if_icmpge', 'joined'),
+        'aload_2', 'iload_3', 'iaload', ('invokestatic', JOIN),
+        ('iinc', 3, 1),
+        ('goto', 'join'),
+        'joined:',
+        'getstatic', 'aload_1', 'iconst_0', 'iaload', 'invokevirtual',
+        'return',
+    ]),
+])
+
+# Only System.out.println(int) is supported: System.out.print(int) must not
+# be taken for it. main() fails to verify, and stops where it calls print().
+# Called through libtinyjvm (see embed.c), f() and g(), which calls it, are
+# refused without running.
+#
+# static int f(int x) { System.out.print(x); return x; }
+# static int g(int x) { return f(x) + 1; }
+# public static void main(String[] args) {
+#     System.out.println(1);
+#     System.out.print(2);
+# }
+PRINT = ('java/io/PrintStream', 'print', '(I)V')
+F = ('f', '(I)I')
+write_class('PrintOnly', [
+    F + (2, 1, ['getstatic', 'iload_0', ('invokevirtual', PRINT), 'iload_0', 'ireturn']),
+    ('g', '(I)I') + (2, 1, ['iload_0', ('invokestatic', F), 'iconst_1', 'iadd', 'ireturn']),
+    MAIN + (2, 1, [
+        'getstatic', 'iconst_1', 'invokevirtual',
+        'getstatic', 'iconst_2', ('invokevirtual', PRINT),
+        'return',
+    ]),
+])
+
+# Collections on several threads (see CMakeLists.txt) keep every live array:
+# 5000 frames hold one each, enough root slots for several mark tasks, while
+# the deepest churns through garbage and arrays that live a while. Passing
+# the held arrays through id() keeps them out of their frames (see escape.h).
+# With a 2 KB nursery, every other run of 128 garbage arrays is big enough
+# to go straight to the old space, which then has thousands of slots to sweep
+# in several chunks.
+#
+# static int[] id(int[] a) { return a; }
+# static int hold(int depth) {
+#     int[] mine = id(new int[256]);
+#     mine[0] = depth;
+#     return (depth == 0 ? churn(200000) : hold(depth - 1)) + mine[0];
+# }
+# static int churn(int n) {
+#     int[] held = new int[1];
+#     int sum = 0;
+#     for (int i = 0; i < n; i++) {
+#         int[] garbage = new int[(i & 128) + 8];
+#         garbage[0] = i;
+#         if ((i & 1023) == 0) held = garbage;
+#         sum += held[0];
+#     }
+#     return sum + held[0];
+# }
+# public static void main(String[] args) {
+#     System.out.println(hold(5000));
+# }
+ID = ('id', '([I)[I')
+HOLD = ('hold', '(I)I')
+CHURN = ('churn', '(I)I')
+write_class('ParallelGc', [
+    ID + (1, 1, ['aload_0', 'areturn']),
+    HOLD + (4, 2, [
+        ('sipush', 256), ('newarray', T_INT), ('invokestatic', ID), 'astore_1',
+        'aload_1', 'iconst_0', 'iload_0', 'iastore',
+        'iload_0', ('ifne', 'deeper'),
+        ('ldc', 200000), ('invokestatic', CHURN),
+        ('goto', 'add'),
+        'deeper:',
+        'iload_0', 'iconst_1', 'isub', ('invokestatic', HOLD),
+        'add:',
+        'aload_1', 'iconst_0', 'iaload', 'iadd', 'ireturn',
+    ]),
+    CHURN + (3, 5, [
+        'iconst_1', ('newarray', T_INT), 'astore_1',
+        'iconst_0', 'istore_2',
+        'iconst_0', 'istore_3',
+        'loop:',
+        'iload_3', 'iload_0', ('if_icmpge', 'done'),
+        'iload_3', ('sipush', 128), 'iand', ('bipush', 8), 'iadd', ('newarray', T_INT),
+        ('astore', 4),
+        ('aload', 4), 'iconst_0', 'iload_3', 'iastore',
+        'iload_3', ('sipush', 1023), 'iand', ('ifne', 'keep'),
+        ('aload', 4), 'astore_1',
+        'keep:',
+        'iload_2', 'aload_1', 'iconst_0', 'iaload', 'iadd', 'istore_2',
+        ('iinc', 3, 1),
+        ('goto', 'loop'),
+        'done:',
+        'iload_2', 'aload_1', 'iconst_0', 'iaload', 'iadd', 'ireturn',
+    ]),
+    MAIN + (2, 1, ['getstatic', ('sipush', 5000), ('invokestatic', HOLD), 'invokevirtual', 'return']),
+])
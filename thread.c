@@ -0,0 +1,950 @@
+// thread.c
+#include "thread.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "decode.h"
+#include "output.h"
+#include "worksteal.h"
+
+const char THREAD_RUN_METHOD[] = "run";
+const char THREAD_RUN_DESCRIPTOR[] = "([II)V";
+
+/* ThreadSanitizer must be told which stack each switch moves to */
+#if defined(__SANITIZE_THREAD__)
+#define TSAN_FIBERS 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define TSAN_FIBERS 1
+#endif
+#endif
+#ifdef TSAN_FIBERS
+void *__tsan_get_current_fiber(void);
+void *__tsan_create_fiber(unsigned flags);
+void __tsan_destroy_fiber(void *fiber);
+void __tsan_switch_to_fiber(void *fiber, unsigned flags);
+#define FIBER_SWITCH(fiber) __tsan_switch_to_fiber(fiber, 0)
+#else
+#define FIBER_SWITCH(fiber)
+#endif
+
+/** Why a thread switched back to its worker, which finishes the job */
+typedef enum {
+    /** It stays runnable */
+    SWITCH_YIELD,
+    /** It waits to lock `monitor_ref` */
+    SWITCH_MONITOR,
+    /** It waits to be notified on `monitor_ref`, which it unlocks */
+    SWITCH_WAIT,
+    /** It waits for thread `join_id` to finish */
+    SWITCH_JOIN,
+    /** It has finished */
+    SWITCH_EXIT
+} switch_reason_t;
+
+typedef struct vm_thread {
+    struct scheduler *scheduler;
+    /** -1 for the main thread */
+    int32_t id;
+    vm_stack_t *vm_stack;
+    ucontext_t context;
+    uint8_t *native_stack;
+#ifdef TSAN_FIBERS
+    void *fiber;
+#endif
+    /** The worker running it, while it runs */
+    struct worker *worker;
+
+    /** What it runs, and how that ended */
+    method_t *method;
+    int32_t *locals;
+    class_file_t *class;
+    heap_t *heap;
+    optional_value_t result;
+    bool finished;
+
+    switch_reason_t reason;
+    int32_t monitor_ref;
+    /** How many times it holds `monitor_ref` once it gets it */
+    uint32_t monitor_count;
+    int32_t join_id;
+    /** The threads waiting for it to finish */
+    struct vm_thread *joiners;
+    /** The next thread in the same monitor queue, joiner list or free list */
+    struct vm_thread *next;
+} vm_thread_t;
+
+typedef struct worker {
+    struct scheduler *scheduler;
+    uint32_t index;
+    pthread_t os_thread;
+    /** Where the worker picks the next thread */
+    ucontext_t context;
+#ifdef TSAN_FIBERS
+    void *fiber;
+#endif
+    /** Its runnable threads, which it takes oldest first and others steal */
+    deque_t queue;
+    /** The thread it is running, or NULL */
+    _Atomic(vm_thread_t *) current;
+} worker_t;
+
+typedef struct {
+    vm_thread_t *head;
+    vm_thread_t *tail;
+} thread_queue_t;
+
+/** The lock of an array, which exists while it is held or waited on */
+typedef struct monitor {
+    int32_t ref;
+    vm_thread_t *owner;
+    uint32_t count;
+    /** Threads waiting to lock it, and threads waiting to be notified */
+    thread_queue_t entrants;
+    thread_queue_t waiters;
+    struct monitor *next;
+} monitor_t;
+
+/** Monitors are kept in lists hashed by reference, each under its own lock */
+typedef struct {
+    pthread_mutex_t lock;
+    monitor_t *monitors;
+} monitor_stripe_t;
+
+#define MONITOR_STRIPE_BITS 6
+#define MONITOR_STRIPES (1u << MONITOR_STRIPE_BITS)
+
+typedef struct scheduler {
+    worker_t *workers;
+    uint32_t worker_count;
+    vm_thread_t *main;
+
+    /** Guards the fields below that are not atomic */
+    pthread_mutex_t lock;
+    /** Signalled when a thread becomes runnable or the last thread finishes */
+    pthread_cond_t wake;
+    /** Signalled when a thread parks or switches out while the world is stopping */
+    pthread_cond_t stopped;
+    /** Signalled when the world starts again */
+    pthread_cond_t resumed;
+    /** Signalled when the last thread finishes, for the ticker */
+    pthread_cond_t tick;
+    /** Workers waiting for a runnable thread */
+    _Atomic uint32_t idle;
+    /** Threads running on a worker, and how many of those are parked */
+    _Atomic uint32_t running;
+    uint32_t parked;
+    /** Whether a thread is stopping the world */
+    _Atomic bool stopping;
+    /** Threads that have not finished, main included */
+    uint32_t live;
+    bool done;
+    /** Started threads by id; an entry is NULL once its thread finishes */
+    vm_thread_t **threads;
+    uint32_t thread_count;
+    uint32_t thread_capacity;
+    /** Finished threads, whose stacks the next threads reuse */
+    vm_thread_t *free_threads;
+
+    /** Held while allocating without stopping the world */
+    pthread_mutex_t heap_lock;
+    monitor_stripe_t stripes[MONITOR_STRIPES];
+    pthread_t ticker;
+} scheduler_t;
+
+/** Numbers the threads started without a scheduler */
+static _Atomic uint32_t unscheduled_threads;
+
+static inline uint16_t read_u2(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+bool class_starts_threads(class_file_t *cls) {
+    for (uint16_t i = 0; i < cls->methods_count; i++) {
+        const code_attribute_t *code = &cls->methods[i].code;
+        uint32_t pc = 0;
+        while (pc < code->code_length) {
+            uint32_t length = bytecode_length(code->code, pc, code->code_length);
+            if (length == 0) {
+                break;
+            }
+            if (code->code[pc] == i_invokestatic && pc + 2 < code->code_length) {
+                int32_t intrinsic = find_intrinsic(read_u2(&code->code[pc + 1]), cls);
+                if (intrinsic >= 0 && intrinsics[intrinsic].kind == INTRINSIC_THREAD_START) {
+                    return true;
+                }
+            }
+            pc += length;
+        }
+    }
+    return false;
+}
+
+static void queue_add(thread_queue_t *queue, vm_thread_t *thread) {
+    thread->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = thread;
+    }
+    else {
+        queue->head = thread;
+    }
+    queue->tail = thread;
+}
+
+static vm_thread_t *queue_take(thread_queue_t *queue) {
+    vm_thread_t *thread = queue->head;
+    if (thread) {
+        queue->head = thread->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+    }
+    return thread;
+}
+
+/** Whether any thread is waiting on a run queue */
+static bool threads_waiting(scheduler_t *s) {
+    for (uint32_t i = 0; i < s->worker_count; i++) {
+        if (!deque_is_empty(&s->workers[i].queue)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Queues a runnable thread on `worker`, which must be the worker the caller
+ * runs on, and wakes an idle worker if there is one
+ */
+static void make_runnable(worker_t *worker, vm_thread_t *thread) {
+    scheduler_t *s = worker->scheduler;
+    if (!deque_push(&worker->queue, (uintptr_t) thread)) {
+        exit(ERROR);
+    }
+    // Pairs with the increment in next_thread(): either the idle worker
+    // finds the thread or this finds the worker idle
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&s->idle) > 0) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/** Takes the oldest thread on the worker's queue, or else steals one */
+static vm_thread_t *take_thread(worker_t *worker) {
+    scheduler_t *s = worker->scheduler;
+    for (uint32_t i = 0; i < s->worker_count; i++) {
+        deque_t *queue = &s->workers[(worker->index + i) % s->worker_count].queue;
+        uintptr_t item;
+        do {
+            item = deque_steal(queue);
+        } while (item == DEQUE_ABORT);
+        if (item != DEQUE_EMPTY) {
+            return (vm_thread_t *) item;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns the next thread for a worker to run, waiting for one if need be.
+ *
+ * @return NULL once every thread has finished
+ */
+static vm_thread_t *next_thread(worker_t *worker) {
+    scheduler_t *s = worker->scheduler;
+    vm_thread_t *thread = take_thread(worker);
+    if (thread) {
+        return thread;
+    }
+    pthread_mutex_lock(&s->lock);
+    atomic_fetch_add(&s->idle, 1);
+    while (!s->done && !(thread = take_thread(worker))) {
+        // With every worker idle, no thread runs that could wake the others
+        if (atomic_load(&s->idle) == s->worker_count) {
+            fprintf(stderr, "Deadlock: all %u threads are blocked\n", s->live);
+            exit(ERROR);
+        }
+        pthread_cond_wait(&s->wake, &s->lock);
+    }
+    atomic_fetch_sub(&s->idle, 1);
+    pthread_mutex_unlock(&s->lock);
+    return thread;
+}
+
+/** Waits while the world is stopped. The caller holds the scheduler lock. */
+static void park_locked(scheduler_t *s) {
+    s->parked++;
+    pthread_cond_broadcast(&s->stopped);
+    while (atomic_load(&s->stopping)) {
+        pthread_cond_wait(&s->resumed, &s->lock);
+    }
+    s->parked--;
+}
+
+static void park(scheduler_t *s) {
+    pthread_mutex_lock(&s->lock);
+    park_locked(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/** Asks every running thread to stop at its next safepoint */
+static void preempt_running(scheduler_t *s) {
+    for (uint32_t i = 0; i < s->worker_count; i++) {
+        vm_thread_t *thread = atomic_load(&s->workers[i].current);
+        if (thread) {
+            __atomic_store_n(&thread->vm_stack->preempt, true, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/** Returns to the worker, which finishes switching out according to `reason` */
+static void switch_out(vm_thread_t *thread, switch_reason_t reason) {
+    thread->reason = reason;
+    FIBER_SWITCH(thread->worker->fiber);
+    swapcontext(&thread->context, &thread->worker->context);
+}
+
+static monitor_stripe_t *stripe_of(scheduler_t *s, int32_t ref) {
+    return &s->stripes[((uint32_t) ref * 2654435761u) >> (32 - MONITOR_STRIPE_BITS)];
+}
+
+/** Finds the monitor of `ref` in its stripe, which the caller holds, creating it if asked */
+static monitor_t *find_monitor(monitor_stripe_t *stripe, int32_t ref, bool create) {
+    for (monitor_t *monitor = stripe->monitors; monitor; monitor = monitor->next) {
+        if (monitor->ref == ref) {
+            return monitor;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    monitor_t *monitor = calloc(1, sizeof(monitor_t));
+    if (!monitor) {
+        exit(ERROR);
+    }
+    monitor->ref = ref;
+    monitor->next = stripe->monitors;
+    stripe->monitors = monitor;
+    return monitor;
+}
+
+/**
+ * Hands a monitor its holder has fully unlocked to the first thread waiting
+ * to lock it, or frees it if no thread needs it.
+ *
+ * @return the new owner, to make runnable, or NULL
+ */
+static vm_thread_t *release_monitor(monitor_stripe_t *stripe, monitor_t *monitor) {
+    vm_thread_t *next = queue_take(&monitor->entrants);
+    monitor->owner = next;
+    monitor->count = next ? next->monitor_count : 0;
+    if (!next && !monitor->waiters.head) {
+        monitor_t **link = &stripe->monitors;
+        while (*link != monitor) {
+            link = &(*link)->next;
+        }
+        *link = monitor->next;
+        free(monitor);
+    }
+    return next;
+}
+
+/** Files a thread that has finished */
+static void finish_thread(worker_t *worker, vm_thread_t *thread) {
+    scheduler_t *s = worker->scheduler;
+    pthread_mutex_lock(&s->lock);
+    thread->finished = true;
+    if (thread != s->main) {
+        s->threads[thread->id] = NULL;
+        thread->next = s->free_threads;
+        s->free_threads = thread;
+    }
+    vm_thread_t *joiners = thread->joiners;
+    thread->joiners = NULL;
+    if (--s->live == 0) {
+        s->done = true;
+        pthread_cond_broadcast(&s->wake);
+        pthread_cond_broadcast(&s->tick);
+    }
+    pthread_mutex_unlock(&s->lock);
+    while (joiners) {
+        vm_thread_t *next = joiners->next;
+        make_runnable(worker, joiners);
+        joiners = next;
+    }
+}
+
+/** Finishes switching out a thread that has returned to its worker */
+static void file_thread(worker_t *worker, vm_thread_t *thread) {
+    scheduler_t *s = worker->scheduler;
+    vm_thread_t *runnable = NULL;
+    switch (thread->reason) {
+        case SWITCH_YIELD:
+            runnable = thread;
+            break;
+        case SWITCH_MONITOR: {
+            // Its owner may have unlocked it since the thread looked
+            monitor_stripe_t *stripe = stripe_of(s, thread->monitor_ref);
+            pthread_mutex_lock(&stripe->lock);
+            monitor_t *monitor = find_monitor(stripe, thread->monitor_ref, true);
+            if (!monitor->owner) {
+                monitor->owner = thread;
+                monitor->count = thread->monitor_count;
+                runnable = thread;
+            }
+            else {
+                queue_add(&monitor->entrants, thread);
+            }
+            pthread_mutex_unlock(&stripe->lock);
+            break;
+        }
+        case SWITCH_WAIT: {
+            // The thread still holds the monitor, so no notify came meanwhile
+            monitor_stripe_t *stripe = stripe_of(s, thread->monitor_ref);
+            pthread_mutex_lock(&stripe->lock);
+            monitor_t *monitor = find_monitor(stripe, thread->monitor_ref, false);
+            queue_add(&monitor->waiters, thread);
+            runnable = release_monitor(stripe, monitor);
+            pthread_mutex_unlock(&stripe->lock);
+            break;
+        }
+        case SWITCH_JOIN: {
+            pthread_mutex_lock(&s->lock);
+            vm_thread_t *target = s->threads[thread->join_id];
+            if (target) {
+                thread->next = target->joiners;
+                target->joiners = thread;
+            }
+            else {
+                runnable = thread;
+            }
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        case SWITCH_EXIT:
+            finish_thread(worker, thread);
+            break;
+    }
+    if (runnable) {
+        make_runnable(worker, runnable);
+    }
+}
+
+static void run_worker(worker_t *worker) {
+    scheduler_t *s = worker->scheduler;
+    vm_thread_t *thread;
+    while ((thread = next_thread(worker)) != NULL) {
+        thread->worker = worker;
+        __atomic_store_n(&thread->vm_stack->preempt, false, __ATOMIC_RELAXED);
+        // Pairs with scheduler_stop_world(): either it sees this thread
+        // running or this sees the world stopping
+        atomic_store(&worker->current, thread);
+        atomic_fetch_add(&s->running, 1);
+        if (atomic_load(&s->stopping)) {
+            park(s);
+        }
+        FIBER_SWITCH(thread->fiber);
+        swapcontext(&worker->context, &thread->context);
+        atomic_store(&worker->current, NULL);
+        // What it printed comes before anything the threads it wakes print
+        output_flush();
+        file_thread(worker, thread);
+        atomic_fetch_sub(&s->running, 1);
+        if (atomic_load(&s->stopping)) {
+            pthread_mutex_lock(&s->lock);
+            pthread_cond_broadcast(&s->stopped);
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+}
+
+static void *run_worker_thread(void *arg) {
+    worker_t *worker = arg;
+#ifdef TSAN_FIBERS
+    worker->fiber = __tsan_get_current_fiber();
+#endif
+    run_worker(worker);
+    return NULL;
+}
+
+/** Preempts the running threads every time slice while others are waiting */
+static void *run_ticker(void *arg) {
+    scheduler_t *s = arg;
+    pthread_mutex_lock(&s->lock);
+    while (!s->done) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += THREAD_TIME_SLICE_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&s->tick, &s->lock, &deadline);
+        if (!s->done && threads_waiting(s)) {
+            preempt_running(s);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static void thread_entry(uint32_t high, uint32_t low) {
+    vm_thread_t *thread = (vm_thread_t *)(((uintptr_t) high << 16 << 16) | low);
+    if (thread->id >= 0) {
+        // The frame that held the arguments until the thread ran
+        pop_frame(thread->vm_stack);
+    }
+    optional_value_t result = execute(thread->method, thread->locals, thread->class,
+                                      thread->heap, thread->vm_stack);
+    if (thread->id >= 0 && result.exception != EXC_NONE) {
+        char name[32];
+        snprintf(name, sizeof(name), "Thread-%d", thread->id);
+        output_flush();
+        print_uncaught_exception(name, result.exception);
+    }
+    thread->result = result;
+    switch_out(thread, SWITCH_EXIT);
+}
+
+/** Sets up a thread to start running its method when a worker switches to it */
+static void prepare_context(vm_thread_t *thread) {
+    getcontext(&thread->context);
+    // The lowest page guards against overflowing the native stack
+    thread->context.uc_stack.ss_sp = thread->native_stack + sysconf(_SC_PAGESIZE);
+    thread->context.uc_stack.ss_size = THREAD_NATIVE_STACK_SIZE - sysconf(_SC_PAGESIZE);
+    thread->context.uc_link = NULL;
+    uintptr_t address = (uintptr_t) thread;
+    makecontext(&thread->context, (void (*)(void)) thread_entry, 2,
+                (uint32_t)(address >> 16 >> 16), (uint32_t) address);
+}
+
+/**
+ * Creates a thread with a native stack and, unless `vm_stack` is given, a
+ * VM stack of its own
+ */
+static vm_thread_t *new_thread(scheduler_t *s, vm_stack_t *vm_stack, uint32_t max_depth) {
+    vm_thread_t *thread = calloc(1, sizeof(vm_thread_t));
+    if (!thread) {
+        return NULL;
+    }
+    thread->scheduler = s;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void *stack = mmap(NULL, THREAD_NATIVE_STACK_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+    thread->vm_stack = vm_stack ? vm_stack : vm_stack_init(THREAD_VM_STACK_RESERVE, max_depth);
+    if (stack == MAP_FAILED || !thread->vm_stack) {
+        if (stack != MAP_FAILED) {
+            munmap(stack, THREAD_NATIVE_STACK_SIZE);
+        }
+        if (thread->vm_stack && !vm_stack) {
+            vm_stack_free(thread->vm_stack);
+        }
+        free(thread);
+        return NULL;
+    }
+    thread->native_stack = stack;
+    mprotect(stack, (size_t) sysconf(_SC_PAGESIZE), PROT_NONE);
+    thread->vm_stack->thread = thread;
+#ifdef TSAN_FIBERS
+    thread->fiber = __tsan_create_fiber(0);
+#endif
+    return thread;
+}
+
+/** Frees a thread, leaving a VM stack it did not create */
+static void free_thread(vm_thread_t *thread, bool own_vm_stack) {
+#ifdef TSAN_FIBERS
+    __tsan_destroy_fiber(thread->fiber);
+#endif
+    munmap(thread->native_stack, THREAD_NATIVE_STACK_SIZE);
+    if (own_vm_stack) {
+        vm_stack_free(thread->vm_stack);
+    }
+    else {
+        thread->vm_stack->thread = NULL;
+    }
+    free(thread);
+}
+
+/** Runs Threads.start() without a scheduler: run() finishes before it returns */
+static int32_t run_unscheduled(method_t *run, int32_t *args, class_file_t *class,
+                               heap_t *heap, vm_stack_t *vm_stack) {
+    int32_t id = (int32_t) atomic_fetch_add(&unscheduled_threads, 1);
+    // The arguments are already in place for run()'s frame
+    optional_value_t result = execute(run, args, class, heap, vm_stack);
+    if (result.exception != EXC_NONE) {
+        char name[32];
+        snprintf(name, sizeof(name), "Thread-%d", id);
+        output_flush();
+        print_uncaught_exception(name, result.exception);
+    }
+    return id;
+}
+
+/** Starts a thread running `run` on copies of the arguments and returns its id */
+static exception_t start_thread(vm_thread_t *parent, const intrinsic_t *intrinsic,
+                                method_t *run, int32_t *args, class_file_t *class,
+                                heap_t *heap) {
+    scheduler_t *s = parent->scheduler;
+    pthread_mutex_lock(&s->lock);
+    vm_thread_t *thread = s->free_threads;
+    if (thread) {
+        s->free_threads = thread->next;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (thread) {
+        thread->vm_stack->max_depth = parent->vm_stack->max_depth;
+        thread->finished = false;
+    }
+    else {
+        thread = new_thread(s, NULL, parent->vm_stack->max_depth);
+        if (!thread) {
+            exit(ERROR);
+        }
+    }
+    thread->method = run;
+    thread->class = class;
+    thread->heap = heap;
+    // Until the thread runs, its arguments sit in a frame of their own,
+    // where the collector finds them
+    thread->locals = vm_stack_free_slots(thread->vm_stack);
+    memset(thread->locals, 0, run->code.max_locals * sizeof(int32_t));
+    memcpy(thread->locals, args, intrinsic->slots * sizeof(int32_t));
+    if (!push_frame(thread->vm_stack, run, thread->locals)) {
+        pthread_mutex_lock(&s->lock);
+        thread->next = s->free_threads;
+        s->free_threads = thread;
+        pthread_mutex_unlock(&s->lock);
+        return EXC_STACK_OVERFLOW;
+    }
+    prepare_context(thread);
+
+    pthread_mutex_lock(&s->lock);
+    if (s->thread_count == s->thread_capacity) {
+        s->thread_capacity = s->thread_capacity ? s->thread_capacity * 2 : 16;
+        s->threads = realloc(s->threads, s->thread_capacity * sizeof(vm_thread_t *));
+        if (!s->threads) {
+            exit(ERROR);
+        }
+    }
+    thread->id = (int32_t) s->thread_count++;
+    s->threads[thread->id] = thread;
+    s->live++;
+    pthread_mutex_unlock(&s->lock);
+    args[0] = thread->id;
+    // What the parent printed comes before anything the thread prints
+    output_flush();
+    make_runnable(parent->worker, thread);
+    return EXC_NONE;
+}
+
+static void join_thread(vm_thread_t *thread, int32_t id) {
+    scheduler_t *s = thread->scheduler;
+    pthread_mutex_lock(&s->lock);
+    bool running = id >= 0 && (uint32_t) id < s->thread_count && s->threads[id];
+    pthread_mutex_unlock(&s->lock);
+    if (running) {
+        thread->join_id = id;
+        switch_out(thread, SWITCH_JOIN);
+    }
+}
+
+static exception_t wait_monitor(vm_thread_t *thread, int32_t ref) {
+    monitor_stripe_t *stripe = stripe_of(thread->scheduler, ref);
+    pthread_mutex_lock(&stripe->lock);
+    monitor_t *monitor = find_monitor(stripe, ref, false);
+    bool owned = monitor && monitor->owner == thread;
+    if (owned) {
+        thread->monitor_count = monitor->count;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    if (!owned) {
+        return EXC_ILLEGAL_MONITOR_STATE;
+    }
+    // The worker unlocks the monitor once the thread is waiting
+    thread->monitor_ref = ref;
+    switch_out(thread, SWITCH_WAIT);
+    return EXC_NONE;
+}
+
+static exception_t notify_monitor(vm_thread_t *thread, int32_t ref, bool all) {
+    monitor_stripe_t *stripe = stripe_of(thread->scheduler, ref);
+    pthread_mutex_lock(&stripe->lock);
+    monitor_t *monitor = find_monitor(stripe, ref, false);
+    bool owned = monitor && monitor->owner == thread;
+    // The notified threads lock the monitor again before they return from wait()
+    vm_thread_t *waiter;
+    while (owned && (waiter = queue_take(&monitor->waiters))) {
+        queue_add(&monitor->entrants, waiter);
+        if (!all) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return owned ? EXC_NONE : EXC_ILLEGAL_MONITOR_STATE;
+}
+
+void thread_safepoint(vm_stack_t *vm_stack) {
+    vm_thread_t *thread = vm_stack->thread;
+    // Pairs with the release in preempt_running()
+    __atomic_store_n(&vm_stack->preempt, false, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!thread) {
+        return;
+    }
+    scheduler_t *s = thread->scheduler;
+    if (atomic_load(&s->stopping)) {
+        park(s);
+    }
+    if (threads_waiting(s)) {
+        switch_out(thread, SWITCH_YIELD);
+    }
+}
+
+void thread_monitor_enter(vm_stack_t *vm_stack, int32_t ref) {
+    vm_thread_t *thread = vm_stack->thread;
+    if (!thread) {
+        return;
+    }
+    monitor_stripe_t *stripe = stripe_of(thread->scheduler, ref);
+    pthread_mutex_lock(&stripe->lock);
+    monitor_t *monitor = find_monitor(stripe, ref, true);
+    bool acquired = true;
+    if (!monitor->owner) {
+        monitor->owner = thread;
+        monitor->count = 1;
+    }
+    else if (monitor->owner == thread) {
+        monitor->count++;
+    }
+    else {
+        acquired = false;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    if (!acquired) {
+        // The monitor is handed over by the time the thread runs again
+        thread->monitor_ref = ref;
+        thread->monitor_count = 1;
+        switch_out(thread, SWITCH_MONITOR);
+    }
+}
+
+exception_t thread_monitor_exit(vm_stack_t *vm_stack, int32_t ref) {
+    vm_thread_t *thread = vm_stack->thread;
+    if (!thread) {
+        return EXC_NONE;
+    }
+    // Whoever locks the monitor next prints after this thread's output so far
+    output_flush();
+    monitor_stripe_t *stripe = stripe_of(thread->scheduler, ref);
+    pthread_mutex_lock(&stripe->lock);
+    monitor_t *monitor = find_monitor(stripe, ref, false);
+    if (!monitor || monitor->owner != thread) {
+        pthread_mutex_unlock(&stripe->lock);
+        return EXC_ILLEGAL_MONITOR_STATE;
+    }
+    vm_thread_t *next = NULL;
+    if (--monitor->count == 0) {
+        next = release_monitor(stripe, monitor);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    if (next) {
+        make_runnable(thread->worker, next);
+    }
+    return EXC_NONE;
+}
+
+exception_t thread_call(const intrinsic_t *intrinsic, method_t *run, int32_t *args,
+                        class_file_t *class, heap_t *heap, vm_stack_t *vm_stack) {
+    vm_thread_t *thread = vm_stack->thread;
+    switch (intrinsic->kind) {
+        case INTRINSIC_THREAD_START:
+            if (!thread) {
+                args[0] = run_unscheduled(run, args, class, heap, vm_stack);
+                return EXC_NONE;
+            }
+            return start_thread(thread, intrinsic, run, args, class, heap);
+        case INTRINSIC_THREAD_JOIN:
+            if (thread) {
+                join_thread(thread, args[0]);
+            }
+            return EXC_NONE;
+        case INTRINSIC_THREAD_YIELD:
+            if (thread && threads_waiting(thread->scheduler)) {
+                switch_out(thread, SWITCH_YIELD);
+            }
+            return EXC_NONE;
+        case INTRINSIC_WAIT:
+            return thread ? wait_monitor(thread, args[0]) : EXC_NONE;
+        case INTRINSIC_NOTIFY:
+        case INTRINSIC_NOTIFY_ALL:
+            return thread ? notify_monitor(thread, args[0], intrinsic->kind == INTRINSIC_NOTIFY_ALL)
+                          : EXC_NONE;
+        default:
+            return EXC_NONE;
+    }
+}
+
+void scheduler_lock_heap(scheduler_t *s) {
+    while (true) {
+        pthread_mutex_lock(&s->heap_lock);
+        if (!atomic_load(&s->stopping)) {
+            return;
+        }
+        pthread_mutex_unlock(&s->heap_lock);
+        park(s);
+    }
+}
+
+void scheduler_unlock_heap(scheduler_t *s) {
+    pthread_mutex_unlock(&s->heap_lock);
+}
+
+void scheduler_stop_world(scheduler_t *s) {
+    pthread_mutex_lock(&s->lock);
+    // Another thread may have got there first
+    while (atomic_load(&s->stopping)) {
+        park_locked(s);
+    }
+    atomic_store(&s->stopping, true);
+    preempt_running(s);
+    while (atomic_load(&s->running) - s->parked > 1) {
+        pthread_cond_wait(&s->stopped, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void scheduler_start_world(scheduler_t *s) {
+    pthread_mutex_lock(&s->lock);
+    atomic_store(&s->stopping, false);
+    pthread_cond_broadcast(&s->resumed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+vm_stack_t **scheduler_stacks(scheduler_t *s, uint32_t *count) {
+    pthread_mutex_lock(&s->lock);
+    vm_stack_t **stacks = malloc((s->thread_count + 1) * sizeof(vm_stack_t *));
+    if (!stacks) {
+        exit(ERROR);
+    }
+    *count = 0;
+    if (!s->main->finished) {
+        stacks[(*count)++] = s->main->vm_stack;
+    }
+    for (uint32_t i = 0; i < s->thread_count; i++) {
+        if (s->threads[i]) {
+            stacks[(*count)++] = s->threads[i]->vm_stack;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return stacks;
+}
+
+optional_value_t execute_threads(method_t *method, int32_t *locals, class_file_t *class,
+                                 heap_t *heap, vm_stack_t *vm_stack, uint32_t workers) {
+    scheduler_t *s = calloc(1, sizeof(scheduler_t));
+    if (!s) {
+        exit(ERROR);
+    }
+    s->worker_count = workers ? workers : 1;
+    s->workers = calloc(s->worker_count, sizeof(worker_t));
+    if (!s->workers) {
+        exit(ERROR);
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    pthread_cond_init(&s->stopped, NULL);
+    pthread_cond_init(&s->resumed, NULL);
+    pthread_cond_init(&s->tick, NULL);
+    pthread_mutex_init(&s->heap_lock, NULL);
+    for (uint32_t i = 0; i < MONITOR_STRIPES; i++) {
+        pthread_mutex_init(&s->stripes[i].lock, NULL);
+    }
+    for (uint32_t i = 0; i < s->worker_count; i++) {
+        worker_t *worker = &s->workers[i];
+        worker->scheduler = s;
+        worker->index = i;
+        if (!deque_init(&worker->queue, 64)) {
+            exit(ERROR);
+        }
+    }
+
+    // main() is thread -1, running on the VM stack it was given
+    s->main = new_thread(s, vm_stack, vm_stack->max_depth);
+    if (!s->main) {
+        exit(ERROR);
+    }
+    s->main->id = -1;
+    s->main->method = method;
+    s->main->locals = locals;
+    s->main->class = class;
+    s->main->heap = heap;
+    prepare_context(s->main);
+    s->live = 1;
+    heap->scheduler = s;
+    if (!deque_push(&s->workers[0].queue, (uintptr_t) s->main)) {
+        exit(ERROR);
+    }
+
+    // The calling thread is worker 0
+#ifdef TSAN_FIBERS
+    s->workers[0].fiber = __tsan_get_current_fiber();
+#endif
+    if (pthread_create(&s->ticker, NULL, run_ticker, s) != 0) {
+        exit(ERROR);
+    }
+    for (uint32_t i = 1; i < s->worker_count; i++) {
+        if (pthread_create(&s->workers[i].os_thread, NULL, run_worker_thread,
+                           &s->workers[i]) != 0) {
+            exit(ERROR);
+        }
+    }
+    run_worker(&s->workers[0]);
+    for (uint32_t i = 1; i < s->worker_count; i++) {
+        pthread_join(s->workers[i].os_thread, NULL);
+    }
+    pthread_join(s->ticker, NULL);
+
+    heap->scheduler = NULL;
+    optional_value_t result = s->main->result;
+    free_thread(s->main, false);
+    while (s->free_threads) {
+        vm_thread_t *next = s->free_threads->next;
+        free_thread(s->free_threads, true);
+        s->free_threads = next;
+    }
+    for (uint32_t i = 0; i < s->worker_count; i++) {
+        deque_free(&s->workers[i].queue);
+    }
+    for (uint32_t i = 0; i < MONITOR_STRIPES; i++) {
+        // Monitors still held by threads that finished without unlocking them
+        while (s->stripes[i].monitors) {
+            monitor_t *next = s->stripes[i].monitors->next;
+            free(s->stripes[i].monitors);
+            s->stripes[i].monitors = next;
+        }
+        pthread_mutex_destroy(&s->stripes[i].lock);
+    }
+    pthread_mutex_destroy(&s->heap_lock);
+    pthread_cond_destroy(&s->tick);
+    pthread_cond_destroy(&s->resumed);
+    pthread_cond_destroy(&s->stopped);
+    pthread_cond_destroy(&s->wake);
+    pthread_mutex_destroy(&s->lock);
+    free(s->threads);
+    free(s->workers);
+    free(s);
+    return result;
+}
@@ -0,0 +1,131 @@
+// thread.h
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "heap.h"
+#include "intrinsic.h"
+#include "jvm.h"
+#include "read_class.h"
+
+/**
+ * Green threads. The VM has no objects, so there is no java.lang.Thread to
+ * subclass; a program starts threads through the VM's own class instead:
+ *
+ *     package tinyjvm;
+ *     public class Threads {
+ *         // Runs the calling class's static void run(int[] data, int arg)
+ *         // on a new thread and returns the thread's id
+ *         public static native int start(int[] data, int arg);
+ *         public static native void join(int id);
+ *     }
+ *
+ * Thread.yield() works as usual. Any array can be locked with `synchronized`
+ * (monitorenter and monitorexit) and waited on with Object.wait(), notify()
+ * and notifyAll().
+ *
+ * Each VM thread has its own VM stack and native stack, and the threads are
+ * multiplexed M:N onto a fixed pool of worker OS threads. A worker switches
+ * to a thread with swapcontext() and the thread switches back when it
+ * blocks, yields or is preempted; the worker then files it where it belongs,
+ * which closes the race with a thread waking it meanwhile. Runnable threads
+ * go on the run queue of the worker that made them runnable, a Chase-Lev
+ * deque (see worksteal.h) that its worker takes from oldest first; a worker
+ * with an empty queue steals from the others'. Every THREAD_TIME_SLICE_NS a
+ * ticker asks the running threads to switch out if others are waiting.
+ *
+ * execute() polls for that at backward branches and invokes, its
+ * safepoints, where the frame is described for the collector. Code compiled
+ * for a class that starts threads polls at backward branches.
+ *
+ * The threads share one heap. Allocations that need neither a collection
+ * nor a larger handle table go ahead under a lock; the others stop the
+ * world first, letting every other running thread reach a safepoint, and
+ * the collector then scans every thread's VM stack.
+ *
+ * Without a scheduler, as in isolates and embedded VMs, Threads.start()
+ * runs run() to completion before returning, monitors and join() do nothing
+ * and wait() returns at once, as if woken spuriously.
+ */
+
+/** The method a started thread runs, and its descriptor */
+extern const char THREAD_RUN_METHOD[];
+extern const char THREAD_RUN_DESCRIPTOR[];
+
+/** How long a thread runs before it yields to waiting threads */
+#define THREAD_TIME_SLICE_NS 10000000L
+/** The native stack of each thread, on which execute() and compiled code run */
+#define THREAD_NATIVE_STACK_SIZE ((size_t) 8 << 20)
+/** The address space reserved for each started thread's VM stack */
+#define THREAD_VM_STACK_RESERVE ((size_t) 32 << 20)
+
+struct scheduler;
+
+/** Whether any method of a class starts threads, so that it needs a scheduler */
+bool class_starts_threads(class_file_t *cls);
+
+/**
+ * Runs `method` like execute(), as the main thread of a scheduler with
+ * `workers` worker threads, and returns once every thread has finished.
+ * The class must have been prepared with share_class() (see isolate.h).
+ *
+ * @return main()'s result, or the exception it threw
+ */
+optional_value_t execute_threads(method_t *method, int32_t *locals, class_file_t *class,
+                                 heap_t *heap, vm_stack_t *vm_stack, uint32_t workers);
+
+/** Whether the thread running on `vm_stack` should call thread_safepoint() */
+static inline bool thread_preempted(vm_stack_t *vm_stack) {
+    return __atomic_load_n(&vm_stack->preempt, __ATOMIC_RELAXED);
+}
+
+/**
+ * Yields to waiting threads, or waits for the world to start again. The
+ * current frame's `ip` and `top` must describe it, as for gc_new_array().
+ */
+void thread_safepoint(vm_stack_t *vm_stack);
+
+/** Locks the array `ref`, waiting for its owner to unlock it. A safepoint. */
+void thread_monitor_enter(vm_stack_t *vm_stack, int32_t ref);
+
+/**
+ * Unlocks the array `ref` once for each time it was locked.
+ *
+ * @return EXC_ILLEGAL_MONITOR_STATE if the thread does not hold the lock
+ */
+exception_t thread_monitor_exit(vm_stack_t *vm_stack, int32_t ref);
+
+/**
+ * Runs a thread intrinsic on its arguments, args[0] to args[slots - 1], and
+ * writes its result, if any, to args[0]. A safepoint.
+ *
+ * @param run the method Threads.start() runs
+ * @return the exception it threw, or EXC_NONE
+ */
+exception_t thread_call(const intrinsic_t *intrinsic, method_t *run, int32_t *args,
+                        class_file_t *class, heap_t *heap, vm_stack_t *vm_stack);
+
+/*
+ * For the collector (see gc.c), while a heap is shared
+ */
+
+/**
+ * Takes the heap lock, first waiting at a safepoint for the world to start
+ * again if it is stopped
+ */
+void scheduler_lock_heap(struct scheduler *scheduler);
+void scheduler_unlock_heap(struct scheduler *scheduler);
+/** Waits until every other running thread has stopped at a safepoint */
+void scheduler_stop_world(struct scheduler *scheduler);
+void scheduler_start_world(struct scheduler *scheduler);
+/**
+ * Returns the VM stacks of every live thread, in an array the caller frees.
+ * The world must be stopped.
+ */
+vm_stack_t **scheduler_stacks(struct scheduler *scheduler, uint32_t *count);
+
+#endif
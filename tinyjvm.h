@@ -0,0 +1,112 @@
+// tinyjvm.h
+#ifndef TINYJVM_H
+#define TINYJVM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The embedding API, built as libtinyjvm. A VM instance owns the classes
+ * loaded into it, a heap and a VM stack, all of which persist from one call
+ * to the next: each class is parsed and verified once, each method decoded
+ * and compiled once, and a call costs little more than running the method.
+ *
+ *     vm_t *vm = vm_create(NULL);
+ *     vm_class_t *math = vm_load_class(vm, "Math.class");
+ *     vm_method_t *gcd = vm_find_method(math, "gcd", "(II)I");
+ *     int32_t args[] = {84, 36}, result;
+ *     if (vm_invoke(vm, gcd, args, 2, &result) == VM_OK) ...
+ *     vm_destroy(vm);
+ *
+ * Only static methods whose parameters and result are ints (or booleans,
+ * bytes, chars or shorts, passed as ints) can be invoked; arrays they
+ * allocate stay inside the VM. A VM must only be used by one thread at a
+ * time, but different VMs can run on different threads at once. The VM's
+ * tuning knobs (JIT and GC thresholds and the like) are process-wide, as in
+ * the command line VM.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define TINYJVM_API __attribute__((visibility("default")))
+#else
+#define TINYJVM_API
+#endif
+
+typedef struct vm vm_t;
+typedef struct vm_class vm_class_t;
+typedef struct vm_method vm_method_t;
+
+typedef struct {
+    /** Throw StackOverflowError past this many frames; 0 for the default */
+    uint32_t max_depth;
+    /** The size of the heap's nursery in bytes; 0 for the default */
+    size_t nursery_size;
+} vm_options_t;
+
+typedef enum {
+    /** The method returned */
+    VM_OK,
+    /** The method threw; vm_exception() names the exception */
+    VM_EXCEPTION,
+    /** The arguments do not match the method's descriptor */
+    VM_BAD_ARGUMENTS,
+    /** The method, or one it can call, failed verification (see verify.h) */
+    VM_UNSUPPORTED
+} vm_status_t;
+
+/**
+ * Creates a VM.
+ *
+ * @param options the VM's settings, or NULL for the defaults
+ * @return the VM, or NULL if its memory cannot be reserved
+ */
+TINYJVM_API vm_t *vm_create(const vm_options_t *options);
+
+/**
+ * Loads and verifies a class file, or maps it from an archive written by
+ * `tinyjvm --dump-archive` if `archive_path` is not NULL and the archive is
+ * up to date (see archive.h). The class stays loaded until vm_destroy().
+ *
+ * @return the class, or NULL if the file cannot be read or is not a valid class file
+ */
+TINYJVM_API vm_class_t *vm_load_class(vm_t *vm, const char *path, const char *archive_path);
+
+/**
+ * Looks up a method of a loaded class by name and descriptor, e.g. "(II)I".
+ * The method stays valid until vm_destroy().
+ *
+ * @return the method, or NULL if the class has no such method
+ */
+TINYJVM_API vm_method_t *vm_find_method(vm_class_t *cls, const char *name, const char *descriptor);
+
+/**
+ * Runs a method to completion.
+ *
+ * @param args the method's arguments, `arg_count` of them
+ * @param result receives the method's result if it returns one; may be NULL
+ * @return VM_OK, VM_EXCEPTION if the method threw, VM_BAD_ARGUMENTS if
+ *   `arg_count` is not the method's number of parameters or the method
+ *   takes or returns anything but ints, or VM_UNSUPPORTED if the method or
+ *   one it can call uses bytecode the VM does not run, so nothing ran
+ */
+TINYJVM_API vm_status_t vm_invoke(vm_t *vm, vm_method_t *method, const int32_t *args,
+                                  uint32_t arg_count, int32_t *result);
+
+/**
+ * The internal name of the class of the exception the last vm_invoke()
+ * threw, e.g. "java/lang/StackOverflowError", or NULL if it returned
+ */
+TINYJVM_API const char *vm_exception(const vm_t *vm);
+
+/** Frees a VM and every class loaded into it */
+TINYJVM_API void vm_destroy(vm_t *vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,674 @@
+// verify.c
+#include "verify.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "bounds.h"
+#include "decode.h"
+#include "escape.h"
+#include "intrinsic.h"
+#include "jvm.h"
+#include "thread.h"
+
+/**
+ * The type of a local or operand stack slot. An array whose element type is
+ * known has type VT_ARRAY + its atype.
+ */
+enum {
+    /** Unset, or different types along different paths: unusable */
+    VT_TOP,
+    /** int, or any other primitive */
+    VT_INT,
+    /** Any reference, e.g. a caught exception */
+    VT_REF,
+    /** An array of unknown element type */
+    VT_ARRAY
+};
+
+static inline bool is_reference(uint8_t type) {
+    return type >= VT_REF;
+}
+
+static inline bool is_array(uint8_t type) {
+    return type >= VT_ARRAY;
+}
+
+static inline int16_t read_s2(const uint8_t *p) {
+    return (int16_t)((uint16_t) p[0] << 8 | p[1]);
+}
+
+static inline uint16_t read_u2(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+typedef struct {
+    method_t *method;
+    class_file_t *cls;
+    const uint8_t *code;
+    uint32_t length;
+    /** Whether each offset starts an instruction */
+    bool *starts;
+    /** The stack depth before each instruction */
+    uint16_t *depths;
+    /** The types before each instruction: `slots` per offset, locals then stack */
+    uint8_t *types;
+    uint32_t slots;
+    /** The state being transformed by the current instruction */
+    uint8_t *current;
+    uint32_t depth;
+    /** Offsets whose successors still have to be checked */
+    uint32_t *worklist;
+    bool *queued;
+    uint32_t pending;
+} verifier_t;
+
+/**
+ * Merges a state into what is known about `pc`, queueing it again if that
+ * changes anything.
+ *
+ * @return false if `pc` is not an instruction or the stack depths differ
+ */
+static bool merge(verifier_t *v, int64_t pc, uint32_t depth, const uint8_t *types) {
+    if (pc < 0 || pc >= v->length || !v->starts[pc]) {
+        return false;
+    }
+    uint8_t *state = &v->types[(size_t) pc * v->slots];
+    bool changed = false;
+    if (v->depths[pc] == UNREACHED_DEPTH) {
+        v->depths[pc] = (uint16_t) depth;
+        memcpy(state, types, v->slots);
+        changed = true;
+    }
+    else if (v->depths[pc] != depth) {
+        return false;
+    }
+    else {
+        for (uint32_t i = 0; i < v->slots; i++) {
+            if (state[i] == types[i] || state[i] == VT_TOP) {
+                continue;
+            }
+            // Different references merge to the closest common type, anything
+            // else to unusable
+            uint8_t merged = is_array(state[i]) && is_array(types[i])           ? VT_ARRAY
+                             : is_reference(state[i]) && is_reference(types[i]) ? VT_REF
+                                                                                 : VT_TOP;
+            if (state[i] != merged) {
+                state[i] = merged;
+                changed = true;
+            }
+        }
+    }
+    if (changed && !v->queued[pc]) {
+        v->queued[pc] = true;
+        v->worklist[v->pending++] = (uint32_t) pc;
+    }
+    return true;
+}
+
+static bool push(verifier_t *v, uint8_t type) {
+    if (v->depth >= v->method->code.max_stack) {
+        return false;
+    }
+    v->current[v->method->code.max_locals + v->depth++] = type;
+    return true;
+}
+
+/** Whether a value of type `type` can be used where `expected` is */
+static bool assignable(uint8_t type, uint8_t expected) {
+    return expected == VT_TOP || type == expected ||
+           (expected == VT_REF && is_reference(type)) ||
+           (expected == VT_ARRAY && is_array(type));
+}
+
+/**
+ * Pops a value of `type`: any value if `type` is VT_TOP, any reference if
+ * it is VT_REF and any array if it is VT_ARRAY
+ */
+static bool pop(verifier_t *v, uint8_t type, uint8_t *popped) {
+    if (v->depth == 0) {
+        return false;
+    }
+    uint8_t *slot = &v->current[v->method->code.max_locals + --v->depth];
+    *popped = *slot;
+    *slot = VT_TOP;
+    return assignable(*popped, type);
+}
+
+/** Pops a reference to an array whose atype is `atype` or, if not 0, `other` */
+static bool pop_array(verifier_t *v, uint8_t atype, uint8_t other) {
+    uint8_t popped;
+    return pop(v, VT_REF, &popped) &&
+           (popped == VT_ARRAY + atype || (other && popped == VT_ARRAY + other));
+}
+
+static bool pop_type(verifier_t *v, uint8_t type) {
+    uint8_t popped;
+    return pop(v, type, &popped);
+}
+
+/** Checks that local `index` exists and holds a value usable as a `type` */
+static bool local_is(verifier_t *v, uint32_t index, uint8_t type) {
+    return index < v->method->code.max_locals && assignable(v->current[index], type);
+}
+
+/** The slot type of the descriptor field type starting at `p` */
+static uint8_t descriptor_type(const char *p, const char *end) {
+    static const char array_types[] = {
+        [T_BOOLEAN] = 'Z', [T_CHAR] = 'C', [T_FLOAT] = 'F', [T_DOUBLE] = 'D',
+        [T_BYTE] = 'B', [T_SHORT] = 'S', [T_INT] = 'I', [T_LONG] = 'J',
+    };
+    if (*p == 'L') {
+        return VT_REF;
+    }
+    if (*p != '[') {
+        return VT_INT;
+    }
+    for (uint8_t atype = T_BOOLEAN; p + 1 < end && atype <= T_LONG; atype++) {
+        if (p[1] == array_types[atype]) {
+            return VT_ARRAY + atype;
+        }
+    }
+    // An array of references
+    return VT_ARRAY;
+}
+
+/**
+ * Writes the slot types of the parameters a method descriptor lists to `types`.
+ *
+ * @return the number of slots, or -1 if there are more than `max`
+ */
+static int32_t parameter_types(const utf8_t *descriptor, uint8_t *types, uint32_t max) {
+    const char *p = descriptor->bytes;
+    const char *end = p + descriptor->length;
+    uint32_t n = 0;
+    if (p == end || *p++ != '(') {
+        return -1;
+    }
+    while (p < end && *p != ')') {
+        uint8_t type = descriptor_type(p, end);
+        uint32_t size = *p == 'J' || *p == 'D' ? 2 : 1;
+        while (p < end && *p == '[') {
+            p++;
+        }
+        if (p < end && *p == 'L') {
+            while (p < end && *p != ';') {
+                p++;
+            }
+        }
+        p++;
+        if (n + size > max) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < size; i++) {
+            types[n++] = type;
+        }
+    }
+    return (int32_t) n;
+}
+
+/** The slot type a method descriptor returns, or VT_TOP for void */
+static uint8_t return_type(const utf8_t *descriptor) {
+    const char *close = memchr(descriptor->bytes, ')', descriptor->length);
+    const char *end = descriptor->bytes + descriptor->length;
+    return close && close + 1 < end && close[1] != 'V' ? descriptor_type(close + 1, end)
+                                                       : VT_TOP;
+}
+
+/**
+ * Applies an invokestatic of a method with this descriptor to the current
+ * state; its parameters must fit in `max_slots` slots
+ */
+static bool invoke(verifier_t *v, const utf8_t *descriptor, uint32_t max_slots) {
+    uint8_t params[256];
+    int32_t n = parameter_types(descriptor, params, sizeof(params));
+    if (n < 0 || (uint32_t) n > max_slots) {
+        return false;
+    }
+    for (int32_t i = n - 1; i >= 0; i--) {
+        if (!pop_type(v, params[i])) {
+            return false;
+        }
+    }
+    uint8_t result = return_type(descriptor);
+    return result == VT_TOP || push(v, result);
+}
+
+/** Merges the locals before and after an instruction into the handlers covering it */
+static bool reach_handlers(verifier_t *v, uint32_t pc, const uint8_t *before) {
+    const code_attribute_t *attr = &v->method->code;
+    const uint8_t *entry = attr->exception_table;
+    uint8_t *state = malloc(v->slots);
+    bool ok = state != NULL;
+    for (uint16_t i = 0; ok && i < attr->exception_table_length; i++, entry += 8) {
+        if (pc < read_u2(&entry[0]) || pc >= read_u2(&entry[2])) {
+            continue;
+        }
+        // The handler finds the exception alone on the stack
+        for (int pass = 0; ok && pass < 2; pass++) {
+            memcpy(state, pass == 0 ? before : v->current, attr->max_locals);
+            memset(state + attr->max_locals, VT_TOP, attr->max_stack);
+            state[attr->max_locals] = VT_REF;
+            ok = merge(v, read_u2(&entry[4]), 1, state);
+        }
+    }
+    free(state);
+    return ok;
+}
+
+/** Checks the instruction at `pc` and merges its result into its successors */
+static bool verify_insn(verifier_t *v, uint32_t pc) {
+    const uint8_t *code = v->code;
+    method_t *method = v->method;
+    class_file_t *cls = v->cls;
+    uint8_t op = code[pc];
+    const uint8_t *before = &v->types[(size_t) pc * v->slots];
+    memcpy(v->current, before, v->slots);
+    v->depth = v->depths[pc];
+    uint8_t *locals = v->current;
+    bool ok = true;
+    bool branches = false;
+    int64_t target = 0;
+    bool falls_through = true;
+    uint8_t value;
+    switch (op) {
+        case i_nop:
+            break;
+        case i_getstatic:
+            // Only System.out, which pushes nothing (see is_system_out)
+            ok = is_system_out(read_u2(&code[pc + 1]), cls);
+            break;
+        case i_iconst_m1:
+        case i_iconst_0:
+        case i_iconst_1:
+        case i_iconst_2:
+        case i_iconst_3:
+        case i_iconst_4:
+        case i_iconst_5:
+        case i_bipush:
+        case i_sipush:
+            ok = push(v, VT_INT);
+            break;
+        case i_ldc: {
+            uint8_t index = code[pc + 1];
+            ok = index > 0 && index < cls->constant_pool_count &&
+                 (cls->constant_pool[index - 1].tag == CONSTANT_Integer ||
+                  cls->constant_pool[index - 1].tag == CONSTANT_Float) &&
+                 push(v, VT_INT);
+            break;
+        }
+        case i_iload:
+            ok = local_is(v, code[pc + 1], VT_INT) && push(v, VT_INT);
+            break;
+        case i_iload_0:
+        case i_iload_1:
+        case i_iload_2:
+        case i_iload_3:
+            ok = local_is(v, op - i_iload_0, VT_INT) && push(v, VT_INT);
+            break;
+        case i_aload:
+        case i_aload_0:
+        case i_aload_1:
+        case i_aload_2:
+        case i_aload_3: {
+            uint32_t index = op == i_aload ? code[pc + 1] : (uint32_t)(op - i_aload_0);
+            ok = local_is(v, index, VT_REF) && push(v, locals[index]);
+            break;
+        }
+        case i_istore:
+        case i_istore_0:
+        case i_istore_1:
+        case i_istore_2:
+        case i_istore_3: {
+            uint32_t index = op == i_istore ? code[pc + 1] : (uint32_t)(op - i_istore_0);
+            ok = local_is(v, index, VT_TOP) && pop_type(v, VT_INT);
+            if (ok) {
+                locals[index] = VT_INT;
+            }
+            break;
+        }
+        case i_astore:
+        case i_astore_0:
+        case i_astore_1:
+        case i_astore_2:
+        case i_astore_3: {
+            uint32_t index = op == i_astore ? code[pc + 1] : (uint32_t)(op - i_astore_0);
+            ok = local_is(v, index, VT_TOP) && pop(v, VT_REF, &value);
+            if (ok) {
+                locals[index] = value;
+            }
+            break;
+        }
+        case i_iinc:
+            ok = local_is(v, code[pc + 1], VT_INT);
+            break;
+        case i_iadd:
+        case i_isub:
+        case i_imul:
+        case i_idiv:
+        case i_irem:
+        case i_ishl:
+        case i_ishr:
+        case i_iushr:
+        case i_iand:
+        case i_ior:
+        case i_ixor:
+            ok = pop_type(v, VT_INT) && pop_type(v, VT_INT) && push(v, VT_INT);
+            break;
+        case i_ineg:
+            ok = pop_type(v, VT_INT) && push(v, VT_INT);
+            break;
+        case i_dup:
+            ok = pop(v, VT_TOP, &value) && push(v, value) && push(v, value);
+            break;
+        case i_ifeq:
+        case i_ifne:
+        case i_iflt:
+        case i_ifge:
+        case i_ifgt:
+        case i_ifle:
+            ok = pop_type(v, VT_INT);
+            branches = true;
+            target = (int64_t) pc + read_s2(&code[pc + 1]);
+            break;
+        case i_if_icmpeq:
+        case i_if_icmpne:
+        case i_if_icmplt:
+        case i_if_icmpge:
+        case i_if_icmpgt:
+        case i_if_icmple:
+            ok = pop_type(v, VT_INT) && pop_type(v, VT_INT);
+            branches = true;
+            target = (int64_t) pc + read_s2(&code[pc + 1]);
+            break;
+        case i_goto:
+            branches = true;
+            target = (int64_t) pc + read_s2(&code[pc + 1]);
+            falls_through = false;
+            break;
+        case i_invokestatic: {
+            uint16_t index = read_u2(&code[pc + 1]);
+            method_t *callee = find_method_from_index(index, cls);
+            int32_t intrinsic = callee ? -1 : find_intrinsic(index, cls);
+            if (callee) {
+                ok = invoke(v, callee->descriptor, callee->code.max_locals);
+            }
+            else if (intrinsic >= 0 && !intrinsics[intrinsic].is_virtual) {
+                const char *descriptor = intrinsics[intrinsic].descriptor;
+                utf8_t symbol = {descriptor, (uint16_t) strlen(descriptor)};
+                ok = invoke(v, &symbol, intrinsics[intrinsic].slots);
+                // Threads.start() needs the run() it will call
+                if (intrinsics[intrinsic].kind == INTRINSIC_THREAD_START) {
+                    method_t *run = find_method(THREAD_RUN_METHOD, THREAD_RUN_DESCRIPTOR, cls);
+                    ok = ok && run && run->code.max_locals >= intrinsics[intrinsic].slots;
+                }
+            }
+            else {
+                ok = false;
+            }
+            break;
+        }
+        case i_invokevirtual: {
+            int32_t intrinsic = find_intrinsic(read_u2(&code[pc + 1]), cls);
+            if (intrinsic >= 0 && intrinsics[intrinsic].is_virtual) {
+                // Object.wait() and the like, on an array
+                ok = pop_type(v, VT_ARRAY);
+            }
+            else {
+                // System.out.println(int); getstatic pushed nothing
+                ok = is_println(read_u2(&code[pc + 1]), cls) && pop_type(v, VT_INT);
+            }
+            break;
+        }
+        case i_monitorenter:
+        case i_monitorexit:
+            ok = pop_type(v, VT_ARRAY);
+            break;
+        case i_newarray:
+            ok = is_array_type(code[pc + 1]) && pop_type(v, VT_INT) &&
+                 push(v, VT_ARRAY + code[pc + 1]);
+            break;
+        case i_arraylength:
+            ok = pop_type(v, VT_ARRAY) && push(v, VT_INT);
+            break;
+        case i_iaload:
+            ok = pop_type(v, VT_INT) && pop_array(v, T_INT, 0) && push(v, VT_INT);
+            break;
+        case i_baload:
+            ok = pop_type(v, VT_INT) && pop_array(v, T_BYTE, T_BOOLEAN) && push(v, VT_INT);
+            break;
+        case i_caload:
+            ok = pop_type(v, VT_INT) && pop_array(v, T_CHAR, 0) && push(v, VT_INT);
+            break;
+        case i_saload:
+            ok = pop_type(v, VT_INT) && pop_array(v, T_SHORT, 0) && push(v, VT_INT);
+            break;
+        case i_laload:
+            ok = pop_type(v, VT_INT) && pop_array(v, T_LONG, 0) && push(v, VT_INT) &&
+                 push(v, VT_INT);
+            break;
+        case i_iastore:
+            ok = pop_type(v, VT_INT) && pop_type(v, VT_INT) && pop_array(v, T_INT, 0);
+            break;
+        case i_bastore:
+            ok = pop_type(v, VT_INT) && pop_type(v, VT_INT) && pop_array(v, T_BYTE, T_BOOLEAN);
+            break;
+        case i_castore:
+            ok = pop_type(v, VT_INT) && pop_type(v, VT_INT) && pop_array(v, T_CHAR, 0);
+            break;
+        case i_sastore:
+            ok = pop_type(v, VT_INT) && pop_type(v, VT_INT) && pop_array(v, T_SHORT, 0);
+            break;
+        case i_lastore:
+            ok = pop_type(v, VT_INT) && pop_type(v, VT_INT) && pop_type(v, VT_INT) &&
+                 pop_array(v, T_LONG, 0);
+            break;
+        case i_ireturn:
+        case i_areturn:
+            ok = returns_value(method) &&
+                 is_reference(return_type(method->descriptor)) == (op == i_areturn) &&
+                 pop_type(v, return_type(method->descriptor));
+            falls_through = false;
+            break;
+        case i_return:
+            ok = !returns_value(method);
+            falls_through = false;
+            break;
+        default:
+            ok = false;
+            break;
+    }
+    ok = ok && reach_handlers(v, pc, before);
+    if (ok && branches) {
+        ok = merge(v, target, v->depth, v->current);
+    }
+    if (ok && falls_through) {
+        ok = merge(v, (int64_t) pc + bytecode_length(code, pc, v->length), v->depth, v->current);
+    }
+    return ok;
+}
+
+/**
+ * Runs the dataflow analysis, leaving the state before each instruction in
+ * `v->depths` and `v->types`. The caller frees the verifier's arrays.
+ */
+static bool run_verifier(verifier_t *v, method_t *method, class_file_t *cls) {
+    const code_attribute_t *attr = &method->code;
+    uint32_t length = attr->code_length;
+    *v = (verifier_t){
+        .method = method,
+        .cls = cls,
+        .code = attr->code,
+        .length = length,
+        .slots = (uint32_t) attr->max_locals + attr->max_stack,
+    };
+    if (!v->code || length == 0 || length > UINT16_MAX) {
+        return false;
+    }
+    v->starts = calloc(length, sizeof(bool));
+    v->queued = calloc(length, sizeof(bool));
+    v->depths = malloc(length * sizeof(uint16_t));
+    v->types = malloc((size_t) length * v->slots + 1);
+    v->current = malloc(v->slots + 1);
+    v->worklist = malloc(length * sizeof(uint32_t));
+    bool ok = v->starts && v->queued && v->depths && v->types && v->current && v->worklist;
+
+    // Every instruction must be supported, reachable or not: decode_method()
+    // stops at the first one that isn't
+    for (uint32_t pc = 0, n; ok && pc < length; pc += n) {
+        n = bytecode_length(v->code, pc, length);
+        ok = n > 0;
+        v->starts[pc] = ok;
+    }
+    for (uint32_t pc = 0; ok && pc < length; pc++) {
+        v->depths[pc] = UNREACHED_DEPTH;
+    }
+
+    // Exception ranges must cover whole instructions
+    const uint8_t *entry = attr->exception_table;
+    for (uint16_t i = 0; ok && i < attr->exception_table_length; i++, entry += 8) {
+        uint16_t start_pc = read_u2(&entry[0]);
+        uint16_t end_pc = read_u2(&entry[2]);
+        ok = start_pc < end_pc && end_pc <= length && v->starts[start_pc] &&
+             (end_pc == length || v->starts[end_pc]) && attr->max_stack >= 1;
+    }
+
+    // Parameters are the first locals; the rest start unset
+    if (ok) {
+        memset(v->current, VT_TOP, v->slots);
+        ok = parameter_types(method->descriptor, v->current, attr->max_locals) >= 0 &&
+             merge(v, 0, 0, v->current);
+    }
+    while (ok && v->pending > 0) {
+        uint32_t pc = v->worklist[--v->pending];
+        v->queued[pc] = false;
+        ok = verify_insn(v, pc);
+    }
+    return ok;
+}
+
+static void free_verifier(verifier_t *v) {
+    free(v->starts);
+    free(v->queued);
+    free(v->depths);
+    free(v->types);
+    free(v->current);
+    free(v->worklist);
+}
+
+bool verify_method(method_t *method, class_file_t *cls, uint16_t *depths) {
+    verifier_t v;
+    bool ok = run_verifier(&v, method, cls);
+    if (ok && depths) {
+        memcpy(depths, v.depths, v.length * sizeof(uint16_t));
+    }
+    free_verifier(&v);
+    return ok;
+}
+
+void verify_class(class_file_t *cls) {
+    for (uint16_t i = 0; i < cls->methods_count; i++) {
+        method_t *method = &cls->methods[i];
+        method->ref_maps = build_ref_maps(method, cls);
+        method->verified = method->ref_maps != NULL;
+        method->in_bounds = find_in_bounds_accesses(method, cls);
+        method->frame_arrays = find_frame_arrays(method, cls);
+    }
+}
+
+/**
+ * Whether the instruction at `pc` can allocate, call or stop its thread, so
+ * a collection can see it
+ */
+static bool is_safepoint(const uint8_t *code, uint32_t pc) {
+    switch (code[pc]) {
+        case i_invokestatic:
+        case i_invokevirtual:
+        case i_newarray:
+        case i_monitorenter:
+        case i_monitorexit:
+            return true;
+        case i_goto:
+        case i_ifeq:
+        case i_ifne:
+        case i_iflt:
+        case i_ifge:
+        case i_ifgt:
+        case i_ifle:
+        case i_if_icmpeq:
+        case i_if_icmpne:
+        case i_if_icmplt:
+        case i_if_icmpge:
+        case i_if_icmpgt:
+        case i_if_icmple:
+            // Threads are preempted at backward branches (see thread.h)
+            return read_s2(&code[pc + 1]) <= 0;
+        default:
+            return false;
+    }
+}
+
+ref_map_t *build_ref_maps(method_t *method, class_file_t *cls) {
+    verifier_t v;
+    ref_map_t *maps = NULL;
+    if (run_verifier(&v, method, cls)) {
+        maps = calloc(1, sizeof(ref_map_t));
+    }
+    uint32_t count = 0;
+    for (uint32_t pc = 0; maps && pc < v.length; pc++) {
+        count += v.starts[pc] && v.depths[pc] != UNREACHED_DEPTH && is_safepoint(v.code, pc);
+    }
+    if (maps) {
+        maps->slots = v.slots;
+        maps->pcs = malloc((count ? count : 1) * sizeof(uint16_t));
+        maps->bits = calloc(((size_t) count * v.slots + 7) / 8 + 1, 1);
+        if (!maps->pcs || !maps->bits) {
+            free_ref_maps(maps);
+            maps = NULL;
+        }
+    }
+    for (uint32_t pc = 0; maps && pc < v.length; pc++) {
+        if (!v.starts[pc] || v.depths[pc] == UNREACHED_DEPTH || !is_safepoint(v.code, pc)) {
+            continue;
+        }
+        const uint8_t *types = &v.types[(size_t) pc * v.slots];
+        size_t base = (size_t) maps->count * v.slots;
+        uint32_t live = method->code.max_locals + v.depths[pc];
+        for (uint32_t slot = 0; slot < live; slot++) {
+            if (is_reference(types[slot])) {
+                maps->bits[(base + slot) / 8] |= (uint8_t)(1u << ((base + slot) % 8));
+            }
+        }
+        maps->pcs[maps->count++] = (uint16_t) pc;
+    }
+    free_verifier(&v);
+    return maps;
+}
+
+const uint8_t *find_ref_map(const ref_map_t *maps, uint16_t pc, size_t *first_bit) {
+    uint32_t low = 0;
+    uint32_t high = maps->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (maps->pcs[mid] < pc) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    if (low == maps->count || maps->pcs[low] != pc) {
+        return NULL;
+    }
+    *first_bit = (size_t) low * maps->slots;
+    return maps->bits;
+}
+
+void free_ref_maps(ref_map_t *maps) {
+    if (maps) {
+        free(maps->pcs);
+        free(maps->bits);
+        free(maps);
+    }
+}
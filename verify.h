@@ -0,0 +1,67 @@
+// verify.h
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "read_class.h"
+
+/** The depth verify_method() reports for unreachable bytecode */
+#define UNREACHED_DEPTH UINT16_MAX
+
+/**
+ * Checks a method's bytecode once, before it runs. Every instruction must be
+ * supported; branches and exception handlers must land on instruction
+ * boundaries; execution must not fall off the end of the code; local
+ * variable indices must be below max_locals; and the operand stack must have
+ * the same depth along every path to an instruction, never underflow and
+ * never exceed max_stack. Every local and stack slot must hold an int or a
+ * reference as the instructions using it expect, and returns must match the
+ * descriptor. execute() skips its runtime stack and local checks for methods
+ * that pass, and the garbage collector scans their frames precisely.
+ *
+ * @param depths if not NULL, receives the operand stack depth before the
+ *   instruction at each offset (code_length entries), or UNREACHED_DEPTH
+ * @return whether the method is valid
+ */
+bool verify_method(method_t *method, class_file_t *cls, uint16_t *depths);
+
+/**
+ * Verifies every method of a class, setting each method's `verified` flag,
+ * reference maps and in-bounds array accesses
+ */
+void verify_class(class_file_t *cls);
+
+/**
+ * Which slots of a verified method's frame hold references at each
+ * safepoint, i.e. each instruction that may allocate, call or stop its
+ * thread, backward branches included. Slot `i` is local `i` for
+ * i < max_locals and operand stack entry `i - max_locals` after that; for a
+ * call, the state is the one before the arguments are popped.
+ */
+typedef struct ref_map {
+    /** The sorted bytecode offsets of the safepoints */
+    uint16_t *pcs;
+    uint32_t count;
+    /** max_locals + max_stack */
+    uint32_t slots;
+    /** `slots` bits per safepoint */
+    uint8_t *bits;
+} ref_map_t;
+
+/** Computes a method's reference maps, or returns NULL if it does not verify */
+ref_map_t *build_ref_maps(method_t *method, class_file_t *cls);
+
+/**
+ * Looks up the map for the safepoint at `pc`.
+ *
+ * @param first_bit receives the index in the returned bits of slot 0
+ * @return the maps' bits, or NULL if `pc` is not a safepoint
+ */
+const uint8_t *find_ref_map(const ref_map_t *maps, uint16_t pc, size_t *first_bit);
+
+void free_ref_maps(ref_map_t *maps);
+
+#endif
@@ -0,0 +1,226 @@
+// vm.c
+#include "tinyjvm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "archive.h"
+#include "decode.h"
+#include "frame.h"
+#include "gc.h"
+#include "heap.h"
+#include "intrinsic.h"
+#include "jvm.h"
+#include "output.h"
+#include "read_class.h"
+#include "simd.h"
+#include "thread.h"
+#include "verify.h"
+
+struct vm_method {
+    method_t *method;
+    vm_class_t *owner;
+    /** Set once the descriptor has been checked, see check_descriptor() */
+    bool checked;
+    /** Whether it only takes and returns ints, and how many */
+    bool callable;
+    uint16_t parameters;
+    bool returns_value;
+    /** Whether it and everything it calls verified, see calls_only_verified() */
+    bool supported;
+};
+
+struct vm_class {
+    class_file_t *class;
+    /** One handle per method, in the order of class->methods */
+    vm_method_t *methods;
+    vm_class_t *next;
+};
+
+struct vm {
+    heap_t *heap;
+    vm_stack_t *vm_stack;
+    vm_class_t *classes;
+    exception_t exception;
+};
+
+vm_t *vm_create(const vm_options_t *options) {
+    vm_options_t defaults = {0};
+    if (!options) {
+        options = &defaults;
+    }
+    simd_init();
+    vm_t *vm = calloc(1, sizeof(vm_t));
+    if (!vm) {
+        return NULL;
+    }
+    vm->heap = heap_init(options->nursery_size ? options->nursery_size : gc_nursery_size);
+    vm->vm_stack = vm_stack_init(VM_STACK_RESERVE,
+                                 options->max_depth ? options->max_depth : VM_STACK_MAX_DEPTH);
+    if (!vm->heap || !vm->vm_stack) {
+        vm_destroy(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+vm_class_t *vm_load_class(vm_t *vm, const char *path, const char *archive_path) {
+    class_file_t *class = archive_path ? map_class_archive(archive_path, path) : NULL;
+    if (!class) {
+        FILE *class_file = fopen(path, "r");
+        if (!class_file) {
+            return NULL;
+        }
+        class = get_class(class_file);
+        fclose(class_file);
+        if (!class) {
+            return NULL;
+        }
+        verify_class(class);
+    }
+    vm_class_t *cls = calloc(1, sizeof(vm_class_t));
+    vm_method_t *methods = calloc(class->methods_count ? class->methods_count : 1,
+                                  sizeof(vm_method_t));
+    if (!cls || !methods) {
+        free(cls);
+        free(methods);
+        free_class(class);
+        return NULL;
+    }
+    for (uint16_t i = 0; i < class->methods_count; i++) {
+        methods[i] = (vm_method_t){.method = &class->methods[i], .owner = cls};
+    }
+    cls->class = class;
+    cls->methods = methods;
+    cls->next = vm->classes;
+    vm->classes = cls;
+    return cls;
+}
+
+vm_method_t *vm_find_method(vm_class_t *cls, const char *name, const char *descriptor) {
+    method_t *method = find_method(name, descriptor, cls->class);
+    return method ? &cls->methods[method - cls->class->methods] : NULL;
+}
+
+/** Whether every parameter and the result, if any, is an int or narrower */
+static bool check_descriptor(vm_method_t *m) {
+    const utf8_t *descriptor = m->method->descriptor;
+    const char *p = descriptor->bytes;
+    const char *end = p + descriptor->length;
+    if (p == end || *p++ != '(') {
+        return false;
+    }
+    while (p < end && *p != ')') {
+        if (!strchr("IZBCS", *p)) {
+            return false;
+        }
+        p++;
+    }
+    if (p + 2 != end) {
+        return false;
+    }
+    m->parameters = get_number_of_parameters(m->method);
+    m->returns_value = returns_value(m->method);
+    return p[1] == 'V' || strchr("IZBCS", p[1]);
+}
+
+static inline uint16_t read_u2(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/**
+ * Whether a method and every method it can call passed verification. The
+ * interpreter runs unverified methods with checks that end the process at
+ * the first instruction it cannot run, which an embedding host must not see.
+ */
+static bool calls_only_verified(method_t *method, class_file_t *cls) {
+    bool *seen = calloc(cls->methods_count, sizeof(bool));
+    method_t **pending = malloc(cls->methods_count * sizeof(method_t *));
+    uint32_t count = 0;
+    bool ok = seen && pending;
+    if (ok) {
+        seen[method - cls->methods] = true;
+        pending[count++] = method;
+    }
+    while (ok && count > 0) {
+        method_t *m = pending[--count];
+        ok = m->verified;
+        const uint8_t *code = m->code.code;
+        uint32_t length = m->code.code_length;
+        for (uint32_t pc = 0, n; ok && pc < length; pc += n) {
+            n = bytecode_length(code, pc, length);
+            if (n == 0 || code[pc] != i_invokestatic) {
+                continue;
+            }
+            uint16_t index = read_u2(&code[pc + 1]);
+            method_t *callee = find_method_from_index(index, cls);
+            int32_t intrinsic = callee ? -1 : find_intrinsic(index, cls);
+            if (intrinsic >= 0 && intrinsics[intrinsic].kind == INTRINSIC_THREAD_START) {
+                callee = find_method(THREAD_RUN_METHOD, THREAD_RUN_DESCRIPTOR, cls);
+            }
+            if (callee && !seen[callee - cls->methods]) {
+                seen[callee - cls->methods] = true;
+                pending[count++] = callee;
+            }
+        }
+    }
+    free(seen);
+    free(pending);
+    return ok;
+}
+
+vm_status_t vm_invoke(vm_t *vm, vm_method_t *method, const int32_t *args,
+                      uint32_t arg_count, int32_t *result) {
+    if (!method->checked) {
+        method->callable = check_descriptor(method) &&
+                           method->method->code.max_locals >= method->parameters;
+        method->supported = calls_only_verified(method->method, method->owner->class);
+        method->checked = true;
+    }
+    if (!method->callable || arg_count != method->parameters) {
+        return VM_BAD_ARGUMENTS;
+    }
+    if (!method->supported) {
+        return VM_UNSUPPORTED;
+    }
+    method_t *m = method->method;
+    int32_t *locals = vm_stack_free_slots(vm->vm_stack);
+    memset(locals, 0, m->code.max_locals * sizeof(int32_t));
+    if (arg_count > 0) {
+        memcpy(locals, args, arg_count * sizeof(int32_t));
+    }
+    optional_value_t value = execute(m, locals, method->owner->class, vm->heap, vm->vm_stack);
+    // Anything the method printed reaches the host's stdout before this returns
+    output_flush();
+    vm->exception = value.exception;
+    if (value.exception != EXC_NONE) {
+        return VM_EXCEPTION;
+    }
+    if (result && value.has_value) {
+        *result = value.value;
+    }
+    return VM_OK;
+}
+
+const char *vm_exception(const vm_t *vm) {
+    return vm->exception == EXC_NONE ? NULL : exception_class_name(vm->exception);
+}
+
+void vm_destroy(vm_t *vm) {
+    while (vm->classes) {
+        vm_class_t *next = vm->classes->next;
+        free_class(vm->classes->class);
+        free(vm->classes->methods);
+        free(vm->classes);
+        vm->classes = next;
+    }
+    if (vm->heap) {
+        heap_free(vm->heap);
+    }
+    if (vm->vm_stack) {
+        vm_stack_free(vm->vm_stack);
+    }
+    free(vm);
+}
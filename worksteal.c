@@ -0,0 +1,314 @@
+// worksteal.c
+#include "worksteal.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+bool deque_init(deque_t *d, uint32_t capacity) {
+    int64_t size = 16;
+    while (size < capacity) {
+        size *= 2;
+    }
+    deque_buffer_t *buffer = malloc(sizeof(deque_buffer_t) + (size_t) size * sizeof(uintptr_t));
+    if (!buffer) {
+        return false;
+    }
+    buffer->mask = size - 1;
+    buffer->retired = NULL;
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    atomic_init(&d->buffer, buffer);
+    return true;
+}
+
+void deque_free(deque_t *d) {
+    deque_buffer_t *buffer = atomic_load_explicit(&d->buffer, memory_order_relaxed);
+    while (buffer) {
+        deque_buffer_t *retired = buffer->retired;
+        free(buffer);
+        buffer = retired;
+    }
+}
+
+/** Replaces a full buffer with one twice its size holding the items in [t, b) */
+static deque_buffer_t *deque_grow(deque_t *d, deque_buffer_t *buffer, int64_t t, int64_t b) {
+    int64_t size = (buffer->mask + 1) * 2;
+    deque_buffer_t *grown = malloc(sizeof(deque_buffer_t) + (size_t) size * sizeof(uintptr_t));
+    if (!grown) {
+        return NULL;
+    }
+    grown->mask = size - 1;
+    grown->retired = buffer;
+    for (int64_t i = t; i < b; i++) {
+        uintptr_t item = atomic_load_explicit(&buffer->items[i & buffer->mask],
+                                              memory_order_relaxed);
+        atomic_store_explicit(&grown->items[i & grown->mask], item, memory_order_relaxed);
+    }
+    atomic_store_explicit(&d->buffer, grown, memory_order_release);
+    return grown;
+}
+
+bool deque_push(deque_t *d, uintptr_t item) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    deque_buffer_t *buffer = atomic_load_explicit(&d->buffer, memory_order_relaxed);
+    if (b - t > buffer->mask) {
+        buffer = deque_grow(d, buffer, t, b);
+        if (!buffer) {
+            return false;
+        }
+    }
+    atomic_store_explicit(&buffer->items[b & buffer->mask], item, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+uintptr_t deque_pop(deque_t *d) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    deque_buffer_t *buffer = atomic_load_explicit(&d->buffer, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return DEQUE_EMPTY;
+    }
+    uintptr_t item = atomic_load_explicit(&buffer->items[b & buffer->mask], memory_order_relaxed);
+    if (t == b) {
+        // The last item: race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            item = DEQUE_EMPTY;
+        }
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+uintptr_t deque_steal(deque_t *d) {
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return DEQUE_EMPTY;
+    }
+    deque_buffer_t *buffer = atomic_load_explicit(&d->buffer, memory_order_acquire);
+    uintptr_t item = atomic_load_explicit(&buffer->items[t & buffer->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return DEQUE_ABORT;
+    }
+    return item;
+}
+
+bool deque_is_empty(deque_t *d) {
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    return t >= b;
+}
+
+struct work_pool {
+    /** One deque per thread, the caller's first */
+    deque_t *deques;
+    uint32_t threads;
+    pthread_t *ids;
+    /** The pool threads that started, besides the caller */
+    uint32_t started;
+    /** Held by the thread running a batch */
+    pthread_mutex_t run_lock;
+    /** Guards the fields below */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    /** Counts the batches, so that each pool thread joins each batch once */
+    uint64_t batch;
+    /** Pool threads still working on the current batch */
+    uint32_t busy;
+    bool stopping;
+    void (*task)(void *ctx, uint32_t i, uint32_t worker);
+    void *ctx;
+};
+
+typedef struct {
+    work_pool_t *pool;
+    uint32_t worker;
+} worker_t;
+
+/** Steals a task from another thread, or returns DEQUE_EMPTY once all deques are empty */
+static uintptr_t steal(work_pool_t *pool, uint32_t self) {
+    bool retry = true;
+    while (retry) {
+        retry = false;
+        for (uint32_t i = 1; i < pool->threads; i++) {
+            uintptr_t task = deque_steal(&pool->deques[(self + i) % pool->threads]);
+            if (task == DEQUE_ABORT) {
+                retry = true;
+            }
+            else if (task != DEQUE_EMPTY) {
+                return task;
+            }
+        }
+    }
+    // No task creates others, so nothing can appear once every deque is empty
+    return DEQUE_EMPTY;
+}
+
+/** Runs the current batch's tasks until every deque is empty */
+static void work(work_pool_t *pool, uint32_t worker) {
+    deque_t *own = &pool->deques[worker];
+    for (;;) {
+        uintptr_t task = deque_pop(own);
+        if (task == DEQUE_EMPTY) {
+            task = steal(pool, worker);
+        }
+        if (task == DEQUE_EMPTY) {
+            return;
+        }
+        pool->task(pool->ctx, (uint32_t) task, worker);
+    }
+}
+
+/** A pool thread: waits for each batch, helps finish it, and waits again */
+static void *pool_thread(void *arg) {
+    worker_t *w = arg;
+    work_pool_t *pool = w->pool;
+    // The pool was created before its first batch, which this thread may
+    // only start after
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->batch == seen && !pool->stopping) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        seen = pool->batch;
+        pthread_mutex_unlock(&pool->lock);
+        work(pool, w->worker);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(w);
+    return NULL;
+}
+
+work_pool_t *work_pool_create(uint32_t threads) {
+    if (threads <= 1) {
+        return NULL;
+    }
+    work_pool_t *pool = calloc(1, sizeof(work_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    pool->deques = calloc(threads, sizeof(deque_t));
+    pool->ids = malloc(threads * sizeof(pthread_t));
+    uint32_t ready = 0;
+    while (pool->deques && ready < threads && deque_init(&pool->deques[ready], 0)) {
+        ready++;
+    }
+    if (ready < threads || !pool->ids) {
+        for (uint32_t t = 0; t < ready; t++) {
+            deque_free(&pool->deques[t]);
+        }
+        free(pool->deques);
+        free(pool->ids);
+        free(pool);
+        return NULL;
+    }
+    pool->threads = threads;
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    // Threads that fail to start leave their deques' tasks to be stolen
+    for (uint32_t t = 1; t < threads; t++) {
+        worker_t *w = malloc(sizeof(worker_t));
+        if (!w) {
+            break;
+        }
+        *w = (worker_t){.pool = pool, .worker = t};
+        if (pthread_create(&pool->ids[pool->started], NULL, pool_thread, w) != 0) {
+            free(w);
+            break;
+        }
+        pool->started++;
+    }
+    return pool;
+}
+
+uint32_t work_pool_threads(const work_pool_t *pool) {
+    return pool ? pool->threads : 1;
+}
+
+void work_pool_run(work_pool_t *pool, uint32_t count,
+                   void (*task)(void *ctx, uint32_t i, uint32_t worker), void *ctx) {
+    if (!pool || count <= 1 || pthread_mutex_trylock(&pool->run_lock) != 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            task(ctx, i, 0);
+        }
+        return;
+    }
+    // Deal the tasks out while the pool threads wait; thread t's deque gets
+    // every threads-th one. A task that finds no room runs right away.
+    uint32_t threads = pool->threads;
+    for (uint32_t t = 0; t < threads; t++) {
+        for (uint32_t i = t; i < count; i += threads) {
+            if (!deque_push(&pool->deques[t], i)) {
+                task(ctx, i, 0);
+            }
+        }
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->ctx = ctx;
+    pool->busy = pool->started;
+    pool->batch++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    work(pool, 0);
+    // The deques are only dealt into again once no thread can be stealing
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->run_lock);
+}
+
+void work_pool_free(work_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t t = 0; t < pool->started; t++) {
+        pthread_join(pool->ids[t], NULL);
+    }
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    for (uint32_t t = 0; t < pool->threads; t++) {
+        deque_free(&pool->deques[t]);
+    }
+    free(pool->deques);
+    free(pool->ids);
+    free(pool);
+}
+
+void run_work_stealing(uint32_t threads, uint32_t count,
+                       void (*task)(void *ctx, uint32_t i, uint32_t worker), void *ctx) {
+    work_pool_t *pool = count > 1 ? work_pool_create(threads) : NULL;
+    work_pool_run(pool, count, task, ctx);
+    work_pool_free(pool);
+}
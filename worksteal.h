@@ -0,0 +1,83 @@
+// worksteal.h
+#ifndef WORKSTEAL_H
+#define WORKSTEAL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * A work-stealing thread pool. Its threads are started once and wait
+ * between batches, so a batch costs a wakeup rather than thread creation.
+ */
+typedef struct work_pool work_pool_t;
+
+/**
+ * Starts a pool of `threads` threads, the caller of work_pool_run() counting
+ * as one of them.
+ *
+ * @return the pool, or NULL if `threads` is 1 or out of memory; work_pool_run()
+ *   then runs tasks on the caller alone
+ */
+work_pool_t *work_pool_create(uint32_t threads);
+/** The number of threads that run a batch, the caller's included */
+uint32_t work_pool_threads(const work_pool_t *pool);
+
+/**
+ * Runs `task(ctx, i, worker)` for every i < `count` on the pool and returns
+ * once all tasks are done. Tasks are dealt round-robin onto one Chase-Lev
+ * deque per thread; each thread pops from the bottom of its own deque and,
+ * once that is empty, steals from the top of the others', so uneven tasks
+ * still keep every thread busy. `worker` is the index of the thread running
+ * the task, below work_pool_threads(). If another thread is running a batch
+ * on the pool, the caller runs this one alone, as worker 0.
+ */
+void work_pool_run(work_pool_t *pool, uint32_t count,
+                   void (*task)(void *ctx, uint32_t i, uint32_t worker), void *ctx);
+/** Stops the pool's threads; no batch may be running */
+void work_pool_free(work_pool_t *pool);
+
+/** Runs one batch like work_pool_run() on a pool of `threads` threads started for it */
+void run_work_stealing(uint32_t threads, uint32_t count,
+                       void (*task)(void *ctx, uint32_t i, uint32_t worker), void *ctx);
+
+typedef struct deque_buffer {
+    /** The capacity minus one; the capacity is a power of two */
+    int64_t mask;
+    /** The buffer this one replaced, which thieves may still be reading */
+    struct deque_buffer *retired;
+    _Atomic uintptr_t items[];
+} deque_buffer_t;
+
+/**
+ * A Chase-Lev deque of pointer-sized items. Only its owner pushes and pops,
+ * at `bottom`; any thread, the owner included, can steal from `top`. The
+ * buffer doubles when a push finds it full; the buffers it replaces are
+ * kept until deque_free(), since a thief may still be reading one.
+ */
+typedef struct {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(deque_buffer_t *) buffer;
+} deque_t;
+
+/** Returned by deque_pop() and deque_steal() when the deque is empty */
+#define DEQUE_EMPTY UINTPTR_MAX
+/** Returned by deque_steal() when it lost a race and should be retried */
+#define DEQUE_ABORT (UINTPTR_MAX - 1)
+
+/**
+ * Sets up an empty deque with room for `capacity` items before it grows.
+ *
+ * @return false if out of memory
+ */
+bool deque_init(deque_t *d, uint32_t capacity);
+void deque_free(deque_t *d);
+/** @return false if the deque was full and could not grow */
+bool deque_push(deque_t *d, uintptr_t item);
+uintptr_t deque_pop(deque_t *d);
+uintptr_t deque_steal(deque_t *d);
+/** Whether the deque looks empty; items pushed or stolen meanwhile may change that */
+bool deque_is_empty(deque_t *d);
+
+#endif